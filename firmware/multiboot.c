@@ -70,7 +70,7 @@ void load_multiboot(struct guest_params *guest_params)
                 | MULTIBOOT_INFO_MEM_MAP
                 ;
         multiboot_info.mem_lower = 0;
-        multiboot_info.mem_upper = (VMM_START - SZ_1M) / SZ_1K;
+        multiboot_info.mem_upper = 0;
         multiboot_info.cmdline = __pa(guest_params->cmdline);
         if (guest_params->initrd_start < guest_params->initrd_end) {
                 multiboot_info.mods_count = 1;
@@ -87,6 +87,9 @@ void load_multiboot(struct guest_params *guest_params)
                 mmap[i].addr = e->addr;
                 mmap[i].len = e->size;
                 mmap[i].type = e->type;
+                /* the RAM from 1M up to the first hole */
+                if (e->type == E820_TYPE_RAM && e->addr <= SZ_1M && e->addr + e->size > SZ_1M)
+                        multiboot_info.mem_upper = (min(e->addr + e->size, SZ_4G) - SZ_1M) / SZ_1K;
         }
         multiboot_info.mmap_addr = __pa(mmap);
         multiboot_info.mmap_length = n * sizeof(mmap[0]);
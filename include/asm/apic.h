@@ -165,6 +165,10 @@ extern struct apic xapic, x2apic;
 
 extern uint64_t acpi_lapic_addr;
 
+/* logical CPU ID to APIC ID, filled in from the MADT */
+extern int cpuid_to_apicid[];
+extern int nr_logical_cpuids;
+
 static inline uint32_t apic_read(uint32_t reg)
 {
         return apic->read(reg);
@@ -195,6 +199,8 @@ static inline uint32_t safe_apic_wait_icr_idle(void)
         return apic->safe_wait_icr_idle();
 }
 
+void apic_send_IPI(uint32_t low, uint32_t apicid);
+
 static inline unsigned int read_apic_id(void)
 {
         unsigned int reg;
@@ -14,12 +14,12 @@
 
 static __always_inline void set_bit(long nr, volatile unsigned long *addr)
 {
-        asm volatile("bts %1,%0" : BITOP_ADDR(addr) : "Ir" (nr) : "memory");
+        asm volatile("lock; bts %1,%0" : BITOP_ADDR(addr) : "Ir" (nr) : "memory");
 }
 
 static __always_inline void clear_bit(long nr, volatile unsigned long *addr)
 {
-        asm volatile("btr %1,%0" : BITOP_ADDR(addr) : "Ir" (nr));
+        asm volatile("lock; btr %1,%0" : BITOP_ADDR(addr) : "Ir" (nr));
 }
 
 static __always_inline bool constant_test_bit(long nr, const volatile unsigned long *addr)
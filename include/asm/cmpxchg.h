@@ -0,0 +1,18 @@
+#pragma once
+
+#include <sys/types.h>
+
+/*
+ * Atomically replace *ptr with new if it holds old.  Returns the value
+ * *ptr held, which is old on success.
+ */
+static __always_inline uint64_t cmpxchg64(volatile uint64_t *ptr, uint64_t old, uint64_t new)
+{
+        uint64_t ret;
+
+        asm volatile("lock; cmpxchgq %2,%1"
+                     : "=a" (ret), "+m" (*ptr)
+                     : "r" (new), "0" (old)
+                     : "memory");
+        return ret;
+}
@@ -149,4 +149,5 @@ static inline struct segment_desc *get_cpu_gdt(int cpu)
 
 void idt_setup_traps(void);
 void idt_setup_ist_traps(void);
+void load_current_idt(void);
 void idt_setup_apic_and_irq_gates(void);
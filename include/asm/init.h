@@ -8,12 +8,34 @@ void porte9_init(const char *prefix);
 void uart8250_init(void);
 void vgacon_init(void);
 void trap_init(void);
+void trap_init_secondary(void);
 void syscall_init(void);
 void cpu_init(void);
 void tsc_init(void);
 void multiboot_init(uint32_t magic, struct multiboot_info *);
 void acpi_table_init(void);
+void numa_init(void);
 void apic_init(void);
 void x2apic_init(void);
 void kvm_init(void);
+void smp_init(void);
+void smp_callin(void);
+int smp_num_online(void);
 noreturn void kvm_bsp_run(void);
+noreturn void kvm_ap_run(void);
+
+/*
+ * VMM command-line options, e.g., "vmm.bin stats_period=1000".
+ * Each handler receives the text following its "name=" prefix.
+ */
+struct obs_kernel_param {
+        const char *str;
+        int (*setup_func)(const char *);
+};
+
+#define __setup(str, fn)                                                \
+        static const struct obs_kernel_param __setup_##fn               \
+                __used __section(.init.setup) __aligned(sizeof(long))   \
+                = { str, fn }
+
+void parse_args(const char *cmdline);
@@ -12,4 +12,5 @@ struct kvm_segment {
         uint8_t  padding;
 };
 
-typedef void (*ept_violation_handler)(uint64_t guest_phys);
+/* access has the PFERR_* bits of the faulting access */
+typedef void (*ept_violation_handler)(uint64_t guest_phys, uint32_t access);
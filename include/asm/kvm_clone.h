@@ -0,0 +1,8 @@
+#pragma once
+
+#include <sys/types.h>
+
+struct kvm_vcpu;
+
+int kvm_clone(struct kvm_vcpu *vcpu, unsigned long nr_clones);
+int kvm_clone_exit(struct kvm_vcpu *vcpu, long status);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <asm/kvm.h>
+#include <sys/percpu.h>
 
 enum kvm_reg {
         VCPU_REGS_RAX = 0,
@@ -19,9 +20,27 @@ enum kvm_reg {
         VCPU_REGS_R13 = 13,
         VCPU_REGS_R14 = 14,
         VCPU_REGS_R15 = 15,
+        VCPU_REGS_RIP,
         NR_VCPU_REGS
 };
 
+/* registers that are saved and restored on every VM entry and exit */
+#define KVM_GPRS_ALWAYS_AVAIL   (BIT_32(NR_VCPU_REGS) - 1 - \
+                                 BIT_32(VCPU_REGS_RSP) - BIT_32(VCPU_REGS_RIP))
+
+/* vcpu->mode */
+enum {
+        OUTSIDE_GUEST_MODE,
+        IN_GUEST_MODE,
+};
+
+/* vcpu->activity_state */
+enum {
+        KVM_ACTIVITY_ACTIVE,
+        /* after INIT; not even an NMI makes it exit */
+        KVM_ACTIVITY_WAIT_SIPI,
+};
+
 enum {
         VCPU_SREG_ES,
         VCPU_SREG_CS,
@@ -40,21 +59,150 @@ enum {
         ACTIVITY_STATE_WAIT_FOR_SIPI,
 };
 
+#define KVM_NR_EXIT_REASONS     65
+
+/* the power-on PAT: WB, WT, UC-, UC repeated */
+#define MSR_IA32_CR_PAT_DEFAULT 0x0007040600070406ull
+#define KVM_STAT_NR_BUCKETS     32
+
+/*
+ * Bucket i of a histogram counts events that took [2^i, 2^(i+1)) cycles;
+ * the last bucket also collects everything longer.
+ */
+struct kvm_exit_stat {
+        uint64_t count;
+        uint64_t handler_cycles;
+        uint64_t roundtrip_cycles;
+        uint32_t handler_hist[KVM_STAT_NR_BUCKETS];
+        uint32_t roundtrip_hist[KVM_STAT_NR_BUCKETS];
+};
+
+struct kvm_vcpu_stat {
+        uint64_t exits;
+        uint64_t vmreads;
+        uint64_t vmwrites;
+        uint64_t start_tsc;
+        uint64_t next_dump;
+        struct kvm_exit_stat exit[KVM_NR_EXIT_REASONS];
+};
+
+#define KVM_NR_ASIDS            64
+
+enum {
+        /* CR3 loads don't exit; address spaces are found on demand */
+        KVM_CR3_TRACK_OFF,
+        /* the hottest address spaces are in the CR3-target list */
+        KVM_CR3_TRACK_SAMPLED,
+        /* every CR3 load exits */
+        KVM_CR3_TRACK_EXACT,
+};
+
+/*
+ * An address space, identified by its CR3 (without PCID and no-flush
+ * bits).  Its index in kvm_vcpu.asids is the ASID shown by the stats dump.
+ */
+struct kvm_asid {
+        uint64_t cr3;
+        /* last value loaded into CR3, used for the CR3-target list */
+        uint64_t raw_cr3;
+        /* CR3 loads that caused an exit */
+        uint64_t loads;
+        /* times found as the current CR3 by the periodic tick */
+        uint64_t samples;
+};
+
+/* #PF error code bits, also used to describe the access of a guest walk */
+#define PFERR_PRESENT_MASK      BIT_32(0)
+#define PFERR_WRITE_MASK        BIT_32(1)
+#define PFERR_USER_MASK         BIT_32(2)
+#define PFERR_RSVD_MASK         BIT_32(3)
+#define PFERR_FETCH_MASK        BIT_32(4)
+
+/* a failed translation: a guest #PF, or an EPT fault if nested is set */
+struct x86_exception {
+        bool nested;
+        uint32_t error_code;
+        uint64_t address;
+};
+
+#define KVM_NR_TLB_ENTRIES      16
+#define KVM_TLB_MAX_LEVELS      5
+
+/*
+ * A cached guest-virtual to host-physical translation of a 4K page.
+ * Entries are tagged with CR3, the paging mode and the EPT generation.
+ * A hit re-reads the guest entries at every level of the walk, and the
+ * PAE PDPTE, so that it is never staler than the walk it replaces.
+ */
+struct kvm_tlb_entry {
+        uint64_t gen;
+        uint64_t cr3;
+        uint64_t gva;
+        uint64_t gpa;
+        uint64_t hpa;
+        /* guest entries of the walk and their values when cached, top first */
+        void *ptep[KVM_TLB_MAX_LEVELS];
+        uint64_t pte[KVM_TLB_MAX_LEVELS];
+        int nr_ptes;
+        /* the PDPTE register used by a PAE walk */
+        uint64_t pdpte;
+        uint32_t mode;
+        /* effective PTE_RW and PTE_USER of the walk; PTE_NX if not executable */
+        uint64_t perm;
+        /* effective EPT read/write/execute bits */
+        uint64_t ept_perm;
+};
+
 struct kvm_vcpu {
         uint64_t regs[NR_VCPU_REGS];
+        /* RSP and RIP live in the VMCS and are read/written back lazily */
+        uint32_t regs_avail;
+        uint32_t regs_dirty;
         uint64_t cr2;
+        int mode;
         _Atomic int activity_state;
         uint8_t sipi_vector;
+        /* NMIs sent by kvm_kick_vcpu(), and those taken (see vmm/kvm.c) */
+        uint32_t kicks_sent;
+        uint32_t kicks_taken;
+        /* an NMI for the guest that arrived while in the VMM */
+        bool nmi_pending;
 	ept_violation_handler ept_handler;
+        int vcpu_id;
+        /* TSC deadline of the next periodic work (0 if none) */
+        uint64_t next_tick;
+        /* the kvm_ept_flush_gen this vcpu last flushed EPT for */
+        uint64_t ept_flush_gen;
+        /* kvm_run() returns at the next exit */
+        bool stopped;
+        /* held outside the guest by kvm_pause_vcpus() on another cpu */
+        bool paused;
+        /* nonzero in a clone of the guest (see vmm/clone.c) */
+        int clone_id;
+        struct kvm_vcpu_stat stat;
+        int nr_asids;
+        uint64_t next_cr3_sample;
+        struct kvm_asid asids[KVM_NR_ASIDS];
+        struct kvm_tlb_entry tlb[KVM_NR_TLB_ENTRIES];
 };
 
+struct kvm_snapshot_cpu;
+
 struct kvm_x86_ops {
         int (*cpu_has_kvm_support)(void);
         int (*disabled_by_bios)(void);
         int (*hardware_setup)(void);
+        /* largest EPT leaf: 2 for 2M pages, 3 for 1G pages */
+        int (*get_lpage_level)(void);
 
         struct kvm_vcpu *(*vcpu_enable)(void);
+        /* more vcpus on the same cpu, each with its own VMCS */
+        struct kvm_vcpu *(*vcpu_create)(void);
+        void (*vcpu_load)(struct kvm_vcpu *vcpu);
+        void (*vcpu_free)(struct kvm_vcpu *vcpu);
         void (*vcpu_setup)(struct kvm_vcpu *vcpu);
+        /* as after INIT: back to the reset state, waiting for SIPI */
+        void (*vcpu_reset)(struct kvm_vcpu *vcpu);
         void (*set_tdp)(struct kvm_vcpu *vcpu, unsigned long tdp);
         int (*get_cpl)(struct kvm_vcpu *vcpu);
         void (*get_segment)(struct kvm_vcpu *vcpu, struct kvm_segment *var, int seg);
@@ -63,15 +211,36 @@ struct kvm_x86_ops {
         void (*set_rflags)(struct kvm_vcpu *vcpu, unsigned long rflags);
         unsigned long (*get_rip)(struct kvm_vcpu *vcpu);
         void (*set_rip)(struct kvm_vcpu *vcpu, unsigned long rip);
+        void (*cache_reg)(struct kvm_vcpu *vcpu, enum kvm_reg reg);
+        unsigned long (*get_cr0)(struct kvm_vcpu *vcpu);
+        unsigned long (*get_cr3)(struct kvm_vcpu *vcpu);
+        unsigned long (*get_cr4)(struct kvm_vcpu *vcpu);
+        uint64_t (*get_efer)(struct kvm_vcpu *vcpu);
+        /* the four PDPTE registers of PAE paging */
+        void (*get_pdptrs)(struct kvm_vcpu *vcpu, uint64_t *pdptrs);
+        uint64_t (*get_tdp)(struct kvm_vcpu *vcpu);
+        void (*flush_tdp)(struct kvm_vcpu *vcpu);
+        bool (*has_pml)(void);
+        void (*set_pml)(struct kvm_vcpu *vcpu, bool enable);
+        void (*flush_pml)(struct kvm_vcpu *vcpu);
+        bool (*has_ept_ad)(void);
+        void (*save_state)(struct kvm_vcpu *vcpu, struct kvm_snapshot_cpu *s);
+        void (*load_state)(struct kvm_vcpu *vcpu, const struct kvm_snapshot_cpu *s);
+        int (*max_cr3_targets)(void);
+        void (*set_cr3_targets)(struct kvm_vcpu *vcpu, const uint64_t *cr3s, int n);
 
         void (*run)(struct kvm_vcpu *vcpu);
         void (*handle_exit)(struct kvm_vcpu *vcpu);
         void (*skip_emulated_instruction)(struct kvm_vcpu *vcpu);
 };
 
+extern struct kvm_x86_ops *kvm_x86_ops;
+
 static inline unsigned long kvm_register_read(struct kvm_vcpu *vcpu,
                                               enum kvm_reg reg)
 {
+        if (!(vcpu->regs_avail & BIT_32(reg)))
+                kvm_x86_ops->cache_reg(vcpu, reg);
         return vcpu->regs[reg];
 }
 
@@ -88,6 +257,8 @@ static inline void kvm_register_write(struct kvm_vcpu *vcpu,
                                       unsigned long val)
 {
         vcpu->regs[reg] = val;
+        vcpu->regs_avail |= BIT_32(reg);
+        vcpu->regs_dirty |= BIT_32(reg);
 }
 
 static inline void kvm_write_edx_eax(struct kvm_vcpu *vcpu, uint64_t val)
@@ -101,6 +272,129 @@ static inline void kvm_set_ept_violation_handler(struct kvm_vcpu *vcpu, ept_viol
 	vcpu->ept_handler = handler;
 }
 
+static inline unsigned int kvm_stat_bucket(uint64_t cycles)
+{
+        unsigned int i;
+
+        if (!cycles)
+                return 0;
+        i = 63 - __builtin_clzll(cycles);
+        return i < KVM_STAT_NR_BUCKETS ? i : KVM_STAT_NR_BUCKETS - 1;
+}
+
+/*
+ * Called on every exit, so these only touch per-vcpu counters:
+ * no locks and no formatting.
+ */
+static inline void kvm_stat_handler(struct kvm_vcpu *vcpu, uint32_t reason, uint64_t cycles)
+{
+        struct kvm_exit_stat *es;
+
+        if (reason >= KVM_NR_EXIT_REASONS)
+                return;
+        es = &vcpu->stat.exit[reason];
+        vcpu->stat.exits++;
+        es->count++;
+        es->handler_cycles += cycles;
+        es->handler_hist[kvm_stat_bucket(cycles)]++;
+}
+
+static inline void kvm_stat_roundtrip(struct kvm_vcpu *vcpu, uint32_t reason, uint64_t cycles)
+{
+        struct kvm_exit_stat *es;
+
+        if (reason >= KVM_NR_EXIT_REASONS)
+                return;
+        es = &vcpu->stat.exit[reason];
+        es->roundtrip_cycles += cycles;
+        es->roundtrip_hist[kvm_stat_bucket(cycles)]++;
+}
+
+void kvm_stat_dump(struct kvm_vcpu *vcpu);
+void kvm_stat_reset(struct kvm_vcpu *vcpu);
+uint64_t kvm_stat_tick(struct kvm_vcpu *vcpu, uint64_t now);
+
+extern unsigned long kvm_guest_tsc_khz;
+extern int kvm_cr3_track;
+
+void kvm_cr3_load(struct kvm_vcpu *vcpu, uint64_t cr3);
+uint64_t kvm_asid_tick(struct kvm_vcpu *vcpu, uint64_t now);
+void kvm_asid_dump(struct kvm_vcpu *vcpu);
+
+extern uint64_t kvm_ept_gen;
+extern uint64_t kvm_ept_flush_gen;
+
+/* call after changing EPT entries, to drop cached translations */
+static inline void kvm_mmu_ept_changed(void)
+{
+        __atomic_add_fetch(&kvm_ept_gen, 1, __ATOMIC_RELEASE);
+}
+
+void kvm_kick_vcpu(struct kvm_vcpu *vcpu, int cpu);
+void kvm_pause_vcpus(struct kvm_vcpu *vcpu);
+void kvm_resume_vcpus(struct kvm_vcpu *vcpu);
+bool kvm_take_kick(struct kvm_vcpu *vcpu);
+void kvm_flush_remote_tdp(uint64_t gen);
+bool kvm_vcpus_flushed(uint64_t gen);
+
+/*
+ * Call after taking permissions away in EPT, instead of flushing right
+ * away: each vcpu does a single-context INVEPT before it next enters the
+ * guest, so that a batch of changes costs one.  The vcpus on other CPUs
+ * are kicked out of the guest first.
+ */
+static inline void kvm_mmu_flush_tdp(void)
+{
+        uint64_t gen;
+
+        gen = __atomic_add_fetch(&kvm_ept_flush_gen, 1, __ATOMIC_SEQ_CST);
+        kvm_mmu_ept_changed();
+        kvm_flush_remote_tdp(gen);
+}
+
+void kvm_mmu_setup_ept(void);
+bool kvm_mmu_ept_fault(uint64_t gpa, uint32_t access);
+bool kvm_mmu_zero_page(uint64_t gpa);
+void kvm_mmu_dump(void);
+uint64_t kvm_ksm_tick(struct kvm_vcpu *vcpu, uint64_t now);
+uint64_t kvm_idle_tick(struct kvm_vcpu *vcpu, uint64_t now);
+uint64_t kvm_huge_tick(struct kvm_vcpu *vcpu, uint64_t now);
+int kvm_mtrr_set_msr(struct kvm_vcpu *vcpu, uint32_t msr, uint64_t val);
+uint64_t kvm_mtrr_get_msr(struct kvm_vcpu *vcpu, uint32_t msr);
+int kvm_dirty_log_enable(struct kvm_vcpu *vcpu);
+long kvm_dirty_log_fetch(struct kvm_vcpu *vcpu, unsigned long *bitmap, pfn_t nr_pfns);
+void kvm_dirty_log_disable(struct kvm_vcpu *vcpu);
+void kvm_dirty_log_mark(uint64_t gpa);
+long kvm_balloon_inflate(struct kvm_vcpu *vcpu, uint64_t gpa, uint64_t nr_pages);
+long kvm_balloon_deflate(struct kvm_vcpu *vcpu, uint64_t gpa, uint64_t nr_pages);
+void kvm_demand_enable(struct kvm_vcpu *vcpu, const unsigned long *pending, pfn_t nr_pfns,
+                       void (*fill)(uint64_t gpa));
+void kvm_demand_fill(uint64_t gpa);
+uint64_t kvm_demand_disable(struct kvm_vcpu *vcpu);
+
+/* a copy-on-write view of guest memory, filled in on EPT violations */
+struct kvm_clone_ept {
+        uint64_t *pml4;
+        /* leaves sharing a guest page, and pages copied */
+        uint64_t nr_shared, nr_private;
+        struct kvm_clone_ept *next;
+};
+
+int kvm_clone_ept_init(struct kvm_clone_ept *ept);
+bool kvm_clone_ept_fault(struct kvm_clone_ept *ept, uint64_t gpa, uint32_t access);
+void kvm_clone_ept_destroy(struct kvm_clone_ept *ept);
+uint64_t kvm_mmu_ept_root(void);
+void kvm_mmu_flush_tlb(struct kvm_vcpu *vcpu);
+int kvm_gpa_to_hpa(struct kvm_vcpu *vcpu, uint64_t gpa, uint32_t access,
+                   uint64_t *hpa, struct x86_exception *fault);
+int kvm_gva_to_hpa(struct kvm_vcpu *vcpu, uint64_t gva, uint32_t access,
+                   uint64_t *hpa, struct x86_exception *fault);
+void *kvm_gva_to_hva(struct kvm_vcpu *vcpu, uint64_t gva, uint32_t access,
+                     struct x86_exception *fault);
+int kvm_read_guest_virt(struct kvm_vcpu *vcpu, uint64_t gva, void *buf, size_t n,
+                        uint32_t access, struct x86_exception *fault);
+int kvm_write_guest_virt(struct kvm_vcpu *vcpu, uint64_t gva, const void *buf, size_t n,
+                         uint32_t access, struct x86_exception *fault);
 
 unsigned long kvm_rip_read(struct kvm_vcpu *vcpu);
 void kvm_rip_write(struct kvm_vcpu *vcpu, unsigned long val);
@@ -109,4 +403,11 @@ void kvm_get_segment(struct kvm_vcpu *vcpu, struct kvm_segment *var, int seg);
 void kvm_set_segment(struct kvm_vcpu *vcpu, struct kvm_segment *var, int seg);
 
 void kvm_emulate_cpuid(struct kvm_vcpu *vcpu);
+void kvm_emulate_hypercall(struct kvm_vcpu *vcpu);
 void kvm_skip_emulated_instruction(struct kvm_vcpu *vcpu);
+void kvm_emulate_sipi(struct kvm_vcpu *vcpu, uint8_t vector);
+void kvm_tick(struct kvm_vcpu *vcpu, uint64_t now);
+void kvm_run(struct kvm_vcpu *vcpu);
+
+/* the vcpu running on this cpu */
+DECLARE_PER_CPU(struct kvm_vcpu *, current_vcpu);
@@ -0,0 +1,84 @@
+#pragma once
+
+/*
+ * Hypercalls use the KVM calling convention: VMCALL with the number
+ * in RAX and arguments in RBX, RCX, RDX, and RSI; the result is
+ * returned in RAX.  Numbers below 0x100 are reserved for Linux KVM.
+ */
+
+#define KVM_ENOSYS              1000
+#define KVM_EFAULT              14
+#define KVM_EINVAL              22
+#define KVM_E2BIG               7
+#define KVM_EPERM               1
+#define KVM_EBUSY               16
+
+/* dump or clear the per-vcpu exit statistics */
+#define KVM_HC_STAT_DUMP        0x100
+#define KVM_HC_STAT_RESET       0x101
+/* drain the exit trace of the current cpu */
+#define KVM_HC_TRACE_FLUSH      0x102
+/*
+ * log guest page writes; fetch copies the pages dirtied since the last
+ * fetch into a bitmap (RBX: address, RCX: number of pages) and returns
+ * their count; like the snapshot and clones, only with a single vcpu
+ * (otherwise -KVM_EBUSY)
+ */
+#define KVM_HC_DIRTY_LOG_ENABLE         0x103
+#define KVM_HC_DIRTY_LOG_FETCH          0x104
+#define KVM_HC_DIRTY_LOG_DISABLE        0x105
+/*
+ * write a snapshot of the guest to the debug port; returns 0, or 1 when
+ * the guest is resumed from the snapshot
+ */
+#define KVM_HC_SNAPSHOT                 0x106
+/*
+ * run RBX copies of the guest, one after the other, sharing its memory
+ * copy-on-write; returns the clone number (from 1) in a clone, and 0 once
+ * they have all exited; a clone ends with exit (RBX: status)
+ */
+#define KVM_HC_CLONE                    0x107
+#define KVM_HC_CLONE_EXIT               0x108
+/*
+ * give free guest pages back to the VMM, or take them back (RBX: address,
+ * RCX: number of pages); returns the number of pages in the balloon that
+ * the range added or removed; a page taken back reads as zero
+ */
+#define KVM_HC_BALLOON_INFLATE          0x109
+#define KVM_HC_BALLOON_DEFLATE          0x10a
+
+/*
+ * CPUID 0x40000001 EAX holds the KVM features that Linux looks for; the
+ * hypercalls above that are optional are advertised in EBX instead.
+ */
+#define KVM_CPUID_FEATURES              0x40000001
+#define KVM_FEATURE_BALLOON             0
+
+#ifndef __ASSEMBLER__
+
+static inline long kvm_hypercall0(unsigned int nr)
+{
+        long ret;
+
+        asm volatile("vmcall" : "=a" (ret) : "a" (nr) : "memory");
+        return ret;
+}
+
+static inline long kvm_hypercall1(unsigned int nr, unsigned long p1)
+{
+        long ret;
+
+        asm volatile("vmcall" : "=a" (ret) : "a" (nr), "b" (p1) : "memory");
+        return ret;
+}
+
+static inline long kvm_hypercall2(unsigned int nr, unsigned long p1,
+                                  unsigned long p2)
+{
+        long ret;
+
+        asm volatile("vmcall" : "=a" (ret) : "a" (nr), "b" (p1), "c" (p2) : "memory");
+        return ret;
+}
+
+#endif  /* !__ASSEMBLER__ */
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <asm/e820.h>
+#include <sys/types.h>
+
+/*
+ * Guest snapshot, streamed over the 0xe9 debug port as
+ *
+ *   struct kvm_snapshot_header
+ *   struct kvm_snapshot_cpu                    (cpu_size bytes)
+ *   struct e820_entry[nr_e820]                 (the guest memory map)
+ *   { struct kvm_snapshot_run, page data }*    (guest RAM)
+ *   struct kvm_snapshot_run                    (KVM_SNAPSHOT_RUN_END)
+ *
+ * interleaved with regular console text.  Runs of zero pages carry no
+ * data.  Hot runs hold the pages the guest is about to touch, which are
+ * restored up front; the rest is restored on demand.  All fields are little-endian; tests/snapshot.py extracts the
+ * stream into a file, which is booted as the guest "kernel" to restore.
+ * Bump KVM_SNAPSHOT_VERSION on any layout change.
+ */
+
+#define KVM_SNAPSHOT_MAGIC      "\xffLVS"
+#define KVM_SNAPSHOT_VERSION    2
+
+struct kvm_snapshot_header {
+        uint8_t magic[4];
+        uint16_t version;
+        uint16_t nr_e820;
+        uint32_t cpu_size;
+        uint32_t reserved;
+        /* guest TSC frequency */
+        uint64_t tsc_khz;
+} __packed;
+
+struct kvm_snapshot_segment {
+        uint64_t base;
+        uint32_t limit;
+        uint32_t ar;
+        uint16_t selector;
+        uint16_t reserved[3];
+} __packed;
+
+struct kvm_snapshot_msr {
+        uint32_t index;
+        uint32_t reserved;
+        uint64_t value;
+} __packed;
+
+#define KVM_SNAPSHOT_NR_SEGS    8
+#define KVM_SNAPSHOT_NR_MSRS    8
+
+struct kvm_snapshot_cpu {
+        uint64_t regs[16];
+        uint64_t rip, rflags, cr2;
+        uint64_t cr0, cr0_shadow, cr3, cr4, cr4_shadow;
+        uint64_t dr7, efer, pat;
+        uint64_t sysenter_cs, sysenter_esp, sysenter_eip;
+        uint64_t pending_dbg;
+        uint64_t pdptr[4];
+        uint64_t gdtr_base, idtr_base;
+        uint32_t gdtr_limit, idtr_limit;
+        uint32_t interruptibility, activity;
+        /* in the order of kvm_vmx_segment_fields */
+        struct kvm_snapshot_segment segs[KVM_SNAPSHOT_NR_SEGS];
+        uint32_t nr_msrs;
+        uint32_t reserved;
+        struct kvm_snapshot_msr msrs[KVM_SNAPSHOT_NR_MSRS];
+        /* the guest TSC when the snapshot was taken */
+        uint64_t tsc;
+        /* FXSAVE image */
+        uint8_t fpu[512];
+} __packed;
+
+#define KVM_SNAPSHOT_RUN_ZERO   BIT_32(0)
+/* the last run; gpa holds the size of the whole snapshot */
+#define KVM_SNAPSHOT_RUN_END    BIT_32(1)
+#define KVM_SNAPSHOT_RUN_HOT    BIT_32(2)
+
+struct kvm_snapshot_run {
+        uint64_t gpa;
+        uint32_t nr_pages;
+        uint32_t flags;
+} __packed;
+
+struct kvm_vcpu;
+
+bool kvm_snapshot_probe(phys_addr_t start, phys_addr_t end);
+void kvm_snapshot_stage(void);
+bool kvm_snapshot_pending(void);
+int kvm_snapshot_save(struct kvm_vcpu *vcpu);
+void kvm_snapshot_restore(struct kvm_vcpu *vcpu);
+/* restore the pages still pending right away */
+void kvm_snapshot_finish(struct kvm_vcpu *vcpu);
+uint64_t kvm_snapshot_tick(struct kvm_vcpu *vcpu, uint64_t now);
+
+/* the vcpu state, as in a snapshot; also used to clone the guest */
+void kvm_snapshot_save_cpu(struct kvm_vcpu *vcpu, struct kvm_snapshot_cpu *s);
+void kvm_snapshot_load_cpu(struct kvm_vcpu *vcpu, const struct kvm_snapshot_cpu *s);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <sys/types.h>
+
+/*
+ * Binary VM-exit trace, drained over the 0xe9 debug port as frames of
+ *
+ *   struct kvm_trace_header
+ *   struct kvm_trace_entry[nr_entries]
+ *
+ * interleaved with regular console text.  All fields are little-endian;
+ * tests/exittrace.py decodes the stream.  Bump KVM_TRACE_VERSION on
+ * any layout change.
+ */
+
+#define KVM_TRACE_MAGIC         "\xffLVT"
+#define KVM_TRACE_VERSION       1
+
+/* must be a power of two */
+#define KVM_TRACE_NR_ENTRIES    1024
+
+struct kvm_trace_header {
+        uint8_t magic[4];
+        uint16_t version;
+        uint16_t cpu;
+        uint32_t nr_entries;
+        /* events dropped because the ring was full */
+        uint32_t lost;
+        uint64_t tsc_khz;
+} __packed;
+
+struct kvm_trace_entry {
+        uint64_t tsc;
+        uint64_t qual;
+        uint64_t rip;
+        uint64_t cr3;
+        uint32_t reason;
+        uint32_t vcpu_id;
+} __packed;
+
+struct kvm_trace_ring {
+        /* written only by the exit path of the owning cpu */
+        uint32_t head;
+        /* written only by the drain */
+        uint32_t tail;
+        uint32_t lost;
+        struct kvm_trace_entry entries[KVM_TRACE_NR_ENTRIES];
+};
+
+struct kvm_vcpu;
+
+extern bool kvm_trace_enabled;
+
+void __kvm_trace_exit(uint64_t tsc, uint32_t reason, uint64_t qual,
+                      uint64_t rip, uint64_t cr3, uint32_t vcpu_id);
+void kvm_trace_flush(void);
+bool kvm_trace_need_flush(void);
+uint64_t kvm_trace_tick(struct kvm_vcpu *vcpu, uint64_t now);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <sys/types.h>
+
+#define MTRR_TYPE_UNCACHABLE    0
+#define MTRR_TYPE_WRCOMB        1
+#define MTRR_TYPE_WRTHROUGH     4
+#define MTRR_TYPE_WRPROT        5
+#define MTRR_TYPE_WRBACK        6
+#define MTRR_NUM_TYPES          7
+
+/* the type of a range that is not uniform */
+#define MTRR_TYPE_INVALID       0xff
+
+#define MTRR_MAX_VAR_RANGES     32
+#define MTRR_NUM_FIXED_RANGES   88
+
+#define MTRRphysBase_MSR(reg)   (0x200 + 2 * (reg))
+#define MTRRphysMask_MSR(reg)   (0x200 + 2 * (reg) + 1)
+
+#define MTRR_CAP_VCNT           0xff
+#define MTRR_CAP_FIX            BIT_64(8)
+#define MTRR_DEF_TYPE_TYPE      0xff
+#define MTRR_DEF_TYPE_FE        BIT_64(10)
+#define MTRR_DEF_TYPE_E         BIT_64(11)
+#define MTRR_PHYSMASK_V         BIT_64(11)
+
+struct mtrr_var_range {
+        uint64_t base;
+        uint64_t mask;
+};
+
+struct mtrr_state {
+        bool have_mtrr;
+        bool have_fixed;
+        unsigned int nr_var;
+        uint64_t phys_mask;
+        uint64_t def_type;
+        uint8_t fixed[MTRR_NUM_FIXED_RANGES];
+        struct mtrr_var_range var[MTRR_MAX_VAR_RANGES];
+};
+
+extern struct mtrr_state mtrr_state;
+
+void mtrr_init(void);
+void mtrr_read_state(void);
+uint8_t mtrr_type_lookup(uint64_t start, uint64_t end);
+uint8_t mtrr_state_type_lookup(const struct mtrr_state *s, uint64_t start, uint64_t end);
+uint8_t mtrr_type_combine(uint8_t host, uint8_t guest);
+uint64_t mtrr_state_get_msr(const struct mtrr_state *s, uint32_t msr);
+void mtrr_state_set_msr(struct mtrr_state *s, uint32_t msr, uint64_t val);
+bool is_mtrr_msr(uint32_t msr);
+bool mtrr_valid_msr(uint32_t msr, uint64_t val);
+const char *mtrr_type_name(uint8_t type);
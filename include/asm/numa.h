@@ -0,0 +1,42 @@
+#pragma once
+
+#include <sys/percpu.h>
+#include <sys/types.h>
+
+/*
+ * The node map from the ACPI SRAT and SLIT.  Without an SRAT there is a
+ * single node 0 with all of memory and all CPUs.
+ */
+
+#define MAX_NUMNODES            8
+#define NR_NODE_MEMBLKS         (MAX_NUMNODES * 4)
+
+#define LOCAL_DISTANCE          10
+#define REMOTE_DISTANCE         20
+
+#define for_each_node(nid)      \
+        for ((nid) = 0; (nid) < nr_node_ids; (nid)++)
+
+struct numa_memblk {
+        uint64_t start;
+        uint64_t end;
+        int nid;
+};
+
+struct numa_meminfo {
+        size_t nr_blks;
+        struct numa_memblk blk[NR_NODE_MEMBLKS];
+};
+
+extern int nr_node_ids;
+extern struct numa_meminfo numa_meminfo;
+
+void numa_init(void);
+int phys_to_node(phys_addr_t addr);
+int cpu_to_node(int cpu);
+int node_distance(int from, int to);
+
+static inline int numa_node_id(void)
+{
+        return cpu_to_node(smp_processor_id());
+}
@@ -2,8 +2,11 @@
 
 #ifdef __ASSEMBLER__
 
-/* keep %gs even if NR_CPU is 1 for shared mamping; see entry.S */
-#define PER_CPU_VAR(var)        %gs:var
+/*
+ * keep %gs even if NR_CPU is 1; RIP-relative, so that this also works in
+ * the shared mapping (see entry.S) and after the VMM has moved
+ */
+#define PER_CPU_VAR(var)        %gs:var(%rip)
 
 #else /* !__ASSEMBLER__ */
 
@@ -102,6 +102,8 @@
 #define X86_CR4_OSFXSR          BIT_64(X86_CR4_OSFXSR_BIT)
 #define X86_CR4_OSXMMEXCPT_BIT  10 /* enable unmasked SSE exceptions */
 #define X86_CR4_OSXMMEXCPT      BIT_64(X86_CR4_OSXMMEXCPT_BIT)
+#define X86_CR4_LA57_BIT        12 /* enable 5-level page tables */
+#define X86_CR4_LA57            BIT_64(X86_CR4_LA57_BIT)
 #define X86_CR4_VMXE_BIT        13 /* enable VMX virtualization */
 #define X86_CR4_VMXE            BIT_64(X86_CR4_VMXE_BIT)
 #define X86_CR4_SMXE_BIT        14 /* enable safer mode (TXT) */
@@ -239,6 +239,17 @@ static inline void cr4_set_bits(unsigned long mask)
                 write_cr4(cr4 | mask);
 }
 
+/* buf is 512 bytes, 16-byte aligned */
+static inline void fxsave(void *buf)
+{
+        asm volatile("fxsave64 (%0)" : : "r" (buf) : "memory");
+}
+
+static inline void fxrstor(const void *buf)
+{
+        asm volatile("fxrstor64 (%0)" : : "r" (buf) : "memory");
+}
+
 static inline void prefetch(const void *x)
 {
         asm volatile("prefetchnta %P1" : : "i" (0), "m" (*(const char *)x));
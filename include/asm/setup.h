@@ -7,6 +7,9 @@
 #define KERNEL_START            0x00100000
 #define FIRMWARE_START          0x00001000
 
+/* real-mode entry of the APs, in pages of guest memory borrowed at boot */
+#define TRAMPOLINE_START        0x00020000
+
 /*
  * This applies to every address shared by user and kernel,
  * such as GDT, IDT, and syscall entries.
@@ -34,4 +37,7 @@ struct guest_params {
 
 extern struct guest_params guest_params;
 
+/* the end of the VMM's direct map of physical memory */
+extern uint64_t direct_map_end;
+
 #endif  /* !__ASSEMBLER__ */
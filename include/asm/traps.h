@@ -29,6 +29,7 @@ enum {
 };
 
 void divide_error(void);
+void nmi(void);
 void overflow(void);
 void bounds(void);
 void invalid_op(void);
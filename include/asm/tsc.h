@@ -2,6 +2,8 @@
 
 #include <sys/types.h>
 
+extern unsigned long tsc_khz;
+
 /**
  * rdtsc() - returns the current TSC without ordering constraints
  *
@@ -83,6 +83,9 @@
 #define VMX_MISC_PREEMPTION_TIMER_RATE_MASK     0x0000001f
 #define VMX_MISC_SAVE_EFER_LMA                  0x00000020
 #define VMX_MISC_ACTIVITY_HLT                   0x00000040
+#define VMX_MISC_ACTIVITY_WAIT_SIPI             0x00000100
+#define VMX_MISC_CR3_TARGETS_SHIFT              16
+#define VMX_MISC_CR3_TARGETS_MASK               0x01ff0000
 
 /* VMCS Encodings */
 enum vmcs_field {
@@ -411,6 +414,7 @@ struct vmx_msr_entry {
 #define VMX_EPT_WRITABLE_MASK                   0x2ull
 #define VMX_EPT_EXECUTABLE_MASK                 0x4ull
 #define VMX_EPT_IPAT_BIT                        (1ull << 6)
+#define VMX_EPT_LARGE_PAGE_BIT                  (1ull << 7)
 #define VMX_EPT_ACCESS_BIT                      (1ull << 8)
 #define VMX_EPT_DIRTY_BIT                       (1ull << 9)
 #define VMX_EPT_RWX_MASK                        (VMX_EPT_READABLE_MASK |        \
@@ -538,3 +542,63 @@ enum vm_instruction_error_number {
 #define EXIT_REASON_PML_FULL            62
 #define EXIT_REASON_XSAVES              63
 #define EXIT_REASON_XRSTORS             64
+
+#define VMX_EXIT_REASONS                                               \
+        { EXIT_REASON_EXCEPTION_NMI, "EXCEPTION_NMI" },                \
+        { EXIT_REASON_EXTERNAL_INTERRUPT, "EXTERNAL_INTERRUPT" },      \
+        { EXIT_REASON_TRIPLE_FAULT, "TRIPLE_FAULT" },                  \
+        { EXIT_REASON_INIT_SIGNAL, "INIT_SIGNAL" },                    \
+        { EXIT_REASON_SIPI, "SIPI" },                                  \
+        { EXIT_REASON_PENDING_INTERRUPT, "PENDING_INTERRUPT" },        \
+        { EXIT_REASON_NMI_WINDOW, "NMI_WINDOW" },                      \
+        { EXIT_REASON_TASK_SWITCH, "TASK_SWITCH" },                    \
+        { EXIT_REASON_CPUID, "CPUID" },                                \
+        { EXIT_REASON_HLT, "HLT" },                                    \
+        { EXIT_REASON_INVD, "INVD" },                                  \
+        { EXIT_REASON_INVLPG, "INVLPG" },                              \
+        { EXIT_REASON_RDPMC, "RDPMC" },                                \
+        { EXIT_REASON_RDTSC, "RDTSC" },                                \
+        { EXIT_REASON_VMCALL, "VMCALL" },                              \
+        { EXIT_REASON_VMCLEAR, "VMCLEAR" },                            \
+        { EXIT_REASON_VMLAUNCH, "VMLAUNCH" },                          \
+        { EXIT_REASON_VMPTRLD, "VMPTRLD" },                            \
+        { EXIT_REASON_VMPTRST, "VMPTRST" },                            \
+        { EXIT_REASON_VMREAD, "VMREAD" },                              \
+        { EXIT_REASON_VMRESUME, "VMRESUME" },                          \
+        { EXIT_REASON_VMWRITE, "VMWRITE" },                            \
+        { EXIT_REASON_VMOFF, "VMOFF" },                                \
+        { EXIT_REASON_VMON, "VMON" },                                  \
+        { EXIT_REASON_CR_ACCESS, "CR_ACCESS" },                        \
+        { EXIT_REASON_DR_ACCESS, "DR_ACCESS" },                        \
+        { EXIT_REASON_IO_INSTRUCTION, "IO_INSTRUCTION" },              \
+        { EXIT_REASON_MSR_READ, "MSR_READ" },                          \
+        { EXIT_REASON_MSR_WRITE, "MSR_WRITE" },                        \
+        { EXIT_REASON_INVALID_STATE, "INVALID_STATE" },                \
+        { EXIT_REASON_MSR_LOAD_FAIL, "MSR_LOAD_FAIL" },                \
+        { EXIT_REASON_MWAIT_INSTRUCTION, "MWAIT_INSTRUCTION" },        \
+        { EXIT_REASON_MONITOR_TRAP_FLAG, "MONITOR_TRAP_FLAG" },        \
+        { EXIT_REASON_MONITOR_INSTRUCTION, "MONITOR_INSTRUCTION" },    \
+        { EXIT_REASON_PAUSE_INSTRUCTION, "PAUSE_INSTRUCTION" },        \
+        { EXIT_REASON_MCE_DURING_VMENTRY, "MCE_DURING_VMENTRY" },      \
+        { EXIT_REASON_TPR_BELOW_THRESHOLD, "TPR_BELOW_THRESHOLD" },    \
+        { EXIT_REASON_APIC_ACCESS, "APIC_ACCESS" },                    \
+        { EXIT_REASON_EOI_INDUCED, "EOI_INDUCED" },                    \
+        { EXIT_REASON_GDTR_IDTR, "GDTR_IDTR" },                        \
+        { EXIT_REASON_LDTR_TR, "LDTR_TR" },                            \
+        { EXIT_REASON_EPT_VIOLATION, "EPT_VIOLATION" },                \
+        { EXIT_REASON_EPT_MISCONFIG, "EPT_MISCONFIG" },                \
+        { EXIT_REASON_INVEPT, "INVEPT" },                              \
+        { EXIT_REASON_RDTSCP, "RDTSCP" },                              \
+        { EXIT_REASON_PREEMPTION_TIMER, "PREEMPTION_TIMER" },          \
+        { EXIT_REASON_INVVPID, "INVVPID" },                            \
+        { EXIT_REASON_WBINVD, "WBINVD" },                              \
+        { EXIT_REASON_XSETBV, "XSETBV" },                              \
+        { EXIT_REASON_APIC_WRITE, "APIC_WRITE" },                      \
+        { EXIT_REASON_RDRAND, "RDRAND" },                              \
+        { EXIT_REASON_INVPCID, "INVPCID" },                            \
+        { EXIT_REASON_VMFUNC, "VMFUNC" },                              \
+        { EXIT_REASON_ENCLS, "ENCLS" },                                \
+        { EXIT_REASON_RDSEED, "RDSEED" },                              \
+        { EXIT_REASON_PML_FULL, "PML_FULL" },                          \
+        { EXIT_REASON_XSAVES, "XSAVES" },                              \
+        { EXIT_REASON_XRSTORS, "XRSTORS" }
@@ -12,6 +12,7 @@
 #define __aligned(x)            __attribute__((aligned(x)))
 #define __packed                __attribute__((packed))
 #define __weak                  __attribute__((weak))
+#define __used                  __attribute__((__used__))
 
 #define __printf(a, b)          __attribute__((format(printf, a, b)))
 #define __malloc                __attribute__((__malloc__))
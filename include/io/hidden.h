@@ -0,0 +1,11 @@
+#pragma once
+
+/*
+ * Included into every file through CFLAGS.  With -fPIE, the address of a
+ * symbol that may be defined elsewhere comes from the GOT, which a static
+ * link turns into a 32-bit absolute address; everything is linked into one
+ * image, so mark all symbols local and get RIP-relative addressing instead.
+ */
+#ifndef __ASSEMBLER__
+#pragma GCC visibility push(hidden)
+#endif
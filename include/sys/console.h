@@ -12,4 +12,9 @@ struct console {
 };
 
 void register_console(struct console *);
+void console_lock(void);
+void console_unlock(void);
+
+/* write raw bytes to the 0xe9 debug port; call with console_lock() held */
+void porte9_write_raw(const void *buf, size_t n);
 
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <sys/types.h>
+
+/*
+ * A small LZ77 codec in the LZ4 block format: greedy matching through a
+ * hash table of the last position of each 4-byte sequence.  The table is
+ * the caller's, so that the codec needs no state of its own.
+ */
+
+#define LZ_HASH_BITS    12
+#define LZ_HASH_SIZE    (1 << LZ_HASH_BITS)
+
+/* returns the compressed size, or 0 if it doesn't fit in dst_size */
+size_t lz_compress(const void *src, size_t src_size, void *dst, size_t dst_size,
+                   uint16_t table[LZ_HASH_SIZE]);
+/* returns the decompressed size, or -1 if src is corrupt or dst too small */
+ssize_t lz_decompress(const void *src, size_t src_size, void *dst, size_t dst_size);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <asm/mmu.h>
+#include <asm/numa.h>
+#include <sys/types.h>
+
+#define PAGE_ORDER_4K           0
+#define PAGE_ORDER_2M           9
+#define PAGE_ORDER_1G           18
+#define MAX_PAGE_ORDER          PAGE_ORDER_1G
+
+/* what VMM-owned pages are used for, for accounting */
+enum page_type {
+        PAGE_TYPE_OTHER,
+        PAGE_TYPE_MEMMAP,
+        PAGE_TYPE_PGTABLE,
+        PAGE_TYPE_VMCS,
+        PAGE_TYPE_BITMAP,
+        PAGE_TYPE_GUEST,
+        NR_PAGE_TYPES,
+};
+
+/* physical ranges of the pools, hidden from the guest; the first is next to the VMM */
+struct page_pool {
+        phys_addr_t start;
+        phys_addr_t end;
+};
+
+extern struct page_pool page_pools[MAX_NUMNODES];
+extern size_t nr_page_pools;
+
+static inline bool page_pool_overlaps(phys_addr_t start, phys_addr_t end)
+{
+        size_t i;
+
+        for (i = 0; i < nr_page_pools; ++i) {
+                if (start < page_pools[i].end && page_pools[i].start < end)
+                        return true;
+        }
+        return false;
+}
+
+void page_alloc_init(phys_addr_t start, phys_addr_t end);
+void page_alloc_add_pool(phys_addr_t start, phys_addr_t end);
+void page_alloc_refill(void);
+void page_alloc_dump(void);
+size_t page_alloc_nr_free(void);
+
+static inline unsigned int get_order(size_t size)
+{
+        unsigned int order = 0;
+
+        while ((PAGE_SIZE << order) < size)
+                ++order;
+        return order;
+}
+
+/* these return NULL if out of memory */
+void *alloc_pages(unsigned int order, enum page_type type);
+void free_pages(void *addr, unsigned int order);
+void *alloc_page(enum page_type type);
+void *get_zeroed_page(enum page_type type);
+void free_page(void *addr);
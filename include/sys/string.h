@@ -18,3 +18,5 @@ size_t strnlen(const char *s, size_t count);
 char *strrchr(const char *s, int c);
 ssize_t strscpy(char *dest, const char *src, size_t count);
 char *strstr(const char *haystack, const char *needle);
+
+unsigned long long simple_strtoull(const char *cp, char **endp, unsigned int base);
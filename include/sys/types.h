@@ -110,6 +110,7 @@
 #define ALIGN(x, a)             __ALIGN_MASK(x, (typeof(x))(a) - 1)
 #define __ALIGN_MASK(x, mask)   (((x) + (mask)) & ~(mask))
 #define PTR_ALIGN(p, a)         ((typeof(p))ALIGN((uintptr_t)(p), (a)))
+#define IS_ALIGNED(x, a)        (((x) & ((typeof(x))(a) - 1)) == 0)
 
 #define BITS_PER_BYTE           8
 #define BITS_PER_LONG           (BITS_PER_BYTE * __SIZEOF_LONG__)
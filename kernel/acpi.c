@@ -179,7 +179,7 @@ static struct acpi_table_header *acpi_find_table(const char *id)
 
         for (i = 0; i < ARRAY_SIZE(initial_tables); ++i) {
                 table_header = initial_tables[i];
-                if (ACPI_COMPARE_NAME(table_header->signature, id))
+                if (table_header && ACPI_COMPARE_NAME(table_header->signature, id))
                         return table_header;
         }
         return NULL;
@@ -273,6 +273,21 @@ void apic_init(void)
         lapic_setup_esr();
 }
 
+/*
+ * The guest may switch the APIC of the CPU it runs on to x2apic mode
+ * (see handle_wrmsr() in vmm/vmx.c), so send IPIs in whatever mode
+ * this CPU's APIC is in now.
+ */
+void apic_send_IPI(uint32_t low, uint32_t apicid)
+{
+        struct apic *ops = &xapic;
+
+        if (rdmsrl(MSR_IA32_APICBASE) & MSR_IA32_APICBASE_X2APIC_ENABLE)
+                ops = &x2apic;
+        ops->safe_wait_icr_idle();
+        ops->icr_write(low, apicid);
+}
+
 void x2apic_init(void)
 {
         /* must be called from BSP */
@@ -112,11 +112,11 @@
         /* save cr3 & switch to kernel page table */
         movq    %cr3, \scratch_reg
         movq    \scratch_reg, PER_CPU_VAR(cr3_scratch)
-        movq    $kpml4, \scratch_reg
+        movabsq $kpml4, \scratch_reg
         movq    \scratch_reg, %cr3
 
         /* relocate to identity mapping */
-        movq    $1f, \scratch_reg
+        movabsq $1f, \scratch_reg
         jmp     *\scratch_reg
 
         1:
@@ -78,6 +78,7 @@ static const struct idt_data apic_idts[] = {
  */
 static const struct idt_data ist_idts[] = {
         ISTG(X86_TRAP_DF,       double_fault,   DOUBLEFAULT_STACK),
+        ISTG(X86_TRAP_NMI,      nmi,            NMI_STACK),
 };
 
 static struct gate_desc idt_table[IDT_ENTRIES];
@@ -138,6 +139,14 @@ void idt_setup_traps(void)
         load_idt(&idt_descr);
 }
 
+/**
+ * load_current_idt - Load the idt table on a secondary CPU
+ */
+void load_current_idt(void)
+{
+        load_idt(&idt_descr);
+}
+
 /**
  * idt_setup_ist_traps - Initialize the idt table with traps using IST
  */
@@ -197,6 +206,11 @@ __weak void do_spurious_interrupt_bug(struct pt_regs *regs, long error_code)
 {
 }
 
+/* NMIs are only sent by the VMM, which overrides this */
+__weak void do_nmi(struct pt_regs *regs, long error_code)
+{
+}
+
 __weak void smp_apic_timer_interrupt(struct pt_regs *regs)
 {
         apic_eoi();
@@ -0,0 +1,277 @@
+#include <asm/cpufeature.h>
+#include <asm/msr.h>
+#include <asm/msr-index.h>
+#include <asm/mtrr.h>
+#include <asm/processor.h>
+#include <io/sizes.h>
+
+/*
+ * A snapshot of the MTRRs, for computing the memory type of physical
+ * ranges.  Variable ranges are assumed to have contiguous masks, as
+ * firmware sets them up in practice.
+ */
+
+struct mtrr_state mtrr_state;
+
+static const char *const mtrr_type_names[MTRR_NUM_TYPES] = {
+        [MTRR_TYPE_UNCACHABLE]  = "UC",
+        [MTRR_TYPE_WRCOMB]      = "WC",
+        [MTRR_TYPE_WRTHROUGH]   = "WT",
+        [MTRR_TYPE_WRPROT]      = "WP",
+        [MTRR_TYPE_WRBACK]      = "WB",
+};
+
+const char *mtrr_type_name(uint8_t type)
+{
+        if (type >= MTRR_NUM_TYPES || !mtrr_type_names[type])
+                return "??";
+        return mtrr_type_names[type];
+}
+
+static bool valid_type(uint8_t type)
+{
+        return type < MTRR_NUM_TYPES && type != 2 && type != 3;
+}
+
+/* index into mtrr_state.fixed of the range containing addr (< 1M) */
+static unsigned int fixed_index(uint64_t addr)
+{
+        if (addr < 0x80000)
+                return addr >> 16;
+        if (addr < 0xc0000)
+                return 8 + ((addr - 0x80000) >> 14);
+        return 24 + ((addr - 0xc0000) >> 12);
+}
+
+/* the MSR holding fixed ranges [8 * i, 8 * i + 8) */
+static uint32_t fixed_msr(unsigned int i)
+{
+        if (i == 0)
+                return MSR_MTRRfix64K_00000;
+        if (i < 3)
+                return MSR_MTRRfix16K_80000 + i - 1;
+        return MSR_MTRRfix4K_C0000 + i - 3;
+}
+
+/* the inverse of fixed_msr() */
+static unsigned int fixed_msr_index(uint32_t msr)
+{
+        if (msr == MSR_MTRRfix64K_00000)
+                return 0;
+        if (msr <= MSR_MTRRfix16K_A0000)
+                return 1 + msr - MSR_MTRRfix16K_80000;
+        return 3 + msr - MSR_MTRRfix4K_C0000;
+}
+
+void mtrr_init(void)
+{
+        uint64_t cap;
+        unsigned int bits = 36;
+
+        if (!this_cpu_has(X86_FEATURE_MTRR))
+                return;
+
+        cap = rdmsrl(MSR_MTRRcap);
+        mtrr_state.have_mtrr = true;
+        mtrr_state.have_fixed = cap & MTRR_CAP_FIX;
+        mtrr_state.nr_var = min((unsigned int)(cap & MTRR_CAP_VCNT), (unsigned int)MTRR_MAX_VAR_RANGES);
+
+        if (cpuid_eax(0x80000000) >= 0x80000008)
+                bits = cpuid_eax(0x80000008) & 0xff;
+        mtrr_state.phys_mask = (UINT64_C(1) << bits) - 1;
+
+        mtrr_read_state();
+}
+
+void mtrr_read_state(void)
+{
+        unsigned int i, j;
+        uint64_t val;
+
+        if (!mtrr_state.have_mtrr)
+                return;
+
+        mtrr_state.def_type = rdmsrl(MSR_MTRRdefType);
+        for (i = 0; i < mtrr_state.nr_var; ++i) {
+                mtrr_state.var[i].base = rdmsrl(MTRRphysBase_MSR(i));
+                mtrr_state.var[i].mask = rdmsrl(MTRRphysMask_MSR(i));
+        }
+        if (!mtrr_state.have_fixed)
+                return;
+        for (i = 0; i < MTRR_NUM_FIXED_RANGES / 8; ++i) {
+                val = rdmsrl(fixed_msr(i));
+                for (j = 0; j < 8; ++j)
+                        mtrr_state.fixed[i * 8 + j] = val >> (j * 8);
+        }
+}
+
+/* the effective type where variable ranges overlap (SDM 11.11.4.1) */
+static uint8_t combine(uint8_t a, uint8_t b)
+{
+        if (a == b)
+                return a;
+        if (a == MTRR_TYPE_UNCACHABLE || b == MTRR_TYPE_UNCACHABLE)
+                return MTRR_TYPE_UNCACHABLE;
+        if ((a == MTRR_TYPE_WRTHROUGH && b == MTRR_TYPE_WRBACK) ||
+            (a == MTRR_TYPE_WRBACK && b == MTRR_TYPE_WRTHROUGH))
+                return MTRR_TYPE_WRTHROUGH;
+        /* undefined; be safe */
+        return MTRR_TYPE_UNCACHABLE;
+}
+
+/*
+ * The value of an MTRR as recorded in s, for an msr that is_mtrr_msr().
+ * The fixed ranges are kept as types, a byte each.
+ */
+uint64_t mtrr_state_get_msr(const struct mtrr_state *s, uint32_t msr)
+{
+        unsigned int i, j;
+        uint64_t val = 0;
+
+        if (msr == MSR_MTRRdefType)
+                return s->def_type;
+        if (msr >= MTRRphysBase_MSR(0) && msr <= MTRRphysMask_MSR(MTRR_MAX_VAR_RANGES - 1)) {
+                i = (msr - MTRRphysBase_MSR(0)) / 2;
+                return (msr & 1) ? s->var[i].mask : s->var[i].base;
+        }
+        i = fixed_msr_index(msr);
+        for (j = 0; j < 8; ++j)
+                val |= (uint64_t)s->fixed[i * 8 + j] << (j * 8);
+        return val;
+}
+
+/* record a write to an MTRR in s, without touching the hardware */
+void mtrr_state_set_msr(struct mtrr_state *s, uint32_t msr, uint64_t val)
+{
+        unsigned int i, j;
+
+        if (msr == MSR_MTRRdefType) {
+                s->def_type = val;
+                return;
+        }
+        if (msr >= MTRRphysBase_MSR(0) && msr <= MTRRphysMask_MSR(MTRR_MAX_VAR_RANGES - 1)) {
+                i = (msr - MTRRphysBase_MSR(0)) / 2;
+                if (msr & 1)
+                        s->var[i].mask = val;
+                else
+                        s->var[i].base = val;
+                return;
+        }
+        i = fixed_msr_index(msr);
+        for (j = 0; j < 8; ++j)
+                s->fixed[i * 8 + j] = val >> (j * 8);
+}
+
+/*
+ * The type of memory that is host under the host MTRRs and guest under
+ * the guest's own: a WB side defers to the other, and two other types
+ * that differ yield UC.
+ */
+uint8_t mtrr_type_combine(uint8_t host, uint8_t guest)
+{
+        if (host == MTRR_TYPE_INVALID || guest == MTRR_TYPE_INVALID)
+                return MTRR_TYPE_INVALID;
+        if (host == guest || guest == MTRR_TYPE_WRBACK)
+                return host;
+        if (host == MTRR_TYPE_WRBACK)
+                return guest;
+        return MTRR_TYPE_UNCACHABLE;
+}
+
+/*
+ * Return the memory type of [start, end) under the MTRRs in s, or
+ * MTRR_TYPE_INVALID if it is not uniform.  Ranges of a single 4K page
+ * always have a type.  Without MTRRs everything is write-back.
+ */
+uint8_t mtrr_state_type_lookup(const struct mtrr_state *s, uint64_t start, uint64_t end)
+{
+        uint8_t type = MTRR_TYPE_INVALID;
+        unsigned int i, first, last;
+
+        if (!s->have_mtrr)
+                return MTRR_TYPE_WRBACK;
+        if (!(s->def_type & MTRR_DEF_TYPE_E))
+                return MTRR_TYPE_UNCACHABLE;
+
+        /* fixed ranges take precedence below 1M */
+        if (s->have_fixed && (s->def_type & MTRR_DEF_TYPE_FE) && start < SZ_1M) {
+                if (end > SZ_1M)
+                        return MTRR_TYPE_INVALID;
+                first = fixed_index(start);
+                last = fixed_index(end - 1);
+                for (i = first + 1; i <= last; ++i) {
+                        if (s->fixed[i] != s->fixed[first])
+                                return MTRR_TYPE_INVALID;
+                }
+                return s->fixed[first];
+        }
+
+        for (i = 0; i < s->nr_var; ++i) {
+                uint64_t mask = s->var[i].mask, base, size;
+
+                if (!(mask & MTRR_PHYSMASK_V))
+                        continue;
+                mask &= s->phys_mask & PAGE_MASK;
+                base = s->var[i].base & mask;
+                size = mask & -mask;
+                if (end <= base || base + size <= start)
+                        continue;
+                /* partly covered */
+                if (start < base || base + size < end)
+                        return MTRR_TYPE_INVALID;
+                if (type == MTRR_TYPE_INVALID)
+                        type = s->var[i].base & 0xff;
+                else
+                        type = combine(type, s->var[i].base & 0xff);
+        }
+
+        if (type == MTRR_TYPE_INVALID)
+                type = s->def_type & MTRR_DEF_TYPE_TYPE;
+        return type;
+}
+
+/* the type of [start, end) under the host MTRRs */
+uint8_t mtrr_type_lookup(uint64_t start, uint64_t end)
+{
+        return mtrr_state_type_lookup(&mtrr_state, start, end);
+}
+
+bool is_mtrr_msr(uint32_t msr)
+{
+        if (!mtrr_state.have_mtrr)
+                return false;
+
+        switch (msr) {
+        case MSR_MTRRdefType:
+                return true;
+        case MSR_MTRRfix64K_00000:
+        case MSR_MTRRfix16K_80000 ... MSR_MTRRfix16K_A0000:
+        case MSR_MTRRfix4K_C0000 ... MSR_MTRRfix4K_F8000:
+                return mtrr_state.have_fixed;
+        }
+        return msr >= MTRRphysBase_MSR(0) && msr < MTRRphysBase_MSR(mtrr_state.nr_var);
+}
+
+/* whether a write would not #GP */
+bool mtrr_valid_msr(uint32_t msr, uint64_t val)
+{
+        uint64_t addr_mask = mtrr_state.phys_mask & PAGE_MASK;
+        unsigned int i;
+
+        if (msr == MSR_MTRRdefType)
+                return !(val & ~(MTRR_DEF_TYPE_TYPE | MTRR_DEF_TYPE_FE | MTRR_DEF_TYPE_E)) &&
+                       valid_type(val & MTRR_DEF_TYPE_TYPE);
+
+        if (msr >= MTRRphysBase_MSR(0) && msr <= MTRRphysMask_MSR(MTRR_MAX_VAR_RANGES - 1)) {
+                if (msr & 1)
+                        return !(val & ~(addr_mask | MTRR_PHYSMASK_V));
+                return !(val & ~(addr_mask | 0xff)) && valid_type(val & 0xff);
+        }
+
+        /* fixed ranges: a type in each byte */
+        for (i = 0; i < 8; ++i) {
+                if (!valid_type(val >> (i * 8)))
+                        return false;
+        }
+        return true;
+}
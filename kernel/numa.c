@@ -0,0 +1,197 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/apic.h>
+#include <asm/numa.h>
+#include <asm/processor.h>
+#include <sys/acpi.h>
+#include <sys/string.h>
+
+#define BAD_SRAT_ENTRY(entry, end) (                                        \
+                (!entry) || (unsigned long)entry + sizeof(*entry) > end ||  \
+                ((struct acpi_subtable_header *)entry)->length < sizeof(*entry))
+
+int nr_node_ids = 1;
+struct numa_meminfo numa_meminfo;
+
+/* node IDs are handed out to proximity domains in SRAT order */
+static uint32_t node_to_pxm[MAX_NUMNODES];
+static int8_t apicid_to_node[MAX_LOCAL_APIC];
+static uint8_t numa_distance[MAX_NUMNODES][MAX_NUMNODES];
+static bool numa_off = true;
+/* from CPUID, for allocations before apic_init() has read the MADT */
+static int boot_apicid = BAD_APICID;
+
+static int pxm_to_node(uint32_t pxm)
+{
+        int nid;
+
+        for (nid = 0; nid < nr_node_ids; ++nid) {
+                if (node_to_pxm[nid] == pxm)
+                        return nid;
+        }
+        if (nid == MAX_NUMNODES) {
+                pr_warn("too many nodes, ignoring PXM %u\n", pxm);
+                return -1;
+        }
+        node_to_pxm[nid] = pxm;
+        nr_node_ids++;
+        return nid;
+}
+
+static void numa_add_cpu(uint32_t pxm, uint32_t apicid)
+{
+        int nid = pxm_to_node(pxm);
+
+        if (nid < 0 || apicid >= MAX_LOCAL_APIC)
+                return;
+        apicid_to_node[apicid] = nid;
+}
+
+static int srat_parse_cpu(struct acpi_subtable_header *header, const unsigned long end)
+{
+        struct acpi_srat_cpu_affinity *p = (struct acpi_srat_cpu_affinity *)header;
+        uint32_t pxm;
+
+        if (BAD_SRAT_ENTRY(p, end))
+                return -1;
+        if (!(p->flags & ACPI_SRAT_CPU_USE_AFFINITY))
+                return 0;
+        pxm = p->proximity_domain_lo | p->proximity_domain_hi[0] << 8 |
+              p->proximity_domain_hi[1] << 16 | p->proximity_domain_hi[2] << 24;
+        numa_add_cpu(pxm, p->apic_id);
+        return 0;
+}
+
+static int srat_parse_x2apic(struct acpi_subtable_header *header, const unsigned long end)
+{
+        struct acpi_srat_x2apic_cpu_affinity *p = (struct acpi_srat_x2apic_cpu_affinity *)header;
+
+        if (BAD_SRAT_ENTRY(p, end))
+                return -1;
+        if (p->flags & ACPI_SRAT_CPU_ENABLED)
+                numa_add_cpu(p->proximity_domain, p->apic_id);
+        return 0;
+}
+
+static int srat_parse_mem(struct acpi_subtable_header *header, const unsigned long end)
+{
+        struct acpi_srat_mem_affinity *p = (struct acpi_srat_mem_affinity *)header;
+        struct numa_memblk *blk;
+        int nid;
+
+        if (BAD_SRAT_ENTRY(p, end))
+                return -1;
+        if (!(p->flags & ACPI_SRAT_MEM_ENABLED) || !p->length)
+                return 0;
+        nid = pxm_to_node(p->proximity_domain);
+        if (nid < 0)
+                return 0;
+        if (numa_meminfo.nr_blks == NR_NODE_MEMBLKS) {
+                pr_warn("too many memory ranges\n");
+                return 0;
+        }
+        blk = &numa_meminfo.blk[numa_meminfo.nr_blks++];
+        blk->start = p->base_address;
+        blk->end = p->base_address + p->length;
+        blk->nid = nid;
+        return 0;
+}
+
+static int slit_parse(struct acpi_table_header *table)
+{
+        struct acpi_table_slit *slit = (struct acpi_table_slit *)table;
+        uint64_t n = slit->locality_count;
+        int i, j;
+
+        if (table->length < sizeof(*slit) - 1 + n * n) {
+                pr_warn("SLIT too short\n");
+                return -1;
+        }
+        for_each_node(i) {
+                for_each_node(j) {
+                        if (node_to_pxm[i] < n && node_to_pxm[j] < n)
+                                numa_distance[i][j] = slit->entry[node_to_pxm[i] * n + node_to_pxm[j]];
+                }
+        }
+        return 0;
+}
+
+int phys_to_node(phys_addr_t addr)
+{
+        size_t i;
+
+        for (i = 0; i < numa_meminfo.nr_blks; ++i) {
+                const struct numa_memblk *blk = &numa_meminfo.blk[i];
+
+                if (blk->start <= addr && addr < blk->end)
+                        return blk->nid;
+        }
+        return 0;
+}
+
+/* CPUs not known to the SRAT go to node 0 */
+int cpu_to_node(int cpu)
+{
+        int apicid = cpuid_to_apicid[cpu];
+
+        if (!cpu && apicid == BAD_APICID)
+                apicid = boot_apicid;
+        if (numa_off || apicid == BAD_APICID || apicid_to_node[apicid] < 0)
+                return 0;
+        return apicid_to_node[apicid];
+}
+
+int node_distance(int from, int to)
+{
+        return numa_distance[from][to];
+}
+
+void numa_init(void)
+{
+        struct acpi_subtable_proc srat_proc[] = {
+                { .id = ACPI_SRAT_TYPE_CPU_AFFINITY,
+                  .handler = srat_parse_cpu,
+                },
+                { .id = ACPI_SRAT_TYPE_MEMORY_AFFINITY,
+                  .handler = srat_parse_mem,
+                },
+                { .id = ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY,
+                  .handler = srat_parse_x2apic,
+                },
+        };
+        size_t i;
+        int r, a, b;
+
+        memset(apicid_to_node, -1, sizeof(apicid_to_node));
+        boot_apicid = cpuid_ebx(1) >> 24;
+        nr_node_ids = 0;
+        r = acpi_table_parse_entries_array(ACPI_SIG_SRAT, sizeof(struct acpi_table_srat),
+                                           srat_proc, ARRAY_SIZE(srat_proc), 0);
+        if (r <= 0 || !numa_meminfo.nr_blks) {
+                nr_node_ids = 1;
+                numa_meminfo.nr_blks = 0;
+                numa_distance[0][0] = LOCAL_DISTANCE;
+                pr_info("no SRAT, faking a single node\n");
+                return;
+        }
+
+        for_each_node(a) {
+                for_each_node(b)
+                        numa_distance[a][b] = a == b ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+        }
+        acpi_table_parse(ACPI_SIG_SLIT, slit_parse);
+        numa_off = false;
+
+        for (i = 0; i < numa_meminfo.nr_blks; ++i) {
+                const struct numa_memblk *blk = &numa_meminfo.blk[i];
+
+                pr_info("node %d: [mem 0x%016" PRIx64 "-0x%016" PRIx64 "]\n",
+                        blk->nid, blk->start, blk->end - 1);
+        }
+        for_each_node(a) {
+                pr_info("node %d (PXM %u) distances:", a, node_to_pxm[a]);
+                for_each_node(b)
+                        pr_cont(" %d", node_distance(a, b));
+                pr_cont("\n");
+        }
+}
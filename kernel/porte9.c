@@ -14,6 +14,11 @@ static void porte9_write(struct console *con, const char *s, size_t n)
         outsb(0xe9, END_COLOR, sizeof(END_COLOR) - 1);
 }
 
+void porte9_write_raw(const void *buf, size_t n)
+{
+        outsb(0xe9, buf, n);
+}
+
 static struct console con = {
         .write = porte9_write,
 };
@@ -77,6 +77,17 @@ struct cpu_entry_area *get_cpu_entry_area(int cpu)
         return per_cpu_ptr(&cpu_entry_area, cpu);
 }
 
+static void trap_init_msrs(void)
+{
+        /* disable sysenter */
+        wrmsrl(MSR_IA32_SYSENTER_CS, GDT_ENTRY_INVALID_SEG);
+        wrmsrl(MSR_IA32_SYSENTER_ESP, 0);
+        wrmsrl(MSR_IA32_SYSENTER_EIP, 0);
+
+        wrmsrl(MSR_FS_BASE, 0);
+        wrmsrl(MSR_KERNEL_GS_BASE, 0);
+}
+
 void trap_init(void)
 {
         switch_to_new_gdt();
@@ -92,16 +103,15 @@ void trap_init(void)
 
         idt_setup_apic_and_irq_gates();
 
-        /* disable sysenter */
-        wrmsrl(MSR_IA32_SYSENTER_CS, GDT_ENTRY_INVALID_SEG);
-        wrmsrl(MSR_IA32_SYSENTER_ESP, 0);
-        wrmsrl(MSR_IA32_SYSENTER_EIP, 0);
-
-        wrmsrl(MSR_FS_BASE, 0);
-        wrmsrl(MSR_KERNEL_GS_BASE, 0);
+        trap_init_msrs();
+}
 
-        /* switch gs to shared mapping */
-        wrmsrl(MSR_GS_BASE, __ENTRY_ADDR(rdmsrl(MSR_GS_BASE)));
+/* the IDT is shared; the GDT and TSS are per CPU */
+void trap_init_secondary(void)
+{
+        switch_to_new_gdt();
+        load_current_idt();
+        trap_init_msrs();
 }
 
 void syscall_init(void)
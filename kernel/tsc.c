@@ -4,7 +4,7 @@
 #include <asm/processor.h>
 #include <asm/tsc.h>
 
-static unsigned long tsc_khz;
+unsigned long tsc_khz;
 
 static unsigned long native_calibrate_tsc(void)
 {
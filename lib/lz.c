@@ -0,0 +1,156 @@
+#include <sys/lz.h>
+#include <sys/string.h>
+
+/*
+ * Each sequence is a token (literal length in the high nibble, match
+ * length minus MIN_MATCH in the low one; 15 means more length bytes
+ * follow, each adding up to 255), the literals, and a 16-bit offset
+ * back to the match.  The last sequence has literals only.
+ */
+
+#define MIN_MATCH       4
+/* as in LZ4, so that its decoders can read our output */
+#define LAST_LITERALS   5
+#define MF_LIMIT        12
+
+static uint32_t read32(const uint8_t *p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static unsigned int hash(uint32_t v)
+{
+        return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+        for (; len >= 255; len -= 255)
+                *op++ = 255;
+        *op++ = len;
+        return op;
+}
+
+/* returns the end of the sequence, or NULL if it doesn't fit */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t lit_len,
+                             size_t offset, size_t match_len)
+{
+        uint8_t *token = op++;
+
+        /* the worst case for both lengths */
+        if ((size_t)(oend - op) < lit_len + lit_len / 255 + 1 + 2 + match_len / 255 + 1)
+                return NULL;
+
+        *token = min(lit_len, (size_t)15) << 4;
+        if (lit_len >= 15)
+                op = put_length(op, lit_len - 15);
+        memcpy(op, lit, lit_len);
+        op += lit_len;
+        if (!match_len)
+                return op;
+
+        *op++ = offset;
+        *op++ = offset >> 8;
+        match_len -= MIN_MATCH;
+        *token |= min(match_len, (size_t)15);
+        if (match_len >= 15)
+                op = put_length(op, match_len - 15);
+        return op;
+}
+
+size_t lz_compress(const void *src, size_t src_size, void *dst, size_t dst_size,
+                   uint16_t table[LZ_HASH_SIZE])
+{
+        const uint8_t *base = src, *ip = base, *anchor = base, *iend = base + src_size;
+        const uint8_t *mflimit = src_size > MF_LIMIT ? iend - MF_LIMIT : base;
+        const uint8_t *ref, *start;
+        uint8_t *op = dst, *oend = op + dst_size;
+        uint32_t seq;
+        unsigned int h;
+
+        /* positions are kept in 16 bits */
+        if (src_size > UINT16_MAX || !dst_size)
+                return 0;
+        memset(table, 0, LZ_HASH_SIZE * sizeof(*table));
+
+        while (ip < mflimit) {
+                seq = read32(ip);
+                h = hash(seq);
+                ref = base + table[h];
+                table[h] = ip - base;
+                if (ref >= ip || read32(ref) != seq) {
+                        ++ip;
+                        continue;
+                }
+
+                start = ip;
+                ip += MIN_MATCH;
+                while (ip < iend - LAST_LITERALS && *ip == ref[ip - start])
+                        ++ip;
+                op = put_sequence(op, oend, anchor, start - anchor, start - ref, ip - start);
+                if (!op)
+                        return 0;
+                anchor = ip;
+        }
+
+        op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+        return op ? op - (uint8_t *)dst : 0;
+}
+
+static bool get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+        uint8_t b;
+
+        do {
+                if (*ip >= iend)
+                        return false;
+                b = *(*ip)++;
+                *len += b;
+        } while (b == 255);
+        return true;
+}
+
+ssize_t lz_decompress(const void *src, size_t src_size, void *dst, size_t dst_size)
+{
+        const uint8_t *ip = src, *iend = ip + src_size, *match;
+        uint8_t *base = dst, *op = base, *oend = base + dst_size;
+        size_t len, offset;
+        uint8_t token;
+
+        for (;;) {
+                if (ip >= iend)
+                        return -1;
+                token = *ip++;
+
+                len = token >> 4;
+                if (len == 15 && !get_length(&ip, iend, &len))
+                        return -1;
+                if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+                        return -1;
+                memcpy(op, ip, len);
+                op += len;
+                ip += len;
+                if (ip == iend)
+                        break;
+
+                if (iend - ip < 2)
+                        return -1;
+                offset = ip[0] | (ip[1] << 8);
+                ip += 2;
+                if (!offset || offset > (size_t)(op - base))
+                        return -1;
+                len = token & 15;
+                if (len == 15 && !get_length(&ip, iend, &len))
+                        return -1;
+                len += MIN_MATCH;
+                if (len > (size_t)(oend - op))
+                        return -1;
+                /* the match may overlap what it produces */
+                for (match = op - offset; len; --len)
+                        *op++ = *match++;
+        }
+        return op - base;
+}
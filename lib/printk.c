@@ -12,7 +12,21 @@
 static LIST_HEAD(console_drivers);
 static int loglevel = LOGLEVEL_DEFAULT;
 static int curlevel = LOGLEVEL_DEFAULT;
-static DEFINE_SPINLOCK(console_lock);
+static DEFINE_SPINLOCK(console_spinlock);
+
+/*
+ * Serialize output that bypasses printk (e.g., binary frames on the
+ * debug port) with regular messages.
+ */
+void console_lock(void)
+{
+        spin_lock(&console_spinlock);
+}
+
+void console_unlock(void)
+{
+        spin_unlock(&console_spinlock);
+}
 
 void register_console(struct console *newcon)
 {
@@ -37,7 +51,7 @@ int vprintk(int level, const char *fmt, va_list args)
         size_t len = 0;
         struct console *con;
 
-        spin_lock(&console_lock);
+        spin_lock(&console_spinlock);
 
         thislevel = (level == LOGLEVEL_CONT) ? curlevel : level;
         if (thislevel > loglevel)
@@ -56,7 +70,7 @@ cont:
         }
 
 done:
-        spin_unlock(&console_lock);
+        spin_unlock(&console_spinlock);
         return len;
 }
 
@@ -13,6 +13,45 @@ static noinline int skip_atoi(const char **s)
         return i;
 }
 
+/**
+ * simple_strtoull - convert a string to an unsigned long long
+ * @cp: The start of the string
+ * @endp: A pointer to the end of the parsed string will be placed here
+ * @base: The number base to use (0 to autodetect "0x" and "0" prefixes)
+ */
+unsigned long long simple_strtoull(const char *cp, char **endp, unsigned int base)
+{
+        unsigned long long result = 0;
+
+        if (!base) {
+                base = 10;
+                if (cp[0] == '0') {
+                        base = 8;
+                        if (_tolower(cp[1]) == 'x' && isxdigit(cp[2])) {
+                                base = 16;
+                                cp += 2;
+                        }
+                }
+        } else if (base == 16 && cp[0] == '0' && _tolower(cp[1]) == 'x') {
+                cp += 2;
+        }
+
+        while (isxdigit(*cp)) {
+                unsigned int value;
+
+                value = isdigit(*cp) ? *cp - '0' : _tolower(*cp) - 'a' + 10;
+                if (value >= base)
+                        break;
+                result = result * base + value;
+                cp++;
+        }
+
+        if (endp)
+                *endp = (char *)cp;
+
+        return result;
+}
+
 /*
  * Decimal conversion is by far the most typical, and is used for
  * /proc and /sys data. This directly impacts e.g. top performance
@@ -0,0 +1,380 @@
+#include <asm/cpufeature.h>
+#include <asm/bitops.h>
+#include <asm/init.h>
+#include <asm/kvm_para.h>
+#include <asm/mmu.h>
+#include <asm/processor.h>
+#include <asm/tsc.h>
+#include <io/sizes.h>
+#include <sys/ctype.h>
+#include <sys/multiboot.h>
+#include <sys/string.h>
+
+/*
+ * Micro-benchmarks run as a guest.  The kernel command line selects
+ * the benchmarks by name (e.g., "bench.bin rdtsc"); all run by default.
+ * The word "stats" additionally dumps the VMM exit statistics at the end,
+ * "snapshot" takes a guest snapshot after the benchmarks, and "trace"
+ * flushes the VM-exit trace of the VMM ("trace=1").
+ */
+
+#define NR_ITERS        100000
+
+static void bench_rdtsc(void)
+{
+        uint64_t start, end;
+        size_t i;
+
+        start = rdtsc();
+        for (i = 0; i < NR_ITERS; ++i)
+                rdtsc();
+        end = rdtsc();
+        pr_info("rdtsc: %" PRIu64 " cycles/op\n", (end - start) / NR_ITERS);
+}
+
+static void bench_rdtscp(void)
+{
+        uint64_t start, end;
+        uint32_t lo, hi, aux;
+        size_t i;
+
+        if (!this_cpu_has(X86_FEATURE_RDTSCP)) {
+                pr_info("rdtscp: not supported\n");
+                return;
+        }
+
+        start = rdtsc();
+        for (i = 0; i < NR_ITERS; ++i)
+                asm volatile("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+        end = rdtsc();
+        pr_info("rdtscp: %" PRIu64 " cycles/op\n", (end - start) / NR_ITERS);
+}
+
+/* a second root sharing all mappings with the boot page table */
+static pteval_t pml4_alt[512] __aligned(PAGE_SIZE);
+extern pteval_t kpml4[];
+
+static void bench_cr3(void)
+{
+        unsigned long cr3[2];
+        uint64_t start, end;
+        size_t i;
+
+        memcpy(pml4_alt, kpml4, sizeof(pml4_alt));
+        cr3[0] = read_cr3();
+        cr3[1] = __pa(pml4_alt);
+
+        start = rdtsc();
+        for (i = 0; i < NR_ITERS; ++i)
+                write_cr3(cr3[i & 1]);
+        end = rdtsc();
+        write_cr3(cr3[0]);
+        pr_info("cr3: %" PRIu64 " cycles/switch\n", (end - start) / NR_ITERS);
+}
+
+/* MiB/s for size bytes moved in the given cycles */
+static uint64_t mib_per_sec(uint64_t size, uint64_t cycles)
+{
+        return size / SZ_1M * tsc_khz * 1000 / max(cycles, UINT64_C(1));
+}
+
+#define MEMBW_SIZE      (8 * SZ_1M)
+#define MEMBW_PASSES    16
+
+static char membw_buf[MEMBW_SIZE] __aligned(PAGE_SIZE);
+
+/* guest RAM should run at native speed, i.e., be mapped write-back */
+static void bench_membw(void)
+{
+        uint64_t start, end;
+        size_t i, half = MEMBW_SIZE / 2;
+
+        /* fault in and warm up */
+        memset(membw_buf, 0, MEMBW_SIZE);
+
+        start = rdtsc();
+        for (i = 0; i < MEMBW_PASSES; ++i)
+                memset(membw_buf, i, MEMBW_SIZE);
+        end = rdtsc();
+        pr_info("membw: write %" PRIu64 " MiB/s\n", mib_per_sec(MEMBW_SIZE * MEMBW_PASSES, end - start));
+
+        start = rdtsc();
+        for (i = 0; i < MEMBW_PASSES; ++i)
+                memcpy(membw_buf + (i & 1 ? 0 : half), membw_buf + (i & 1 ? half : 0), half);
+        end = rdtsc();
+        pr_info("membw: copy %" PRIu64 " MiB/s\n", mib_per_sec(half * MEMBW_PASSES, end - start));
+}
+
+#define DIRTY_PAGES     256
+/* the log is fetched for the low 64M, which holds the image */
+#define DIRTY_NR_PFNS   (SZ_64M / PAGE_SIZE)
+
+static unsigned long dirty_bitmap[BITS_TO_LONGS(DIRTY_NR_PFNS)];
+
+/* write to each page of a buffer and check that the dirty log saw them all */
+static void bench_dirty(void)
+{
+        pfn_t base = __pa(membw_buf) >> PAGE_SHIFT;
+        uint64_t start, end;
+        size_t i, missed = 0;
+        long n;
+
+        BUG_ON(base + DIRTY_PAGES > DIRTY_NR_PFNS);
+        if (kvm_hypercall0(KVM_HC_DIRTY_LOG_ENABLE)) {
+                pr_info("dirty: not supported\n");
+                return;
+        }
+        /* start from a clean log */
+        kvm_hypercall2(KVM_HC_DIRTY_LOG_FETCH, 0, 0);
+
+        start = rdtsc();
+        for (i = 0; i < DIRTY_PAGES; ++i)
+                membw_buf[i * PAGE_SIZE] = i;
+        end = rdtsc();
+
+        n = kvm_hypercall2(KVM_HC_DIRTY_LOG_FETCH, (unsigned long)dirty_bitmap, DIRTY_NR_PFNS);
+        for (i = 0; i < DIRTY_PAGES; ++i) {
+                if (!test_bit(base + i, dirty_bitmap))
+                        ++missed;
+        }
+        kvm_hypercall0(KVM_HC_DIRTY_LOG_DISABLE);
+        pr_info("dirty: %ld pages logged, %zu missed, %" PRIu64 " cycles/page\n",
+                n, missed, (end - start) / DIRTY_PAGES);
+}
+
+#define NR_CLONES       4
+#define CLONE_PAGES     16
+
+/* clone n writes to n * CLONE_PAGES pages, which the guest must not see */
+static void bench_clone(void)
+{
+        uint64_t start;
+        size_t i, changed = 0;
+        long id;
+
+        BUILD_BUG_ON(NR_CLONES * CLONE_PAGES * PAGE_SIZE > MEMBW_SIZE);
+        for (i = 0; i < NR_CLONES * CLONE_PAGES; ++i)
+                membw_buf[i * PAGE_SIZE] = 0;
+
+        start = rdtsc();
+        id = kvm_hypercall1(KVM_HC_CLONE, NR_CLONES);
+        if (id > 0) {
+                for (i = 0; i < id * CLONE_PAGES; ++i)
+                        membw_buf[i * PAGE_SIZE] = id;
+                kvm_hypercall1(KVM_HC_CLONE_EXIT, id);
+                BUG();
+        }
+        if (id < 0) {
+                pr_info("clone: not supported\n");
+                return;
+        }
+
+        for (i = 0; i < NR_CLONES * CLONE_PAGES; ++i) {
+                if (membw_buf[i * PAGE_SIZE])
+                        ++changed;
+        }
+        pr_info("clone: %d clones in %" PRIu64 " us, %zu pages changed\n",
+                NR_CLONES, (rdtsc() - start) * 1000 / tsc_khz, changed);
+}
+
+#define KSM_PAGES       64
+#define KSM_WAIT_MS     1000
+
+/*
+ * Fill pages with the same contents and give the VMM time to merge
+ * them; the writes afterwards take the faults that break the sharing.
+ */
+static void bench_ksm(void)
+{
+        uint64_t start, end;
+        size_t i;
+
+        BUILD_BUG_ON(KSM_PAGES * PAGE_SIZE > MEMBW_SIZE);
+        memset(membw_buf, 0x5a, KSM_PAGES * PAGE_SIZE);
+
+        start = rdtsc();
+        while (rdtsc() - start < (uint64_t)KSM_WAIT_MS * tsc_khz)
+                cpu_relax();
+
+        start = rdtsc();
+        for (i = 0; i < KSM_PAGES; ++i)
+                membw_buf[i * PAGE_SIZE] = i;
+        end = rdtsc();
+        pr_info("ksm: %" PRIu64 " cycles/write\n", (end - start) / KSM_PAGES);
+}
+
+#define BALLOON_PAGES   256
+
+/*
+ * Give pages to the VMM and take them back; the first touch of each
+ * maps it again, and it must read as zero.
+ */
+static void bench_balloon(void)
+{
+        unsigned long gpa = __pa(membw_buf);
+        long inflated, deflated;
+        uint64_t start, end;
+        size_t i, j, dirty = 0;
+
+        BUILD_BUG_ON(BALLOON_PAGES * PAGE_SIZE > MEMBW_SIZE);
+        if (cpuid_eax(0x40000000) < KVM_CPUID_FEATURES ||
+            !(cpuid_ebx(KVM_CPUID_FEATURES) & BIT_32(KVM_FEATURE_BALLOON))) {
+                pr_info("balloon: not supported\n");
+                return;
+        }
+        memset(membw_buf, 0xa5, BALLOON_PAGES * PAGE_SIZE);
+
+        inflated = kvm_hypercall2(KVM_HC_BALLOON_INFLATE, gpa, BALLOON_PAGES);
+        deflated = kvm_hypercall2(KVM_HC_BALLOON_DEFLATE, gpa, BALLOON_PAGES);
+
+        start = rdtsc();
+        for (i = 0; i < BALLOON_PAGES; ++i)
+                READ_ONCE(membw_buf[i * PAGE_SIZE]);
+        end = rdtsc();
+        for (i = 0; i < BALLOON_PAGES; ++i) {
+                for (j = 0; j < PAGE_SIZE && !membw_buf[i * PAGE_SIZE + j]; ++j)
+                        ;
+                dirty += j < PAGE_SIZE;
+        }
+        pr_info("balloon: %ld pages inflated, %ld deflated, %zu not zeroed, %" PRIu64 " cycles/refill\n",
+                inflated, deflated, dirty, (end - start) / BALLOON_PAGES);
+}
+
+#define ZSWAP_PAGES     256
+#define ZSWAP_WAIT_MS   1500
+
+static unsigned long zswap_word(size_t i)
+{
+        return i / (PAGE_SIZE / sizeof(long)) * 0x0101010101010101UL + i % 8;
+}
+
+/*
+ * Leave compressible pages alone for long enough that the VMM compresses
+ * them; reading them back takes the faults that decompress them.
+ */
+static void bench_zswap(void)
+{
+        unsigned long *words = (unsigned long *)membw_buf;
+        size_t i, n = ZSWAP_PAGES * PAGE_SIZE / sizeof(long), corrupted = 0;
+        uint64_t start, end;
+
+        BUILD_BUG_ON(ZSWAP_PAGES * PAGE_SIZE > MEMBW_SIZE);
+        for (i = 0; i < n; ++i)
+                words[i] = zswap_word(i);
+
+        start = rdtsc();
+        while (rdtsc() - start < (uint64_t)ZSWAP_WAIT_MS * tsc_khz)
+                cpu_relax();
+
+        start = rdtsc();
+        for (i = 0; i < ZSWAP_PAGES; ++i)
+                READ_ONCE(membw_buf[i * PAGE_SIZE]);
+        end = rdtsc();
+        for (i = 0; i < n; ++i) {
+                if (words[i] != zswap_word(i)) {
+                        ++corrupted;
+                        i = ALIGN(i + 1, PAGE_SIZE / sizeof(long)) - 1;
+                }
+        }
+        pr_info("zswap: %zu pages corrupted, %" PRIu64 " cycles/read\n",
+                corrupted, (end - start) / ZSWAP_PAGES);
+}
+
+/*
+ * A restored guest comes back here on a fresh machine; there is no
+ * device state worth restoring, as the UART works from reset.
+ */
+static void snapshot(void)
+{
+        uint64_t start = rdtsc();
+        long ret;
+
+        ret = kvm_hypercall0(KVM_HC_SNAPSHOT);
+        if (ret == 1)
+                pr_info("snapshot: restored\n");
+        else if (ret == 0)
+                pr_info("snapshot: saved in %" PRIu64 " us\n", (rdtsc() - start) * 1000 / tsc_khz);
+        else
+                pr_info("snapshot: not supported\n");
+}
+
+static const struct {
+        const char *name;
+        void (*fn)(void);
+} benches[] = {
+        { "rdtsc", bench_rdtsc },
+        { "rdtscp", bench_rdtscp },
+        { "cr3", bench_cr3 },
+        { "membw", bench_membw },
+        { "dirty", bench_dirty },
+        { "clone", bench_clone },
+        { "ksm", bench_ksm },
+        { "balloon", bench_balloon },
+        { "zswap", bench_zswap },
+};
+
+static bool has_word(const char *cmdline, const char *name)
+{
+        const char *s = cmdline, *end;
+        size_t n = strlen(name);
+
+        /* skip the image path */
+        while (*s && !isspace(*s))
+                ++s;
+
+        for (;;) {
+                while (isspace(*s))
+                        ++s;
+                if (!*s)
+                        break;
+                for (end = s; *end && !isspace(*end); ++end)
+                        ;
+                if (end - s == n && !strncmp(s, name, n))
+                        return true;
+                s = end;
+        }
+
+        return false;
+}
+
+static bool selected(const char *cmdline, const char *name)
+{
+        size_t i;
+
+        for (i = 0; i < ARRAY_SIZE(benches); ++i) {
+                if (has_word(cmdline, benches[i].name))
+                        return has_word(cmdline, name);
+        }
+        /* no benchmark named: run all */
+        return true;
+}
+
+noreturn void main(unsigned int magic, struct multiboot_info *multiboot_info)
+{
+        const char *cmdline = "";
+        size_t i;
+
+        uart8250_init();
+        vgacon_init();
+
+        cpu_init();
+        tsc_init();
+
+        if (magic == MULTIBOOT_BOOTLOADER_MAGIC && (multiboot_info->flags & MULTIBOOT_INFO_CMDLINE))
+                cmdline = __va(multiboot_info->cmdline);
+
+        for (i = 0; i < ARRAY_SIZE(benches); ++i) {
+                if (selected(cmdline, benches[i].name))
+                        benches[i].fn();
+        }
+
+        if (has_word(cmdline, "snapshot"))
+                snapshot();
+        if (has_word(cmdline, "trace"))
+                kvm_hypercall0(KVM_HC_TRACE_FLUSH);
+        if (has_word(cmdline, "stats"))
+                kvm_hypercall0(KVM_HC_STAT_DUMP);
+
+        pr_info("bench: done\n");
+        die();
+}
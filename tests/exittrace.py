@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+#
+# Decode the binary VM-exit trace emitted by the VMM with "trace=1"
+# (see include/asm/kvm_trace.h).  Capture the debug port first, e.g.:
+#
+#   make qemu VMM_APPEND="trace=1" > trace.out
+#   tests/exittrace.py trace.out
+#
+# Regular console text between frames is ignored.
+
+import argparse, collections, struct, sys
+
+MAGIC = b'\xffLVT'
+VERSION = 1
+HEADER = struct.Struct('<4sHHIIQ')
+ENTRY = struct.Struct('<QQQQII')
+
+EXIT_REASONS = {
+    0: 'EXCEPTION_NMI', 1: 'EXTERNAL_INTERRUPT', 2: 'TRIPLE_FAULT',
+    3: 'INIT_SIGNAL', 4: 'SIPI', 7: 'PENDING_INTERRUPT', 8: 'NMI_WINDOW',
+    9: 'TASK_SWITCH', 10: 'CPUID', 12: 'HLT', 13: 'INVD', 14: 'INVLPG',
+    15: 'RDPMC', 16: 'RDTSC', 18: 'VMCALL', 19: 'VMCLEAR', 20: 'VMLAUNCH',
+    21: 'VMPTRLD', 22: 'VMPTRST', 23: 'VMREAD', 24: 'VMRESUME',
+    25: 'VMWRITE', 26: 'VMOFF', 27: 'VMON', 28: 'CR_ACCESS',
+    29: 'DR_ACCESS', 30: 'IO_INSTRUCTION', 31: 'MSR_READ', 32: 'MSR_WRITE',
+    33: 'INVALID_STATE', 34: 'MSR_LOAD_FAIL', 36: 'MWAIT_INSTRUCTION',
+    37: 'MONITOR_TRAP_FLAG', 39: 'MONITOR_INSTRUCTION',
+    40: 'PAUSE_INSTRUCTION', 41: 'MCE_DURING_VMENTRY',
+    43: 'TPR_BELOW_THRESHOLD', 44: 'APIC_ACCESS', 45: 'EOI_INDUCED',
+    46: 'GDTR_IDTR', 47: 'LDTR_TR', 48: 'EPT_VIOLATION',
+    49: 'EPT_MISCONFIG', 50: 'INVEPT', 51: 'RDTSCP', 52: 'PREEMPTION_TIMER',
+    53: 'INVVPID', 54: 'WBINVD', 55: 'XSETBV', 56: 'APIC_WRITE',
+    57: 'RDRAND', 58: 'INVPCID', 59: 'VMFUNC', 60: 'ENCLS', 61: 'RDSEED',
+    62: 'PML_FULL', 63: 'XSAVES', 64: 'XRSTORS',
+}
+
+Event = collections.namedtuple('Event', 'cpu tsc qual rip cr3 reason vcpu')
+
+
+def reason_name(reason):
+    name = EXIT_REASONS.get(reason & 0xffff, 'UNKNOWN_%d' % (reason & 0xffff))
+    if reason & 0x80000000:
+        name += '(FAILED_VMENTRY)'
+    return name
+
+
+def parse(data):
+    """Yield (header, events) for every frame found in data."""
+    pos = 0
+    while True:
+        pos = data.find(MAGIC, pos)
+        if pos < 0 or pos + HEADER.size > len(data):
+            return
+        magic, version, cpu, n, lost, tsc_khz = HEADER.unpack_from(data, pos)
+        if version != VERSION:
+            sys.stderr.write('skipping frame with unknown version %d at %d\n' % (version, pos))
+            pos += len(MAGIC)
+            continue
+        end = pos + HEADER.size + n * ENTRY.size
+        if end > len(data):
+            sys.stderr.write('truncated frame at %d\n' % pos)
+            return
+        events = [Event(cpu, *ENTRY.unpack_from(data, pos + HEADER.size + i * ENTRY.size))
+                  for i in range(n)]
+        yield dict(cpu=cpu, lost=lost, tsc_khz=tsc_khz), events
+        pos = end
+
+
+def timeline(events, tsc_khz, out):
+    if not events:
+        return
+    base = events[0].tsc
+    last = {}
+    out.write('%14s %4s %4s %12s  %-20s %-18s %-18s %s\n' %
+              ('time(us)', 'cpu', 'vcpu', 'delta(us)', 'reason', 'qual', 'rip', 'cr3'))
+    for e in events:
+        t = (e.tsc - base) * 1000.0 / tsc_khz
+        prev = last.get(e.cpu)
+        delta = '' if prev is None else '%.3f' % ((e.tsc - prev) * 1000.0 / tsc_khz)
+        last[e.cpu] = e.tsc
+        out.write('%14.3f %4d %4d %12s  %-20s %#018x %#018x %#x\n' %
+                  (t, e.cpu, e.vcpu, delta, reason_name(e.reason), e.qual, e.rip, e.cr3))
+
+
+def summary(events, tsc_khz, window_us, threshold, out):
+    by_reason = collections.Counter(reason_name(e.reason) for e in events)
+    by_site = collections.Counter((reason_name(e.reason), e.rip) for e in events)
+    out.write('exits by reason:\n')
+    for name, count in by_reason.most_common():
+        out.write('  %-20s %d\n' % (name, count))
+    out.write('top exit sites:\n')
+    for (name, rip), count in by_site.most_common(10):
+        out.write('  %-20s %#018x %d\n' % (name, rip, count))
+
+    # exit storms: windows with at least `threshold` exits
+    if not events:
+        return
+    window = window_us * tsc_khz / 1000.0
+    base = events[0].tsc
+    buckets = collections.defaultdict(list)
+    for e in events:
+        buckets[int((e.tsc - base) // window)].append(e)
+    storms = sorted(b for b, evs in buckets.items() if len(evs) >= threshold)
+    out.write('windows of %dus with >= %d exits: %d\n' % (window_us, threshold, len(storms)))
+    for b in storms:
+        inwin = buckets[b]
+        top = collections.Counter(reason_name(e.reason) for e in inwin).most_common(3)
+        out.write('  @%.3fus: %d exits (%s)\n' %
+                  (b * window_us, len(inwin), ', '.join('%s %d' % x for x in top)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode the lvisor VM-exit trace.')
+    parser.add_argument('file', nargs='?', help='captured debug port output (default: stdin)')
+    parser.add_argument('-s', '--summary', action='store_true', help='print a summary instead of the timeline')
+    parser.add_argument('-w', '--window', type=int, default=1000, help='storm window in microseconds')
+    parser.add_argument('-t', '--threshold', type=int, default=100, help='exits per window to report as a storm')
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file, 'rb') as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    events = []
+    tsc_khz = None
+    lost = 0
+    for hdr, evs in parse(data):
+        tsc_khz = tsc_khz or hdr['tsc_khz']
+        lost += hdr['lost']
+        events.extend(evs)
+    if not tsc_khz:
+        sys.exit('no trace frames found')
+    events.sort(key=lambda e: e.tsc)
+
+    if args.summary:
+        summary(events, tsc_khz, args.window, args.threshold, sys.stdout)
+    else:
+        timeline(events, tsc_khz, sys.stdout)
+    if lost:
+        sys.stderr.write('warning: %d events lost\n' % lost)
+
+
+if __name__ == '__main__':
+    main()
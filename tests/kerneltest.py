@@ -1,24 +1,20 @@
 import re, unittest, time
-import os, signal
+import os, signal, subprocess, sys
 import asyncio
 from asyncio.subprocess import DEVNULL, PIPE
 from pathlib import Path
 
 TIMEOUT = 5
 TESTDIR = ['o.x86_64/', 'o.x86_64/tests/', 'tests/']
+LINE_LIMIT = 64 * 1024 * 1024
+
+def path(name):
+    return next(x + name for x in TESTDIR if Path(x + name).is_file())
 
 def kernel(name, **kwargs):
     def _kernel(f):
-        def path(name):
-            return next(x + name for x in TESTDIR if Path(x + name).is_file())
         def _wrap(self):
-            cmd = 'make qemu KERNEL=%s' % (path(name),)
-            if 'append' in kwargs:
-                cmd = cmd + ' APPEND="%s"' % (kwargs['append'],)
-            if 'initrd' in kwargs:
-                cmd = cmd + ' INITRD=%s' % (path(kwargs['initrd']),)
-            create = asyncio.create_subprocess_shell(cmd, stdin=PIPE, stdout=PIPE, stderr=DEVNULL, preexec_fn=os.setsid)
-            self.proc = self.loop.run_until_complete(create)
+            self.boot(name, **kwargs)
             return f(self)
         return _wrap
     return _kernel
@@ -28,8 +24,30 @@ class KernelTestCase(unittest.TestCase):
     def setUp(self):
         self.loop = asyncio.get_event_loop()
         self.output = []
+        # the undecoded output, for the tools that parse the binary streams
+        self.raw = bytearray()
+        self.proc = None
 
     def tearDown(self):
+        self.kill()
+
+    def boot(self, name, **kwargs):
+        cmd = 'make qemu KERNEL=%s' % (path(name),)
+        if 'append' in kwargs:
+            cmd = cmd + ' APPEND="%s"' % (kwargs['append'],)
+        if 'vmm_append' in kwargs:
+            cmd = cmd + ' VMM_APPEND="%s"' % (kwargs['vmm_append'],)
+        if 'qemu_append' in kwargs:
+            cmd = cmd + ' QEMU_APPEND="%s"' % (kwargs['qemu_append'],)
+        if 'initrd' in kwargs:
+            cmd = cmd + ' INITRD=%s' % (path(kwargs['initrd']),)
+        # binary output (e.g., snapshots) can make for long "lines"
+        create = asyncio.create_subprocess_shell(cmd, stdin=PIPE, stdout=PIPE, stderr=DEVNULL, preexec_fn=os.setsid, limit=LINE_LIMIT)
+        self.proc = self.loop.run_until_complete(create)
+
+    def kill(self):
+        if not self.proc:
+            return
         # kill shell, make, qemu, etc.
         try:
             # try not to use SIGKILL
@@ -37,6 +55,15 @@ class KernelTestCase(unittest.TestCase):
         except:
             pass
         self.loop.run_until_complete(self.proc.wait())
+        self.proc = None
+
+    def run_tool(self, name, *args):
+        """Run a script from tests/ on the raw output; return its stdout."""
+        p = subprocess.run([sys.executable, path(name)] + list(args), input=bytes(self.raw),
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE, timeout=TIMEOUT * 6)
+        if p.returncode:
+            self.fail('%s failed:\n%s' % (name, p.stderr.decode(errors='replace')))
+        return p.stdout.decode(errors='replace')
 
     async def _assertOutput(self, regex):
         while True:
@@ -47,7 +74,8 @@ class KernelTestCase(unittest.TestCase):
             else:
                 if not line:
                     break
-                line = line.decode().rstrip('\n')
+                self.raw += line
+                line = line.decode(errors='replace').rstrip('\n')
                 # remove ansi escape
                 line = re.sub(r'\x1b[^m]*m', '', line)
                 self.output.append(line)
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+#
+# Extract a guest snapshot taken with the KVM_HC_SNAPSHOT hypercall
+# (see include/asm/kvm_snapshot.h) from the captured debug port, e.g.:
+#
+#   make qemu KERNEL=o.x86_64/tests/bench.bin APPEND="snapshot" > snap.out
+#   tests/snapshot.py snap.out -o snap.bin
+#
+# and restore it by booting it as the guest kernel, with the same memory
+# size and vmm_mem=:
+#
+#   make qemu KERNEL=snap.bin
+#
+# Pages are restored on demand; VMM_APPEND="snapshot_lazy=0" restores
+# all of them before resuming.
+#
+# Regular console text around the snapshot is ignored.
+
+import argparse, struct, sys
+
+MAGIC = b'\xffLVS'
+VERSION = 2
+HEADER = struct.Struct('<4sHHIIQ')
+E820 = struct.Struct('<QQI')
+RUN = struct.Struct('<QII')
+PAGE_SIZE = 4096
+
+RUN_ZERO = 1 << 0
+RUN_END = 1 << 1
+RUN_HOT = 1 << 2
+
+# offsets into struct kvm_snapshot_cpu
+CPU_RIP = 16 * 8
+CPU_CR3 = CPU_RIP + 5 * 8
+
+
+def parse(data, pos):
+    """Return (header, runs, end) of the snapshot at pos."""
+    magic, version, nr_e820, cpu_size, _, tsc_khz = HEADER.unpack_from(data, pos)
+    if version != VERSION:
+        raise ValueError('unknown version %d' % version)
+    cpu = pos + HEADER.size
+    rip, = struct.unpack_from('<Q', data, cpu + CPU_RIP)
+    cr3, = struct.unpack_from('<Q', data, cpu + CPU_CR3)
+    off = cpu + cpu_size + nr_e820 * E820.size
+    runs = []
+    while True:
+        if off + RUN.size > len(data):
+            raise ValueError('truncated')
+        gpa, n, flags = RUN.unpack_from(data, off)
+        off += RUN.size
+        if flags & RUN_END:
+            if gpa != off - pos:
+                raise ValueError('size mismatch: %d != %d' % (gpa, off - pos))
+            break
+        runs.append((gpa, n, flags))
+        if not flags & RUN_ZERO:
+            off += n * PAGE_SIZE
+    hdr = dict(tsc_khz=tsc_khz, nr_e820=nr_e820, rip=rip, cr3=cr3)
+    return hdr, runs, off
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Extract an lvisor guest snapshot.')
+    parser.add_argument('file', nargs='?', help='captured debug port output (default: stdin)')
+    parser.add_argument('-o', '--output', help='write the snapshot to this file')
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file, 'rb') as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    # the last complete snapshot wins
+    found = None
+    pos = data.find(MAGIC)
+    while pos >= 0:
+        try:
+            found = (pos,) + parse(data, pos)
+        except (ValueError, struct.error) as e:
+            sys.stderr.write('skipping snapshot at %d: %s\n' % (pos, e))
+            pos = data.find(MAGIC, pos + len(MAGIC))
+        else:
+            pos = data.find(MAGIC, found[3])
+    if not found:
+        sys.exit('no snapshot found')
+
+    start, hdr, runs, end = found
+    pages = sum(n for _, n, _ in runs)
+    zero = sum(n for _, n, flags in runs if flags & RUN_ZERO)
+    hot = sum(n for _, n, flags in runs if flags & RUN_HOT)
+    print('%d bytes, %d runs, %d pages (%d zero, %d hot), rip %#x, cr3 %#x, %d kHz' %
+          (end - start, len(runs), pages, zero, hot, hdr['rip'], hdr['cr3'], hdr['tsc_khz']))
+    if args.output:
+        with open(args.output, 'wb') as f:
+            f.write(data[start:end])
+
+
+if __name__ == '__main__':
+    main()
@@ -9,13 +9,158 @@ class TestVMM(KernelTestCase):
 
     @kernel('hello64.bin')
     def test_hello64(self):
+        self.assertOutput('mmu: \d+ MiB mapped: \d+ 1G \+ \d+ 2M \+ \d+ 4K leaves, \d+ table pages$')
+        self.assertOutput('mmu: memory types:.* WB \d+ KiB')
         self.assertOutput('^Hello from long mode!$')
 
+    @kernel('hello64.bin')
+    def test_relocate(self):
+        # moved from 256M to the top of the 1G of RAM
+        self.assertOutput('multiboot: vmm at \[mem 0x3[0-9a-f]{7}-0x3[0-9a-f]{7}\]$')
+        self.assertOutput('multiboot: direct map of \d+ GiB: \d+ 1G \+ \d+ 2M pages$')
+        self.assertOutput('^Hello from long mode!$')
+
+    @kernel('bench.bin', append='rdtsc stats',
+            qemu_append='-object memory-backend-ram,id=m0,size=512M -object memory-backend-ram,id=m1,size=512M '
+                        '-numa node,nodeid=0,memdev=m0,cpus=0 -numa node,nodeid=1,memdev=m1')
+    def test_numa(self):
+        self.assertOutput('numa: node 1: \[mem 0x0*20000000-0x0*3fffffff\]$')
+        # the VMM moves to node 1, and cpu 0 gets a pool on node 0
+        self.assertOutput('page_alloc: 32 MiB at 0x[0-9a-f]{16} on node 1$')
+        self.assertOutput('page_alloc: 16 MiB at 0x[0-9a-f]{16} on node 0$')
+        self.assertOutput('page_alloc: node 0: free \d+ KiB$')
+        self.assertOutput('page_alloc: local [1-9]\d* KiB remote \d+ KiB$')
+
     @kernel('lv6.bin')
     def test_lv6(self):
         self.assertOutput('^\[.{12}\] hey 481$')
+        self.assertOutput('^\[.{12}\] syscall: \d+ cycles/op$')
         self.assertOutput('^\[.{12}\] bye 451$')
 
+    @kernel('bench.bin', append='rdtsc rdtscp')
+    def test_bench_tsc_offset(self):
+        self.assertOutput('rdtsc: \d+ cycles/op$')
+        self.assertOutput('rdtscp: (\d+ cycles/op|not supported)$')
+
+    @kernel('bench.bin', append='rdtsc rdtscp', vmm_append='tsc=exit')
+    def test_bench_tsc_exit(self):
+        self.assertOutput('rdtsc: \d+ cycles/op$')
+        self.assertOutput('rdtscp: (\d+ cycles/op|not supported)$')
+
+    @kernel('bench.bin', append='rdtsc stats')
+    def test_bench_stats(self):
+        self.assertOutput('stats: vcpu 0: \d+ exits in \d+ cycles$')
+        self.assertOutput('stats:   CPUID ')
+        self.assertOutput('stats:   vmread \d+\.\d\d/exit vmwrite \d+\.\d\d/exit$')
+        self.assertOutput('page_alloc: free \d+ KiB cached \d+ KiB$')
+        self.assertOutput('page_alloc:   pgtable +[1-9]\d* KiB$')
+
+    @kernel('bench.bin', append='membw')
+    def test_bench_membw(self):
+        self.assertOutput('membw: write \d+ MiB/s$')
+        self.assertOutput('membw: copy \d+ MiB/s$')
+
+    @kernel('bench.bin', append='dirty')
+    def test_bench_dirty(self):
+        self.assertOutput('dirty: \d+ pages logged, 0 missed, \d+ cycles/page$')
+
+    @kernel('bench.bin', append='dirty', vmm_append='pml=0')
+    def test_bench_dirty_wp(self):
+        self.assertOutput('mmu: dirty log: write-protect, [1-9]\d* write faults$')
+        self.assertOutput('dirty: \d+ pages logged, 0 missed, \d+ cycles/page$')
+
+    @kernel('bench.bin', append='rdtsc snapshot')
+    def test_bench_snapshot(self):
+        self.assertOutput('snapshot: \d+ pages, \d+ zero, \d+ KiB$')
+        self.assertOutput('snapshot: saved in \d+ us$')
+
+    def save_snapshot(self, name):
+        self.assertOutput('snapshot: saved in \d+ us$')
+        self.assertOutput('^bench: done$')
+        self.run_tool('snapshot.py', '-o', 'o.x86_64/tests/' + name)
+        self.kill()
+
+    @kernel('bench.bin', append='rdtsc snapshot')
+    def test_bench_snapshot_restore(self):
+        self.save_snapshot('snapshot.bin')
+        self.boot('snapshot.bin')
+        self.assertOutput('snapshot: resuming after \d+ us, [1-9]\d* of [1-9]\d* pages pending$')
+        self.assertOutput('^snapshot: restored$')
+        self.assertOutput('^bench: done$')
+
+    @kernel('bench.bin', append='rdtsc snapshot')
+    def test_bench_snapshot_restore_eager(self):
+        self.save_snapshot('snapshot-eager.bin')
+        self.boot('snapshot-eager.bin', vmm_append='snapshot_lazy=0')
+        self.assertOutput('snapshot: resuming after \d+ us, 0 of [1-9]\d* pages pending$')
+        self.assertOutput('snapshot: restored [1-9]\d* pages in \d+ us: \d+ hot, 0 on demand, 0 in background$')
+        self.assertOutput('^snapshot: restored$')
+        self.assertOutput('^bench: done$')
+
+    @kernel('bench.bin', append='clone')
+    def test_bench_clone(self):
+        for i in range(1, 5):
+            self.assertOutput('clone: %d exited with %d after \d+ us: [1-9]\d* pages copied, \d+ shared$' %
+                              (i, i))
+        self.assertOutput('clone: 4 clones in \d+ us, 0 pages changed$')
+
+    @kernel('bench.bin', append='membw stats', vmm_append='zero_pages=1')
+    def test_zero_pages(self):
+        self.assertOutput('membw: write \d+ MiB/s$')
+        self.assertOutput('mmu: zero pages: \d+ shared, [1-9]\d* private$')
+
+    @kernel('bench.bin', append='membw stats', vmm_append='zero_pages=1 collapse_period=1')
+    def test_collapse(self):
+        self.assertOutput('membw: write \d+ MiB/s$')
+        self.assertOutput('mmu: pages: \d+ 1G \+ \d+ 2M \+ \d+ 4K mapped, [1-9]\d* split, \d+ \+ \d+ collapsed in [1-9]\d* passes$')
+
+    @kernel('bench.bin', append='ksm stats', vmm_append='ksm_rate=1000000')
+    def test_ksm(self):
+        self.assertOutput('ksm: \d+ cycles/write$')
+        self.assertOutput('mmu: ksm: \d+ scanned, \d+ cycles/page, [1-9]\d* shared in [1-9]\d* frames, [1-9]\d* unshared$')
+
+    @kernel('bench.bin', append='balloon stats')
+    def test_balloon(self):
+        self.assertOutput('balloon: 256 pages inflated, 256 deflated, 0 not zeroed, \d+ cycles/refill$')
+        self.assertOutput('mmu: balloon: 0 pages, 256 inflated, 256 deflated, 256 refilled$')
+
+    @kernel('bench.bin', append='zswap stats', vmm_append='zswap_age=2')
+    def test_zswap(self):
+        self.assertOutput('zswap: 0 pages corrupted, \d+ cycles/read$')
+        self.assertOutput('mmu: zswap: \d+ pages in \d+ KiB, ratio [1-9]\d*\.\d\d, [1-9]\d* stored, [1-9]\d* loaded, \d+ rejected$')
+
+    @kernel('bench.bin', append='zswap stats', vmm_append='wss=1')
+    def test_wss(self):
+        self.assertOutput('mmu: idle: [1-9]\d* passes of 100 ms, \d+ cycles/pass, wss [1-9]\d* KiB$')
+        self.assertOutput('mmu:   pages   0:[1-9]\d* 1:\d+ 2:\d+ 4:\d+ 8:\d+ 16:\d+ 32:\d+ 64:\d+ 128:\d+$')
+
+    @kernel('bench.bin', append='rdtsc stats', vmm_append='vmm_mem=64')
+    def test_vmm_mem(self):
+        self.assertOutput('page_alloc: 64 MiB at 0x[0-9a-f]{16}$')
+
+    @kernel('bench.bin', append='rdtsc stats', vmm_append='vmcs_cache=0')
+    def test_bench_stats_uncached(self):
+        self.assertOutput('stats:   vmread \d+\.\d\d/exit vmwrite \d+\.\d\d/exit$')
+
+    @kernel('bench.bin', append='cr3 stats', vmm_append='cr3=exact')
+    def test_bench_cr3_exact(self):
+        self.assertOutput('cr3: \d+ cycles/switch$')
+        self.assertOutput('stats:   CR_ACCESS ')
+        self.assertOutput('asid 1 ')
+
+    @kernel('bench.bin', append='cr3 stats', vmm_append='cr3=sampled')
+    def test_bench_cr3_sampled(self):
+        self.assertOutput('cr3: \d+ cycles/switch$')
+        self.assertOutput('asid 0 ')
+
+    @kernel('bench.bin', append='rdtsc trace', vmm_append='trace=1')
+    def test_bench_trace(self):
+        self.assertOutput('^bench: done$')
+        out = self.run_tool('exittrace.py', '--summary')
+        self.assertRegex(out, 'exits by reason:\n')
+        # at least the flush itself
+        self.assertRegex(out, '\n  VMCALL +[1-9]\d*\n')
+
     @kernel('xv6/kernelmemfs')
     def test_xv6(self):
         # boot correctly
@@ -31,5 +176,14 @@ class TestVMM(KernelTestCase):
         self.input('usertests\n')
         self.assertOutput('^ALL TESTS PASSED$')
 
+    @kernel('xv6/kernelmemfs', qemu_append='-smp 2')
+    def test_xv6_smp(self):
+        self.assertOutput('smpboot: 2 CPUs online$')
+        # the guest starts its AP with INIT-SIPI-SIPI
+        self.assertOutput('^cpu1: starting$')
+        self.assertOutput('^init: starting sh$')
+        self.input('usertests\n')
+        self.assertOutput('^ALL TESTS PASSED$')
+
 if __name__ == '__main__':
     unittest.main(testRunner=KernelTestRunner)
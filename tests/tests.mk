@@ -2,6 +2,7 @@ TESTS   :=                              \
         $(O)/tests/hello32.elf          \
         $(O)/tests/hello64.bin          \
         $(O)/tests/lv6.bin              \
+        $(O)/tests/bench.bin            \
 
 TESTS_SRCS = $(wildcard tests/*.S) $(wildcard tests/*.c)
 TESTS_OBJS = $(call object,$(TESTS_SRCS))
@@ -18,3 +19,7 @@ $(O)/tests/hello64.elf: $(O)/tests/hello64.o
 
 $(O)/tests/lv6.elf: $(KERNEL_LDS) $(KERNEL_OBJS) $(call object,$(wildcard tests/lv6/*.c tests/lv6/*.S))
 	$(QUIET_LD)$(LD) -o $@ $(LDFLAGS) -T $^ $(LIBS)
+
+# benchmarks share the boot code of lv6
+$(O)/tests/bench.elf: $(KERNEL_LDS) $(KERNEL_OBJS) $(O)/tests/lv6/head.o $(call object,$(wildcard tests/bench/*.c tests/bench/*.S))
+	$(QUIET_LD)$(LD) -o $@ $(LDFLAGS) -T $^ $(LIBS)
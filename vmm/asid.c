@@ -0,0 +1,135 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/init.h>
+#include <asm/kvm_host.h>
+#include <asm/tsc.h>
+#include <sys/string.h>
+
+#define CR3_SAMPLE_MS           10
+#define CR3_ADDR_MASK           UINT64_C(0x000ffffffffff000)
+#define MAX_CR3_TARGETS         4
+
+int kvm_cr3_track = KVM_CR3_TRACK_OFF;
+
+static uint64_t asid_heat(const struct kvm_asid *as)
+{
+        return as->loads + as->samples;
+}
+
+/*
+ * Return the ASID of cr3, adding it if it's new.  Once the table is full
+ * the coldest entry is recycled, so an ASID stays stable only as long as
+ * its address space remains in use.
+ */
+static int asid_lookup(struct kvm_vcpu *vcpu, uint64_t cr3)
+{
+        uint64_t key = cr3 & CR3_ADDR_MASK;
+        struct kvm_asid *as;
+        int i, victim;
+
+        for (i = 0; i < vcpu->nr_asids; ++i) {
+                if (vcpu->asids[i].cr3 == key)
+                        return i;
+        }
+
+        if (vcpu->nr_asids < KVM_NR_ASIDS) {
+                victim = vcpu->nr_asids++;
+        } else {
+                victim = 0;
+                for (i = 1; i < KVM_NR_ASIDS; ++i) {
+                        if (asid_heat(&vcpu->asids[i]) < asid_heat(&vcpu->asids[victim]))
+                                victim = i;
+                }
+        }
+
+        as = &vcpu->asids[victim];
+        memset(as, 0, sizeof(*as));
+        as->cr3 = key;
+        as->raw_cr3 = cr3;
+        return victim;
+}
+
+/* called on CR3-load exits */
+void kvm_cr3_load(struct kvm_vcpu *vcpu, uint64_t cr3)
+{
+        struct kvm_asid *as = &vcpu->asids[asid_lookup(vcpu, cr3)];
+
+        as->raw_cr3 = cr3;
+        as->loads++;
+}
+
+/* put the hottest address spaces into the CR3-target list */
+static void update_cr3_targets(struct kvm_vcpu *vcpu)
+{
+        uint64_t targets[MAX_CR3_TARGETS];
+        int top[MAX_CR3_TARGETS];
+        int i, j, k, n = 0, max;
+
+        max = min(kvm_x86_ops->max_cr3_targets(), MAX_CR3_TARGETS);
+
+        for (i = 0; i < vcpu->nr_asids; ++i) {
+                uint64_t heat = asid_heat(&vcpu->asids[i]);
+
+                /* insertion into the sorted top list */
+                for (j = 0; j < n && asid_heat(&vcpu->asids[top[j]]) >= heat; ++j)
+                        ;
+                if (j >= max)
+                        continue;
+                if (n < max)
+                        ++n;
+                for (k = n - 1; k > j; --k)
+                        top[k] = top[k - 1];
+                top[j] = i;
+        }
+
+        for (i = 0; i < n; ++i)
+                targets[i] = vcpu->asids[top[i]].raw_cr3;
+        kvm_x86_ops->set_cr3_targets(vcpu, targets, n);
+}
+
+/*
+ * In the sampled mode, switches between target address spaces don't exit;
+ * sample the current CR3 periodically so that they still gain heat.
+ */
+uint64_t kvm_asid_tick(struct kvm_vcpu *vcpu, uint64_t now)
+{
+        int id;
+
+        if (kvm_cr3_track != KVM_CR3_TRACK_SAMPLED)
+                return 0;
+
+        if (vcpu->next_cr3_sample && now >= vcpu->next_cr3_sample) {
+                id = asid_lookup(vcpu, kvm_x86_ops->get_cr3(vcpu));
+                vcpu->asids[id].samples++;
+                update_cr3_targets(vcpu);
+        }
+        if (now >= vcpu->next_cr3_sample)
+                vcpu->next_cr3_sample = now + (uint64_t)CR3_SAMPLE_MS * tsc_khz;
+        return vcpu->next_cr3_sample;
+}
+
+void kvm_asid_dump(struct kvm_vcpu *vcpu)
+{
+        int i;
+
+        for (i = 0; i < vcpu->nr_asids; ++i) {
+                struct kvm_asid *as = &vcpu->asids[i];
+
+                pr_info("  asid %-3d cr3 0x%016" PRIx64 " loads %-10" PRIu64 " samples %" PRIu64 "\n",
+                        i, as->cr3, as->loads, as->samples);
+        }
+}
+
+static int set_cr3_track(const char *val)
+{
+        if (!strcmp(val, "off"))
+                kvm_cr3_track = KVM_CR3_TRACK_OFF;
+        else if (!strcmp(val, "sampled"))
+                kvm_cr3_track = KVM_CR3_TRACK_SAMPLED;
+        else if (!strcmp(val, "exact"))
+                kvm_cr3_track = KVM_CR3_TRACK_EXACT;
+        else
+                return -1;
+        return 0;
+}
+__setup("cr3=", set_cr3_track);
@@ -0,0 +1,125 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/init.h>
+#include <asm/kvm_clone.h>
+#include <asm/kvm_host.h>
+#include <asm/kvm_snapshot.h>
+#include <asm/processor.h>
+#include <asm/tsc.h>
+#include <sys/errno.h>
+#include <sys/string.h>
+
+#define MAX_CLONES              64
+
+/*
+ * Clones start from the paused guest (the template): each gets its own
+ * VMCS and an EPT tree that shares the template's memory copy-on-write,
+ * so that a clone costs as much as what it writes.  There is a single
+ * cpu to run them on, so the clones run one at a time, each until it
+ * exits, and the template resumes once they are done.  The template
+ * doesn't run while it has clones and needs no write protection.
+ */
+
+static struct kvm_snapshot_cpu template_cpu;
+static uint8_t template_fpu[512] __aligned(16);
+
+struct clone {
+        struct kvm_vcpu *vcpu;
+        struct kvm_clone_ept ept;
+        long status;
+};
+
+static struct clone *current_clone;
+
+static void handle_clone_ept_violation(uint64_t guest_phys, uint32_t access)
+{
+        struct clone *clone = current_clone;
+
+        if (kvm_clone_ept_fault(&clone->ept, guest_phys, access))
+                return;
+        panic("clone %d: EPT violation at 0x%016" PRIx64 "\n",
+              clone->vcpu->clone_id, guest_phys);
+}
+
+static int run_clone(struct kvm_vcpu *template, int id)
+{
+        struct clone clone = { 0 };
+        struct kvm_vcpu *vcpu;
+        uint64_t start = rdtsc();
+
+        if (kvm_clone_ept_init(&clone.ept))
+                return -ENOMEM;
+        vcpu = kvm_x86_ops->vcpu_create();
+        if (!vcpu) {
+                kvm_clone_ept_destroy(&clone.ept);
+                return -ENOMEM;
+        }
+        clone.vcpu = vcpu;
+
+        kvm_x86_ops->vcpu_setup(vcpu);
+        template_cpu.regs[VCPU_REGS_RAX] = id;
+        kvm_snapshot_load_cpu(vcpu, &template_cpu);
+        kvm_x86_ops->set_tdp(vcpu, __pa(clone.ept.pml4));
+        kvm_set_ept_violation_handler(vcpu, handle_clone_ept_violation);
+        vcpu->vcpu_id = template->vcpu_id;
+        vcpu->clone_id = id;
+        kvm_stat_reset(vcpu);
+        kvm_tick(vcpu, rdtsc());
+
+        current_clone = &clone;
+        this_cpu_write(current_vcpu, vcpu);
+        kvm_run(vcpu);
+        current_clone = NULL;
+
+        pr_info("%d exited with %ld after %" PRIu64 " us: %" PRIu64 " pages copied, %" PRIu64 " shared\n",
+                id, clone.status, (rdtsc() - start) * 1000 / tsc_khz,
+                clone.ept.nr_private, clone.ept.nr_shared);
+
+        /* the VMCS of a clone is freed once it is no longer current */
+        kvm_x86_ops->vcpu_load(template);
+        this_cpu_write(current_vcpu, template);
+        kvm_x86_ops->vcpu_free(vcpu);
+        kvm_clone_ept_destroy(&clone.ept);
+        return 0;
+}
+
+/*
+ * Run nr_clones clones of the guest, which resume after the hypercall
+ * with their number in RAX.  Returns 0 once they have all exited, or
+ * -EBUSY if the guest runs on more than one vcpu, which would keep
+ * running alongside the clones.
+ */
+int kvm_clone(struct kvm_vcpu *vcpu, unsigned long nr_clones)
+{
+        unsigned long i;
+        int ret = 0;
+
+        if (!nr_clones || nr_clones > MAX_CLONES)
+                return -EINVAL;
+        if (smp_num_online() > 1)
+                return -EBUSY;
+
+        /* all of memory has to be there */
+        kvm_snapshot_finish(vcpu);
+        kvm_snapshot_save_cpu(vcpu, &template_cpu);
+        memcpy(template_fpu, template_cpu.fpu, sizeof(template_fpu));
+
+        for (i = 1; i <= nr_clones && !ret; ++i) {
+                ret = run_clone(vcpu, i);
+                if (ret)
+                        pr_info("out of memory for clone %lu\n", i);
+        }
+
+        /* the clones have left their FPU state behind */
+        fxrstor(template_fpu);
+        return ret;
+}
+
+int kvm_clone_exit(struct kvm_vcpu *vcpu, long status)
+{
+        if (!vcpu->clone_id)
+                return -EINVAL;
+        current_clone->status = status;
+        vcpu->stopped = true;
+        return 0;
+}
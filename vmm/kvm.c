@@ -1,51 +1,32 @@
 #include <asm/apic.h>
 #include <asm/cpufeature.h>
+#include <asm/init.h>
+#include <asm/kvm_clone.h>
 #include <asm/kvm_host.h>
+#include <asm/kvm_para.h>
+#include <asm/kvm_snapshot.h>
+#include <asm/kvm_trace.h>
 #include <asm/mmu.h>
 #include <asm/processor.h>
+#include <asm/ptrace.h>
+#include <asm/mtrr.h>
 #include <asm/setup.h>
+#include <asm/tsc.h>
 #include <sys/errno.h>
+#include <sys/page_alloc.h>
 #include <sys/string.h>
 #include <asm/e820.h>
 #include <asm/setup.h>
 
 
-#define EPTE_READ               BIT_64(0)
-#define EPTE_WRITE              BIT_64(1)
-#define EPTE_EXECUTE            BIT_64(2)
-#define EPTE_PSE                BIT_64(7)
-
 extern struct kvm_x86_ops vmx_x86_ops;
 
-static struct kvm_x86_ops *kvm_x86_ops;
-
-static uint64_t ept_pml4[512] __aligned(PAGE_SIZE);
-static uint64_t ept_pdpt_0_512g[512] __aligned(PAGE_SIZE);
-static uint64_t ept_pd_0_4g[4 * 512] __aligned(PAGE_SIZE);
+struct kvm_x86_ops *kvm_x86_ops;
 
 DEFINE_PER_CPU(struct kvm_vcpu *, current_vcpu);
 
-__attribute__((unused)) static void construct_tdp(void)
-{
-        size_t i, n;
-        uint64_t rwx = EPTE_READ | EPTE_WRITE | EPTE_EXECUTE;
-
-        BUG_ON(__pa(_start) % SZ_2M);
-        BUG_ON(__pa(_end) % SZ_2M);
-
-        ept_pml4[0] = __pa(ept_pdpt_0_512g) | rwx;
-        for (i = 0; i < 4; ++i)
-                ept_pdpt_0_512g[i] = __pa(ept_pd_0_4g + i * 512) | rwx;
-
-        /*
-         * Map the entire [0, 4G) except for [_start, _end)
-         * Is this safe?
-         */
-        for (i = 0, n = __pa(_start) / SZ_2M; i < n; ++i)
-                ept_pd_0_4g[i] = (SZ_2M * i) | rwx | EPTE_PSE;
-        for (i = __pa(_end) / SZ_2M, n = SZ_4G / SZ_2M; i < n; ++i)
-                ept_pd_0_4g[i] = (SZ_2M * i) | rwx | EPTE_PSE;
-}
+/* guest TSC frequency requested with tsc_khz= (0: same as host) */
+unsigned long kvm_guest_tsc_khz;
 
 void kvm_init(void)
 {
@@ -60,7 +41,9 @@ void kvm_init(void)
         if (kvm_x86_ops->disabled_by_bios())
                 panic("kvm: disabled by bios\n");
 
+        mtrr_init();
         kvm_x86_ops->hardware_setup();
+        kvm_mmu_setup_ept();
 
         /* copy firmware */
         memcpy(__va(FIRMWARE_START), _binary_firmware_start, _binary_firmware_end - _binary_firmware_start);
@@ -83,23 +66,16 @@ void kvm_init(void)
         memcpy(__va(FIRMWARE_START), &guest_params, sizeof(struct guest_params));
 }
 
-static void handle_ept_violation(uint64_t guest_phys)
+static void handle_ept_violation(uint64_t guest_phys, uint32_t access)
 {
-	static int pml4_0_512g_initialized = 0;
-        uint64_t rwx = EPTE_READ | EPTE_WRITE | EPTE_EXECUTE;
-	if ((uint64_t) _start <= guest_phys && guest_phys < (uint64_t) _end) {
-		panic("cannot write into VMM\n");
-	}
-	if (guest_phys >= SZ_4G) {
-		panic("cannot write to physmem higher than 4G\n");
-	}
-	if (!pml4_0_512g_initialized) {
-		ept_pml4[0] = __pa(ept_pdpt_0_512g) | rwx;
-		for (int i = 0; i < 4; ++i)
-			ept_pdpt_0_512g[i] = __pa(ept_pd_0_4g + i * 512) | rwx;
-		pml4_0_512g_initialized = 1;
-	}
-	ept_pd_0_4g[guest_phys / SZ_2M] = (guest_phys & ~(SZ_2M - 1)) | rwx | EPTE_PSE;
+        if (kvm_mmu_ept_fault(guest_phys, access))
+                return;
+
+        /* all guest memory is mapped by kvm_mmu_setup_ept() */
+        if ((__pa(_start) <= guest_phys && guest_phys < __pa(_end)) ||
+            page_pool_overlaps(guest_phys, guest_phys + 1))
+                panic("cannot write into VMM\n");
+        panic("EPT violation at unmapped 0x%016" PRIx64 "\n", guest_phys);
 }
 
 static struct kvm_vcpu *create_vcpu(void)
@@ -110,21 +86,260 @@ static struct kvm_vcpu *create_vcpu(void)
         kvm_x86_ops->vcpu_setup(vcpu);
 
         /* set EPT */
-        kvm_x86_ops->set_tdp(vcpu, __pa(ept_pml4));
-	kvm_set_ept_violation_handler(vcpu, handle_ept_violation);
+        kvm_x86_ops->set_tdp(vcpu, kvm_mmu_ept_root());
+        kvm_set_ept_violation_handler(vcpu, handle_ept_violation);
+
+        vcpu->vcpu_id = smp_processor_id();
+        kvm_stat_reset(vcpu);
+        kvm_tick(vcpu, rdtsc());
 
         this_cpu_write(current_vcpu, vcpu);
         return vcpu;
 }
 
-noreturn void kvm_loop(struct kvm_vcpu *vcpu)
+/*
+ * Run periodic work that is due and compute the next deadline.
+ * The backend arms a timer (if available) so that the guest exits
+ * by vcpu->next_tick.
+ */
+static uint64_t earliest(uint64_t a, uint64_t b)
+{
+        if (!a)
+                return b;
+        if (!b)
+                return a;
+        return min(a, b);
+}
+
+void kvm_tick(struct kvm_vcpu *vcpu, uint64_t now)
+{
+        uint64_t next;
+
+        next = kvm_stat_tick(vcpu, now);
+        next = earliest(next, kvm_trace_tick(vcpu, now));
+        next = earliest(next, kvm_asid_tick(vcpu, now));
+        /* the passes over guest memory run on one vcpu */
+        if (!vcpu->vcpu_id) {
+                next = earliest(next, kvm_snapshot_tick(vcpu, now));
+                next = earliest(next, kvm_ksm_tick(vcpu, now));
+                next = earliest(next, kvm_idle_tick(vcpu, now));
+                next = earliest(next, kvm_huge_tick(vcpu, now));
+        }
+        vcpu->next_tick = next;
+
+        /* piggyback on the tick to keep zeroed pages at hand */
+        page_alloc_refill();
+}
+
+/* the cpu whose vcpu has the others paused, or -1 */
+static int pause_owner = -1;
+
+static bool paused_by_other(void)
+{
+        int owner = __atomic_load_n(&pause_owner, __ATOMIC_SEQ_CST);
+
+        return owner >= 0 && owner != smp_processor_id();
+}
+
+/* wait outside the guest for the vcpu pausing the others to be done */
+static void park(struct kvm_vcpu *vcpu)
+{
+        if (!paused_by_other())
+                return;
+        __atomic_store_n(&vcpu->paused, true, __ATOMIC_RELEASE);
+        while (paused_by_other())
+                cpu_relax();
+        __atomic_store_n(&vcpu->paused, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Hold the vcpus on other CPUs outside the guest, for changes to EPT
+ * that free tables they may be walking.  They stop at the top of
+ * kvm_run(), holding no locks, and flush before they enter the guest
+ * again.  Those waiting for SIPI may stay in the guest, as they don't
+ * touch memory and exit on the SIPI.  The caller must not hold locks
+ * either, as the other vcpus may be spinning on them.
+ */
+void kvm_pause_vcpus(struct kvm_vcpu *self)
 {
-        for (;;) {
+        struct kvm_vcpu *vcpu;
+        int cpu, this_cpu = smp_processor_id(), none = -1;
+
+        while (!__atomic_compare_exchange_n(&pause_owner, &none, this_cpu, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                park(self);
+                none = -1;
+        }
+
+        for (cpu = 0; cpu < nr_logical_cpuids; ++cpu) {
+                vcpu = per_cpu(current_vcpu, cpu);
+                if (cpu == this_cpu || !vcpu)
+                        continue;
+                while (!__atomic_load_n(&vcpu->paused, __ATOMIC_ACQUIRE)) {
+                        if (__atomic_load_n(&vcpu->mode, __ATOMIC_SEQ_CST) == IN_GUEST_MODE) {
+                                if (vcpu->activity_state != KVM_ACTIVITY_ACTIVE)
+                                        break;
+                                kvm_kick_vcpu(vcpu, cpu);
+                        }
+                        cpu_relax();
+                }
+        }
+}
+
+void kvm_resume_vcpus(struct kvm_vcpu *self)
+{
+        __atomic_store_n(&pause_owner, -1, __ATOMIC_RELEASE);
+}
+
+/* run the vcpu until an exit handler stops it */
+void kvm_run(struct kvm_vcpu *vcpu)
+{
+        uint64_t now, flush_gen;
+
+        while (!vcpu->stopped) {
+                /*
+                 * Pairs with kvm_flush_remote_tdp() and kvm_pause_vcpus():
+                 * see either the mode, or the new gen and the pause.
+                 */
+                __atomic_store_n(&vcpu->mode, IN_GUEST_MODE, __ATOMIC_SEQ_CST);
+                if (paused_by_other()) {
+                        __atomic_store_n(&vcpu->mode, OUTSIDE_GUEST_MODE, __ATOMIC_RELEASE);
+                        park(vcpu);
+                        continue;
+                }
+                flush_gen = __atomic_load_n(&kvm_ept_flush_gen, __ATOMIC_SEQ_CST);
+                if (vcpu->ept_flush_gen != flush_gen) {
+                        kvm_x86_ops->flush_tdp(vcpu);
+                        __atomic_store_n(&vcpu->ept_flush_gen, flush_gen, __ATOMIC_RELEASE);
+                }
                 kvm_x86_ops->run(vcpu);
+                __atomic_store_n(&vcpu->mode, OUTSIDE_GUEST_MODE, __ATOMIC_RELEASE);
                 kvm_x86_ops->handle_exit(vcpu);
+                if (kvm_trace_enabled && kvm_trace_need_flush())
+                        kvm_trace_flush();
+                if (vcpu->next_tick && (now = rdtsc()) >= vcpu->next_tick)
+                        kvm_tick(vcpu, now);
+        }
+}
+
+noreturn void kvm_loop(struct kvm_vcpu *vcpu)
+{
+        kvm_run(vcpu);
+        panic("vcpu %d stopped\n", vcpu->vcpu_id);
+}
+
+/*
+ * Kick the vcpu on cpu out of the guest with an NMI, unless a kick is
+ * still on its way.  The vcpu matches every NMI it takes, in the guest or
+ * in the VMM, against the kicks sent: while some are outstanding the NMI
+ * counts as one, otherwise it is for the guest.  With a single kick in
+ * flight, kicks never merge into one NMI and the counts stay in step.
+ */
+void kvm_kick_vcpu(struct kvm_vcpu *vcpu, int cpu)
+{
+        uint32_t sent = __atomic_load_n(&vcpu->kicks_sent, __ATOMIC_ACQUIRE);
+
+        if (sent != __atomic_load_n(&vcpu->kicks_taken, __ATOMIC_ACQUIRE))
+                return;
+        if (!__atomic_compare_exchange_n(&vcpu->kicks_sent, &sent, sent + 1, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                return;
+        apic_send_IPI(APIC_DM_NMI, cpuid_to_apicid[cpu]);
+}
+
+/*
+ * On the vcpu's CPU, for an NMI it took: returns true if that was a kick.
+ * A guest NMI may be taken in place of a kick still on its way; the kick
+ * then counts as the guest's NMI, so the guest gets as many as were sent.
+ */
+bool kvm_take_kick(struct kvm_vcpu *vcpu)
+{
+        uint32_t taken = __atomic_load_n(&vcpu->kicks_taken, __ATOMIC_ACQUIRE);
+
+        /* an NMI in the VMM may interrupt this and take the kick first */
+        do {
+                if (taken == __atomic_load_n(&vcpu->kicks_sent, __ATOMIC_ACQUIRE))
+                        return false;
+        } while (!__atomic_compare_exchange_n(&vcpu->kicks_taken, &taken, taken + 1, false,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+        return true;
+}
+
+/*
+ * An NMI in the VMM: a kick that arrived before the vcpu entered the guest
+ * (the sender kicks again if it still needs to), or one for the guest,
+ * which gets it at the next entry.
+ */
+void do_nmi(struct pt_regs *regs, long error_code)
+{
+        struct kvm_vcpu *vcpu = this_cpu_read(current_vcpu);
+
+        if (vcpu && !kvm_take_kick(vcpu))
+                WRITE_ONCE(vcpu->nmi_pending, true);
+}
+
+/*
+ * Make the vcpus on other CPUs drop EPT translations older than gen.
+ * kvm_run() flushes before every entry, so only the vcpus in the guest
+ * need a kick: an NMI, which makes them exit.  A kick taken in the VMM
+ * just before a vcpu entered the guest is lost, so vcpus are kicked
+ * again for as long as they are waited for.  Vcpus in the VMM are not
+ * waited for, as they may be spinning on a lock the caller holds; nor
+ * are those waiting for SIPI, which no NMI can wake.
+ */
+static bool need_kick(struct kvm_vcpu *vcpu, uint64_t gen)
+{
+        return __atomic_load_n(&vcpu->mode, __ATOMIC_SEQ_CST) == IN_GUEST_MODE &&
+               vcpu->activity_state == KVM_ACTIVITY_ACTIVE &&
+               __atomic_load_n(&vcpu->ept_flush_gen, __ATOMIC_ACQUIRE) < gen;
+}
+
+void kvm_flush_remote_tdp(uint64_t gen)
+{
+        struct kvm_vcpu *vcpu;
+        int cpu, self = smp_processor_id();
+
+        for (cpu = 0; cpu < nr_logical_cpuids; ++cpu) {
+                vcpu = per_cpu(current_vcpu, cpu);
+                if (cpu == self || !vcpu || !need_kick(vcpu, gen))
+                        continue;
+                kvm_kick_vcpu(vcpu, cpu);
+        }
+        for (cpu = 0; cpu < nr_logical_cpuids; ++cpu) {
+                vcpu = per_cpu(current_vcpu, cpu);
+                if (cpu == self || !vcpu)
+                        continue;
+                while (need_kick(vcpu, gen)) {
+                        kvm_kick_vcpu(vcpu, cpu);
+                        cpu_relax();
+                }
         }
 }
 
+/*
+ * Whether the vcpus on other CPUs have all entered the guest since gen,
+ * flushing EPT and leaving the VMM code that may have walked it before.
+ * Those waiting for SIPI in the guest walk nothing until they exit.
+ */
+bool kvm_vcpus_flushed(uint64_t gen)
+{
+        struct kvm_vcpu *vcpu;
+        int cpu, self = smp_processor_id();
+
+        for (cpu = 0; cpu < nr_logical_cpuids; ++cpu) {
+                vcpu = per_cpu(current_vcpu, cpu);
+                if (cpu == self || !vcpu)
+                        continue;
+                if (__atomic_load_n(&vcpu->ept_flush_gen, __ATOMIC_ACQUIRE) >= gen)
+                        continue;
+                if (__atomic_load_n(&vcpu->mode, __ATOMIC_SEQ_CST) == IN_GUEST_MODE &&
+                    vcpu->activity_state != KVM_ACTIVITY_ACTIVE)
+                        continue;
+                return false;
+        }
+        return true;
+}
+
 noreturn static void run_vcpu(struct kvm_vcpu *vcpu, uint32_t start_ip)
 {
         struct kvm_segment cs = {
@@ -147,17 +362,51 @@ noreturn void kvm_bsp_run(void)
         struct kvm_vcpu *vcpu;
 
         vcpu = create_vcpu();
+        if (kvm_snapshot_pending()) {
+                kvm_snapshot_restore(vcpu);
+                kvm_tick(vcpu, rdtsc());
+                kvm_loop(vcpu);
+        }
         run_vcpu(vcpu, FIRMWARE_START);
 }
 
+/* APs wait in the guest for the guest to start them */
+noreturn void kvm_ap_run(void)
+{
+        struct kvm_vcpu *vcpu;
+
+        vcpu = create_vcpu();
+        kvm_x86_ops->vcpu_reset(vcpu);
+        smp_callin();
+        kvm_loop(vcpu);
+}
+
+/* a SIPI starts the vcpu in real mode at vector:0000 */
+void kvm_emulate_sipi(struct kvm_vcpu *vcpu, uint8_t vector)
+{
+        struct kvm_segment cs = {
+                .limit = 0xffff,
+                .type = 11,
+                .s = 1,
+                .present = 1,
+        };
+
+        cs.selector = vector << 8;
+        cs.base = vector << 12;
+        kvm_set_segment(vcpu, &cs, VCPU_SREG_CS);
+        kvm_rip_write(vcpu, 0);
+        vcpu->sipi_vector = vector;
+        vcpu->activity_state = KVM_ACTIVITY_ACTIVE;
+}
+
 unsigned long kvm_rip_read(struct kvm_vcpu *vcpu)
 {
-        return kvm_x86_ops->get_rip(vcpu);
+        return kvm_register_read(vcpu, VCPU_REGS_RIP);
 }
 
 void kvm_rip_write(struct kvm_vcpu *vcpu, unsigned long val)
 {
-        kvm_x86_ops->set_rip(vcpu, val);
+        kvm_register_write(vcpu, VCPU_REGS_RIP, val);
 }
 
 void kvm_get_segment(struct kvm_vcpu *vcpu, struct kvm_segment *var, int seg)
@@ -218,6 +467,15 @@ void kvm_emulate_cpuid(struct kvm_vcpu *vcpu)
                  */
                 eax = ebx = ecx = edx = 0;
                 break;
+        case 0x15:
+        case 0x16:
+                /*
+                 * These leaves report the host TSC frequency, which is wrong
+                 * under TSC scaling; make the guest calibrate against the PIT.
+                 */
+                if (kvm_guest_tsc_khz)
+                        eax = ebx = ecx = edx = 0;
+                break;
         case 0x40000000:
                 /* fake string "KVMKVMKVM" for x2apic in Linux guest */
                 eax = 0x40000001;
@@ -225,13 +483,15 @@ void kvm_emulate_cpuid(struct kvm_vcpu *vcpu)
                 ecx = 0x564b4d56;
                 edx = 0x4d;
                 break;
-        case 0x40000001:
+        case KVM_CPUID_FEATURES:
                 /*
                  * Linux guest support uses this leaf to commucate with KVM
                  * for hypervisor-specific features.  Since the VMM doesn't
-                 * have these features, don't advertise.
+                 * have these features, don't advertise.  EBX is reserved
+                 * in KVM, and tells our own guests about the balloon.
                  */
-                eax = ebx = ecx = edx = 0;
+                eax = ecx = edx = 0;
+                ebx = BIT_32(KVM_FEATURE_BALLOON);
                 break;
         default:
                 break;
@@ -244,8 +504,129 @@ void kvm_emulate_cpuid(struct kvm_vcpu *vcpu)
         return kvm_skip_emulated_instruction(vcpu);
 }
 
+/* fetch the dirty log into a guest bitmap at gva covering nr_pfns pages */
+static unsigned long hc_dirty_log_fetch(struct kvm_vcpu *vcpu, uint64_t gva, pfn_t nr_pfns)
+{
+        struct x86_exception fault;
+        size_t size = BITS_TO_LONGS(nr_pfns) * sizeof(long);
+        unsigned int order = get_order(size);
+        unsigned long *bitmap = NULL;
+        long ret;
+
+        if (nr_pfns) {
+                bitmap = alloc_pages(order, PAGE_TYPE_OTHER);
+                if (!bitmap)
+                        return -KVM_E2BIG;
+        }
+        ret = kvm_dirty_log_fetch(vcpu, bitmap, nr_pfns);
+        if (ret >= 0 && bitmap && kvm_write_guest_virt(vcpu, gva, bitmap, size, 0, &fault))
+                ret = -KVM_EFAULT;
+        else if (ret < 0)
+                ret = -KVM_EINVAL;
+        if (bitmap)
+                free_pages(bitmap, order);
+        return ret;
+}
+
+/* the hypercall result of a VMM function returning 0 or -errno */
+static unsigned long hc_result(int err)
+{
+        if (!err)
+                return 0;
+        return err == -EBUSY ? -KVM_EBUSY : -KVM_EINVAL;
+}
+
+void kvm_emulate_hypercall(struct kvm_vcpu *vcpu)
+{
+        unsigned long nr, ret;
+
+        nr = kvm_register_read(vcpu, VCPU_REGS_RAX);
+
+        if (kvm_x86_ops->get_cpl(vcpu) != 0) {
+                ret = -KVM_EPERM;
+                goto out;
+        }
+
+        /* clones can't change how guest memory is mapped */
+        if (vcpu->clone_id && nr != KVM_HC_CLONE_EXIT && nr != KVM_HC_STAT_DUMP &&
+            nr != KVM_HC_STAT_RESET && nr != KVM_HC_TRACE_FLUSH) {
+                ret = -KVM_EPERM;
+                goto out;
+        }
+
+        switch (nr) {
+        case KVM_HC_STAT_DUMP:
+                kvm_stat_dump(vcpu);
+                ret = 0;
+                break;
+        case KVM_HC_STAT_RESET:
+                kvm_stat_reset(vcpu);
+                ret = 0;
+                break;
+        case KVM_HC_TRACE_FLUSH:
+                kvm_trace_flush();
+                ret = 0;
+                break;
+        case KVM_HC_DIRTY_LOG_ENABLE:
+                ret = hc_result(kvm_dirty_log_enable(vcpu));
+                break;
+        case KVM_HC_DIRTY_LOG_FETCH:
+                ret = hc_dirty_log_fetch(vcpu, kvm_register_read(vcpu, VCPU_REGS_RBX),
+                                         kvm_register_read(vcpu, VCPU_REGS_RCX));
+                break;
+        case KVM_HC_DIRTY_LOG_DISABLE:
+                kvm_dirty_log_disable(vcpu);
+                ret = 0;
+                break;
+        case KVM_HC_SNAPSHOT:
+                /* the snapshot resumes after the hypercall, returning 1 */
+                kvm_skip_emulated_instruction(vcpu);
+                kvm_register_write(vcpu, VCPU_REGS_RAX, 1);
+                ret = hc_result(kvm_snapshot_save(vcpu));
+                kvm_register_write(vcpu, VCPU_REGS_RAX, ret);
+                return;
+        case KVM_HC_CLONE:
+                /* the clones start after the hypercall as well */
+                kvm_skip_emulated_instruction(vcpu);
+                ret = hc_result(kvm_clone(vcpu, kvm_register_read(vcpu, VCPU_REGS_RBX)));
+                kvm_register_write(vcpu, VCPU_REGS_RAX, ret);
+                return;
+        case KVM_HC_CLONE_EXIT:
+                ret = kvm_clone_exit(vcpu, kvm_register_read(vcpu, VCPU_REGS_RBX)) ? -KVM_EINVAL : 0;
+                break;
+        case KVM_HC_BALLOON_INFLATE:
+                ret = kvm_balloon_inflate(vcpu, kvm_register_read(vcpu, VCPU_REGS_RBX),
+                                          kvm_register_read(vcpu, VCPU_REGS_RCX));
+                if ((long)ret < 0)
+                        ret = ret == -ENOMEM ? -KVM_E2BIG : -KVM_EINVAL;
+                break;
+        case KVM_HC_BALLOON_DEFLATE:
+                ret = kvm_balloon_deflate(vcpu, kvm_register_read(vcpu, VCPU_REGS_RBX),
+                                          kvm_register_read(vcpu, VCPU_REGS_RCX));
+                if ((long)ret < 0)
+                        ret = -KVM_EINVAL;
+                break;
+        default:
+                ret = -KVM_ENOSYS;
+                break;
+        }
+
+out:
+        kvm_register_write(vcpu, VCPU_REGS_RAX, ret);
+        return kvm_skip_emulated_instruction(vcpu);
+}
+
 void kvm_skip_emulated_instruction(struct kvm_vcpu *vcpu)
 {
         kvm_x86_ops->skip_emulated_instruction(vcpu);
         /* TODO: check TF in RFLAGS for single-step */
 }
+
+static int set_guest_tsc_khz(const char *val)
+{
+        char *end;
+
+        kvm_guest_tsc_khz = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("tsc_khz=", set_guest_tsc_khz);
@@ -17,15 +17,22 @@ noreturn void main(unsigned int magic, struct multiboot_info *multiboot_info)
         /* require cpu */
         trap_init();
 
-        multiboot_init(magic, multiboot_info);
-
         acpi_table_init();
 
+        /* require acpi */
+        numa_init();
+
+        /* require numa */
+        multiboot_init(magic, multiboot_info);
+
         /* require acpi */
         apic_init();
 
         /* require multiboot */
         kvm_init();
 
+        /* require kvm */
+        smp_init();
+
         kvm_bsp_run();
 }
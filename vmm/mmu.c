@@ -0,0 +1,2808 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/cmpxchg.h>
+#include <asm/e820.h>
+#include <asm/init.h>
+#include <asm/kvm_host.h>
+#include <asm/kvm_snapshot.h>
+#include <asm/mmu.h>
+#include <asm/msr.h>
+#include <asm/msr-index.h>
+#include <asm/mtrr.h>
+#include <asm/processor-flags.h>
+#include <asm/setup.h>
+#include <asm/tsc.h>
+#include <asm/vmx.h>
+#include <io/sizes.h>
+#include <asm/bitops.h>
+#include <sys/bitops.h>
+#include <sys/errno.h>
+#include <sys/list.h>
+#include <sys/lz.h>
+#include <sys/page_alloc.h>
+#include <sys/sort.h>
+#include <sys/spinlock.h>
+#include <sys/string.h>
+
+#define EPT_TABLE_PERM          VMX_EPT_RWX_MASK
+#define EPT_LEAF_PERM           VMX_EPT_RWX_MASK
+/* software bit: write-protected for dirty logging */
+#define EPT_DIRTY_LOG           BIT_64(52)
+/* software bit: no permissions until the page is filled on demand */
+#define EPT_DEMAND              BIT_64(53)
+/* software bits: a clone leaf sharing a guest page, or mapping a copy */
+#define EPT_COW                 BIT_64(54)
+#define EPT_PRIVATE             BIT_64(55)
+/* software bit: read-only to the zero page until the first write */
+#define EPT_ZERO                BIT_64(56)
+/* software bit: read-only to a frame shared by identical pages */
+#define EPT_KSM                 BIT_64(57)
+/* software bit: not present, given up by the guest */
+#define EPT_BALLOON             BIT_64(58)
+/* software bit: not present, compressed; the rest is the handle and type */
+#define EPT_ZSWAP               BIT_64(59)
+/* software bit: not present while a vcpu fills in the leaf */
+#define EPT_BUSY                BIT_64(60)
+
+static uint64_t *ept_pml4;
+static size_t ept_table_pages;
+
+/*
+ * Software walks of the guest page tables and of EPT, for exit handlers
+ * that need to access guest memory.  Both walks behave like the hardware
+ * ones: permissions are checked, accessed/dirty bits are set, and faults
+ * are returned to the caller instead of being fatal.
+ */
+
+uint64_t kvm_ept_gen = 1;
+uint64_t kvm_ept_flush_gen;
+
+/* the guest paging mode, derived from CR0, CR4 and EFER */
+enum {
+        PAGING_NONE,
+        PAGING_32,
+        PAGING_PAE,
+        PAGING_4LEVEL,
+        PAGING_5LEVEL,
+        PAGING_MODE_MASK        = 7,
+        /* tags that change the meaning of a walk */
+        PAGING_NXE              = 8,
+        PAGING_PSE              = 16,
+};
+
+struct paging_state {
+        uint64_t cr0, cr3, cr4, efer;
+        uint64_t pdptrs[4];
+        uint32_t mode;
+};
+
+struct walk_result {
+        uint64_t gpa;
+        uint64_t hpa;
+        void *ptep[KVM_TLB_MAX_LEVELS];
+        uint64_t pte[KVM_TLB_MAX_LEVELS];
+        int nr_ptes;
+        uint64_t pdpte;
+        uint64_t perm;
+        uint64_t ept_perm;
+};
+
+static void get_paging_state(struct kvm_vcpu *vcpu, struct paging_state *ps)
+{
+        ps->cr0 = kvm_x86_ops->get_cr0(vcpu);
+        if (!(ps->cr0 & X86_CR0_PG)) {
+                ps->mode = PAGING_NONE;
+                ps->cr3 = 0;
+                return;
+        }
+
+        ps->cr3 = kvm_x86_ops->get_cr3(vcpu);
+        ps->cr4 = kvm_x86_ops->get_cr4(vcpu);
+        ps->efer = kvm_x86_ops->get_efer(vcpu);
+
+        if (!(ps->cr4 & X86_CR4_PAE))
+                ps->mode = PAGING_32 | ((ps->cr4 & X86_CR4_PSE) ? PAGING_PSE : 0);
+        else if (!(ps->efer & EFER_LMA)) {
+                ps->mode = PAGING_PAE;
+                kvm_x86_ops->get_pdptrs(vcpu, ps->pdptrs);
+        }
+        else if (ps->cr4 & X86_CR4_LA57)
+                ps->mode = PAGING_5LEVEL;
+        else
+                ps->mode = PAGING_4LEVEL;
+
+        if ((ps->mode & PAGING_MODE_MASK) != PAGING_32 && (ps->efer & EFER_NX))
+                ps->mode |= PAGING_NXE;
+}
+
+static void set_fault(struct x86_exception *fault, bool nested, uint32_t error_code, uint64_t address)
+{
+        fault->nested = nested;
+        fault->error_code = error_code;
+        fault->address = address;
+}
+
+static uint64_t ept_need(uint32_t access)
+{
+        if (access & PFERR_FETCH_MASK)
+                return VMX_EPT_EXECUTABLE_MASK;
+        if (access & PFERR_WRITE_MASK)
+                return VMX_EPT_READABLE_MASK | VMX_EPT_WRITABLE_MASK;
+        return VMX_EPT_READABLE_MASK;
+}
+
+static void ept_unprotect(uint64_t *ep, uint64_t gpa);
+static void ept_demand_fill(uint64_t *ep, uint64_t gpa);
+static bool ept_walk_fault(uint64_t eptp, uint64_t gpa, uint32_t access);
+
+static int __walk_ept(uint64_t eptp, uint64_t gpa, uint32_t access,
+                      uint64_t *hpa, uint64_t *rwx, struct x86_exception *fault)
+{
+        uint64_t need = ept_need(access), eff = VMX_EPT_RWX_MASK, *table, e, mask;
+        int level, levels, shift;
+
+        levels = ((eptp >> VMX_EPT_GAW_EPTP_SHIFT) & 7) + 1;
+        table = __va(eptp & PTE_PFN_MASK);
+        for (level = levels; level >= 1; --level) {
+                shift = PAGE_SHIFT + 9 * (level - 1);
+                e = READ_ONCE(table[(gpa >> shift) & 511]);
+                /* the VMM is about to access the page as well */
+                if (e & EPT_DEMAND) {
+                        ept_demand_fill(&table[(gpa >> shift) & 511], gpa);
+                        e = READ_ONCE(table[(gpa >> shift) & 511]);
+                }
+                eff &= e;
+                if (!(e & VMX_EPT_RWX_MASK))
+                        break;
+                if (level == 1 || (level <= 3 && (e & VMX_EPT_LARGE_PAGE_BIT))) {
+                        if ((need & ~eff) == VMX_EPT_WRITABLE_MASK && (e & EPT_DIRTY_LOG)) {
+                                ept_unprotect(&table[(gpa >> shift) & 511], gpa);
+                                eff |= VMX_EPT_WRITABLE_MASK;
+                        }
+                        if ((eff & need) != need)
+                                break;
+                        mask = (UINT64_C(1) << shift) - 1;
+                        *hpa = (e & PTE_PFN_MASK & ~mask) | (gpa & mask);
+                        if (rwx)
+                                *rwx = eff & VMX_EPT_RWX_MASK;
+                        return 0;
+                }
+                table = __va(e & PTE_PFN_MASK);
+        }
+
+        set_fault(fault, true, access, gpa);
+        return -1;
+}
+
+/* on success, *rwx (if not NULL) is the effective EPT permission */
+static int walk_ept(uint64_t eptp, uint64_t gpa, uint32_t access,
+                    uint64_t *hpa, uint64_t *rwx, struct x86_exception *fault)
+{
+        if (!__walk_ept(eptp, gpa, access, hpa, rwx, fault))
+                return 0;
+        /* parts of EPT are filled in lazily */
+        if (!ept_walk_fault(eptp, gpa, access))
+                return -1;
+        return __walk_ept(eptp, gpa, access, hpa, rwx, fault);
+}
+
+static bool check_perm(struct kvm_vcpu *vcpu, const struct paging_state *ps,
+                       uint64_t perm, uint32_t access)
+{
+        bool user = access & PFERR_USER_MASK;
+
+        if (user && !(perm & PTE_USER))
+                return false;
+        if ((access & PFERR_WRITE_MASK) && !(perm & PTE_RW) &&
+            (user || (ps->cr0 & X86_CR0_WP)))
+                return false;
+        if ((access & PFERR_FETCH_MASK) && (perm & PTE_NX))
+                return false;
+        if (!user && (perm & PTE_USER)) {
+                if (access & PFERR_FETCH_MASK)
+                        return !(ps->cr4 & X86_CR4_SMEP);
+                if ((ps->cr4 & X86_CR4_SMAP) &&
+                    !(kvm_x86_ops->get_rflags(vcpu) & X86_RFLAGS_AC))
+                        return false;
+        }
+        return true;
+}
+
+static uint64_t read_pte(void *ptep, int size)
+{
+        return size == 4 ? READ_ONCE(*(uint32_t *)ptep) : READ_ONCE(*(uint64_t *)ptep);
+}
+
+/*
+ * A/D updates are atomic: the guest may be changing the entry concurrently.
+ * PML only logs the writes of the CPU, so those of the VMM to the guest's
+ * own page tables are logged here.
+ */
+static uint64_t set_pte_bits(struct kvm_vcpu *vcpu, void *ptep, uint64_t pte_gpa, int size,
+                             uint64_t bits)
+{
+        uint64_t old;
+
+        if (size == 4)
+                old = __atomic_fetch_or((uint32_t *)ptep, (uint32_t)bits, __ATOMIC_RELAXED);
+        else
+                old = __atomic_fetch_or((uint64_t *)ptep, bits, __ATOMIC_RELAXED);
+        if ((old & bits) != bits && !vcpu->clone_id)
+                kvm_dirty_log_mark(pte_gpa);
+        return old | bits;
+}
+
+/*
+ * A/D updates write to the guest page table, which EPT may map read-only
+ * (logged for dirty logging, or shared by a clone); returns where the
+ * entry is once the page is writable.
+ */
+static void *pte_writable(uint64_t eptp, uint64_t pte_gpa, uint64_t rwx, void *ptep,
+                          struct x86_exception *fault)
+{
+        uint64_t hpa;
+
+        if (rwx & VMX_EPT_WRITABLE_MASK)
+                return ptep;
+        if (walk_ept(eptp, pte_gpa, PFERR_WRITE_MASK, &hpa, NULL, fault))
+                return NULL;
+        return __va(hpa);
+}
+
+static int walk_guest(struct kvm_vcpu *vcpu, const struct paging_state *ps, uint64_t eptp,
+                      uint64_t gva, uint32_t access, struct walk_result *res,
+                      struct x86_exception *fault)
+{
+        uint32_t mode = ps->mode & PAGING_MODE_MASK;
+        uint64_t table, pte = 0, pte_gpa = 0, pte_hpa, pte_rwx = 0, perm, mask, gpa;
+        int level, levels, size, bits, shift, n = 0;
+        void *ptep = NULL;
+        bool large;
+
+        switch (mode) {
+        case PAGING_32:
+                levels = 2, size = 4, bits = 10;
+                table = ps->cr3 & 0xfffff000;
+                break;
+        case PAGING_PAE:
+                levels = 3, size = 8, bits = 9;
+                table = 0;
+                break;
+        default:
+                levels = mode == PAGING_5LEVEL ? 5 : 4, size = 8, bits = 9;
+                table = ps->cr3 & PTE_PFN_MASK;
+                break;
+        }
+
+        res->pdpte = 0;
+        perm = PTE_RW | PTE_USER;
+        for (level = levels; level >= 1; --level) {
+                shift = PAGE_SHIFT + bits * (level - 1);
+                mask = (UINT64_C(1) << shift) - 1;
+
+                /*
+                 * PAE PDPTEs are loaded into registers along with CR3 and
+                 * carry no permissions or A/D bits (Intel SDM 4.4.1).
+                 */
+                if (mode == PAGING_PAE && level == 3) {
+                        pte = ps->pdptrs[(gva >> shift) & 3];
+                        if (!(pte & PTE_PRESENT)) {
+                                set_fault(fault, false, access, gva);
+                                return -1;
+                        }
+                        res->pdpte = pte;
+                        table = pte & PTE_PFN_MASK;
+                        continue;
+                }
+
+                pte_gpa = table + ((gva >> shift) & ((1 << bits) - 1)) * size;
+                if (walk_ept(eptp, pte_gpa, 0, &pte_hpa, &pte_rwx, fault))
+                        return -1;
+                ptep = __va(pte_hpa);
+                pte = read_pte(ptep, size);
+
+                if (!(pte & PTE_PRESENT)) {
+                        set_fault(fault, false, access, gva);
+                        return -1;
+                }
+
+                if ((pte & PTE_NX) && mode != PAGING_32 && !(ps->mode & PAGING_NXE))
+                        goto rsvd;
+                large = (pte & PTE_PSE) && level > 1;
+                if (large && (level > 3 || (mode == PAGING_32 && !(ps->mode & PAGING_PSE))))
+                        goto rsvd;
+
+                /* RW and USER must be set at all levels, NX at any */
+                perm &= pte | PTE_NX;
+                if (mode != PAGING_32 && (pte & PTE_NX))
+                        perm |= PTE_NX;
+                if (!(pte & PTE_ACCESSED)) {
+                        ptep = pte_writable(eptp, pte_gpa, pte_rwx, ptep, fault);
+                        if (!ptep)
+                                return -1;
+                        pte_rwx |= VMX_EPT_WRITABLE_MASK;
+                        pte = set_pte_bits(vcpu, ptep, pte_gpa, size, PTE_ACCESSED);
+                }
+                res->ptep[n] = ptep;
+                res->pte[n++] = pte;
+
+                if (level == 1 || large)
+                        break;
+                table = pte & (mode == PAGING_32 ? 0xfffff000 : PTE_PFN_MASK);
+        }
+
+        if (!check_perm(vcpu, ps, perm, access)) {
+                set_fault(fault, false, access | PFERR_PRESENT_MASK, gva);
+                return -1;
+        }
+        if ((access & PFERR_WRITE_MASK) && !(pte & PTE_DIRTY)) {
+                ptep = pte_writable(eptp, pte_gpa, pte_rwx, ptep, fault);
+                if (!ptep)
+                        return -1;
+                pte = set_pte_bits(vcpu, ptep, pte_gpa, size, PTE_DIRTY);
+                res->ptep[n - 1] = ptep;
+                res->pte[n - 1] = pte;
+        }
+
+        if (mode == PAGING_32 && level == 2)
+                /* PSE-36: bits 20:13 of a 4M entry are bits 39:32 of the address */
+                gpa = (pte & 0xffc00000) | ((pte & 0x001fe000) << 19);
+        else
+                gpa = pte & PTE_PFN_MASK & ~mask;
+        gpa |= gva & mask;
+
+        if (walk_ept(eptp, gpa, access, &res->hpa, &res->ept_perm, fault))
+                return -1;
+        res->gpa = gpa;
+        res->nr_ptes = n;
+        res->perm = perm;
+        return 0;
+
+rsvd:
+        set_fault(fault, false, access | PFERR_PRESENT_MASK | PFERR_RSVD_MASK, gva);
+        return -1;
+}
+
+void kvm_mmu_flush_tlb(struct kvm_vcpu *vcpu)
+{
+        memset(vcpu->tlb, 0, sizeof(vcpu->tlb));
+}
+
+static bool tlb_hit(struct kvm_vcpu *vcpu, const struct paging_state *ps,
+                    const struct kvm_tlb_entry *e, uint64_t gva, uint32_t access)
+{
+        int i, size = (ps->mode & PAGING_MODE_MASK) == PAGING_32 ? 4 : 8;
+        uint64_t pte = 0;
+
+        if (e->gen != READ_ONCE(kvm_ept_gen) || e->gva != (gva & PAGE_MASK) ||
+            e->cr3 != ps->cr3 || e->mode != ps->mode)
+                return false;
+        if ((e->ept_perm & ept_need(access)) != ept_need(access))
+                return false;
+        if (!e->nr_ptes)
+                return true;
+
+        if ((ps->mode & PAGING_MODE_MASK) == PAGING_PAE &&
+            e->pdpte != ps->pdptrs[(gva >> 30) & 3])
+                return false;
+        /* any entry of the walk may have changed without an INVLPG */
+        for (i = 0; i < e->nr_ptes; ++i) {
+                pte = read_pte(e->ptep[i], size);
+                if (pte != e->pte[i])
+                        return false;
+        }
+        /* the slow path sets the dirty bit */
+        if ((access & PFERR_WRITE_MASK) && !(pte & PTE_DIRTY))
+                return false;
+        return check_perm(vcpu, ps, e->perm, access);
+}
+
+int kvm_gpa_to_hpa(struct kvm_vcpu *vcpu, uint64_t gpa, uint32_t access,
+                   uint64_t *hpa, struct x86_exception *fault)
+{
+        return walk_ept(kvm_x86_ops->get_tdp(vcpu), gpa, access, hpa, NULL, fault);
+}
+
+/* translate gva to both the guest- and the host-physical address */
+static int gva_to_gpa_hpa(struct kvm_vcpu *vcpu, uint64_t gva, uint32_t access,
+                          uint64_t *gpa, uint64_t *hpa, struct x86_exception *fault)
+{
+        struct kvm_tlb_entry *e = &vcpu->tlb[(gva >> PAGE_SHIFT) % KVM_NR_TLB_ENTRIES];
+        struct paging_state ps;
+        struct walk_result res;
+        uint64_t gen, eptp;
+
+        get_paging_state(vcpu, &ps);
+        if (tlb_hit(vcpu, &ps, e, gva, access)) {
+                *gpa = e->gpa | (gva & ~PAGE_MASK);
+                *hpa = e->hpa | (gva & ~PAGE_MASK);
+                return 0;
+        }
+
+        gen = READ_ONCE(kvm_ept_gen);
+        eptp = kvm_x86_ops->get_tdp(vcpu);
+        if (ps.mode == PAGING_NONE) {
+                if (walk_ept(eptp, gva, access, &res.hpa, &res.ept_perm, fault))
+                        return -1;
+                res.gpa = gva;
+                res.nr_ptes = 0;
+                res.pdpte = 0;
+                res.perm = PTE_RW | PTE_USER;
+        } else if (walk_guest(vcpu, &ps, eptp, gva, access, &res, fault)) {
+                return -1;
+        }
+
+        e->gen = gen;
+        e->cr3 = ps.cr3;
+        e->gva = gva & PAGE_MASK;
+        e->gpa = res.gpa & PAGE_MASK;
+        e->hpa = res.hpa & PAGE_MASK;
+        memcpy(e->ptep, res.ptep, res.nr_ptes * sizeof(e->ptep[0]));
+        memcpy(e->pte, res.pte, res.nr_ptes * sizeof(e->pte[0]));
+        e->nr_ptes = res.nr_ptes;
+        e->pdpte = res.pdpte;
+        e->mode = ps.mode;
+        e->perm = res.perm;
+        e->ept_perm = res.ept_perm;
+
+        *gpa = res.gpa;
+        *hpa = res.hpa;
+        return 0;
+}
+
+int kvm_gva_to_hpa(struct kvm_vcpu *vcpu, uint64_t gva, uint32_t access,
+                   uint64_t *hpa, struct x86_exception *fault)
+{
+        uint64_t gpa;
+
+        return gva_to_gpa_hpa(vcpu, gva, access, &gpa, hpa, fault);
+}
+
+void *kvm_gva_to_hva(struct kvm_vcpu *vcpu, uint64_t gva, uint32_t access,
+                     struct x86_exception *fault)
+{
+        uint64_t hpa;
+
+        if (kvm_gva_to_hpa(vcpu, gva, access, &hpa, fault))
+                return NULL;
+        return __va(hpa);
+}
+
+/* accesses may cross pages, which are translated one at a time */
+static int access_guest_virt(struct kvm_vcpu *vcpu, uint64_t gva, void *buf, size_t n,
+                             uint32_t access, struct x86_exception *fault)
+{
+        uint64_t gpa, hpa;
+        uint8_t *p = buf;
+        size_t len;
+
+        while (n) {
+                len = min_t(size_t, n, PAGE_SIZE - (gva & ~PAGE_MASK));
+                if (gva_to_gpa_hpa(vcpu, gva, access, &gpa, &hpa, fault))
+                        return -1;
+                if (access & PFERR_WRITE_MASK) {
+                        memcpy(__va(hpa), p, len);
+                        /* a clone writes to its own copy, which isn't logged */
+                        if (!vcpu->clone_id)
+                                kvm_dirty_log_mark(gpa);
+                } else
+                        memcpy(p, __va(hpa), len);
+                gva += len;
+                p += len;
+                n -= len;
+        }
+        return 0;
+}
+
+int kvm_read_guest_virt(struct kvm_vcpu *vcpu, uint64_t gva, void *buf, size_t n,
+                        uint32_t access, struct x86_exception *fault)
+{
+        return access_guest_virt(vcpu, gva, buf, n, access & ~PFERR_WRITE_MASK, fault);
+}
+
+int kvm_write_guest_virt(struct kvm_vcpu *vcpu, uint64_t gva, const void *buf, size_t n,
+                         uint32_t access, struct x86_exception *fault)
+{
+        return access_guest_virt(vcpu, gva, (void *)buf, n, access | PFERR_WRITE_MASK, fault);
+}
+
+static uint64_t *ept_alloc_table(void)
+{
+        uint64_t *table = get_zeroed_page(PAGE_TYPE_PGTABLE);
+
+        if (!table)
+                panic("out of memory for EPT tables\n");
+        ept_table_pages++;
+        return table;
+}
+
+static uint64_t *ept_next_table(uint64_t *table, size_t index)
+{
+        uint64_t *next, e = READ_ONCE(table[index]);
+
+        if (!e) {
+                next = ept_alloc_table();
+                e = cmpxchg64(&table[index], 0, __pa(next) | EPT_TABLE_PERM);
+                if (!e)
+                        return next;
+                /* another vcpu installed one first */
+                free_page(next);
+                ept_table_pages--;
+        }
+        BUG_ON(e & VMX_EPT_LARGE_PAGE_BIT);
+        return __va(e & PTE_PFN_MASK);
+}
+
+struct ept_range {
+        uint64_t start, end;
+};
+
+static int cmp_range(const void *a, const void *b)
+{
+        const struct ept_range *x = a, *y = b;
+
+        return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/*
+ * Guest memory types: EPT leaves carry the type that the MTRRs give for
+ * RAM (normally WB), and UC for everything else, including MMIO and ACPI
+ * NVS.  IPAT stays clear so that the guest PAT still applies on top, as
+ * it would natively; e.g., a UC leaf with a WC PAT entry is WC.
+ *
+ * With EPT the processor ignores the MTRRs for guest accesses, so the
+ * guest's MTRR writes are applied to the hardware and the tree rebuilt.
+ */
+
+struct ept_map_stats {
+        size_t nr_leaves[3];            /* 4K, 2M, 1G */
+        uint64_t bytes[MTRR_NUM_TYPES];
+};
+
+/*
+ * Dirty logging records guest pages written since the last fetch.  RAM
+ * is mapped with 4K leaves while it is on.  With PML, the processor sets
+ * EPT dirty bits and logs the addresses to a per-vCPU buffer; otherwise
+ * the leaves are write-protected and the first write to each page faults.
+ */
+static struct {
+        bool enabled;
+        bool pml;
+        unsigned int order;
+        pfn_t nr_pfns;
+        unsigned long *bitmap;
+        uint64_t nr_faults;
+} dirty_log;
+
+static bool pml_enabled = true;
+
+/*
+ * Demand paging: pages whose contents are not there yet (e.g., while a
+ * snapshot is being restored) are mapped with 4K leaves that have no
+ * permissions, so that the first access faults and fill() provides the
+ * page.  Only the 2M ranges with pending pages are split.
+ */
+static struct {
+        bool enabled;
+        const unsigned long *pending;
+        pfn_t nr_pfns;
+        void (*fill)(uint64_t gpa);
+        uint64_t nr_faults;
+} demand;
+
+static bool demand_pending(uint64_t start, uint64_t end)
+{
+        pfn_t first = start >> PAGE_SHIFT, last = min(end >> PAGE_SHIFT, demand.nr_pfns);
+
+        return demand.enabled && first < last && find_next_bit(demand.pending, last, first) < last;
+}
+
+/*
+ * Zero pages: RAM that the guest hasn't written yet (except what the VMM
+ * loaded for it) is mapped read-only to a shared zero page, 2M at a time
+ * where possible, so that it needs no zeroing up front.  The first write
+ * to a page zeroes the guest frame and maps it.
+ */
+static struct {
+        bool enabled;
+        unsigned long *pending;
+        unsigned int order;
+        pfn_t nr_pfns;
+        void *page, *page_2m;
+        uint64_t nr_pending, nr_private;
+} zero;
+
+static bool zero_pages;
+
+/*
+ * Same-page merging: a scanner on the tick hashes guest pages and maps
+ * identical ones read-only to the frame of one of them.  The first write
+ * to a merged page breaks the sharing; its own frame still holds the same
+ * contents, so nothing needs to be copied.  Pages whose hash changes from
+ * one pass to the next aren't merged.  Candidates are found through two
+ * direct-mapped tables of hashes: the stable one of shared frames, and
+ * the unstable one of pages seen in the current pass.
+ */
+#define KSM_SLOTS               4096
+#define KSM_PERIOD_MS           10
+
+struct ksm_slot {
+        uint64_t hash;
+        /* 0 if empty; pages below 1M are not merged */
+        pfn_t pfn;
+};
+
+static struct {
+        bool enabled;
+        /* pages scanned per second (0: off) */
+        uint64_t rate;
+        pfn_t nr_pfns, next;
+        uint32_t *csum;
+        unsigned int csum_order;
+        struct ksm_slot *stable, *unstable;
+        /* for the reverse map of the shared frames */
+        struct spinlock lock;
+        uint64_t next_tick;
+        uint64_t nr_scanned, nr_frames, nr_shared, nr_unshared, cycles;
+} ksm;
+
+static void ksm_unmerge_all(void);
+
+/*
+ * Balloon: the guest gives up free pages with a hypercall, and they are
+ * unmapped with 4K leaves that have no permissions.  The guest takes
+ * them back by deflating, or just by touching them; either way, the
+ * first access faults and maps the page again, zeroed.
+ */
+static struct {
+        unsigned long *unbacked;
+        unsigned int order;
+        pfn_t nr_pfns;
+        uint64_t nr_pages, nr_inflated, nr_deflated, nr_refilled;
+} balloon;
+
+static bool balloon_pending(uint64_t start, uint64_t end)
+{
+        pfn_t first = start >> PAGE_SHIFT, last = min(end >> PAGE_SHIFT, balloon.nr_pfns);
+
+        return first < last && find_next_bit(balloon.unbacked, last, first) < last;
+}
+
+static void balloon_fill(uint64_t *ep, uint64_t gpa, bool written);
+
+/*
+ * Idle page tracking: a pass every period harvests and clears the EPT
+ * accessed bits of guest RAM above 1M, and counts for each page the
+ * passes since it was last accessed.  The pages accessed in the last
+ * pass are the working set.  Bucket i > 0 of the histogram counts the
+ * pages idle for [2^(i-1), 2^i) passes.
+ */
+#define IDLE_NR_BUCKETS         9
+
+static struct {
+        bool enabled;
+        /* sample for the working set, even without the compressed tier */
+        bool wss;
+        unsigned int period_ms;
+        pfn_t nr_pfns;
+        uint8_t *ages;
+        unsigned int ages_order;
+        uint64_t next_tick;
+        uint64_t nr_passes, cycles;
+        /* of the last pass, in pages */
+        uint64_t hist[IDLE_NR_BUCKETS];
+} idle = {
+        .period_ms = 100,
+};
+
+/*
+ * Compressed tier: pages that the idle pass finds cold for long enough
+ * are compressed into a pool and unmapped.  The first access faults and
+ * decompresses the page back.  Pool objects are runs of 256-byte chunks,
+ * and each pool page holds objects of one size after a header in its
+ * first chunk; the leaf of a page holds the address of its object, which
+ * starts with the compressed size.
+ *
+ * Guest memory is identity-mapped, so the frame of a compressed page
+ * stays reserved for it: the pool comes on top, out of the VMM's own
+ * memory, and saves nothing.  It is capped, and leaves a reserve for EPT
+ * tables and VMCSs; pool pages go back to the allocator once empty.
+ */
+#define ZSWAP_CHUNK             256
+/* a page that doesn't compress to less than this is left alone */
+#define ZSWAP_MAX_CHUNKS        (PAGE_SIZE / ZSWAP_CHUNK - 1)
+#define ZSWAP_HANDLE_MASK       (PTE_PFN_MASK | (PAGE_SIZE - ZSWAP_CHUNK))
+/* pages compressed per pass at most */
+#define ZSWAP_BATCH             4096
+/* leaves claimed before a flush and compressing them */
+#define ZSWAP_CLAIM             512
+/* free VMM pages the pool leaves for everything else */
+#define ZSWAP_RESERVE           (SZ_4M >> PAGE_SHIFT)
+
+struct zswap_page {
+        /* on zswap.partial[chunks] while some objects are free */
+        struct list_head list;
+        void *free;
+        unsigned int chunks, nr_used;
+};
+
+static struct {
+        /* passes without access before a page is compressed (0: off) */
+        unsigned int age;
+        /* pool pages at most (0: a quarter of the free VMM memory) */
+        uint64_t max_pool_pages;
+        /* for the pool, which vcpus faulting pages in share */
+        struct spinlock lock;
+        struct list_head partial[ZSWAP_MAX_CHUNKS + 1];
+        uint16_t table[LZ_HASH_SIZE];
+        uint8_t buf[PAGE_SIZE];
+        /* claimed leaves of cold pages, and their values before */
+        struct {
+                uint64_t *ep;
+                uint64_t old;
+        } claimed[ZSWAP_CLAIM];
+        size_t nr_claimed;
+        uint64_t nr_pages, nr_bytes, nr_pool_pages, nr_stored_bytes;
+        uint64_t nr_stored, nr_loaded, nr_rejected, nr_capped;
+        /* compressed sizes, in chunks, and fault-in cycles */
+        uint32_t size_hist[ZSWAP_MAX_CHUNKS + 1];
+        uint32_t fault_hist[KVM_STAT_NR_BUCKETS];
+} zswap;
+
+static void zswap_load_all(void);
+static bool zswap_fault(uint64_t gpa, uint32_t access);
+
+/*
+ * Huge pages: large leaves split for 4K granularity (zero pages, the
+ * balloon, merging, and so on) come back.  A periodic pass, in the spirit
+ * of khugepaged, collapses each table whose leaves map a contiguous,
+ * aligned range alike into one large leaf, 2M and then 1G.
+ */
+static struct {
+        /* between passes (0: off) */
+        unsigned int period_ms;
+        uint64_t next_tick;
+        uint64_t nr_split, nr_passes, cycles;
+        /* into 2M and 1G leaves */
+        uint64_t nr_collapsed[2];
+        /* tables collapsed, freed once every vcpu has flushed past stale_gen */
+        uint64_t *stale[512];
+        size_t nr_stale;
+        uint64_t stale_gen;
+        /* the table being collapsed, as it was */
+        uint64_t snap[512];
+} huge = {
+        .period_ms = 1000,
+};
+
+/* 1 if all of [start, end) is still zero, 0 if none of it is, -1 if mixed */
+static int zero_pending(uint64_t start, uint64_t end)
+{
+        pfn_t first = start >> PAGE_SHIFT, last = end >> PAGE_SHIFT, n = min(last, zero.nr_pfns);
+
+        if (!zero.enabled || first >= n || find_next_bit(zero.pending, n, first) >= n)
+                return 0;
+        return n == last && find_next_zero_bit(zero.pending, n, first) >= n ? 1 : -1;
+}
+
+/* 1 if [start, end) is all RAM, 0 if none of it is, -1 if mixed */
+static int e820_ram(uint64_t start, uint64_t end)
+{
+        uint64_t covered = 0, s, e;
+        size_t i;
+
+        for (i = 0; i < e820_table.nr_entries; ++i) {
+                const struct e820_entry *entry = &e820_table.entries[i];
+
+                if (entry->type != E820_TYPE_RAM && entry->type != E820_TYPE_ACPI)
+                        continue;
+                s = max(start, entry->addr);
+                e = min(end, entry->addr + entry->size);
+                if (s < e)
+                        covered += e - s;
+        }
+        if (covered == end - start)
+                return 1;
+        return covered ? -1 : 0;
+}
+
+/* the number of page frames up to the end of guest RAM */
+static pfn_t ram_pfns(void)
+{
+        pfn_t nr_pfns = 0;
+        size_t i;
+
+        for (i = 0; i < e820_table.nr_entries; ++i) {
+                const struct e820_entry *e = &e820_table.entries[i];
+
+                if (e->type == E820_TYPE_RAM || e->type == E820_TYPE_ACPI)
+                        nr_pfns = max(nr_pfns, (e->addr + e->size) >> PAGE_SHIFT);
+        }
+        return nr_pfns;
+}
+
+/*
+ * The guest's MTRRs never reach the hardware: guest_mtrr has what the
+ * guest wrote, and ept_mtrr the state EPT was last built from.  Both
+ * start out as a copy of the host's.
+ */
+static struct mtrr_state guest_mtrr, ept_mtrr;
+
+/*
+ * The memory type of [start, end), or MTRR_TYPE_INVALID if not uniform;
+ * *ram is set if it is all RAM.
+ */
+static uint8_t ept_mem_type(uint64_t start, uint64_t end, bool *ram)
+{
+        uint8_t type = mtrr_type_combine(mtrr_type_lookup(start, end),
+                                         mtrr_state_type_lookup(&ept_mtrr, start, end));
+
+        *ram = false;
+        if (type == MTRR_TYPE_INVALID)
+                return type;
+        switch (e820_ram(start, end)) {
+        case 1:
+                *ram = true;
+                return type;
+        case 0:
+                return MTRR_TYPE_UNCACHABLE;
+        default:
+                return MTRR_TYPE_INVALID;
+        }
+}
+
+static uint64_t ept_leaf(uint64_t addr, uint8_t type, int level, bool logged, struct ept_map_stats *st)
+{
+        uint64_t e = addr | EPT_LEAF_PERM | ((uint64_t)type << VMX_EPT_MT_EPTE_SHIFT);
+
+        st->nr_leaves[level]++;
+        st->bytes[type] += UINT64_C(1) << (PAGE_SHIFT + 9 * level);
+        if (level)
+                e |= VMX_EPT_LARGE_PAGE_BIT;
+        if (logged && !dirty_log.pml)
+                e = (e & ~VMX_EPT_WRITABLE_MASK) | EPT_DIRTY_LOG;
+        return e;
+}
+
+/* no dirty logging needed: the first write faults anyway */
+static uint64_t zero_leaf(uint8_t type, int level, struct ept_map_stats *st)
+{
+        void *page = level ? zero.page_2m : zero.page;
+
+        return (ept_leaf(__pa(page), type, level, false, st) & ~VMX_EPT_WRITABLE_MASK) | EPT_ZERO;
+}
+
+/*
+ * Map [start, end), both 2M-aligned, with the largest leaves of a uniform
+ * type.  RAM is mapped with 4K leaves while dirty logging is on, and so
+ * are pages pending demand paging.  RAM that is still zero is mapped to
+ * the zero page, with a 2M leaf if all of the range is.
+ */
+static void ept_map_range(uint64_t start, uint64_t end, bool use_1g, struct ept_map_stats *st)
+{
+        bool split = dirty_log.enabled, ram;
+        uint64_t *pdpt, *pd, *pt, addr;
+        uint8_t type;
+
+        while (start < end) {
+                pdpt = ept_next_table(ept_pml4, pml4_index(start));
+                if (use_1g && IS_ALIGNED(start, SZ_1G) && end - start >= SZ_1G) {
+                        type = ept_mem_type(start, start + SZ_1G, &ram);
+                        if (type != MTRR_TYPE_INVALID && !(split && ram) &&
+                            !demand_pending(start, start + SZ_1G) && !zero_pending(start, start + SZ_1G) &&
+                            !balloon_pending(start, start + SZ_1G)) {
+                                pdpt[pdpt_index(start)] = ept_leaf(start, type, 2, false, st);
+                                start += SZ_1G;
+                                continue;
+                        }
+                }
+                pd = ept_next_table(pdpt, pdpt_index(start));
+                type = ept_mem_type(start, start + SZ_2M, &ram);
+                if (type != MTRR_TYPE_INVALID && ram && zero.page_2m &&
+                    zero_pending(start, start + SZ_2M) == 1 && !demand_pending(start, start + SZ_2M) &&
+                    !balloon_pending(start, start + SZ_2M)) {
+                        pd[pd_index(start)] = zero_leaf(type, 1, st);
+                        start += SZ_2M;
+                        continue;
+                }
+                if (type != MTRR_TYPE_INVALID && !(split && ram) &&
+                    !demand_pending(start, start + SZ_2M) && !zero_pending(start, start + SZ_2M) &&
+                    !balloon_pending(start, start + SZ_2M)) {
+                        pd[pd_index(start)] = ept_leaf(start, type, 1, false, st);
+                        start += SZ_2M;
+                        continue;
+                }
+                pt = ept_next_table(pd, pd_index(start));
+                for (addr = start; addr < start + SZ_2M; addr += PAGE_SIZE) {
+                        uint8_t t = type;
+                        bool r = ram;
+                        uint64_t e;
+
+                        /* a uniform range being split needs no lookup per page */
+                        if (t == MTRR_TYPE_INVALID) {
+                                t = ept_mem_type(addr, addr + PAGE_SIZE, &r);
+                                /* a page that is only partly RAM */
+                                if (t == MTRR_TYPE_INVALID)
+                                        t = MTRR_TYPE_UNCACHABLE;
+                        }
+                        if (zero_pending(addr, addr + PAGE_SIZE))
+                                e = zero_leaf(t, 0, st);
+                        else
+                                e = ept_leaf(addr, t, 0, split && r, st);
+                        if (demand_pending(addr, addr + PAGE_SIZE))
+                                e = (e & ~VMX_EPT_RWX_MASK) | EPT_DEMAND;
+                        else if (balloon_pending(addr, addr + PAGE_SIZE))
+                                e = (e & ~VMX_EPT_RWX_MASK) | EPT_BALLOON;
+                        pt[pt_index(addr)] = e;
+                }
+                start += SZ_2M;
+        }
+}
+
+/* map [start, end) minus the sorted, disjoint holes */
+static void ept_map_around(uint64_t start, uint64_t end, const struct ept_range *holes, size_t nr_holes,
+                           bool use_1g, struct ept_map_stats *st)
+{
+        size_t i;
+
+        for (i = 0; i < nr_holes && start < end; ++i) {
+                if (holes[i].end <= start || end <= holes[i].start)
+                        continue;
+                if (start < holes[i].start)
+                        ept_map_range(start, holes[i].start, use_1g, st);
+                start = holes[i].end;
+        }
+        if (start < end)
+                ept_map_range(start, end, use_1g, st);
+}
+
+static void ept_free_table(uint64_t *table, int level)
+{
+        size_t i;
+
+        for (i = 0; level && i < 512; ++i) {
+                if (!table[i] || (table[i] & VMX_EPT_LARGE_PAGE_BIT))
+                        continue;
+                ept_free_table(__va(table[i] & PTE_PFN_MASK), level - 1);
+                free_page(__va(table[i] & PTE_PFN_MASK));
+                ept_table_pages--;
+        }
+}
+
+static void ept_build(struct ept_map_stats *st)
+{
+        static struct ept_range ranges[E820_MAX_ENTRIES + 1];
+        struct ept_range holes[1 + MAX_NUMNODES] = {
+                { __pa(_start), __pa(_end) },
+        };
+        size_t i, n = 0, nr_holes = 1;
+        bool use_1g = kvm_x86_ops->get_lpage_level() >= 3;
+
+        for (i = 0; i < nr_page_pools; ++i)
+                holes[nr_holes++] = (struct ept_range){ page_pools[i].start, page_pools[i].end };
+
+        ranges[n++] = (struct ept_range){ 0, SZ_4G };
+        for (i = 0; i < e820_table.nr_entries; ++i) {
+                const struct e820_entry *e = &e820_table.entries[i];
+
+                if (!e->size)
+                        continue;
+                ranges[n].start = e->addr & ~(uint64_t)(SZ_2M - 1);
+                ranges[n].end = ALIGN(e->addr + e->size, (uint64_t)SZ_2M);
+                ++n;
+        }
+        sort(ranges, n, sizeof(ranges[0]), cmp_range, NULL);
+        sort(holes, nr_holes, sizeof(holes[0]), cmp_range, NULL);
+
+        for (i = 0; i < n; ++i) {
+                uint64_t start = ranges[i].start, end = ranges[i].end;
+
+                /* merge overlapping and adjacent ranges */
+                while (i + 1 < n && ranges[i + 1].start <= end)
+                        end = max(end, ranges[++i].end);
+                ept_map_around(start, end, holes, nr_holes, use_1g, st);
+        }
+}
+
+static void ept_print_stats(const struct ept_map_stats *st)
+{
+        uint64_t total = 0;
+        size_t i;
+
+        for (i = 0; i < MTRR_NUM_TYPES; ++i)
+                total += st->bytes[i];
+        pr_info("%" PRIu64 " MiB mapped: %zu 1G + %zu 2M + %zu 4K leaves, %zu table pages\n",
+                total / SZ_1M, st->nr_leaves[2], st->nr_leaves[1], st->nr_leaves[0], ept_table_pages);
+        pr_info("memory types:");
+        for (i = 0; i < MTRR_NUM_TYPES; ++i) {
+                if (st->bytes[i])
+                        pr_cont(" %s %" PRIu64 " KiB", mtrr_type_name(i), st->bytes[i] / SZ_1K);
+        }
+        pr_cont("\n");
+}
+
+static void zero_range(uint64_t start, uint64_t end, bool pending)
+{
+        pfn_t pfn;
+
+        for (pfn = start >> PAGE_SHIFT; pfn < min(end >> PAGE_SHIFT, zero.nr_pfns); ++pfn) {
+                if (pending == test_bit(pfn, zero.pending))
+                        continue;
+                if (pending) {
+                        set_bit(pfn, zero.pending);
+                        zero.nr_pending++;
+                } else {
+                        clear_bit(pfn, zero.pending);
+                        zero.nr_pending--;
+                }
+        }
+}
+
+/*
+ * RAM above 1M starts out zero, except the kernel and initrd that the
+ * guest boots from.  A restored snapshot brings its own memory.
+ */
+static void zero_init(void)
+{
+        size_t i, size;
+
+        zero.nr_pfns = ram_pfns();
+        size = BITS_TO_LONGS(zero.nr_pfns) * sizeof(long);
+        zero.order = get_order(size);
+        zero.pending = alloc_pages(zero.order, PAGE_TYPE_BITMAP);
+        zero.page = get_zeroed_page(PAGE_TYPE_OTHER);
+        if (!zero.pending || !zero.page)
+                panic("out of memory for zero pages\n");
+        memset(zero.pending, 0, size);
+        /* optional: without it, zero RAM is mapped 4K at a time */
+        zero.page_2m = alloc_pages(PAGE_ORDER_2M, PAGE_TYPE_OTHER);
+        if (zero.page_2m)
+                memset(zero.page_2m, 0, SZ_2M);
+
+        for (i = 0; i < e820_table.nr_entries; ++i) {
+                const struct e820_entry *e = &e820_table.entries[i];
+
+                if (e->type == E820_TYPE_RAM)
+                        zero_range(ALIGN(max(e->addr, (uint64_t)SZ_1M), PAGE_SIZE),
+                                   rounddown(e->addr + e->size, PAGE_SIZE), true);
+        }
+        zero_range(rounddown(guest_params.kernel_start, PAGE_SIZE), ALIGN(guest_params.kernel_end, PAGE_SIZE), false);
+        zero_range(rounddown(guest_params.initrd_start, PAGE_SIZE), ALIGN(guest_params.initrd_end, PAGE_SIZE), false);
+        zero.enabled = true;
+}
+
+/*
+ * Identity-map all guest-physical memory up front: everything below 4G
+ * (RAM and MMIO holes alike) and every e820 range above it, rounded out
+ * to 2M, except the VMM itself and its page pool.
+ */
+void kvm_mmu_setup_ept(void)
+{
+        struct ept_map_stats st = { 0 };
+
+        if (zero_pages && !kvm_snapshot_pending())
+                zero_init();
+        guest_mtrr = ept_mtrr = mtrr_state;
+        ept_pml4 = ept_alloc_table();
+        ept_build(&st);
+        ept_print_stats(&st);
+        kvm_mmu_ept_changed();
+}
+
+/*
+ * Rebuild the tree in place, keeping the root so that EPTP stays the same.
+ * The old tables are freed, so no other vcpu may be walking them: the
+ * caller has paused them, and they flush before they next enter the guest.
+ */
+static void __ept_rebuild(void)
+{
+        struct ept_map_stats st = { 0 };
+
+        /* the merged pages get their own frames back */
+        ksm_unmerge_all();
+        zswap_load_all();
+        ept_free_table(ept_pml4, 3);
+        memset(ept_pml4, 0, PAGE_SIZE);
+        ept_build(&st);
+        kvm_mmu_flush_tdp();
+}
+
+static void ept_rebuild(struct kvm_vcpu *vcpu)
+{
+        kvm_pause_vcpus(vcpu);
+        __ept_rebuild();
+        kvm_resume_vcpus(vcpu);
+}
+
+/*
+ * Apply a guest MTRR write to the guest's MTRRs.  While the guest has
+ * MTRRs disabled (normally with CR0.CD set, while it reprograms them) the
+ * old types stay.
+ */
+int kvm_mtrr_set_msr(struct kvm_vcpu *vcpu, uint32_t msr, uint64_t val)
+{
+        uint64_t old;
+
+        if (!mtrr_valid_msr(msr, val))
+                return -EINVAL;
+
+        kvm_pause_vcpus(vcpu);
+        old = mtrr_state_get_msr(&guest_mtrr, msr);
+        mtrr_state_set_msr(&guest_mtrr, msr, val);
+        if (val != old && (guest_mtrr.def_type & MTRR_DEF_TYPE_E)) {
+                ept_mtrr = guest_mtrr;
+                __ept_rebuild();
+        }
+        kvm_resume_vcpus(vcpu);
+        return 0;
+}
+
+uint64_t kvm_mtrr_get_msr(struct kvm_vcpu *vcpu, uint32_t msr)
+{
+        return mtrr_state_get_msr(&guest_mtrr, msr);
+}
+
+/* the leaf mapping gpa (including one not present but known), or NULL */
+static uint64_t *ept_lookup(uint64_t gpa, int *level)
+{
+        uint64_t *table = ept_pml4, e;
+        int l;
+
+        for (l = 4; l >= 1; --l) {
+                e = table[(gpa >> (PAGE_SHIFT + 9 * (l - 1))) & 511];
+                if (!(e & (VMX_EPT_RWX_MASK | EPT_DEMAND | EPT_BALLOON | EPT_ZSWAP | EPT_BUSY)))
+                        return NULL;
+                if (l == 1 || (e & VMX_EPT_LARGE_PAGE_BIT)) {
+                        *level = l;
+                        return &table[(gpa >> (PAGE_SHIFT + 9 * (l - 1))) & 511];
+                }
+                table = __va(e & PTE_PFN_MASK);
+        }
+        return NULL;
+}
+
+/*
+ * Replace a large leaf with a table of the next level that maps the same,
+ * returning the entry of gpa, or NULL if the leaf changed meanwhile.  The
+ * table is filled in before it replaces the leaf, so other vcpus see one
+ * or the other.  The translation doesn't change, so there is nothing to
+ * flush until the new leaves do.
+ */
+static uint64_t *ept_split(uint64_t *ep, int level, uint64_t gpa)
+{
+        int shift = PAGE_SHIFT + 9 * (level - 2);
+        uint64_t *table = ept_alloc_table(), e = READ_ONCE(*ep), attr, addr;
+        size_t i;
+
+        attr = e & ~PTE_PFN_MASK;
+        if (level == 2)
+                attr &= ~VMX_EPT_LARGE_PAGE_BIT;
+        addr = e & PTE_PFN_MASK & ~((UINT64_C(1) << (shift + 9)) - 1);
+        for (i = 0; i < 512; ++i)
+                table[i] = attr | (addr + (i << shift));
+        if (cmpxchg64(ep, e, __pa(table) | EPT_TABLE_PERM) != e) {
+                free_page(table);
+                ept_table_pages--;
+                return NULL;
+        }
+        huge.nr_split++;
+        return &table[(gpa >> shift) & 511];
+}
+
+/* the 4K leaf mapping gpa, splitting large leaves as needed */
+static uint64_t *ept_leaf_4k(uint64_t gpa)
+{
+        uint64_t *ep, *next;
+        int level;
+
+        ep = ept_lookup(gpa, &level);
+        while (ep && level > 1) {
+                next = ept_split(ep, level, gpa);
+                /* lost to another vcpu: look again */
+                if (!next) {
+                        ep = ept_lookup(gpa, &level);
+                        continue;
+                }
+                ep = next;
+                --level;
+        }
+        return ep;
+}
+
+/*
+ * EPT is shared by the vcpus, which fill it in as they fault without a
+ * lock.  A vcpu claims a leaf by swapping in a busy, not-present one for
+ * the value it has read, fills in the page, and installs the new leaf.
+ * A vcpu that loses the race, or finds the leaf busy, returns to the
+ * guest, which faults again until the leaf is there.  A stale translation
+ * of the old leaf at worst reads the page as it was, until the flush.
+ */
+static uint64_t ept_claimed(uint64_t e)
+{
+        return (e & ~VMX_EPT_RWX_MASK) | EPT_BUSY;
+}
+
+static bool ept_claim(uint64_t *ep, uint64_t e)
+{
+        return !(e & EPT_BUSY) && cmpxchg64(ep, e, ept_claimed(e)) == e;
+}
+
+/* returns true if the EPT violation was for a leaf that another vcpu is filling in */
+static bool busy_fault(uint64_t gpa)
+{
+        uint64_t *ep;
+        int level;
+
+        ep = ept_lookup(gpa, &level);
+        return ep && (READ_ONCE(*ep) & EPT_BUSY);
+}
+
+void kvm_dirty_log_mark(uint64_t gpa)
+{
+        pfn_t pfn = gpa >> PAGE_SHIFT;
+
+        if (dirty_log.enabled && pfn < dirty_log.nr_pfns)
+                set_bit(pfn, dirty_log.bitmap);
+}
+
+/*
+ * The first write to a protected page.  No flush is needed: a stale
+ * read-only translation at worst causes one more, spurious, violation.
+ * Of racing vcpus, the one whose swap goes through logs the page.
+ */
+static void ept_unprotect(uint64_t *ep, uint64_t gpa)
+{
+        uint64_t e = READ_ONCE(*ep);
+
+        if (!(e & EPT_DIRTY_LOG) ||
+            cmpxchg64(ep, e, (e | VMX_EPT_WRITABLE_MASK) & ~EPT_DIRTY_LOG) != e)
+                return;
+        kvm_dirty_log_mark(gpa);
+}
+
+/* returns true if the EPT violation was a write to a logged page */
+static bool dirty_log_fault(uint64_t gpa)
+{
+        uint64_t *ep;
+        int level;
+
+        if (!dirty_log.enabled)
+                return false;
+        ep = ept_lookup(gpa, &level);
+        if (!ep)
+                return false;
+        /* already unprotected by a write from the VMM */
+        if (*ep & VMX_EPT_WRITABLE_MASK)
+                return true;
+        if (!(*ep & EPT_DIRTY_LOG))
+                return false;
+        ept_unprotect(ep, gpa);
+        dirty_log.nr_faults++;
+        return true;
+}
+
+int kvm_dirty_log_enable(struct kvm_vcpu *vcpu)
+{
+        pfn_t nr_pfns = ram_pfns();
+        size_t size;
+
+        /* fetching the log rearms leaves that other vcpus may be writing */
+        if (dirty_log.enabled || smp_num_online() > 1)
+                return -EBUSY;
+
+        size = BITS_TO_LONGS(nr_pfns) * sizeof(long);
+        dirty_log.order = get_order(size);
+        dirty_log.bitmap = alloc_pages(dirty_log.order, PAGE_TYPE_BITMAP);
+        if (!dirty_log.bitmap)
+                return -ENOMEM;
+        memset(dirty_log.bitmap, 0, size);
+
+        dirty_log.nr_pfns = nr_pfns;
+        dirty_log.nr_faults = 0;
+        dirty_log.pml = pml_enabled && kvm_x86_ops->has_pml();
+        dirty_log.enabled = true;
+        ept_rebuild(vcpu);
+        if (dirty_log.pml)
+                kvm_x86_ops->set_pml(vcpu, true);
+        return 0;
+}
+
+/*
+ * Copy the pages dirtied since the last fetch into bitmap (if not NULL,
+ * nr_pfns bits) and clear the log, so that the next write to each of
+ * them is logged again.  Returns the number of dirty pages.
+ */
+long kvm_dirty_log_fetch(struct kvm_vcpu *vcpu, unsigned long *bitmap, pfn_t nr_pfns)
+{
+        unsigned long pfn;
+        uint64_t *ep;
+        long count = 0;
+        int level;
+
+        if (!dirty_log.enabled)
+                return -EINVAL;
+        if (dirty_log.pml)
+                kvm_x86_ops->flush_pml(vcpu);
+
+        if (bitmap)
+                memset(bitmap, 0, BITS_TO_LONGS(nr_pfns) * sizeof(long));
+        for_each_set_bit(pfn, dirty_log.bitmap, dirty_log.nr_pfns) {
+                clear_bit(pfn, dirty_log.bitmap);
+                if (bitmap && pfn < nr_pfns)
+                        set_bit(pfn, bitmap);
+                ++count;
+
+                /* rearm: clear the dirty bit, or write-protect again */
+                ep = ept_lookup((uint64_t)pfn << PAGE_SHIFT, &level);
+                if (!ep || level != 1)
+                        continue;
+                if (dirty_log.pml)
+                        WRITE_ONCE(*ep, *ep & ~VMX_EPT_DIRTY_BIT);
+                else if (*ep & VMX_EPT_WRITABLE_MASK)
+                        WRITE_ONCE(*ep, (*ep & ~VMX_EPT_WRITABLE_MASK) | EPT_DIRTY_LOG);
+        }
+
+        if (count)
+                kvm_mmu_flush_tdp();
+        return count;
+}
+
+/* large leaves come back on the rebuild */
+void kvm_dirty_log_disable(struct kvm_vcpu *vcpu)
+{
+        if (!dirty_log.enabled)
+                return;
+
+        if (dirty_log.pml)
+                kvm_x86_ops->set_pml(vcpu, false);
+        pr_info("dirty log: %s, %" PRIu64 " write faults\n",
+                dirty_log.pml ? "pml" : "write-protect", dirty_log.nr_faults);
+        dirty_log.enabled = false;
+        ept_rebuild(vcpu);
+        free_pages(dirty_log.bitmap, dirty_log.order);
+        dirty_log.bitmap = NULL;
+}
+
+/*
+ * Not-present translations aren't cached, so filling in the permissions
+ * needs no flush.  A page still write-protected for dirty logging stays so.
+ */
+static void ept_demand_fill(uint64_t *ep, uint64_t gpa)
+{
+        uint64_t e = READ_ONCE(*ep);
+
+        if (!ept_claim(ep, e))
+                return;
+        demand.fill(gpa & PAGE_MASK);
+        e |= VMX_EPT_READABLE_MASK | VMX_EPT_EXECUTABLE_MASK;
+        if (!(e & EPT_DIRTY_LOG))
+                e |= VMX_EPT_WRITABLE_MASK;
+        WRITE_ONCE(*ep, e & ~EPT_DEMAND);
+}
+
+/*
+ * Map the pages set in pending (nr_pfns bits) on demand.  The bitmap is
+ * owned by the caller, and fill() clears the bit of each page it fills.
+ */
+void kvm_demand_enable(struct kvm_vcpu *vcpu, const unsigned long *pending, pfn_t nr_pfns,
+                       void (*fill)(uint64_t gpa))
+{
+        demand.pending = pending;
+        demand.nr_pfns = nr_pfns;
+        demand.fill = fill;
+        demand.nr_faults = 0;
+        demand.enabled = true;
+        ept_rebuild(vcpu);
+}
+
+/* returns true if the EPT violation was the first access to a pending page */
+static bool demand_fault(uint64_t gpa)
+{
+        uint64_t *ep;
+        int level;
+
+        if (!demand.enabled)
+                return false;
+        ep = ept_lookup(gpa, &level);
+        if (!ep || !(*ep & EPT_DEMAND))
+                return false;
+        ept_demand_fill(ep, gpa);
+        demand.nr_faults++;
+        return true;
+}
+
+/* fill a pending page before the guest gets to it */
+void kvm_demand_fill(uint64_t gpa)
+{
+        uint64_t *ep;
+        int level;
+
+        ep = ept_lookup(gpa, &level);
+        if (ep && (*ep & EPT_DEMAND))
+                ept_demand_fill(ep, gpa);
+        else
+                demand.fill(gpa & PAGE_MASK);
+}
+
+/* once nothing is pending; returns the number of faults taken */
+uint64_t kvm_demand_disable(struct kvm_vcpu *vcpu)
+{
+        if (!demand.enabled)
+                return 0;
+        demand.enabled = false;
+        ept_rebuild(vcpu);
+        return demand.nr_faults;
+}
+
+/*
+ * Reverse map from host frames to the EPT leaves that share them, for
+ * clones and same-page merging, kept while either is in use.  Each entry
+ * has the guest-physical address of its leaf, and the clone EPT it is
+ * part of (NULL for the guest's own).
+ */
+struct rmap_entry {
+        uint64_t *ep;
+        uint64_t gpa;
+        struct kvm_clone_ept *owner;
+        struct rmap_entry *next;
+};
+
+#define RMAP_PER_PAGE           (PAGE_SIZE / sizeof(struct rmap_entry))
+
+static struct {
+        struct rmap_entry **heads;
+        unsigned int order;
+        pfn_t nr_pfns;
+        struct rmap_entry *free;
+        /* pages of entries, linked through their first entry */
+        struct rmap_entry *pages;
+} rmap;
+
+static struct kvm_clone_ept *clone_epts;
+
+static int rmap_init(void)
+{
+        size_t size, i;
+
+        if (rmap.heads)
+                return 0;
+
+        /* shared frames are guest RAM, or zero pages from the pools */
+        rmap.nr_pfns = ram_pfns();
+        for (i = 0; i < nr_page_pools; ++i)
+                rmap.nr_pfns = max(rmap.nr_pfns, page_pools[i].end >> PAGE_SHIFT);
+        size = rmap.nr_pfns * sizeof(*rmap.heads);
+        rmap.order = get_order(size);
+        rmap.heads = alloc_pages(rmap.order, PAGE_TYPE_OTHER);
+        if (!rmap.heads)
+                return -ENOMEM;
+        memset(rmap.heads, 0, size);
+        return 0;
+}
+
+static void rmap_destroy(void)
+{
+        struct rmap_entry *page;
+
+        while ((page = rmap.pages)) {
+                rmap.pages = page->next;
+                free_page(page);
+        }
+        free_pages(rmap.heads, rmap.order);
+        memset(&rmap, 0, sizeof(rmap));
+}
+
+static int rmap_add(pfn_t pfn, uint64_t *ep, uint64_t gpa, struct kvm_clone_ept *owner)
+{
+        struct rmap_entry *r;
+        size_t i;
+
+        if (!rmap.free) {
+                r = get_zeroed_page(PAGE_TYPE_OTHER);
+                if (!r)
+                        return -ENOMEM;
+                r->next = rmap.pages;
+                rmap.pages = r;
+                for (i = 1; i < RMAP_PER_PAGE; ++i) {
+                        r[i].next = rmap.free;
+                        rmap.free = &r[i];
+                }
+        }
+        r = rmap.free;
+        rmap.free = r->next;
+        r->ep = ep;
+        r->gpa = gpa;
+        r->owner = owner;
+        r->next = rmap.heads[pfn];
+        rmap.heads[pfn] = r;
+        return 0;
+}
+
+static void rmap_remove(pfn_t pfn, uint64_t *ep)
+{
+        struct rmap_entry **p, *r;
+
+        for (p = &rmap.heads[pfn]; (r = *p); p = &r->next) {
+                if (r->ep == ep) {
+                        *p = r->next;
+                        r->next = rmap.free;
+                        rmap.free = r;
+                        return;
+                }
+        }
+        BUG();
+}
+
+/*
+ * Clone EPT trees start empty and are filled in on violations, following
+ * the guest's own tree.  RAM is mapped with 4K leaves: read-only to the
+ * guest's frame at first, and to a copy of the clone's own from the first
+ * write on.
+ */
+static uint64_t *clone_next_table(uint64_t *table, size_t index)
+{
+        uint64_t *next;
+
+        if (table[index])
+                return __va(table[index] & PTE_PFN_MASK);
+        next = get_zeroed_page(PAGE_TYPE_PGTABLE);
+        if (next)
+                table[index] = __pa(next) | EPT_TABLE_PERM;
+        return next;
+}
+
+/*
+ * Fill in the clone leaf for gpa, with the memory type of the guest's
+ * leaf.  Returns 1 if a present leaf changed, 0 if one was added, or -1
+ * if gpa isn't guest memory (or there is no memory left).
+ */
+static int clone_ept_fill(struct kvm_clone_ept *ept, uint64_t gpa, uint32_t access)
+{
+        uint64_t *tep, *pdpt, *pd, *pt, *ep, e, src, mask, addr = gpa & PAGE_MASK;
+        struct ept_map_stats st = { 0 };
+        uint8_t type;
+        void *page;
+        int level;
+
+        tep = ept_lookup(gpa, &level);
+        /* the guest would see a zeroed page as well */
+        if (tep && (*tep & EPT_BALLOON))
+                balloon_fill(tep, addr, false);
+        if (tep && (*tep & EPT_ZSWAP))
+                zswap_fault(addr, 0);
+        if (!tep || !(*tep & VMX_EPT_RWX_MASK))
+                return -1;
+        type = (*tep >> VMX_EPT_MT_EPTE_SHIFT) & 7;
+        /* the guest frame, or the zero page */
+        mask = (UINT64_C(1) << (PAGE_SHIFT + 9 * (level - 1))) - 1;
+        src = (*tep & PTE_PFN_MASK & ~mask) | (addr & mask);
+
+        pdpt = clone_next_table(ept->pml4, pml4_index(gpa));
+        pd = pdpt ? clone_next_table(pdpt, pdpt_index(gpa)) : NULL;
+        if (!pd || (pd[pd_index(gpa)] & VMX_EPT_LARGE_PAGE_BIT))
+                return -1;
+
+        /* anything but RAM is shared as is; a large leaf has no RAM in it */
+        if (!e820_ram(addr, addr + PAGE_SIZE) && level > 1 && !pd[pd_index(gpa)]) {
+                pd[pd_index(gpa)] = ept_leaf(gpa & ~(uint64_t)(SZ_2M - 1), type, 1, false, &st);
+                return 0;
+        }
+        pt = clone_next_table(pd, pd_index(gpa));
+        if (!pt)
+                return -1;
+        ep = &pt[pt_index(gpa)];
+        e = *ep;
+        if (!e820_ram(addr, addr + PAGE_SIZE)) {
+                if (e)
+                        return -1;
+                *ep = ept_leaf(addr, type, 0, false, &st);
+                return 0;
+        }
+
+        if (!e && !(access & PFERR_WRITE_MASK)) {
+                if (rmap_add(src >> PAGE_SHIFT, ep, addr, ept))
+                        return -1;
+                *ep = (ept_leaf(src, type, 0, false, &st) & ~VMX_EPT_WRITABLE_MASK) | EPT_COW;
+                ept->nr_shared++;
+                return 0;
+        }
+        if (e && !((e & EPT_COW) && (access & PFERR_WRITE_MASK)))
+                return -1;
+
+        page = alloc_page(PAGE_TYPE_GUEST);
+        if (!page)
+                return -1;
+        memcpy(page, __va(src), PAGE_SIZE);
+        if (e) {
+                rmap_remove(src >> PAGE_SHIFT, ep);
+                ept->nr_shared--;
+        }
+        WRITE_ONCE(*ep, ept_leaf(__pa(page), type, 0, false, &st) | EPT_PRIVATE);
+        ept->nr_private++;
+        kvm_mmu_ept_changed();
+        return !!e;
+}
+
+/* a walk by the VMM fell into a hole of a clone EPT */
+static bool clone_ept_walk_fault(uint64_t eptp, uint64_t gpa, uint32_t access)
+{
+        struct kvm_clone_ept *ept;
+        int ret;
+
+        for (ept = clone_epts; ept; ept = ept->next) {
+                if (__pa(ept->pml4) != (eptp & PTE_PFN_MASK))
+                        continue;
+                ret = clone_ept_fill(ept, gpa, access);
+                /* unlike a violation, the walk leaves the old leaf cached */
+                if (ret > 0)
+                        kvm_mmu_flush_tdp();
+                return ret >= 0;
+        }
+        return false;
+}
+
+/* guest memory must stay where it is while it is shared */
+int kvm_clone_ept_init(struct kvm_clone_ept *ept)
+{
+        if (dirty_log.enabled || demand.enabled)
+                return -EBUSY;
+        if (rmap_init())
+                return -ENOMEM;
+        ept->pml4 = get_zeroed_page(PAGE_TYPE_PGTABLE);
+        if (!ept->pml4) {
+                if (!clone_epts && !ksm.enabled)
+                        rmap_destroy();
+                return -ENOMEM;
+        }
+        ept->nr_shared = ept->nr_private = 0;
+        ept->next = clone_epts;
+        clone_epts = ept;
+        return 0;
+}
+
+/*
+ * Returns true if the EPT violation was filled in.  The violation drops
+ * any cached translation of the page, so a leaf may change without flush.
+ */
+bool kvm_clone_ept_fault(struct kvm_clone_ept *ept, uint64_t gpa, uint32_t access)
+{
+        return clone_ept_fill(ept, gpa, access) >= 0;
+}
+
+static void clone_ept_free(uint64_t *table, int level)
+{
+        uint64_t e;
+        size_t i;
+
+        for (i = 0; i < 512; ++i) {
+                e = table[i];
+                if (!e)
+                        continue;
+                if (level > 1 && !(e & VMX_EPT_LARGE_PAGE_BIT))
+                        clone_ept_free(__va(e & PTE_PFN_MASK), level - 1);
+                else if (e & EPT_COW)
+                        rmap_remove((e & PTE_PFN_MASK) >> PAGE_SHIFT, &table[i]);
+                else if (e & EPT_PRIVATE)
+                        free_page(__va(e & PTE_PFN_MASK));
+        }
+        free_page(table);
+}
+
+/* the clone must not be running */
+void kvm_clone_ept_destroy(struct kvm_clone_ept *ept)
+{
+        struct kvm_clone_ept **p;
+
+        clone_ept_free(ept->pml4, 4);
+        for (p = &clone_epts; *p != ept; p = &(*p)->next)
+                ;
+        *p = ept->next;
+        if (!clone_epts && !ksm.enabled)
+                rmap_destroy();
+        kvm_mmu_ept_changed();
+}
+
+/* the first write to a zero page: the guest frame takes its place */
+static void zero_fill(uint64_t *ep, uint64_t gpa)
+{
+        struct ept_map_stats st = { 0 };
+        uint64_t e = READ_ONCE(*ep), addr = gpa & PAGE_MASK;
+        uint8_t type = (e >> VMX_EPT_MT_EPTE_SHIFT) & 7;
+
+        if (!(e & EPT_ZERO) || !ept_claim(ep, e))
+                return;
+        memset(__va(addr), 0, PAGE_SIZE);
+        WRITE_ONCE(*ep, ept_leaf(addr, type, 0, false, &st));
+        kvm_dirty_log_mark(addr);
+        clear_bit(addr >> PAGE_SHIFT, zero.pending);
+        zero.nr_pending--;
+        zero.nr_private++;
+        /* other vcpus may still read the zero page through the old leaf */
+        kvm_mmu_flush_tdp();
+}
+
+/* returns true if the EPT violation was the first write to a zero page */
+static bool zero_fault(uint64_t gpa, uint32_t access)
+{
+        uint64_t *ep;
+        int level;
+
+        if (!zero.enabled || !(access & PFERR_WRITE_MASK))
+                return false;
+        ep = ept_lookup(gpa, &level);
+        if (!ep || !(*ep & EPT_ZERO))
+                return false;
+        ep = ept_leaf_4k(gpa);
+        if (ep)
+                zero_fill(ep, gpa);
+        return true;
+}
+
+/* true if the guest page is still mapped to the zero page */
+bool kvm_mmu_zero_page(uint64_t gpa)
+{
+        pfn_t pfn = gpa >> PAGE_SHIFT;
+
+        if (pfn < balloon.nr_pfns && test_bit(pfn, balloon.unbacked))
+                return true;
+        return zero.enabled && pfn < zero.nr_pfns && test_bit(pfn, zero.pending);
+}
+
+/* the page is no longer the guest's; map it again zeroed */
+static void balloon_fill(uint64_t *ep, uint64_t gpa, bool written)
+{
+        struct ept_map_stats st = { 0 };
+        uint64_t e = READ_ONCE(*ep), addr = gpa & PAGE_MASK;
+        uint8_t type = (e >> VMX_EPT_MT_EPTE_SHIFT) & 7;
+
+        if (!(e & EPT_BALLOON) || !ept_claim(ep, e))
+                return;
+        memset(__va(addr), 0, PAGE_SIZE);
+        WRITE_ONCE(*ep, ept_leaf(addr, type, 0, dirty_log.enabled && !written, &st));
+        if (written)
+                kvm_dirty_log_mark(addr);
+        clear_bit(addr >> PAGE_SHIFT, balloon.unbacked);
+        __atomic_sub_fetch(&balloon.nr_pages, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&balloon.nr_refilled, 1, __ATOMIC_RELAXED);
+        kvm_mmu_ept_changed();
+}
+
+/* returns true if the EPT violation was the first access to a ballooned page */
+static bool balloon_fault(uint64_t gpa, uint32_t access)
+{
+        uint64_t *ep;
+        int level;
+
+        if (!__atomic_load_n(&balloon.nr_pages, __ATOMIC_ACQUIRE))
+                return false;
+        ep = ept_lookup(gpa, &level);
+        if (!ep || !(*ep & EPT_BALLOON))
+                return false;
+        balloon_fill(ep, gpa, access & PFERR_WRITE_MASK);
+        return true;
+}
+
+/* [gpa, gpa + nr_pages pages) of RAM, or 0 if the range is out of it */
+static pfn_t balloon_range(uint64_t gpa, uint64_t nr_pages)
+{
+        pfn_t first = gpa >> PAGE_SHIFT;
+
+        if ((gpa & ~PAGE_MASK) || first < (SZ_1M >> PAGE_SHIFT) ||
+            nr_pages > balloon.nr_pfns || first > balloon.nr_pfns - nr_pages)
+                return 0;
+        return first;
+}
+
+/*
+ * Unmap the page at ep if it is plain RAM, mapped with full permissions;
+ * pages mapped lazily for other reasons are left alone.  Other vcpus may
+ * be changing the leaf too, so it is replaced with cmpxchg.  The page
+ * counts as ballooned before the leaf says so, for balloon_fault().
+ */
+static bool balloon_unmap(uint64_t *ep, pfn_t pfn)
+{
+        uint64_t e;
+
+        set_bit(pfn, balloon.unbacked);
+        __atomic_add_fetch(&balloon.nr_pages, 1, __ATOMIC_SEQ_CST);
+        do {
+                e = READ_ONCE(*ep);
+                if ((e & VMX_EPT_RWX_MASK) != VMX_EPT_RWX_MASK ||
+                    (e & (EPT_DEMAND | EPT_ZERO | EPT_KSM | EPT_BUSY))) {
+                        __atomic_sub_fetch(&balloon.nr_pages, 1, __ATOMIC_RELAXED);
+                        clear_bit(pfn, balloon.unbacked);
+                        return false;
+                }
+        } while (cmpxchg64(ep, e, (e & ~(VMX_EPT_RWX_MASK | EPT_DIRTY_LOG)) | EPT_BALLOON) != e);
+        return true;
+}
+
+/* unmap the pages of the range that are plain RAM, returning how many */
+long kvm_balloon_inflate(struct kvm_vcpu *vcpu, uint64_t gpa, uint64_t nr_pages)
+{
+        pfn_t first, pfn;
+        uint64_t *ep, addr;
+        long count = 0;
+        size_t size;
+        int level;
+
+        if (!balloon.unbacked) {
+                balloon.nr_pfns = ram_pfns();
+                size = BITS_TO_LONGS(balloon.nr_pfns) * sizeof(long);
+                balloon.order = get_order(size);
+                balloon.unbacked = alloc_pages(balloon.order, PAGE_TYPE_BITMAP);
+                if (!balloon.unbacked)
+                        return -ENOMEM;
+                memset(balloon.unbacked, 0, size);
+        }
+        first = balloon_range(gpa, nr_pages);
+        if (!first)
+                return -EINVAL;
+
+        for (pfn = first; pfn < first + nr_pages; ++pfn) {
+                addr = (uint64_t)pfn << PAGE_SHIFT;
+                ep = ept_lookup(addr, &level);
+                if (!ep || test_bit(pfn, balloon.unbacked) || e820_ram(addr, addr + PAGE_SIZE) != 1 ||
+                    (*ep & VMX_EPT_RWX_MASK) != VMX_EPT_RWX_MASK ||
+                    (*ep & (EPT_DEMAND | EPT_ZERO | EPT_KSM)))
+                        continue;
+                ep = ept_leaf_4k(addr);
+                if (!ep)
+                        break;
+                count += balloon_unmap(ep, pfn);
+        }
+
+        if (count)
+                kvm_mmu_flush_tdp();
+        __atomic_add_fetch(&balloon.nr_inflated, count, __ATOMIC_RELAXED);
+        return count;
+}
+
+/*
+ * The guest takes the range back, returning how many of its pages were
+ * in the balloon.  They are mapped again as they are touched.
+ */
+long kvm_balloon_deflate(struct kvm_vcpu *vcpu, uint64_t gpa, uint64_t nr_pages)
+{
+        pfn_t first, pfn;
+        long count = 0;
+
+        if (!balloon.unbacked)
+                return 0;
+        first = balloon_range(gpa, nr_pages);
+        if (!first)
+                return -EINVAL;
+        for (pfn = first; pfn < first + nr_pages; ++pfn)
+                count += test_bit(pfn, balloon.unbacked);
+        balloon.nr_deflated += count;
+        return count;
+}
+
+static uint64_t page_hash(const void *page)
+{
+        const uint64_t *p = page;
+        uint64_t h[4] = { 0 };
+        size_t i, j;
+
+        /* independent lanes, so that the multiplies overlap */
+        for (i = 0; i < PAGE_SIZE / sizeof(*p); i += ARRAY_SIZE(h)) {
+                for (j = 0; j < ARRAY_SIZE(h); ++j)
+                        h[j] = (h[j] ^ p[i + j]) * UINT64_C(0x9e3779b97f4a7c15);
+        }
+        h[0] ^= (h[1] >> 16 | h[1] << 48) ^ (h[2] >> 32 | h[2] << 32) ^ (h[3] >> 48 | h[3] << 16);
+        /* the slot and checksum use the low bits */
+        return h[0] ^ (h[0] >> 32);
+}
+
+static int ksm_init(void)
+{
+        size_t size;
+
+        ksm.nr_pfns = ram_pfns();
+        ksm.next = SZ_1M >> PAGE_SHIFT;
+        size = ksm.nr_pfns * sizeof(*ksm.csum);
+        ksm.csum_order = get_order(size);
+        ksm.csum = alloc_pages(ksm.csum_order, PAGE_TYPE_BITMAP);
+        BUILD_BUG_ON(KSM_SLOTS * sizeof(struct ksm_slot) > (PAGE_SIZE << 4));
+        ksm.stable = alloc_pages(4, PAGE_TYPE_OTHER);
+        ksm.unstable = alloc_pages(4, PAGE_TYPE_OTHER);
+        if (!ksm.csum || !ksm.stable || !ksm.unstable || rmap_init()) {
+                if (ksm.csum)
+                        free_pages(ksm.csum, ksm.csum_order);
+                if (ksm.stable)
+                        free_pages(ksm.stable, 4);
+                if (ksm.unstable)
+                        free_pages(ksm.unstable, 4);
+                return -ENOMEM;
+        }
+        memset(ksm.csum, 0, size);
+        memset(ksm.stable, 0, KSM_SLOTS * sizeof(struct ksm_slot));
+        memset(ksm.unstable, 0, KSM_SLOTS * sizeof(struct ksm_slot));
+        ksm.enabled = true;
+        return 0;
+}
+
+/* a RAM page mapped to its own frame, with no other use for its leaf */
+static bool ksm_candidate(uint64_t gpa)
+{
+        uint64_t *ep, mask;
+        int level;
+
+        ep = ept_lookup(gpa, &level);
+        if (!ep || (*ep & VMX_EPT_RWX_MASK) != VMX_EPT_RWX_MASK ||
+            (*ep & (EPT_DIRTY_LOG | EPT_DEMAND | EPT_ZERO | EPT_KSM)))
+                return false;
+        mask = (UINT64_C(1) << (PAGE_SHIFT + 9 * (level - 1))) - 1;
+        return (*ep & PTE_PFN_MASK & ~mask) == (gpa & ~mask) &&
+               e820_ram(gpa, gpa + PAGE_SIZE) == 1;
+}
+
+/*
+ * Claim the 4K leaf of gpa for merging, if it still maps the page to
+ * itself with full permissions; *old is set to the leaf as it was.
+ */
+static uint64_t *ksm_claim(uint64_t gpa, uint64_t *old)
+{
+        uint64_t *ep = ept_leaf_4k(gpa), e;
+
+        if (!ep)
+                return NULL;
+        e = READ_ONCE(*ep);
+        if ((e & VMX_EPT_RWX_MASK) != VMX_EPT_RWX_MASK ||
+            (e & (EPT_DIRTY_LOG | EPT_DEMAND | EPT_ZERO | EPT_KSM)) ||
+            (e & PTE_PFN_MASK) != gpa || !ept_claim(ep, e))
+                return NULL;
+        *old = e;
+        return ep;
+}
+
+/* map the claimed leaf ep (old before the claim) read-only to the frame */
+static void ksm_share(pfn_t frame, uint64_t *ep, uint64_t old)
+{
+        uint64_t e = (old & ~(PTE_PFN_MASK | VMX_EPT_WRITABLE_MASK)) |
+                     ((uint64_t)frame << PAGE_SHIFT) | EPT_KSM;
+
+        /* nobody else changes a claimed leaf */
+        BUG_ON(cmpxchg64(ep, ept_claimed(old), e) != ept_claimed(old));
+        if ((old & PTE_PFN_MASK) >> PAGE_SHIFT != frame)
+                ksm.nr_shared++;
+}
+
+/*
+ * Merge gpa into the frame, which had the same contents when the caller
+ * compared them: a shared frame, or (if new) a page mapped to itself,
+ * which becomes one.  The leaves are claimed, and the translations of
+ * other vcpus flushed, before comparing again: a write through a
+ * translation cached before the claim could be lost otherwise.
+ */
+static bool ksm_merge(pfn_t frame, uint64_t gpa, bool new)
+{
+        uint64_t fgpa = (uint64_t)frame << PAGE_SHIFT, *ep, *fep = NULL, e, fe = 0;
+
+        ep = ksm_claim(gpa, &e);
+        if (!ep)
+                return false;
+        if (new && !(fep = ksm_claim(fgpa, &fe))) {
+                WRITE_ONCE(*ep, e);
+                return false;
+        }
+        kvm_mmu_flush_tdp();
+
+        if (memcmp(__va(fgpa), __va(gpa), PAGE_SIZE) || rmap_add(frame, ep, gpa, NULL))
+                goto fail;
+        if (new && rmap_add(frame, fep, fgpa, NULL)) {
+                rmap_remove(frame, ep);
+                goto fail;
+        }
+        if (new)
+                ksm_share(frame, fep, fe);
+        ksm_share(frame, ep, e);
+        return true;
+
+fail:
+        /* the leaves were not present meanwhile; nothing to flush */
+        WRITE_ONCE(*ep, e);
+        if (fep)
+                WRITE_ONCE(*fep, fe);
+        return false;
+}
+
+/*
+ * Map gpa to its own frame again; written if the guest is writing to it.
+ * Other vcpus may still read the shared frame through the old leaf, so
+ * the caller must kvm_mmu_flush_tdp() before the guest writes the page.
+ */
+static void ksm_unshare(pfn_t frame, uint64_t *ep, uint64_t gpa, bool written)
+{
+        struct ept_map_stats st = { 0 };
+        uint8_t type = (*ep >> VMX_EPT_MT_EPTE_SHIFT) & 7;
+
+        rmap_remove(frame, ep);
+        WRITE_ONCE(*ep, ept_leaf(gpa, type, 0, dirty_log.enabled && !written, &st));
+        if (written)
+                kvm_dirty_log_mark(gpa);
+        if (gpa >> PAGE_SHIFT != frame) {
+                ksm.nr_shared--;
+                ksm.nr_unshared++;
+        }
+}
+
+/*
+ * Stop sharing the frame, flushing the translations of the leaves that
+ * shared it; clones only run while the guest is stopped.
+ */
+static void ksm_break(pfn_t frame, uint64_t written)
+{
+        struct ksm_slot *slot = &ksm.stable[page_hash(__va((uint64_t)frame << PAGE_SHIFT)) % KSM_SLOTS];
+        struct rmap_entry *r, *next;
+
+        for (r = rmap.heads[frame]; r; r = next) {
+                next = r->next;
+                if (!r->owner)
+                        ksm_unshare(frame, r->ep, r->gpa, r->gpa == written);
+        }
+        if (slot->pfn == frame)
+                slot->pfn = 0;
+        ksm.nr_frames--;
+        kvm_mmu_flush_tdp();
+}
+
+static size_t ksm_nr_sharing(pfn_t frame)
+{
+        struct rmap_entry *r;
+        size_t n = 0;
+
+        for (r = rmap.heads[frame]; r; r = r->next)
+                n += !r->owner;
+        return n;
+}
+
+/* returns true if the EPT violation was a write to a merged page */
+static bool ksm_fault(uint64_t gpa, uint32_t access)
+{
+        uint64_t *ep;
+        pfn_t frame;
+        int level;
+
+        if (!ksm.enabled || !(access & PFERR_WRITE_MASK))
+                return false;
+        ep = ept_lookup(gpa, &level);
+        if (!ep || !(*ep & EPT_KSM))
+                return false;
+        spin_lock(&ksm.lock);
+        /* unshared by another vcpu meanwhile */
+        if (!(READ_ONCE(*ep) & EPT_KSM)) {
+                spin_unlock(&ksm.lock);
+                return true;
+        }
+        frame = (*ep & PTE_PFN_MASK) >> PAGE_SHIFT;
+        gpa &= PAGE_MASK;
+        if (gpa >> PAGE_SHIFT == frame) {
+                /* the frame is about to change under the pages sharing it */
+                ksm_break(frame, gpa);
+        } else {
+                ksm_unshare(frame, ep, gpa, true);
+                /* the owner alone is left */
+                if (ksm_nr_sharing(frame) == 1)
+                        ksm_break(frame, 0);
+                else
+                        kvm_mmu_flush_tdp();
+        }
+        spin_unlock(&ksm.lock);
+        return true;
+}
+
+static void ksm_unmerge_all(void)
+{
+        size_t i;
+
+        if (!ksm.enabled)
+                return;
+        for (i = 0; i < KSM_SLOTS; ++i) {
+                if (ksm.stable[i].pfn)
+                        ksm_break(ksm.stable[i].pfn, 0);
+        }
+}
+
+/* returns true if the page was merged */
+static bool ksm_scan(pfn_t pfn)
+{
+        uint64_t gpa = (uint64_t)pfn << PAGE_SHIFT, hash;
+        struct ksm_slot *stable, *unstable;
+        void *page = __va(gpa);
+
+        if (!ksm_candidate(gpa))
+                return false;
+        hash = page_hash(page);
+        if (ksm.csum[pfn] != (uint32_t)hash) {
+                ksm.csum[pfn] = hash;
+                return false;
+        }
+
+        stable = &ksm.stable[hash % KSM_SLOTS];
+        if (stable->pfn) {
+                if (stable->hash != hash ||
+                    memcmp(__va((uint64_t)stable->pfn << PAGE_SHIFT), page, PAGE_SIZE))
+                        return false;
+                return ksm_merge(stable->pfn, gpa, false);
+        }
+
+        unstable = &ksm.unstable[hash % KSM_SLOTS];
+        if (!unstable->pfn || unstable->pfn == pfn || unstable->hash != hash ||
+            !ksm_candidate((uint64_t)unstable->pfn << PAGE_SHIFT) ||
+            memcmp(__va((uint64_t)unstable->pfn << PAGE_SHIFT), page, PAGE_SIZE)) {
+                unstable->hash = hash;
+                unstable->pfn = pfn;
+                return false;
+        }
+
+        /* the page seen first becomes the shared frame */
+        if (!ksm_merge(unstable->pfn, gpa, true))
+                return false;
+        stable->hash = hash;
+        stable->pfn = unstable->pfn;
+        unstable->pfn = 0;
+        ksm.nr_frames++;
+        return true;
+}
+
+/*
+ * Scan the pages due since the last tick.  Clones and demand paging
+ * need guest memory to stay where it is, so scanning waits for them.
+ */
+uint64_t kvm_ksm_tick(struct kvm_vcpu *vcpu, uint64_t now)
+{
+        uint64_t start, i, batch;
+
+        if (!ksm.rate)
+                return 0;
+        if (now < ksm.next_tick)
+                return ksm.next_tick;
+        ksm.next_tick = now + KSM_PERIOD_MS * tsc_khz;
+        if (clone_epts || demand.enabled)
+                return ksm.next_tick;
+        if (!ksm.enabled && ksm_init()) {
+                pr_info("ksm: out of memory\n");
+                ksm.rate = 0;
+                return 0;
+        }
+
+        start = rdtsc();
+        batch = max(ksm.rate * KSM_PERIOD_MS / 1000, UINT64_C(1));
+        spin_lock(&ksm.lock);
+        for (i = 0; i < batch; ++i) {
+                ksm_scan(ksm.next);
+                if (++ksm.next == ksm.nr_pfns)
+                        ksm.next = SZ_1M >> PAGE_SHIFT;
+        }
+        spin_unlock(&ksm.lock);
+        ksm.nr_scanned += batch;
+        ksm.cycles += rdtsc() - start;
+        return ksm.next_tick;
+}
+
+/* NULL if out of memory, or if the pool is at its cap */
+static void *zswap_alloc(unsigned int chunks)
+{
+        size_t size = chunks * ZSWAP_CHUNK, offset;
+        struct zswap_page *zp;
+        void *obj;
+
+        spin_lock(&zswap.lock);
+        if (list_empty(&zswap.partial[chunks])) {
+                if (zswap.nr_pool_pages >= zswap.max_pool_pages ||
+                    page_alloc_nr_free() < ZSWAP_RESERVE ||
+                    !(zp = alloc_page(PAGE_TYPE_GUEST))) {
+                        zswap.nr_capped++;
+                        spin_unlock(&zswap.lock);
+                        return NULL;
+                }
+                zswap.nr_pool_pages++;
+                zp->chunks = chunks;
+                zp->nr_used = 0;
+                zp->free = NULL;
+                for (offset = ZSWAP_CHUNK + (PAGE_SIZE / ZSWAP_CHUNK - 1) / chunks * size;
+                     offset > ZSWAP_CHUNK; ) {
+                        offset -= size;
+                        *(void **)((uint8_t *)zp + offset) = zp->free;
+                        zp->free = (uint8_t *)zp + offset;
+                }
+                list_add(&zp->list, &zswap.partial[chunks]);
+        }
+        zp = list_first_entry(&zswap.partial[chunks], struct zswap_page, list);
+        obj = zp->free;
+        zp->free = *(void **)obj;
+        zp->nr_used++;
+        if (!zp->free)
+                list_del(&zp->list);
+        spin_unlock(&zswap.lock);
+        return obj;
+}
+
+static void zswap_free(void *obj)
+{
+        struct zswap_page *zp = (void *)((uintptr_t)obj & PAGE_MASK);
+
+        spin_lock(&zswap.lock);
+        if (!zp->free)
+                list_add(&zp->list, &zswap.partial[zp->chunks]);
+        *(void **)obj = zp->free;
+        zp->free = obj;
+        if (--zp->nr_used) {
+                spin_unlock(&zswap.lock);
+                return;
+        }
+        list_del(&zp->list);
+        zswap.nr_pool_pages--;
+        spin_unlock(&zswap.lock);
+        free_page(zp);
+}
+
+static unsigned int zswap_chunks(size_t len)
+{
+        return DIV_ROUND_UP(sizeof(uint16_t) + len, ZSWAP_CHUNK);
+}
+
+/*
+ * Compress the page of a claimed leaf (old before the claim) and unmap
+ * it; returns false if it isn't worth it.
+ */
+static bool zswap_store(uint64_t *ep, uint64_t old)
+{
+        uint64_t gpa = old & PTE_PFN_MASK;
+        unsigned int chunks;
+        size_t len;
+        uint8_t *obj;
+
+        len = lz_compress(__va(gpa), PAGE_SIZE, zswap.buf,
+                          ZSWAP_MAX_CHUNKS * ZSWAP_CHUNK - sizeof(uint16_t), zswap.table);
+        if (!len) {
+                zswap.nr_rejected++;
+                return false;
+        }
+        chunks = zswap_chunks(len);
+        obj = zswap_alloc(chunks);
+        if (!obj)
+                return false;
+
+        *(uint16_t *)obj = len;
+        memcpy(obj + sizeof(uint16_t), zswap.buf, len);
+        /* nobody else changes a claimed leaf */
+        BUG_ON(cmpxchg64(ep, ept_claimed(old), (old & VMX_EPT_MT_MASK) | __pa(obj) | EPT_ZSWAP) !=
+               ept_claimed(old));
+        zswap.nr_pages++;
+        zswap.nr_bytes += len;
+        zswap.nr_stored++;
+        zswap.nr_stored_bytes += len;
+        zswap.size_hist[chunks]++;
+        return true;
+}
+
+/*
+ * Compress the pages claimed so far.  The flush first makes sure that no
+ * vcpu writes them through translations cached before the claim.
+ */
+static void zswap_store_claimed(void)
+{
+        size_t i;
+
+        if (!zswap.nr_claimed)
+                return;
+        kvm_mmu_flush_tdp();
+        for (i = 0; i < zswap.nr_claimed; ++i) {
+                if (zswap_store(zswap.claimed[i].ep, zswap.claimed[i].old))
+                        continue;
+                /* a page that doesn't compress waits for another round */
+                WRITE_ONCE(*zswap.claimed[i].ep, zswap.claimed[i].old);
+                idle.ages[(zswap.claimed[i].old & PTE_PFN_MASK) >> PAGE_SHIFT] = 0;
+        }
+        zswap.nr_claimed = 0;
+}
+
+/*
+ * Claim the 4K leaf of a cold page to be compressed, if it still maps the
+ * page to itself, unaccessed, with full permissions.
+ */
+static bool zswap_claim(uint64_t gpa)
+{
+        uint64_t *ep = ept_leaf_4k(gpa), e;
+
+        if (!ep)
+                return false;
+        e = READ_ONCE(*ep);
+        if ((e & VMX_EPT_RWX_MASK) != VMX_EPT_RWX_MASK ||
+            (e & (EPT_DIRTY_LOG | EPT_DEMAND | EPT_ZERO | EPT_KSM | VMX_EPT_ACCESS_BIT)) ||
+            (e & PTE_PFN_MASK) != gpa || !ept_claim(ep, e))
+                return false;
+        zswap.claimed[zswap.nr_claimed].ep = ep;
+        zswap.claimed[zswap.nr_claimed].old = e;
+        if (++zswap.nr_claimed == ZSWAP_CLAIM)
+                zswap_store_claimed();
+        return true;
+}
+
+/* decompress the page of a compressed leaf and map it again */
+static void zswap_load(uint64_t *ep, uint64_t gpa, bool written)
+{
+        struct ept_map_stats st = { 0 };
+        uint64_t e = READ_ONCE(*ep), addr = gpa & PAGE_MASK, start = rdtsc();
+        uint8_t type = (e >> VMX_EPT_MT_EPTE_SHIFT) & 7, *obj;
+        size_t len;
+
+        if (!(e & EPT_ZSWAP) || !ept_claim(ep, e))
+                return;
+        obj = __va(e & ZSWAP_HANDLE_MASK);
+        len = *(uint16_t *)obj;
+        if (lz_decompress(obj + sizeof(uint16_t), len, __va(addr), PAGE_SIZE) != PAGE_SIZE)
+                panic("zswap: corrupt page at 0x%016" PRIx64 "\n", addr);
+        zswap_free(obj);
+
+        WRITE_ONCE(*ep, ept_leaf(addr, type, 0, dirty_log.enabled && !written, &st));
+        if (written)
+                kvm_dirty_log_mark(addr);
+        idle.ages[addr >> PAGE_SHIFT] = 0;
+        zswap.nr_pages--;
+        zswap.nr_bytes -= len;
+        zswap.nr_loaded++;
+        zswap.fault_hist[kvm_stat_bucket(rdtsc() - start)]++;
+        kvm_mmu_ept_changed();
+}
+
+/* returns true if the EPT violation was the first access to a compressed page */
+static bool zswap_fault(uint64_t gpa, uint32_t access)
+{
+        uint64_t *ep;
+        int level;
+
+        if (!zswap.nr_pages)
+                return false;
+        ep = ept_lookup(gpa, &level);
+        if (!ep || !(*ep & EPT_ZSWAP))
+                return false;
+        zswap_load(ep, gpa, access & PFERR_WRITE_MASK);
+        return true;
+}
+
+static void zswap_load_all(void)
+{
+        uint64_t gpa, *ep;
+        int level;
+
+        for (gpa = 0; zswap.nr_pages && gpa < (uint64_t)idle.nr_pfns << PAGE_SHIFT; gpa += PAGE_SIZE) {
+                ep = ept_lookup(gpa, &level);
+                if (ep && (*ep & EPT_ZSWAP))
+                        zswap_load(ep, gpa, false);
+        }
+}
+
+static int idle_init(void)
+{
+        size_t i;
+
+        if (!kvm_x86_ops->has_ept_ad()) {
+                pr_info("idle: no EPT A/D bits\n");
+                return -ENODEV;
+        }
+        idle.nr_pfns = ram_pfns();
+        idle.ages_order = get_order(idle.nr_pfns);
+        idle.ages = alloc_pages(idle.ages_order, PAGE_TYPE_BITMAP);
+        if (!idle.ages) {
+                pr_info("idle: out of memory\n");
+                return -ENOMEM;
+        }
+        memset(idle.ages, 0, idle.nr_pfns);
+        for (i = 0; i <= ZSWAP_MAX_CHUNKS; ++i)
+                INIT_LIST_HEAD(&zswap.partial[i]);
+        if (!zswap.max_pool_pages)
+                zswap.max_pool_pages = page_alloc_nr_free() / 4;
+        idle.enabled = true;
+        return 0;
+}
+
+static unsigned int idle_bucket(uint8_t age)
+{
+        return age ? min(__fls(age) + 1, (unsigned long)IDLE_NR_BUCKETS - 1) : 0;
+}
+
+/*
+ * Age the pages of a RAM leaf: clear its accessed bit if set, or compress
+ * the pages that have been idle for long enough, if the leaf maps them to
+ * themselves.  Returns the number of pages claimed to be compressed.
+ */
+static size_t idle_scan_leaf(uint64_t *ep, uint64_t gpa, int level, size_t budget, bool *changed)
+{
+        size_t i, n = UINT64_C(1) << (9 * (level - 1)), stored = 0;
+        uint64_t mask = (PAGE_SIZE << (9 * (level - 1))) - 1;
+        pfn_t pfn = gpa >> PAGE_SHIFT;
+        bool compress;
+
+        if (!(*ep & VMX_EPT_RWX_MASK) || e820_ram(gpa, gpa + n * PAGE_SIZE) != 1)
+                return 0;
+
+        if (*ep & VMX_EPT_ACCESS_BIT) {
+                /* the CPU sets A/D bits, and other vcpus change leaves, meanwhile */
+                __atomic_fetch_and(ep, ~VMX_EPT_ACCESS_BIT, __ATOMIC_RELAXED);
+                memset(&idle.ages[pfn], 0, n);
+                idle.hist[0] += n;
+                *changed = true;
+                return 0;
+        }
+
+        compress = zswap.age && (*ep & VMX_EPT_RWX_MASK) == VMX_EPT_RWX_MASK &&
+                   !(*ep & (EPT_DIRTY_LOG | EPT_DEMAND | EPT_ZERO | EPT_KSM)) &&
+                   (*ep & PTE_PFN_MASK & ~mask) == gpa;
+        for (i = 0; i < n; ++i) {
+                if (idle.ages[pfn + i] < UINT8_MAX)
+                        idle.ages[pfn + i]++;
+                idle.hist[idle_bucket(idle.ages[pfn + i])]++;
+                if (compress && stored < budget && idle.ages[pfn + i] >= zswap.age &&
+                    zswap_claim((pfn + i) << PAGE_SHIFT))
+                        stored++;
+        }
+        return stored;
+}
+
+/*
+ * Age guest RAM once a period.  Like merging, this waits while clones
+ * or demand paging need guest memory to stay where it is.
+ */
+uint64_t kvm_idle_tick(struct kvm_vcpu *vcpu, uint64_t now)
+{
+        uint64_t gpa, end, *ep, size, start;
+        size_t stored = 0;
+        bool changed = false;
+        int level;
+
+        if ((!idle.wss && !zswap.age) || !idle.period_ms)
+                return 0;
+        if (now < idle.next_tick)
+                return idle.next_tick;
+        idle.next_tick = now + (uint64_t)idle.period_ms * tsc_khz;
+        if (clone_epts || demand.enabled)
+                return idle.next_tick;
+        if (!idle.enabled && idle_init()) {
+                idle.wss = false;
+                zswap.age = 0;
+                return 0;
+        }
+
+        start = rdtsc();
+        memset(idle.hist, 0, sizeof(idle.hist));
+        end = (uint64_t)idle.nr_pfns << PAGE_SHIFT;
+        for (gpa = SZ_1M; gpa < end; gpa += size) {
+                ep = ept_lookup(gpa, &level);
+                size = ep ? PAGE_SIZE << (9 * (level - 1)) : PAGE_SIZE;
+                /* a large leaf that starts below 1M, or goes past RAM */
+                if (!ep || !IS_ALIGNED(gpa, size) || gpa + size > end) {
+                        size = PAGE_SIZE;
+                        continue;
+                }
+                stored += idle_scan_leaf(ep, gpa, level, ZSWAP_BATCH - stored, &changed);
+        }
+
+        zswap_store_claimed();
+        /* translations cached with the accessed bit set wouldn't set it again */
+        if (changed)
+                kvm_mmu_flush_tdp();
+        idle.nr_passes++;
+        idle.cycles += rdtsc() - start;
+        return idle.next_tick;
+}
+
+/* leaves with these bits need 4K granularity; the A/D bits may differ */
+#define EPT_COLLAPSE_DENY       (EPT_DIRTY_LOG | EPT_DEMAND | EPT_ZERO | EPT_KSM | EPT_BALLOON | EPT_ZSWAP)
+#define EPT_COLLAPSE_IGNORE     (VMX_EPT_ACCESS_BIT | VMX_EPT_DIRTY_BIT)
+
+/*
+ * The large leaf of the entry at level that maps the same as its table,
+ * or 0 if the leaves of the table differ in more than their addresses.
+ */
+static uint64_t ept_collapsible(const uint64_t *table, int level)
+{
+        int shift = PAGE_SHIFT + 9 * (level - 2);
+        uint64_t attr, addr, ad = 0, e;
+        size_t i;
+
+        e = table[0];
+        if (!(e & VMX_EPT_RWX_MASK) || (e & EPT_COLLAPSE_DENY))
+                return 0;
+        /* a 1G leaf only replaces 2M ones, not tables */
+        if (level == 3 && !(e & VMX_EPT_LARGE_PAGE_BIT))
+                return 0;
+        attr = e & ~PTE_PFN_MASK & ~EPT_COLLAPSE_IGNORE;
+        addr = e & PTE_PFN_MASK;
+        if (!IS_ALIGNED(addr, UINT64_C(1) << (shift + 9)))
+                return 0;
+        for (i = 0; i < 512; ++i) {
+                e = table[i];
+                if ((e & ~PTE_PFN_MASK & ~EPT_COLLAPSE_IGNORE) != attr ||
+                    (e & PTE_PFN_MASK) != addr + (i << shift))
+                        return 0;
+                ad |= e & EPT_COLLAPSE_IGNORE;
+        }
+        return addr | attr | ad | VMX_EPT_LARGE_PAGE_BIT;
+}
+
+/*
+ * Replace the entry at ep, the table next of level, with leaf, which maps
+ * the same as the table in huge.snap.  Claiming the leaves of the table
+ * first keeps other vcpus from changing them (and the CPU from setting
+ * A/D bits) after the snapshot: a change would be lost with the table.
+ */
+static bool ept_collapse_one(uint64_t *ep, uint64_t *next, uint64_t leaf)
+{
+        uint64_t e = __pa(next) | EPT_TABLE_PERM;
+        size_t i, n;
+
+        for (n = 0; n < 512; ++n) {
+                if (!ept_claim(&next[n], huge.snap[n]))
+                        break;
+        }
+        if (n == 512 && cmpxchg64(ep, e, leaf) == e)
+                return true;
+        /* lost a race: give the leaves back */
+        for (i = 0; i < n; ++i)
+                WRITE_ONCE(next[i], huge.snap[i]);
+        return false;
+}
+
+/*
+ * Collapse the tables under table (of level), bottom-up.  Other vcpus
+ * may still walk a collapsed table, in the guest until they flush and in
+ * the VMM until they next enter the guest, so it goes on huge.stale
+ * rather than back to the allocator.
+ */
+static size_t ept_collapse(uint64_t *table, int level, bool use_1g)
+{
+        uint64_t *next, leaf, e;
+        size_t i, j, n = 0;
+
+        for (i = 0; i < 512 && huge.nr_stale < ARRAY_SIZE(huge.stale); ++i) {
+                e = READ_ONCE(table[i]);
+                if (!(e & VMX_EPT_RWX_MASK) || (e & VMX_EPT_LARGE_PAGE_BIT))
+                        continue;
+                next = __va(e & PTE_PFN_MASK);
+                if (level > 2)
+                        n += ept_collapse(next, level - 1, use_1g);
+                if (level > 3 || (level == 3 && !use_1g))
+                        continue;
+                for (j = 0; j < 512; ++j)
+                        huge.snap[j] = READ_ONCE(next[j]);
+                leaf = ept_collapsible(huge.snap, level);
+                if (!leaf || huge.nr_stale == ARRAY_SIZE(huge.stale) ||
+                    !ept_collapse_one(&table[i], next, leaf))
+                        continue;
+                huge.stale[huge.nr_stale++] = next;
+                huge.nr_collapsed[level - 2]++;
+                ++n;
+        }
+        return n;
+}
+
+/* free the collapsed tables once no vcpu can be walking them */
+static bool ept_free_stale(void)
+{
+        if (huge.nr_stale && !kvm_vcpus_flushed(huge.stale_gen))
+                return false;
+        while (huge.nr_stale) {
+                free_page(huge.stale[--huge.nr_stale]);
+                ept_table_pages--;
+        }
+        return true;
+}
+
+/*
+ * Collapse split leaves once a period.  Dirty logging, clones, and demand
+ * paging keep their 4K leaves until they are done.
+ */
+uint64_t kvm_huge_tick(struct kvm_vcpu *vcpu, uint64_t now)
+{
+        uint64_t start;
+
+        if (!huge.period_ms)
+                return 0;
+        if (now < huge.next_tick)
+                return huge.next_tick;
+        huge.next_tick = now + (uint64_t)huge.period_ms * tsc_khz;
+        /* the tables collapsed by the last pass come first */
+        if (!ept_free_stale())
+                return huge.next_tick;
+        if (!huge.nr_split || dirty_log.enabled || clone_epts || demand.enabled)
+                return huge.next_tick;
+
+        start = rdtsc();
+        /* the old translations are still cached with the old page size */
+        if (ept_collapse(ept_pml4, 4, kvm_x86_ops->get_lpage_level() >= 3)) {
+                kvm_mmu_flush_tdp();
+                huge.stale_gen = __atomic_load_n(&kvm_ept_flush_gen, __ATOMIC_ACQUIRE);
+        }
+        huge.nr_passes++;
+        huge.cycles += rdtsc() - start;
+        return huge.next_tick;
+}
+
+/* count the present leaves under table (of level) by size */
+static void ept_count_leaves(const uint64_t *table, int level, size_t nr_leaves[3])
+{
+        size_t i;
+
+        for (i = 0; i < 512; ++i) {
+                if (!(table[i] & VMX_EPT_RWX_MASK))
+                        continue;
+                if (level == 1 || (table[i] & VMX_EPT_LARGE_PAGE_BIT))
+                        nr_leaves[level - 1]++;
+                else
+                        ept_count_leaves(__va(table[i] & PTE_PFN_MASK), level - 1, nr_leaves);
+        }
+}
+
+/*
+ * The EPT violation path of the guest: returns true if the violation was
+ * for a page that is mapped lazily.  A leaf that another vcpu is filling
+ * in only needs a retry.  Demand paging goes first, as the page may also
+ * be logged for dirty logging.
+ */
+bool kvm_mmu_ept_fault(uint64_t gpa, uint32_t access)
+{
+        return busy_fault(gpa) || demand_fault(gpa) || balloon_fault(gpa, access) ||
+               zswap_fault(gpa, access) || zero_fault(gpa, access) || ksm_fault(gpa, access) ||
+               dirty_log_fault(gpa);
+}
+
+/* a walk by the VMM faulted where a guest access would fill in EPT */
+static bool ept_walk_fault(uint64_t eptp, uint64_t gpa, uint32_t access)
+{
+        if ((eptp & PTE_PFN_MASK) != __pa(ept_pml4))
+                return clone_ept_walk_fault(eptp, gpa, access);
+        if (busy_fault(gpa) || balloon_fault(gpa, access) || zswap_fault(gpa, access))
+                return true;
+        if (!zero_fault(gpa, access) && !ksm_fault(gpa, access))
+                return false;
+        /* unlike a violation, the walk leaves the old leaf cached */
+        kvm_mmu_flush_tdp();
+        return true;
+}
+
+/* of the pages stored so far, in hundredths */
+static uint64_t zswap_ratio(void)
+{
+        if (!zswap.nr_stored_bytes)
+                return 0;
+        return zswap.nr_stored * PAGE_SIZE * 100 / zswap.nr_stored_bytes;
+}
+
+void kvm_mmu_dump(void)
+{
+        size_t nr_leaves[3] = { 0 };
+
+        ept_count_leaves(ept_pml4, 4, nr_leaves);
+        pr_info("pages: %zu 1G + %zu 2M + %zu 4K mapped, %" PRIu64 " split, %" PRIu64 " + %" PRIu64
+                " collapsed in %" PRIu64 " passes\n", nr_leaves[2], nr_leaves[1], nr_leaves[0],
+                huge.nr_split, huge.nr_collapsed[0], huge.nr_collapsed[1], huge.nr_passes);
+        if (zero.enabled)
+                pr_info("zero pages: %" PRIu64 " shared, %" PRIu64 " private\n",
+                        zero.nr_pending, zero.nr_private);
+        if (balloon.nr_inflated)
+                pr_info("balloon: %" PRIu64 " pages, %" PRIu64 " inflated, %" PRIu64
+                        " deflated, %" PRIu64 " refilled\n", balloon.nr_pages,
+                        balloon.nr_inflated, balloon.nr_deflated, balloon.nr_refilled);
+        if (idle.enabled) {
+                size_t i;
+
+                pr_info("idle: %" PRIu64 " passes of %u ms, %" PRIu64 " cycles/pass, wss %" PRIu64 " KiB\n",
+                        idle.nr_passes, idle.period_ms, idle.cycles / max(idle.nr_passes, UINT64_C(1)),
+                        idle.hist[0] * 4);
+                pr_info("  pages  ");
+                for (i = 0; i < IDLE_NR_BUCKETS; ++i)
+                        pr_cont(" %u:%" PRIu64, i ? 1U << (i - 1) : 0, idle.hist[i]);
+                pr_cont("\n");
+        }
+        if (zswap.age && idle.enabled) {
+                size_t i;
+
+                pr_info("zswap: %" PRIu64 " pages in %" PRIu64 " of %" PRIu64 " KiB, ratio %" PRIu64
+                        ".%02" PRIu64 ", %" PRIu64 " stored, %" PRIu64 " loaded, %" PRIu64
+                        " rejected, %" PRIu64 " capped\n",
+                        zswap.nr_pages, zswap.nr_pool_pages * 4, zswap.max_pool_pages * 4,
+                        zswap_ratio() / 100, zswap_ratio() % 100,
+                        zswap.nr_stored, zswap.nr_loaded, zswap.nr_rejected, zswap.nr_capped);
+                /* the guest frames are identity-mapped and stay reserved */
+                pr_info("  pool adds %" PRIu64 " KiB of VMM memory; it saves none\n",
+                        zswap.nr_pool_pages * 4);
+                pr_info("  size    ");
+                for (i = 1; i <= ZSWAP_MAX_CHUNKS; ++i) {
+                        if (zswap.size_hist[i])
+                                pr_cont(" %zu/%lu:%u", i, PAGE_SIZE / ZSWAP_CHUNK, zswap.size_hist[i]);
+                }
+                pr_cont("\n");
+                pr_info("  fault-in");
+                for (i = 0; i < KVM_STAT_NR_BUCKETS; ++i) {
+                        if (zswap.fault_hist[i])
+                                pr_cont(" 2^%zu:%u", i, zswap.fault_hist[i]);
+                }
+                pr_cont("\n");
+        }
+        if (ksm.enabled)
+                pr_info("ksm: %" PRIu64 " scanned, %" PRIu64 " cycles/page, %" PRIu64
+                        " shared in %" PRIu64 " frames, %" PRIu64 " unshared\n",
+                        ksm.nr_scanned, ksm.cycles / max(ksm.nr_scanned, UINT64_C(1)),
+                        ksm.nr_shared, ksm.nr_frames, ksm.nr_unshared);
+}
+
+static int set_ksm_rate(const char *val)
+{
+        char *end;
+
+        ksm.rate = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("ksm_rate=", set_ksm_rate);
+
+static int set_zswap_age(const char *val)
+{
+        char *end;
+
+        zswap.age = min(simple_strtoull(val, &end, 0), (unsigned long long)UINT8_MAX);
+        return *end ? -1 : 0;
+}
+__setup("zswap_age=", set_zswap_age);
+
+/* in MiB */
+static int set_zswap_max(const char *val)
+{
+        char *end;
+
+        zswap.max_pool_pages = simple_strtoull(val, &end, 0) * (SZ_1M >> PAGE_SHIFT);
+        return *end ? -1 : 0;
+}
+__setup("zswap_max=", set_zswap_max);
+
+static int set_wss(const char *val)
+{
+        char *end;
+
+        idle.wss = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("wss=", set_wss);
+
+static int set_idle_period(const char *val)
+{
+        char *end;
+
+        idle.period_ms = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("idle_period=", set_idle_period);
+
+static int set_zero_pages(const char *val)
+{
+        char *end;
+
+        zero_pages = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("zero_pages=", set_zero_pages);
+
+static int set_collapse_period(const char *val)
+{
+        char *end;
+
+        huge.period_ms = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("collapse_period=", set_collapse_period);
+
+static int set_pml(const char *val)
+{
+        char *end;
+
+        pml_enabled = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("pml=", set_pml);
+
+uint64_t kvm_mmu_ept_root(void)
+{
+        return __pa(ept_pml4);
+}
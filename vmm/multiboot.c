@@ -1,7 +1,242 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/cpufeature.h>
+#include <asm/init.h>
+#include <asm/kvm_snapshot.h>
+#include <asm/mmu.h>
+#include <asm/numa.h>
+#include <asm/processor.h>
 #include <asm/setup.h>
+#include <io/sizes.h>
 #include <sys/multiboot.h>
+#include <sys/page_alloc.h>
 #include <sys/string.h>
 
+/* memory for the page allocator, in MiB */
+static uint64_t vmm_mem = 32;
+/* and on each other NUMA node */
+static uint64_t vmm_node_mem = 16;
+
+extern pteval_t kpml4[];
+
+uint64_t direct_map_end = SZ_4G;
+
+static bool overlaps(uint64_t start, uint64_t end, uint64_t s, uint64_t e)
+{
+        return start < e && s < end;
+}
+
+/*
+ * Take the 2M-aligned stretch of RAM right below the VMM, which leaves
+ * the guest a single hole at the top of its RAM.  Otherwise take the
+ * highest one below 4G (the VMM's direct map ends there) that doesn't
+ * overlap the VMM or a boot module.
+ */
+static void reserve_vmm_memory(struct multiboot_mod_list *mods, uint32_t mods_count)
+{
+        uint64_t size = vmm_mem * SZ_1M, best = 0, start, end;
+        uint32_t i, j;
+
+        start = __pa(_start) - size;
+        for (j = 0; j < mods_count; ++j) {
+                if (overlaps(start, __pa(_start), mods[j].mod_start, mods[j].mod_end))
+                        break;
+        }
+        if (__pa(_start) >= size && j == mods_count &&
+            e820_mapped_all(start, __pa(_start), E820_TYPE_RAM))
+                best = start;
+
+        for (i = 0; !best && i < e820_table.nr_entries; ++i) {
+                struct e820_entry *e = &e820_table.entries[i];
+
+                if (e->type != E820_TYPE_RAM || e->addr >= SZ_4G)
+                        continue;
+                end = rounddown(min(e->addr + e->size, SZ_4G), SZ_2M);
+                if (end < e->addr + size)
+                        continue;
+                start = end - size;
+                if (overlaps(start, end, __pa(_start), __pa(_end)))
+                        continue;
+                for (j = 0; j < mods_count; ++j) {
+                        if (overlaps(start, end, mods[j].mod_start, mods[j].mod_end))
+                                break;
+                }
+                if (j == mods_count && start > best)
+                        best = start;
+        }
+
+        if (!best)
+                panic("cannot reserve %" PRIu64 " MiB for the VMM\n", vmm_mem);
+        e820_range_update(best, size, E820_TYPE_RAM, E820_TYPE_RESERVED);
+        page_alloc_init(best, best + size);
+}
+
+static bool overlaps_mods(uint64_t start, uint64_t end, struct multiboot_mod_list *mods, uint32_t mods_count)
+{
+        uint32_t i;
+
+        for (i = 0; i < mods_count; ++i) {
+                if (overlaps(start, end, mods[i].mod_start, mods[i].mod_end))
+                        return true;
+        }
+        return false;
+}
+
+/*
+ * Give every node other than the one with the VMM a pool of its own,
+ * from the top of its RAM, so that vCPUs running there allocate their
+ * VMCS, EPT tables and guest pages locally.  The guest keeps seeing
+ * the firmware SRAT: guest-physical is host-physical, so it describes
+ * the guest's memory as well, with the pools as reserved holes.
+ */
+static void reserve_node_memory(struct multiboot_mod_list *mods, uint32_t mods_count)
+{
+        uint64_t size = vmm_node_mem * SZ_1M, best, start, end;
+        int nid, pool_nid = phys_to_node(page_pools[0].start);
+        uint32_t i;
+        size_t j;
+
+        for_each_node(nid) {
+                if (nid == pool_nid || !size)
+                        continue;
+                best = 0;
+                for (j = 0; j < numa_meminfo.nr_blks; ++j) {
+                        const struct numa_memblk *blk = &numa_meminfo.blk[j];
+
+                        if (blk->nid != nid)
+                                continue;
+                        for (i = 0; i < e820_table.nr_entries; ++i) {
+                                struct e820_entry *e = &e820_table.entries[i];
+
+                                if (e->type != E820_TYPE_RAM)
+                                        continue;
+                                end = rounddown(min(e->addr + e->size, blk->end), SZ_2M);
+                                if (end < max(e->addr, blk->start) + size)
+                                        continue;
+                                start = end - size;
+                                if (start > best && !overlaps_mods(start, end, mods, mods_count))
+                                        best = start;
+                        }
+                }
+                if (!best) {
+                        pr_warn("no %" PRIu64 " MiB for the VMM on node %d\n", vmm_node_mem, nid);
+                        continue;
+                }
+                e820_range_update(best, size, E820_TYPE_RAM, E820_TYPE_RESERVED);
+                page_alloc_add_pool(best, best + size);
+        }
+}
+
+static bool e820_overlaps(uint64_t start, uint64_t end)
+{
+        uint32_t i;
+
+        for (i = 0; i < e820_table.nr_entries; ++i) {
+                struct e820_entry *e = &e820_table.entries[i];
+
+                if (overlaps(start, end, e->addr, e->addr + e->size))
+                        return true;
+        }
+        return false;
+}
+
+/* RAM, counting the VMM and its pool that multiboot_init() took from it */
+static bool direct_map_ram(uint64_t start, uint64_t end)
+{
+        const uint64_t holes[][2] = {
+                { __pa(_start), __pa(_end) },
+                { page_pools[0].start, page_pools[0].end },
+        };
+        size_t i;
+
+        if (start >= end)
+                return true;
+        for (i = 0; i < ARRAY_SIZE(holes); ++i) {
+                if (overlaps(start, end, holes[i][0], holes[i][1]))
+                        return direct_map_ram(start, max(start, holes[i][0])) &&
+                               direct_map_ram(min(end, holes[i][1]), end);
+        }
+        return e820_mapped_all(start, end, E820_TYPE_RAM);
+}
+
+/*
+ * Replace the boot page table, which covers the first 4G, with a direct
+ * map of all of physical memory: everything below 4G (RAM and MMIO holes
+ * alike, as before) and every 1G above it that e820 knows about.  A 1G
+ * of RAM takes a 1G page if the CPU has them; the rest uses 2M pages,
+ * so that no large page spans RAM and MMIO.
+ */
+static void direct_map_init(void)
+{
+        bool use_1g = this_cpu_has(X86_FEATURE_GBPAGES);
+        pteval_t *pdpt = NULL, *pd;
+        uint64_t addr, end = SZ_4G;
+        size_t nr_1g = 0, nr_2m = 0;
+        uint32_t i, pml4 = 0;
+
+        for (i = 0; i < e820_table.nr_entries; ++i)
+                end = max(end, e820_table.entries[i].addr + e820_table.entries[i].size);
+        end = min(ALIGN(end, (uint64_t)SZ_1G), MAXMEM);
+
+        for (addr = 0; addr < end; addr += SZ_1G) {
+                if (addr >= SZ_4G && !e820_overlaps(addr, addr + SZ_1G))
+                        continue;
+                if (!pdpt || pml4_index(addr) != pml4) {
+                        pdpt = get_zeroed_page(PAGE_TYPE_PGTABLE);
+                        if (!pdpt)
+                                panic("no memory for the direct map\n");
+                        pml4 = pml4_index(addr);
+                        kpml4[pml4] = __pa(pdpt) | PTE_PRESENT | PTE_RW;
+                }
+                if (use_1g && direct_map_ram(addr, addr + SZ_1G)) {
+                        pdpt[pdpt_index(addr)] = addr | PTE_PRESENT | PTE_RW | PTE_PSE;
+                        ++nr_1g;
+                        continue;
+                }
+                pd = alloc_page(PAGE_TYPE_PGTABLE);
+                if (!pd)
+                        panic("no memory for the direct map\n");
+                for (i = 0; i < PTRS_PER_PD; ++i)
+                        pd[i] = (addr + i * SZ_2M) | PTE_PRESENT | PTE_RW | PTE_PSE;
+                pdpt[pdpt_index(addr)] = __pa(pd) | PTE_PRESENT | PTE_RW;
+                nr_2m += PTRS_PER_PD;
+        }
+
+        /* the shared mapping covers the first 512G, which has the VMM */
+        kpml4[pml4_index(__ENTRY_OFFSET)] = kpml4[0];
+        write_cr3(__pa(kpml4));
+        direct_map_end = end;
+        pr_info("direct map of %" PRIu64 " GiB: %zu 1G + %zu 2M pages\n", end / SZ_1G, nr_1g, nr_2m);
+}
+
+static int set_vmm_mem(const char *val)
+{
+        char *end;
+        uint64_t mb;
+
+        /* whole 2M pages */
+        mb = simple_strtoull(val, &end, 0);
+        if (*end || !mb || mb % 2)
+                return -1;
+        vmm_mem = mb;
+        return 0;
+}
+__setup("vmm_mem=", set_vmm_mem);
+
+static int set_vmm_node_mem(const char *val)
+{
+        char *end;
+        uint64_t mb;
+
+        /* whole 2M pages, or 0 to use the first pool only */
+        mb = simple_strtoull(val, &end, 0);
+        if (*end || mb % 2)
+                return -1;
+        vmm_node_mem = mb;
+        return 0;
+}
+__setup("vmm_node_mem=", set_vmm_node_mem);
+
 void multiboot_init(uint32_t magic, struct multiboot_info *multiboot_info)
 {
         struct multiboot_mod_list *mods;
@@ -9,6 +244,9 @@ void multiboot_init(uint32_t magic, struct multiboot_info *multiboot_info)
         BUG_ON(magic != MULTIBOOT_BOOTLOADER_MAGIC);
         BUG_ON(!multiboot_info);
 
+        if (multiboot_info->flags & MULTIBOOT_INFO_CMDLINE)
+                parse_args(__va(multiboot_info->cmdline));
+
         if (!(multiboot_info->flags & MULTIBOOT_INFO_MEM_MAP))
                 panic("no memory map!\n");
         e820_range_add_multiboot(__va(multiboot_info->mmap_addr), multiboot_info->mmap_length);
@@ -16,6 +254,8 @@ void multiboot_init(uint32_t magic, struct multiboot_info *multiboot_info)
         if (!multiboot_info->mods_count)
                 panic("no guest kernel loaded!\n");
         mods = __va(multiboot_info->mods_addr);
+        if (kvm_snapshot_probe(mods[0].mod_start, mods[0].mod_end))
+                goto reserve;
         guest_params.kernel_start = mods[0].mod_start;
         guest_params.kernel_end = mods[0].mod_end;
         if (strscpy((char *)guest_params.cmdline, __va(mods[0].cmdline), sizeof(guest_params.cmdline)) < 0)
@@ -26,9 +266,17 @@ void multiboot_init(uint32_t magic, struct multiboot_info *multiboot_info)
                 guest_params.initrd_end = mods[1].mod_end;
         }
 
+reserve:
         /* mask out vmm */
         BUG_ON(__pa(_start) % SZ_2M);
         BUG_ON(__pa(_end) % SZ_2M);
         BUG_ON(!e820_mapped_all(__pa(_start), __pa(_end), E820_TYPE_RAM));
         e820_range_update(__pa(_start), _end - _start, E820_TYPE_RAM, E820_TYPE_RESERVED);
+        pr_info("vmm at [mem %#010" PRIx64 "-%#010" PRIx64 "]\n", __pa(_start), __pa(_end) - 1);
+
+        reserve_vmm_memory(mods, multiboot_info->mods_count);
+        direct_map_init();
+        /* require direct map, for pools above 4G */
+        reserve_node_memory(mods, multiboot_info->mods_count);
+        kvm_snapshot_stage();
 }
@@ -0,0 +1,445 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/init.h>
+#include <asm/mmu.h>
+#include <asm/numa.h>
+#include <sys/list.h>
+#include <sys/page_alloc.h>
+#include <sys/percpu.h>
+#include <sys/spinlock.h>
+#include <sys/string.h>
+
+/*
+ * A buddy allocator for the memory reserved for the VMM at boot.
+ * Blocks of 2^order pages are naturally aligned, so 2M and 1G
+ * allocations can back large EPT or page-table entries directly.
+ *
+ * Each pool is a zone of one NUMA node: the one next to the VMM, plus
+ * one per other node with memory.  Allocations try the zones nearest
+ * to the CPU's node first, so that what a vCPU allocates (its VMCS,
+ * EPT tables and guest pages) is local to where it runs.
+ *
+ * Single pages go through per-CPU caches that are refilled and drained
+ * in batches, and each CPU keeps a small pool of pre-zeroed pages for
+ * page tables.
+ */
+
+#define PCP_HIGH                64
+#define PCP_BATCH               16
+#define ZEROED_HIGH             32
+
+/* the page heads a free block of the given order */
+#define PG_FREE                 BIT_32(0)
+
+struct page {
+        struct list_head list;
+        uint8_t flags;
+        uint8_t order;
+        uint8_t type;
+};
+
+struct zone {
+        struct page *mem_map;
+        pfn_t base_pfn, end_pfn;
+        struct list_head free_area[MAX_PAGE_ORDER + 1];
+        size_t nr_free[MAX_PAGE_ORDER + 1];
+        int nid;
+};
+
+struct per_cpu_pages {
+        size_t count;
+        void *pages[PCP_HIGH];
+        size_t nr_zeroed;
+        void *zeroed[ZEROED_HIGH];
+};
+
+struct page_pool page_pools[MAX_NUMNODES];
+size_t nr_page_pools;
+
+static struct zone zones[MAX_NUMNODES];
+/* for each node, the zones from the nearest to the farthest */
+static struct zone *zonelists[MAX_NUMNODES][MAX_NUMNODES];
+static DEFINE_SPINLOCK(zone_lock);
+static struct per_cpu_pages pcp[NR_CPUS];
+
+/* pages handed out, by type; cached pages are counted separately */
+static size_t nr_used[NR_PAGE_TYPES];
+/* pages taken from the preferred node, or from another one */
+static size_t numa_hit, numa_miss;
+
+static const char *const page_type_names[NR_PAGE_TYPES] = {
+        [PAGE_TYPE_OTHER]       = "other",
+        [PAGE_TYPE_MEMMAP]      = "memmap",
+        [PAGE_TYPE_PGTABLE]     = "pgtable",
+        [PAGE_TYPE_VMCS]        = "vmcs",
+        [PAGE_TYPE_BITMAP]      = "bitmap",
+        [PAGE_TYPE_GUEST]       = "guest",
+};
+
+static struct zone *pfn_to_zone(pfn_t pfn)
+{
+        size_t i;
+
+        for (i = 0; i < nr_page_pools; ++i) {
+                if (zones[i].base_pfn <= pfn && pfn < zones[i].end_pfn)
+                        return &zones[i];
+        }
+        return NULL;
+}
+
+static struct page *pfn_to_page(struct zone *zone, pfn_t pfn)
+{
+        return &zone->mem_map[pfn - zone->base_pfn];
+}
+
+static pfn_t page_to_pfn(struct zone *zone, struct page *page)
+{
+        return zone->base_pfn + (page - zone->mem_map);
+}
+
+static void *page_address(struct zone *zone, struct page *page)
+{
+        return __va(page_to_pfn(zone, page) << PAGE_SHIFT);
+}
+
+static struct page *virt_to_page(void *addr)
+{
+        pfn_t pfn = __pa(addr) >> PAGE_SHIFT;
+        struct zone *zone = pfn_to_zone(pfn);
+
+        BUG_ON(!zone);
+        return pfn_to_page(zone, pfn);
+}
+
+static void account(enum page_type type, ssize_t nr_pages)
+{
+        __atomic_add_fetch(&nr_used[type], nr_pages, __ATOMIC_RELAXED);
+}
+
+static void add_free_block(struct zone *zone, pfn_t pfn, unsigned int order)
+{
+        struct page *page = pfn_to_page(zone, pfn);
+
+        page->flags = PG_FREE;
+        page->order = order;
+        list_add(&page->list, &zone->free_area[order]);
+        zone->nr_free[order]++;
+}
+
+/* called with zone_lock held */
+static void __free_block(struct zone *zone, pfn_t pfn, unsigned int order)
+{
+        struct page *buddy;
+        pfn_t buddy_pfn;
+
+        while (order < MAX_PAGE_ORDER) {
+                buddy_pfn = pfn ^ (UINT64_C(1) << order);
+                if (buddy_pfn < zone->base_pfn || buddy_pfn + (UINT64_C(1) << order) > zone->end_pfn)
+                        break;
+                buddy = pfn_to_page(zone, buddy_pfn);
+                if (!(buddy->flags & PG_FREE) || buddy->order != order)
+                        break;
+                list_del(&buddy->list);
+                buddy->flags = 0;
+                zone->nr_free[order]--;
+                pfn &= ~(UINT64_C(1) << order);
+                order++;
+        }
+        add_free_block(zone, pfn, order);
+}
+
+/* called with zone_lock held */
+static struct page *__alloc_zone_block(struct zone *zone, unsigned int order)
+{
+        struct page *page;
+        unsigned int o;
+        pfn_t pfn;
+
+        for (o = order; o <= MAX_PAGE_ORDER; ++o) {
+                if (!list_empty(&zone->free_area[o]))
+                        break;
+        }
+        if (o > MAX_PAGE_ORDER)
+                return NULL;
+
+        page = list_first_entry(&zone->free_area[o], struct page, list);
+        list_del(&page->list);
+        page->flags = 0;
+        zone->nr_free[o]--;
+
+        /* return the upper halves to the free lists */
+        pfn = page_to_pfn(zone, page);
+        while (o > order) {
+                --o;
+                add_free_block(zone, pfn + (UINT64_C(1) << o), o);
+        }
+        page->order = order;
+        return page;
+}
+
+/* called with zone_lock held; falls back to farther nodes */
+static void *__alloc_block(int nid, unsigned int order)
+{
+        struct zone *zone;
+        struct page *page;
+        size_t i;
+
+        for (i = 0; i < nr_page_pools; ++i) {
+                zone = zonelists[nid][i];
+                page = __alloc_zone_block(zone, order);
+                if (!page)
+                        continue;
+                if (zone->nid == nid)
+                        numa_hit += 1 << order;
+                else
+                        numa_miss += 1 << order;
+                return page_address(zone, page);
+        }
+        return NULL;
+}
+
+void *alloc_pages(unsigned int order, enum page_type type)
+{
+        void *addr;
+
+        if (order > MAX_PAGE_ORDER)
+                return NULL;
+
+        spin_lock(&zone_lock);
+        addr = __alloc_block(numa_node_id(), order);
+        spin_unlock(&zone_lock);
+        if (!addr)
+                return NULL;
+
+        virt_to_page(addr)->type = type;
+        account(type, 1 << order);
+        return addr;
+}
+
+void free_pages(void *addr, unsigned int order)
+{
+        pfn_t pfn = __pa(addr) >> PAGE_SHIFT;
+        struct page *page = virt_to_page(addr);
+
+        BUG_ON(page->order != order);
+        account(page->type, -(1 << order));
+
+        spin_lock(&zone_lock);
+        __free_block(pfn_to_zone(pfn), pfn, order);
+        spin_unlock(&zone_lock);
+}
+
+static void pcp_refill(struct per_cpu_pages *p)
+{
+        int nid = numa_node_id();
+        void *addr;
+
+        spin_lock(&zone_lock);
+        while (p->count < PCP_BATCH && (addr = __alloc_block(nid, 0)))
+                p->pages[p->count++] = addr;
+        spin_unlock(&zone_lock);
+}
+
+static void pcp_drain(struct per_cpu_pages *p)
+{
+        pfn_t pfn;
+
+        spin_lock(&zone_lock);
+        while (p->count > PCP_HIGH - PCP_BATCH) {
+                pfn = __pa(p->pages[--p->count]) >> PAGE_SHIFT;
+                __free_block(pfn_to_zone(pfn), pfn, 0);
+        }
+        spin_unlock(&zone_lock);
+}
+
+void *alloc_page(enum page_type type)
+{
+        struct per_cpu_pages *p = &pcp[smp_processor_id()];
+        void *addr;
+
+        if (!p->count)
+                pcp_refill(p);
+        if (!p->count)
+                return NULL;
+
+        addr = p->pages[--p->count];
+        virt_to_page(addr)->type = type;
+        account(type, 1);
+        return addr;
+}
+
+void free_page(void *addr)
+{
+        struct per_cpu_pages *p = &pcp[smp_processor_id()];
+        struct page *page = virt_to_page(addr);
+
+        BUG_ON(page->order != 0);
+        account(page->type, -1);
+
+        if (p->count == PCP_HIGH)
+                pcp_drain(p);
+        p->pages[p->count++] = addr;
+}
+
+void *get_zeroed_page(enum page_type type)
+{
+        struct per_cpu_pages *p = &pcp[smp_processor_id()];
+        void *addr;
+
+        if (!p->nr_zeroed) {
+                addr = alloc_page(type);
+                if (addr)
+                        memset(addr, 0, PAGE_SIZE);
+                return addr;
+        }
+
+        addr = p->zeroed[--p->nr_zeroed];
+        virt_to_page(addr)->type = type;
+        account(type, 1);
+        return addr;
+}
+
+/* top up this CPU's zeroed pool; called outside of latency-critical paths */
+void page_alloc_refill(void)
+{
+        struct per_cpu_pages *p = &pcp[smp_processor_id()];
+        void *addr;
+
+        while (p->nr_zeroed < ZEROED_HIGH) {
+                if (!p->count)
+                        pcp_refill(p);
+                if (!p->count)
+                        break;
+                addr = p->pages[--p->count];
+                memset(addr, 0, PAGE_SIZE);
+                p->zeroed[p->nr_zeroed++] = addr;
+        }
+}
+
+static void build_zonelists(void)
+{
+        struct zone *z;
+        size_t i, j;
+        int nid;
+
+        /* insertion sort by distance, keeping the pool order for ties */
+        for_each_node(nid) {
+                for (i = 0; i < nr_page_pools; ++i) {
+                        z = &zones[i];
+                        for (j = i; j && node_distance(nid, zonelists[nid][j - 1]->nid) >
+                                         node_distance(nid, z->nid); --j)
+                                zonelists[nid][j] = zonelists[nid][j - 1];
+                        zonelists[nid][j] = z;
+                }
+        }
+}
+
+static void zone_init(phys_addr_t start, phys_addr_t end)
+{
+        struct zone *zone = &zones[nr_page_pools];
+        size_t i, memmap_pages;
+        unsigned int order;
+        pfn_t pfn;
+
+        BUG_ON(nr_page_pools == MAX_NUMNODES);
+        page_pools[nr_page_pools].start = start;
+        page_pools[nr_page_pools].end = end;
+        zone->base_pfn = start >> PAGE_SHIFT;
+        zone->end_pfn = end >> PAGE_SHIFT;
+        zone->nid = phys_to_node(start);
+
+        for (i = 0; i <= MAX_PAGE_ORDER; ++i)
+                INIT_LIST_HEAD(&zone->free_area[i]);
+
+        /* the page array lives at the start of the pool, on its node */
+        zone->mem_map = __va(start);
+        memmap_pages = DIV_ROUND_UP((zone->end_pfn - zone->base_pfn) * sizeof(struct page), PAGE_SIZE);
+        memset(zone->mem_map, 0, memmap_pages * PAGE_SIZE);
+        account(PAGE_TYPE_MEMMAP, memmap_pages);
+
+        /* carve the rest into the largest naturally aligned blocks */
+        for (pfn = zone->base_pfn + memmap_pages; pfn < zone->end_pfn; pfn += UINT64_C(1) << order) {
+                for (order = MAX_PAGE_ORDER; order; --order) {
+                        if (IS_ALIGNED(pfn, UINT64_C(1) << order) &&
+                            pfn + (UINT64_C(1) << order) <= zone->end_pfn)
+                                break;
+                }
+                add_free_block(zone, pfn, order);
+        }
+
+        spin_lock(&zone_lock);
+        nr_page_pools++;
+        build_zonelists();
+        spin_unlock(&zone_lock);
+        pr_info("%" PRIu64 " MiB at 0x%016" PRIx64 " on node %d\n", (end - start) >> 20, start, zone->nid);
+}
+
+void page_alloc_init(phys_addr_t start, phys_addr_t end)
+{
+        zone_init(start, end);
+        page_alloc_refill();
+}
+
+/*
+ * Add the pool of another node, and refill this CPU's caches from the
+ * nearest one, which may be the new pool.
+ */
+void page_alloc_add_pool(phys_addr_t start, phys_addr_t end)
+{
+        struct per_cpu_pages *p = &pcp[smp_processor_id()];
+        pfn_t pfn;
+
+        zone_init(start, end);
+
+        spin_lock(&zone_lock);
+        while (p->count) {
+                pfn = __pa(p->pages[--p->count]) >> PAGE_SHIFT;
+                __free_block(pfn_to_zone(pfn), pfn, 0);
+        }
+        while (p->nr_zeroed) {
+                pfn = __pa(p->zeroed[--p->nr_zeroed]) >> PAGE_SHIFT;
+                __free_block(pfn_to_zone(pfn), pfn, 0);
+        }
+        spin_unlock(&zone_lock);
+        page_alloc_refill();
+}
+
+/* pages left in the pools, not counting the per-CPU caches */
+size_t page_alloc_nr_free(void)
+{
+        size_t i, j, free = 0;
+
+        spin_lock(&zone_lock);
+        for (i = 0; i < nr_page_pools; ++i) {
+                for (j = 0; j <= MAX_PAGE_ORDER; ++j)
+                        free += zones[i].nr_free[j] << j;
+        }
+        spin_unlock(&zone_lock);
+        return free;
+}
+
+void page_alloc_dump(void)
+{
+        size_t i, j, free = 0, cached = 0, zone_free;
+        int cpu;
+
+        spin_lock(&zone_lock);
+        for (i = 0; i < nr_page_pools; ++i) {
+                zone_free = 0;
+                for (j = 0; j <= MAX_PAGE_ORDER; ++j)
+                        zone_free += zones[i].nr_free[j] << j;
+                if (nr_page_pools > 1)
+                        pr_info("node %d: free %zu KiB\n", zones[i].nid, zone_free * 4);
+                free += zone_free;
+        }
+        spin_unlock(&zone_lock);
+
+        for_each_possible_cpu(cpu)
+                cached += pcp[cpu].count + pcp[cpu].nr_zeroed;
+
+        pr_info("free %zu KiB cached %zu KiB\n", free * 4, cached * 4);
+        pr_info("local %zu KiB remote %zu KiB\n",
+                READ_ONCE(numa_hit) * 4, READ_ONCE(numa_miss) * 4);
+        for (i = 0; i < NR_PAGE_TYPES; ++i)
+                pr_info("  %-8s %zu KiB\n", page_type_names[i], READ_ONCE(nr_used[i]) * 4);
+}
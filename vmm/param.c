@@ -0,0 +1,56 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/init.h>
+#include <sys/ctype.h>
+#include <sys/printk.h>
+#include <sys/string.h>
+
+extern const struct obs_kernel_param __setup_start[], __setup_end[];
+
+static void do_param(const char *param, size_t len)
+{
+        const struct obs_kernel_param *p;
+        char buf[64];
+
+        if (len >= sizeof(buf)) {
+                pr_warn("parameter too long: %.*s\n", (int)len, param);
+                return;
+        }
+        memcpy(buf, param, len);
+        buf[len] = 0;
+
+        for (p = __setup_start; p < __setup_end; ++p) {
+                size_t n = strlen(p->str);
+
+                if (strncmp(buf, p->str, n))
+                        continue;
+                if (p->setup_func(buf + n))
+                        pr_warn("invalid parameter: %s\n", buf);
+                return;
+        }
+
+        pr_warn("unknown parameter: %s\n", buf);
+}
+
+/*
+ * The multiboot command line starts with the image path,
+ * which is skipped; the remaining words are VMM options.
+ */
+void parse_args(const char *cmdline)
+{
+        const char *s = cmdline, *end;
+
+        while (*s && !isspace(*s))
+                ++s;
+
+        for (;;) {
+                while (isspace(*s))
+                        ++s;
+                if (!*s)
+                        break;
+                for (end = s; *end && !isspace(*end); ++end)
+                        ;
+                do_param(s, end - s);
+                s = end;
+        }
+}
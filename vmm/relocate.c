@@ -0,0 +1,112 @@
+#include <asm/cpufeatures.h>
+#include <asm/mmu.h>
+#include <asm/processor.h>
+#include <io/sizes.h>
+#include <sys/multiboot.h>
+#include <sys/string.h>
+
+/*
+ * The VMM is linked at VMM_START, right in the guest's low memory.
+ * Before anything else runs, head.S calls relocate_vmm() to copy the
+ * image to the top of RAM and fix up the absolute addresses in the
+ * copy, using the offsets that vmm/relocs.py collected at build time.
+ * The guest then sees one contiguous RAM range from 1M.
+ *
+ * The code is position-independent and the table holds the 64-bit
+ * addresses only, so the copy can go anywhere the boot page table maps.
+ * That table covers 4G; with 1G pages, it is extended to 512G, which is
+ * what its pdpt0 can hold.
+ *
+ * This runs on the boot page table with nothing set up, so it must not
+ * print anything, nor write to the image other than to map the copy.
+ */
+
+extern const uint32_t __relocs_start[], __relocs_end[];
+extern uint64_t pdpt0[];
+
+static uint64_t relocate_limit(void)
+{
+        if (cpuid_edx(0x80000001) & (1U << (X86_FEATURE_GBPAGES & 31)))
+                return (uint64_t)PTRS_PER_PDPT * SZ_1G;
+        return SZ_4G;
+}
+
+/* identity-map [SZ_4G, end) with 1G pages, before the copy inherits pdpt0 */
+static void map_high(uint64_t end)
+{
+        uint64_t addr;
+
+        for (addr = SZ_4G; addr < end; addr += SZ_1G)
+                pdpt0[pdpt_index(addr)] = addr | PTE_PRESENT | PTE_RW | PTE_PSE;
+}
+
+static bool overlaps(uint64_t start, uint64_t end, uint64_t s, uint64_t e)
+{
+        return start < e && s < end;
+}
+
+/* would [start, end) clobber the image or anything the bootloader passed? */
+static bool in_use(uint64_t start, uint64_t end, struct multiboot_info *mbi)
+{
+        struct multiboot_mod_list *mods = __va(mbi->mods_addr);
+        uint32_t i;
+
+        if (overlaps(start, end, __pa(_start), __pa(_end)) ||
+            overlaps(start, end, __pa(mbi), __pa(mbi + 1)) ||
+            overlaps(start, end, mbi->mmap_addr, mbi->mmap_addr + mbi->mmap_length))
+                return true;
+        if ((mbi->flags & MULTIBOOT_INFO_CMDLINE) &&
+            overlaps(start, end, mbi->cmdline, mbi->cmdline + strlen(__va(mbi->cmdline)) + 1))
+                return true;
+        if (!(mbi->flags & MULTIBOOT_INFO_MODS))
+                return false;
+        if (overlaps(start, end, mbi->mods_addr, __pa(mods + mbi->mods_count)))
+                return true;
+        for (i = 0; i < mbi->mods_count; ++i) {
+                if (overlaps(start, end, mods[i].mod_start, mods[i].mod_end) ||
+                    overlaps(start, end, mods[i].cmdline,
+                             mods[i].cmdline + strlen(__va(mods[i].cmdline)) + 1))
+                        return true;
+        }
+        return false;
+}
+
+/* returns how far the image has moved, or 0 if it stays */
+uint64_t relocate_vmm(uint32_t magic, struct multiboot_info *mbi)
+{
+        uint64_t size = _end - _start, limit, best = 0, start, end, delta;
+        void *mmap, *mmap_end;
+        const uint32_t *r;
+
+        /* multiboot_init() will complain */
+        if (magic != MULTIBOOT_BOOTLOADER_MAGIC || !mbi || !(mbi->flags & MULTIBOOT_INFO_MEM_MAP))
+                return 0;
+
+        limit = relocate_limit();
+        mmap = __va(mbi->mmap_addr);
+        mmap_end = mmap + mbi->mmap_length;
+        while (mmap < mmap_end) {
+                struct multiboot_mmap_entry *e = mmap;
+
+                mmap += e->size + sizeof(e->size);
+                if (e->type != MULTIBOOT_MEMORY_AVAILABLE || e->addr >= limit)
+                        continue;
+                /* the image uses 2M pages in EPT */
+                end = rounddown(min(e->addr + e->len, limit), SZ_2M);
+                if (end < e->addr + size)
+                        continue;
+                start = end - size;
+                if (start > best && !in_use(start, end, mbi))
+                        best = start;
+        }
+
+        if (best <= __pa(_start))
+                return 0;
+
+        map_high(best + size);
+        memcpy(__va(best), _start, size);
+        delta = best - __pa(_start);
+        for (r = __relocs_start; r < __relocs_end; ++r)
+                *(uint64_t *)__va(best + *r) += delta;
+        return delta;
+}
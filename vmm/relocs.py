@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+#
+# Generate the VMM relocation table from an image linked with
+# --emit-relocs, e.g.:
+#
+#   vmm/relocs.py o.x86_64/vmm.elf.0 > o.x86_64/vmm/relocs.S
+#
+# The table lists the offsets from _start of all the 64-bit absolute
+# addresses of the image, so that the VMM can move itself at boot (see
+# vmm/relocate.c).  The code is position-independent otherwise: a 32-bit
+# absolute address can't follow the image above 4G, and is only allowed in
+# the 32-bit boot code of head.S, which runs before the move.  Without an
+# image, generate an empty table for the first link.
+
+import argparse, struct, sys
+
+SHT_SYMTAB = 2
+SHT_RELA = 4
+SHF_ALLOC = 0x2
+SHN_UNDEF = 0
+SHN_ABS = 0xfff1
+
+R_X86_64_NONE = 0
+R_X86_64_64 = 1
+R_X86_64_PC32 = 2
+R_X86_64_PLT32 = 4
+R_X86_64_32 = 10
+R_X86_64_32S = 11
+
+EHDR = struct.Struct('<16sHHIQQQIHHHHHH')
+SHDR = struct.Struct('<IIQQQQIIQQ')
+SYM = struct.Struct('<IBBHQQ')
+RELA = struct.Struct('<QQq')
+
+
+def sections(elf):
+    ehdr = EHDR.unpack_from(elf)
+    shoff, shentsize, shnum = ehdr[6], ehdr[11], ehdr[12]
+    return [SHDR.unpack_from(elf, shoff + i * shentsize) for i in range(shnum)]
+
+
+def symbol_address(elf, shdrs, name):
+    for sh in shdrs:
+        if sh[1] != SHT_SYMTAB:
+            continue
+        strtab = shdrs[sh[6]]
+        for off in range(sh[4], sh[4] + sh[5], SYM.size):
+            sym = SYM.unpack_from(elf, off)
+            start = strtab[4] + sym[0]
+            if elf[start:elf.index(b'\0', start)] == name:
+                return sym[4]
+    sys.exit('relocs: no symbol ' + name.decode())
+
+
+def relocs(elf):
+    shdrs = sections(elf)
+    start = symbol_address(elf, shdrs, b'_start')
+    end = symbol_address(elf, shdrs, b'_end')
+    boot32_end = symbol_address(elf, shdrs, b'start_64')
+    table = set()
+
+    for sh in shdrs:
+        if sh[1] != SHT_RELA or not (shdrs[sh[7]][2] & SHF_ALLOC):
+            continue
+        symtab = shdrs[sh[6]]
+        for off in range(sh[4], sh[4] + sh[5], RELA.size):
+            r_offset, r_info, r_addend = RELA.unpack_from(elf, off)
+            r_type = r_info & 0xffffffff
+            sym = SYM.unpack_from(elf, symtab[4] + (r_info >> 32) * SYM.size)
+            shndx, value = sym[3], sym[4]
+            # linker-defined symbols may be absolute but still in the image
+            relative = shndx != SHN_UNDEF and (shndx != SHN_ABS or start <= value <= end)
+
+            if r_type in (R_X86_64_NONE, R_X86_64_PC32, R_X86_64_PLT32):
+                if shndx == SHN_ABS and relative:
+                    sys.exit('relocs: PC-relative reference to an absolute symbol at %#x' % r_offset)
+            elif r_type == R_X86_64_64:
+                if relative:
+                    table.add(r_offset - start)
+            elif r_type in (R_X86_64_32, R_X86_64_32S):
+                if relative and not start <= r_offset < boot32_end:
+                    sys.exit('relocs: 32-bit absolute address at %#x' % r_offset)
+            else:
+                sys.exit('relocs: unsupported relocation type %d at %#x' % (r_type, r_offset))
+
+    return sorted(table)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate the VMM relocation table.')
+    parser.add_argument('elf', nargs='?', help='the VMM image, linked with --emit-relocs')
+    args = parser.parse_args()
+
+    offsets = []
+    if args.elf:
+        with open(args.elf, 'rb') as f:
+            offsets = relocs(f.read())
+
+    print('#include <io/linkage.h>')
+    print('')
+    print('        .section .relocs, "a"')
+    print('        .balign 4')
+    print('GLOBAL(__relocs_start)')
+    for off in offsets:
+        print('        .long   %#x' % off)
+    print('GLOBAL(__relocs_end)')
+    print('')
+    print('        .section .note.GNU-stack, "", @progbits')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,109 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/apic.h>
+#include <asm/init.h>
+#include <asm/processor.h>
+#include <asm/setup.h>
+#include <asm/tsc.h>
+#include <sys/delay.h>
+#include <sys/percpu.h>
+#include <sys/string.h>
+
+/*
+ * Start the other CPUs of the MADT with INIT-SIPI-SIPI, one at a time as
+ * they share initial_gs and initial_stack.  Each AP enters the guest in
+ * the wait-for-SIPI state, so that the guest starts it later with its
+ * own INIT-SIPI-SIPI (see vmx.c).
+ */
+
+/* how long an AP has to get to kvm_ap_run() */
+#define AP_TIMEOUT_MS   1000
+
+extern char trampoline_start[], trampoline_end[];
+extern char __per_cpu_start[], __per_cpu_end[];
+
+/* CPUs that have entered the guest */
+static int nr_cpus_online = 1;
+
+static void setup_per_cpu_areas(void)
+{
+        size_t size = __per_cpu_end - __per_cpu_start;
+        int cpu;
+
+        for (cpu = 1; cpu < nr_logical_cpuids; ++cpu) {
+                __per_cpu_offset[cpu] = cpu * size;
+                memset(__per_cpu_start + __per_cpu_offset[cpu], 0, size);
+                per_cpu(cpu_number, cpu) = cpu;
+        }
+}
+
+static void boot_cpu(int cpu)
+{
+        uint32_t apicid = cpuid_to_apicid[cpu];
+        uint64_t deadline;
+        int i;
+
+        initial_gs = per_cpu_offset(cpu);
+        initial_stack = (uintptr_t)cpu_stacks[cpu] + CPU_STACK_SIZE;
+
+        apic_send_IPI(APIC_INT_LEVELTRIG | APIC_INT_ASSERT | APIC_DM_INIT, apicid);
+        mdelay(10);
+        for (i = 0; i < 2; ++i) {
+                apic_send_IPI(APIC_DM_STARTUP | (TRAMPOLINE_START >> PAGE_SHIFT), apicid);
+                udelay(200);
+        }
+
+        deadline = rdtsc() + (uint64_t)AP_TIMEOUT_MS * tsc_khz;
+        while (__atomic_load_n(&nr_cpus_online, __ATOMIC_ACQUIRE) <= cpu) {
+                if (rdtsc() > deadline)
+                        panic("CPU%d (APIC 0x%x) did not start\n", cpu, apicid);
+                cpu_relax();
+        }
+}
+
+void smp_init(void)
+{
+        /* the trampoline code and its page table */
+        static uint8_t saved[4 * PAGE_SIZE];
+        size_t size = trampoline_end - trampoline_start;
+        int cpu;
+
+        if (nr_logical_cpuids == 1)
+                return;
+
+        BUILD_BUG_ON(TRAMPOLINE_START & ~PAGE_MASK);
+        BUG_ON(size > sizeof(saved));
+
+        setup_per_cpu_areas();
+
+        /* the page belongs to the guest, which hasn't run yet */
+        memcpy(saved, __va(TRAMPOLINE_START), size);
+        memcpy(__va(TRAMPOLINE_START), trampoline_start, size);
+
+        for (cpu = 1; cpu < nr_logical_cpuids; ++cpu)
+                boot_cpu(cpu);
+
+        memcpy(__va(TRAMPOLINE_START), saved, size);
+
+        pr_info("%d CPUs online\n", nr_cpus_online);
+}
+
+/* called by kvm_ap_run() once the AP is ready to take the guest's SIPI */
+void smp_callin(void)
+{
+        __atomic_add_fetch(&nr_cpus_online, 1, __ATOMIC_RELEASE);
+}
+
+/* the number of CPUs running a vcpu */
+int smp_num_online(void)
+{
+        return __atomic_load_n(&nr_cpus_online, __ATOMIC_ACQUIRE);
+}
+
+noreturn void start_secondary(void)
+{
+        cpu_init();
+        trap_init_secondary();
+        apic_init();
+        kvm_ap_run();
+}
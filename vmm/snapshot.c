@@ -0,0 +1,511 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/e820.h>
+#include <asm/kvm_host.h>
+#include <asm/kvm_snapshot.h>
+#include <asm/processor.h>
+#include <asm/setup.h>
+#include <asm/tsc.h>
+#include <asm/bitops.h>
+#include <asm/init.h>
+#include <io/sizes.h>
+#include <sys/bitops.h>
+#include <sys/console.h>
+#include <sys/errno.h>
+#include <sys/page_alloc.h>
+#include <sys/sort.h>
+#include <sys/string.h>
+
+/* background restore: pages per tick, and the tick period */
+#define RESTORE_BATCH           256
+#define RESTORE_PERIOD_MS       1
+
+/* pages recorded as hot in a snapshot */
+#define NR_HOT_PAGES            8
+
+/*
+ * A snapshot holds guest RAM and the vcpu state at the point where the
+ * guest asked for it.  Device and local APIC state is not captured, as
+ * devices are passed through: in the restored guest the hypercall
+ * returns 1, and the guest reinitializes what it needs.
+ *
+ * Restoring boots the snapshot in place of the guest kernel.  The
+ * bootloader has put it somewhere in guest RAM, so it is first staged
+ * into the VMM pool, which must be large enough (see vmm_mem=).  Only
+ * the hot pages are restored before the guest resumes; the others are
+ * filled on first access, through EPT violations, and in the background
+ * from the tick, so that resuming doesn't depend on the guest memory
+ * size.  With snapshot_lazy=0 everything is restored up front.
+ *
+ * Devices write to memory bypassing EPT, so a guest must not program
+ * DMA into memory it hasn't touched since the restore.
+ */
+
+/* the snapshot module, and its staged copy */
+static phys_addr_t snap_start, snap_end;
+static void *snap_copy;
+static unsigned int snap_order;
+
+static struct kvm_snapshot_cpu snap_cpu;
+static uint8_t snap_fpu[512] __aligned(16);
+
+static bool snapshot_lazy = true;
+
+/* where the pages of a staged run are; data is NULL for zero pages */
+struct snap_run {
+        uint64_t gpa;
+        uint32_t nr_pages;
+        uint32_t flags;
+        const uint8_t *data;
+};
+
+/* a restore in progress */
+static struct {
+        struct snap_run *runs;
+        size_t nr_runs;
+        unsigned int runs_order;
+        /* pages not yet restored */
+        unsigned long *pending;
+        unsigned int pending_order;
+        pfn_t nr_pfns;
+        uint64_t nr_pending;
+        /* where the background restore continues */
+        unsigned long next;
+        uint64_t nr_pages, nr_hot, nr_background;
+        uint64_t start_tsc;
+} restore;
+
+/* guest pages the vcpu is about to touch, when saving */
+static uint64_t hot_pages[NR_HOT_PAGES];
+static size_t nr_hot_pages;
+
+/* guest memory that goes into a snapshot */
+static bool snapshot_range(const struct e820_entry *e, uint64_t *start, uint64_t *end)
+{
+        switch (e->type) {
+        case E820_TYPE_RAM:
+        case E820_TYPE_ACPI:
+        case E820_TYPE_NVS:
+                break;
+        default:
+                return false;
+        }
+        *start = rounddown(e->addr, PAGE_SIZE);
+        *end = roundup(min(e->addr + e->size, direct_map_end), PAGE_SIZE);
+        return *start < *end;
+}
+
+static bool page_is_zero(uint64_t gpa)
+{
+        const uint64_t *p = __va(gpa);
+        size_t i;
+
+        /* the guest sees the zero page, whatever is in the frame */
+        if (kvm_mmu_zero_page(gpa))
+                return true;
+        for (i = 0; i < PAGE_SIZE / sizeof(*p); ++i) {
+                if (p[i])
+                        return false;
+        }
+        return true;
+}
+
+void kvm_snapshot_save_cpu(struct kvm_vcpu *vcpu, struct kvm_snapshot_cpu *s)
+{
+        int i;
+
+        memset(s, 0, sizeof(*s));
+        for (i = 0; i < ARRAY_SIZE(s->regs); ++i)
+                s->regs[i] = kvm_register_read(vcpu, i);
+        s->rip = kvm_rip_read(vcpu);
+        s->cr2 = vcpu->cr2;
+        kvm_x86_ops->save_state(vcpu, s);
+
+        /* the VMM doesn't touch the FPU, so it holds guest state */
+        fxsave(snap_fpu);
+        memcpy(s->fpu, snap_fpu, sizeof(s->fpu));
+}
+
+void kvm_snapshot_load_cpu(struct kvm_vcpu *vcpu, const struct kvm_snapshot_cpu *s)
+{
+        int i;
+
+        kvm_x86_ops->load_state(vcpu, s);
+        for (i = 0; i < ARRAY_SIZE(s->regs); ++i)
+                kvm_register_write(vcpu, i, s->regs[i]);
+        kvm_rip_write(vcpu, s->rip);
+        vcpu->cr2 = s->cr2;
+
+        memcpy(snap_fpu, s->fpu, sizeof(snap_fpu));
+        fxrstor(snap_fpu);
+}
+
+static void stream(const void *buf, size_t n, uint64_t *size)
+{
+        porte9_write_raw(buf, n);
+        *size += n;
+}
+
+static void record_hot_pages(struct kvm_vcpu *vcpu)
+{
+        const struct kvm_snapshot_cpu *s = &snap_cpu;
+        const uint64_t gvas[] = {
+                s->rip,
+                s->regs[VCPU_REGS_RSP],
+                s->gdtr_base,
+                s->idtr_base,
+                s->segs[VCPU_SREG_TR].base,
+        };
+        struct x86_exception fault;
+        uint64_t hpa;
+        size_t i;
+
+        nr_hot_pages = 0;
+        /* the root of the guest page tables; EPT maps guest memory 1:1 */
+        if (s->cr0 & X86_CR0_PG)
+                hot_pages[nr_hot_pages++] = s->cr3 & PTE_PFN_MASK;
+        for (i = 0; i < ARRAY_SIZE(gvas); ++i) {
+                if (!kvm_gva_to_hpa(vcpu, gvas[i], 0, &hpa, &fault))
+                        hot_pages[nr_hot_pages++] = hpa & PAGE_MASK;
+        }
+        BUILD_BUG_ON(ARRAY_SIZE(gvas) + 1 > NR_HOT_PAGES);
+}
+
+static uint32_t page_flags(uint64_t gpa)
+{
+        uint32_t flags = 0;
+        size_t i;
+
+        if (page_is_zero(gpa))
+                flags |= KVM_SNAPSHOT_RUN_ZERO;
+        for (i = 0; i < nr_hot_pages; ++i) {
+                if (hot_pages[i] == gpa)
+                        flags |= KVM_SNAPSHOT_RUN_HOT;
+        }
+        return flags;
+}
+
+/*
+ * Write the snapshot to the debug port.  The caller sets up the
+ * registers as they should be on restore.  Only a guest on a single
+ * vcpu can be saved: the others would change memory while it is
+ * streamed, and their state isn't part of the snapshot.
+ */
+int kvm_snapshot_save(struct kvm_vcpu *vcpu)
+{
+        struct kvm_snapshot_header hdr = { 0 };
+        struct kvm_snapshot_run run;
+        uint64_t size = 0, nr_pages = 0, nr_zero = 0;
+        uint64_t start, end, gpa;
+        uint32_t i;
+
+        if (smp_num_online() > 1)
+                return -EBUSY;
+
+        /* all of memory has to be there */
+        kvm_snapshot_finish(vcpu);
+
+        memcpy(hdr.magic, KVM_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+        hdr.version = KVM_SNAPSHOT_VERSION;
+        hdr.nr_e820 = e820_table.nr_entries;
+        hdr.cpu_size = sizeof(snap_cpu);
+        hdr.tsc_khz = kvm_guest_tsc_khz ? : tsc_khz;
+
+        kvm_snapshot_save_cpu(vcpu, &snap_cpu);
+        record_hot_pages(vcpu);
+
+        console_lock();
+        stream(&hdr, sizeof(hdr), &size);
+        stream(&snap_cpu, sizeof(snap_cpu), &size);
+        stream(e820_table.entries, e820_table.nr_entries * sizeof(struct e820_entry), &size);
+
+        for (i = 0; i < e820_table.nr_entries; ++i) {
+                if (!snapshot_range(&e820_table.entries[i], &start, &end))
+                        continue;
+                /* a run of pages with the same flags */
+                for (gpa = start; gpa < end; gpa += (uint64_t)run.nr_pages * PAGE_SIZE) {
+                        run.gpa = gpa;
+                        run.nr_pages = 1;
+                        run.flags = page_flags(gpa);
+                        while (gpa + (uint64_t)run.nr_pages * PAGE_SIZE < end &&
+                               page_flags(gpa + (uint64_t)run.nr_pages * PAGE_SIZE) == run.flags)
+                                ++run.nr_pages;
+                        stream(&run, sizeof(run), &size);
+                        if (!(run.flags & KVM_SNAPSHOT_RUN_ZERO))
+                                stream(__va(gpa), (size_t)run.nr_pages * PAGE_SIZE, &size);
+                        else
+                                nr_zero += run.nr_pages;
+                        nr_pages += run.nr_pages;
+                }
+        }
+
+        run.gpa = size + sizeof(run);
+        run.nr_pages = 0;
+        run.flags = KVM_SNAPSHOT_RUN_END;
+        stream(&run, sizeof(run), &size);
+        console_unlock();
+
+        pr_info("%" PRIu64 " pages, %" PRIu64 " zero, %" PRIu64 " KiB\n",
+                nr_pages, nr_zero, size / SZ_1K);
+        return 0;
+}
+
+bool kvm_snapshot_probe(phys_addr_t start, phys_addr_t end)
+{
+        const struct kvm_snapshot_header *hdr = __va(start);
+
+        if (end - start < sizeof(*hdr) || memcmp(hdr->magic, KVM_SNAPSHOT_MAGIC, sizeof(hdr->magic)))
+                return false;
+        snap_start = start;
+        snap_end = end;
+        return true;
+}
+
+/* copy the module out of guest RAM before it gets overwritten */
+void kvm_snapshot_stage(void)
+{
+        size_t size = snap_end - snap_start;
+
+        if (!size)
+                return;
+        snap_order = get_order(size);
+        snap_copy = alloc_pages(snap_order, PAGE_TYPE_OTHER);
+        if (!snap_copy)
+                panic("snapshot: no room for %zu KiB; increase vmm_mem=\n", size / SZ_1K);
+        memcpy(snap_copy, __va(snap_start), size);
+}
+
+bool kvm_snapshot_pending(void)
+{
+        return snap_copy && !restore.runs;
+}
+
+static bool overlaps(uint64_t start, uint64_t end, uint64_t s, uint64_t e)
+{
+        return start < e && s < end;
+}
+
+static bool valid_run(const struct kvm_snapshot_run *run)
+{
+        uint64_t start = run->gpa, end = start + (uint64_t)run->nr_pages * PAGE_SIZE;
+
+        return !(start % PAGE_SIZE) && end <= direct_map_end &&
+               !overlaps(start, end, __pa(_start), __pa(_end)) &&
+               !page_pool_overlaps(start, end);
+}
+
+/* check the runs starting at p, and store them into runs if not NULL */
+static size_t parse_runs(const uint8_t *p, const uint8_t *end, struct snap_run *runs)
+{
+        const struct kvm_snapshot_run *run;
+        uint64_t len;
+        size_t n = 0;
+
+        for (;;) {
+                if (end - p < sizeof(*run))
+                        panic("snapshot: truncated\n");
+                run = (const void *)p;
+                p += sizeof(*run);
+                if (run->flags & KVM_SNAPSHOT_RUN_END)
+                        break;
+                if (!valid_run(run))
+                        panic("snapshot: bad run at 0x%016" PRIx64 "\n", run->gpa);
+                if (runs) {
+                        runs[n].gpa = run->gpa;
+                        runs[n].nr_pages = run->nr_pages;
+                        runs[n].flags = run->flags;
+                        runs[n].data = (run->flags & KVM_SNAPSHOT_RUN_ZERO) ? NULL : p;
+                }
+                if (!(run->flags & KVM_SNAPSHOT_RUN_ZERO)) {
+                        len = (uint64_t)run->nr_pages * PAGE_SIZE;
+                        if (end - p < len)
+                                panic("snapshot: truncated\n");
+                        p += len;
+                }
+                ++n;
+        }
+        if (run->gpa != p - (const uint8_t *)snap_copy)
+                panic("snapshot: size mismatch\n");
+        return n;
+}
+
+static int cmp_run(const void *a, const void *b)
+{
+        const struct snap_run *x = a, *y = b;
+
+        if (x->gpa < y->gpa)
+                return -1;
+        return x->gpa > y->gpa;
+}
+
+static void fill_pages(const struct snap_run *run, uint64_t gpa, uint64_t len)
+{
+        if (run->data)
+                memcpy(__va(gpa), run->data + (gpa - run->gpa), len);
+        else
+                memset(__va(gpa), 0, len);
+}
+
+/* the demand paging callback */
+static void fill_page(uint64_t gpa)
+{
+        pfn_t pfn = gpa >> PAGE_SHIFT;
+        size_t lo = 0, hi = restore.nr_runs, mid;
+
+        if (pfn >= restore.nr_pfns || !test_bit(pfn, restore.pending))
+                return;
+        /* the last run starting at or below gpa */
+        while (hi - lo > 1) {
+                mid = (lo + hi) / 2;
+                if (restore.runs[mid].gpa <= gpa)
+                        lo = mid;
+                else
+                        hi = mid;
+        }
+        fill_pages(&restore.runs[lo], gpa, PAGE_SIZE);
+        clear_bit(pfn, restore.pending);
+        restore.nr_pending--;
+}
+
+static void restore_done(struct kvm_vcpu *vcpu)
+{
+        uint64_t faults = kvm_demand_disable(vcpu);
+
+        pr_info("restored %" PRIu64 " pages in %" PRIu64 " us: %" PRIu64 " hot, %" PRIu64
+                " on demand, %" PRIu64 " in background\n",
+                restore.nr_pages, (rdtsc() - restore.start_tsc) * 1000 / tsc_khz,
+                restore.nr_hot, faults, restore.nr_background);
+
+        free_pages(restore.pending, restore.pending_order);
+        free_pages(restore.runs, restore.runs_order);
+        free_pages(snap_copy, snap_order);
+        memset(&restore, 0, sizeof(restore));
+        snap_copy = NULL;
+}
+
+/* restore whatever is left right away */
+void kvm_snapshot_finish(struct kvm_vcpu *vcpu)
+{
+        unsigned long pfn;
+
+        if (!restore.runs)
+                return;
+        for_each_set_bit(pfn, restore.pending, restore.nr_pfns) {
+                kvm_demand_fill((uint64_t)pfn << PAGE_SHIFT);
+                restore.nr_background++;
+        }
+        restore_done(vcpu);
+}
+
+uint64_t kvm_snapshot_tick(struct kvm_vcpu *vcpu, uint64_t now)
+{
+        unsigned long pfn = restore.next;
+        unsigned int n = 0;
+
+        if (!restore.runs)
+                return 0;
+
+        for_each_set_bit_from(pfn, restore.pending, restore.nr_pfns) {
+                kvm_demand_fill((uint64_t)pfn << PAGE_SHIFT);
+                if (++n == RESTORE_BATCH)
+                        break;
+        }
+        restore.next = pfn;
+        restore.nr_background += n;
+
+        if (!restore.nr_pending) {
+                restore_done(vcpu);
+                return 0;
+        }
+        return now + (uint64_t)RESTORE_PERIOD_MS * tsc_khz;
+}
+
+static void *alloc_or_panic(size_t size, unsigned int *order)
+{
+        void *p;
+
+        *order = get_order(size);
+        p = alloc_pages(*order, PAGE_TYPE_OTHER);
+        if (!p)
+                panic("snapshot: out of memory; increase vmm_mem=\n");
+        return p;
+}
+
+void kvm_snapshot_restore(struct kvm_vcpu *vcpu)
+{
+        const uint8_t *p = snap_copy, *end = p + (snap_end - snap_start);
+        const struct kvm_snapshot_header *hdr = snap_copy;
+        const struct snap_run *run;
+        size_t e820_size, i, size;
+        uint64_t pfn, khz = hdr->tsc_khz;
+
+        restore.start_tsc = rdtsc();
+        if (hdr->version != KVM_SNAPSHOT_VERSION || hdr->cpu_size != sizeof(snap_cpu))
+                panic("snapshot: unsupported version %u\n", hdr->version);
+        e820_size = hdr->nr_e820 * sizeof(struct e820_entry);
+        if (end - p < sizeof(*hdr) + hdr->cpu_size + e820_size)
+                panic("snapshot: truncated\n");
+        p += sizeof(*hdr);
+        memcpy(&snap_cpu, p, sizeof(snap_cpu));
+        p += hdr->cpu_size;
+
+        /*
+         * Pages go back where they were, so the machine must have the same
+         * memory, and the VMM the same vmm_mem=.
+         */
+        if (hdr->nr_e820 != e820_table.nr_entries || memcmp(p, e820_table.entries, e820_size))
+                panic("snapshot: memory map doesn't match\n");
+        p += e820_size;
+
+        restore.nr_runs = parse_runs(p, end, NULL);
+        restore.runs = alloc_or_panic(max(restore.nr_runs, (size_t)1) * sizeof(struct snap_run),
+                                      &restore.runs_order);
+        parse_runs(p, end, restore.runs);
+        sort(restore.runs, restore.nr_runs, sizeof(struct snap_run), cmp_run, NULL);
+
+        for (i = 0; i < restore.nr_runs; ++i) {
+                run = &restore.runs[i];
+                restore.nr_pfns = max(restore.nr_pfns, (pfn_t)(run->gpa >> PAGE_SHIFT) + run->nr_pages);
+        }
+        size = BITS_TO_LONGS(restore.nr_pfns) * sizeof(long);
+        restore.pending = alloc_or_panic(size, &restore.pending_order);
+        memset(restore.pending, 0, size);
+
+        for (i = 0; i < restore.nr_runs; ++i) {
+                run = &restore.runs[i];
+                restore.nr_pages += run->nr_pages;
+                if ((run->flags & KVM_SNAPSHOT_RUN_HOT) || !snapshot_lazy) {
+                        fill_pages(run, run->gpa, (uint64_t)run->nr_pages * PAGE_SIZE);
+                        restore.nr_hot += run->nr_pages;
+                        continue;
+                }
+                for (pfn = run->gpa >> PAGE_SHIFT; pfn < (run->gpa >> PAGE_SHIFT) + run->nr_pages; ++pfn) {
+                        /* runs may share a page at the edges of e820 entries */
+                        if (!test_bit(pfn, restore.pending)) {
+                                set_bit(pfn, restore.pending);
+                                restore.nr_pending++;
+                        }
+                }
+        }
+
+        kvm_snapshot_load_cpu(vcpu, &snap_cpu);
+        if (khz != (kvm_guest_tsc_khz ? : tsc_khz))
+                pr_warn("taken at %" PRIu64 " kHz; guest TSC now runs at %lu kHz\n",
+                        khz, kvm_guest_tsc_khz ? : tsc_khz);
+
+        if (restore.nr_pending)
+                kvm_demand_enable(vcpu, restore.pending, restore.nr_pfns, fill_page);
+        pr_info("resuming after %" PRIu64 " us, %" PRIu64 " of %" PRIu64 " pages pending\n",
+                (rdtsc() - restore.start_tsc) * 1000 / tsc_khz, restore.nr_pending, restore.nr_pages);
+        if (!restore.nr_pending)
+                restore_done(vcpu);
+}
+
+static int set_snapshot_lazy(const char *val)
+{
+        char *end;
+
+        snapshot_lazy = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("snapshot_lazy=", set_snapshot_lazy);
@@ -0,0 +1,120 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/init.h>
+#include <asm/kvm_host.h>
+#include <asm/tsc.h>
+#include <asm/vmx.h>
+#include <sys/page_alloc.h>
+#include <sys/string.h>
+
+/* dump period in TSC cycles (0 disables periodic dumps) */
+static uint64_t stat_period;
+
+static const struct {
+        uint32_t reason;
+        const char *name;
+} exit_reason_names[] = {
+        VMX_EXIT_REASONS
+};
+
+static const char *exit_reason_name(uint32_t reason)
+{
+        size_t i;
+
+        for (i = 0; i < ARRAY_SIZE(exit_reason_names); ++i) {
+                if (exit_reason_names[i].reason == reason)
+                        return exit_reason_names[i].name;
+        }
+        return "UNKNOWN";
+}
+
+static void dump_hist(const char *name, const uint32_t *hist)
+{
+        size_t i;
+
+        pr_info("    %-9s", name);
+        for (i = 0; i < KVM_STAT_NR_BUCKETS; ++i) {
+                if (hist[i])
+                        pr_cont(" 2^%zu:%u", i, hist[i]);
+        }
+        pr_cont("\n");
+}
+
+/*
+ * This is the slow path: it runs with the console lock held,
+ * either from a hypercall or from the periodic tick.
+ */
+void kvm_stat_dump(struct kvm_vcpu *vcpu)
+{
+        struct kvm_vcpu_stat *stat = &vcpu->stat;
+        uint64_t cycles;
+        uint32_t reason;
+
+        cycles = rdtsc() - stat->start_tsc;
+        pr_info("vcpu %d: %" PRIu64 " exits in %" PRIu64 " cycles\n",
+                vcpu->vcpu_id, stat->exits, cycles);
+        if (stat->exits) {
+                /* in hundredths */
+                uint64_t reads = stat->vmreads * 100 / stat->exits;
+                uint64_t writes = stat->vmwrites * 100 / stat->exits;
+
+                pr_info("  vmread %" PRIu64 ".%02" PRIu64 "/exit vmwrite %" PRIu64 ".%02" PRIu64 "/exit\n",
+                        reads / 100, reads % 100, writes / 100, writes % 100);
+        }
+
+        for (reason = 0; reason < KVM_NR_EXIT_REASONS; ++reason) {
+                struct kvm_exit_stat *es = &stat->exit[reason];
+
+                if (!es->count)
+                        continue;
+                pr_info("  %-20s count %-10" PRIu64 " handler avg %-8" PRIu64 " roundtrip avg %" PRIu64 "\n",
+                        exit_reason_name(reason), es->count,
+                        es->handler_cycles / es->count,
+                        es->roundtrip_cycles / es->count);
+                dump_hist("handler", es->handler_hist);
+                dump_hist("roundtrip", es->roundtrip_hist);
+        }
+
+        kvm_asid_dump(vcpu);
+        kvm_mmu_dump();
+        page_alloc_dump();
+}
+
+void kvm_stat_reset(struct kvm_vcpu *vcpu)
+{
+        struct kvm_vcpu_stat *stat = &vcpu->stat;
+
+        stat->exits = 0;
+        stat->vmreads = 0;
+        stat->vmwrites = 0;
+        memset(stat->exit, 0, sizeof(stat->exit));
+        stat->start_tsc = rdtsc();
+}
+
+/* returns the deadline of the next dump, or 0 if there is none */
+uint64_t kvm_stat_tick(struct kvm_vcpu *vcpu, uint64_t now)
+{
+        struct kvm_vcpu_stat *stat = &vcpu->stat;
+
+        if (!stat_period)
+                return 0;
+
+        if (stat->next_dump && now >= stat->next_dump)
+                kvm_stat_dump(vcpu);
+        if (now >= stat->next_dump)
+                stat->next_dump = now + stat_period;
+        return stat->next_dump;
+}
+
+static int set_stat_period(const char *val)
+{
+        char *end;
+        uint64_t ms;
+
+        ms = simple_strtoull(val, &end, 0);
+        if (*end)
+                return -1;
+        stat_period = ms * tsc_khz;
+        return 0;
+}
+__setup("stats_period=", set_stat_period);
@@ -0,0 +1,114 @@
+#define pr_fmt(fmt) __MODULE__ ": " fmt
+
+#include <asm/init.h>
+#include <asm/kvm_host.h>
+#include <asm/kvm_trace.h>
+#include <asm/tsc.h>
+#include <sys/console.h>
+#include <sys/percpu.h>
+#include <sys/string.h>
+
+#define TRACE_FLUSH_MS          100
+
+bool kvm_trace_enabled;
+
+static struct kvm_trace_ring trace_rings[NR_CPUS];
+static uint32_t lost_reported[NR_CPUS];
+static uint64_t next_flush[NR_CPUS];
+
+/*
+ * Called on every exit: single producer per ring, no locks, no formatting.
+ * Events are dropped (and counted) if the drain falls behind.
+ */
+void __kvm_trace_exit(uint64_t tsc, uint32_t reason, uint64_t qual,
+                      uint64_t rip, uint64_t cr3, uint32_t vcpu_id)
+{
+        struct kvm_trace_ring *ring = &trace_rings[smp_processor_id()];
+        uint32_t head = ring->head;
+        struct kvm_trace_entry *e;
+
+        if (head - READ_ONCE(ring->tail) >= KVM_TRACE_NR_ENTRIES) {
+                WRITE_ONCE(ring->lost, ring->lost + 1);
+                return;
+        }
+
+        e = &ring->entries[head & (KVM_TRACE_NR_ENTRIES - 1)];
+        e->tsc = tsc;
+        e->qual = qual;
+        e->rip = rip;
+        e->cr3 = cr3;
+        e->reason = reason;
+        e->vcpu_id = vcpu_id;
+
+        /* x86 doesn't reorder stores; only stop the compiler from doing so */
+        barrier();
+        WRITE_ONCE(ring->head, head + 1);
+}
+
+bool kvm_trace_need_flush(void)
+{
+        struct kvm_trace_ring *ring = &trace_rings[smp_processor_id()];
+
+        return READ_ONCE(ring->head) - ring->tail >= KVM_TRACE_NR_ENTRIES / 2;
+}
+
+/* drain this cpu's ring as one binary frame */
+void kvm_trace_flush(void)
+{
+        int cpu = smp_processor_id();
+        struct kvm_trace_ring *ring = &trace_rings[cpu];
+        struct kvm_trace_header hdr;
+        uint32_t head, tail, lost, start, n;
+
+        head = READ_ONCE(ring->head);
+        barrier();
+        tail = ring->tail;
+        lost = READ_ONCE(ring->lost);
+        if (head == tail && lost == lost_reported[cpu])
+                return;
+
+        memcpy(hdr.magic, KVM_TRACE_MAGIC, sizeof(hdr.magic));
+        hdr.version = KVM_TRACE_VERSION;
+        hdr.cpu = cpu;
+        hdr.nr_entries = head - tail;
+        hdr.lost = lost - lost_reported[cpu];
+        hdr.tsc_khz = tsc_khz;
+
+        console_lock();
+        porte9_write_raw(&hdr, sizeof(hdr));
+        while (tail != head) {
+                start = tail & (KVM_TRACE_NR_ENTRIES - 1);
+                n = min(head - tail, KVM_TRACE_NR_ENTRIES - start);
+                porte9_write_raw(&ring->entries[start], n * sizeof(struct kvm_trace_entry));
+                tail += n;
+        }
+        console_unlock();
+
+        lost_reported[cpu] = lost;
+        barrier();
+        WRITE_ONCE(ring->tail, tail);
+}
+
+/* flush periodically so that a quiet guest still shows up in the trace */
+uint64_t kvm_trace_tick(struct kvm_vcpu *vcpu, uint64_t now)
+{
+        int cpu = smp_processor_id();
+
+        if (!kvm_trace_enabled)
+                return 0;
+
+        if (next_flush[cpu] && now >= next_flush[cpu])
+                kvm_trace_flush();
+        if (now >= next_flush[cpu])
+                next_flush[cpu] = now + (uint64_t)TRACE_FLUSH_MS * tsc_khz;
+        return next_flush[cpu];
+}
+
+static int set_trace(const char *val)
+{
+        char *end;
+
+        kvm_trace_enabled = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("trace=", set_trace);
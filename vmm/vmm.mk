@@ -6,6 +6,7 @@ VMM_ISO         := $(basename $(VMM_ELF)).iso
 VMM_LDS         := $(O)/vmm/vmm.lds
 VMM_SRCS        += $(wildcard vmm/*.S) $(wildcard vmm/*.c)
 VMM_OBJS        := $(call object,$(VMM_SRCS))
+VMM_RELOCS      := $(O)/vmm/relocs
 
 VMM_PY          := $(O)/vmm/vmm.py
 
@@ -15,14 +16,31 @@ $(O)/vmm/vmm.ll: $(VMM_LLS)
 $(O)/vmm/firmware.o: $(FIRMWARE_BIN)
 $(O)/vmm/firmware.o: CFLAGS += -I $(O)/firmware
 
-$(VMM_ELF): $(VMM_LDS) $(VMM_OBJS) $(KERNEL_OBJS)
-	$(QUIET_LD)$(LD) -o $@ $(LDFLAGS) -T $(VMM_LDS) $(VMM_OBJS) $(KERNEL_OBJS)
+# the guest kernels share head.S but don't move themselves or start APs
+$(O)/vmm/head.o: CFLAGS += -DCONFIG_RELOCATABLE -DCONFIG_SMP
+
+# link twice: the first image, with an empty table, yields the relocations
+$(VMM_RELOCS).0.S:
+	$(Q)$(MKDIR_P) $(@D)
+	$(QUIET_PY3)$(PY3) vmm/relocs.py > $@
+
+$(VMM_RELOCS).0.elf: $(VMM_LDS) $(VMM_OBJS) $(KERNEL_OBJS) $(VMM_RELOCS).0.o
+	$(QUIET_LD)$(LD) -o $@ $(LDFLAGS) --emit-relocs -T $(VMM_LDS) $(VMM_OBJS) $(KERNEL_OBJS) $(VMM_RELOCS).0.o
+
+$(VMM_RELOCS).S: $(VMM_RELOCS).0.elf vmm/relocs.py
+	$(QUIET_PY3)$(PY3) vmm/relocs.py $< > $@
+
+$(VMM_RELOCS).0.o $(VMM_RELOCS).o: %.o: %.S
+	$(QUIET_CC)$(CC) -o $@ -c $(CFLAGS) $<
+
+$(VMM_ELF): $(VMM_LDS) $(VMM_OBJS) $(KERNEL_OBJS) $(VMM_RELOCS).o
+	$(QUIET_LD)$(LD) -o $@ $(LDFLAGS) -T $(VMM_LDS) $(VMM_OBJS) $(KERNEL_OBJS) $(VMM_RELOCS).o
 
 $(VMM_ISO): $(VMM_BIN) $(KERNEL) $(INITRD)
 	$(Q)-rm -rf $(@D)/iso
 	$(Q)$(MKDIR_P) $(@D)/iso/
 	$(Q)$(LN_S) $(realpath $(VMM_BIN)) $(@D)/iso/
-	$(Q)echo 'default mboot.c32 /$(notdir $(VMM_BIN)) --- /$(notdir $(KERNEL))$(if $(APPEND), $(APPEND))$(if $(INITRD), --- /$(notdir $(INITRD)))' > $(@D)/iso/isolinux.cfg
+	$(Q)echo 'default mboot.c32 /$(notdir $(VMM_BIN))$(if $(VMM_APPEND), $(VMM_APPEND)) --- /$(notdir $(KERNEL))$(if $(APPEND), $(APPEND))$(if $(INITRD), --- /$(notdir $(INITRD)))' > $(@D)/iso/isolinux.cfg
 	$(QUIET_GEN)$(call gen-iso)
 
 -include $(VMM_OBJS:.o=.d)
@@ -1,13 +1,21 @@
 #include <asm/apic.h>
 #include <asm/cpufeature.h>
 #include <asm/desc.h>
+#include <asm/init.h>
 #include <asm/kvm_host.h>
+#include <asm/kvm_snapshot.h>
+#include <asm/kvm_trace.h>
 #include <asm/mmu.h>
 #include <asm/msr.h>
+#include <asm/mtrr.h>
+#include <asm/traps.h>
 #include <asm/tsc.h>
 #include <asm/vmx.h>
+#include <sys/page_alloc.h>
+#include <sys/string.h>
 
 #define NR_AUTOLOAD_MSRS        8
+#define NR_INSN_CACHE           64
 
 extern const uint64_t vmx_return;
 
@@ -33,6 +41,26 @@ static struct vmx_capability {
         uint32_t vpid;
 } vmx_capability;
 
+/* the VMX-preemption timer counts down at this shift of the TSC rate */
+static int cpu_preemption_timer_rate;
+
+enum {
+        /* guest RDTSC/RDTSCP run natively, adjusted by TSC_OFFSET/TSC_MULTIPLIER */
+        TSC_MODE_OFFSET,
+        /* guest RDTSC/RDTSCP cause VM exits and are emulated */
+        TSC_MODE_EXIT,
+};
+
+static int tsc_mode = TSC_MODE_OFFSET;
+
+/* all vcpus share one VPID, as each runs on its own cpu */
+#define GUEST_VPID      1
+
+/* host TSC at which the guest TSC reads 0 */
+static uint64_t tsc_epoch;
+
+#define TSC_MULTIPLIER_FRAC_BITS        48
+
 #define VMX_SEGMENT_FIELD(seg)                                  \
         [VCPU_SREG_##seg] = {                                   \
                 .selector = GUEST_##seg##_SELECTOR,             \
@@ -81,21 +109,91 @@ static const char *vmx_msr_name[] = {
 #undef T
 };
 
+enum {
+        INSN_NONE,
+        /* indices into insn_patterns[] plus one */
+        INSN_SYSCALL,
+        INSN_SYSRET,
+};
+
+struct insn_cache_entry {
+        uint64_t cr3;
+        uint64_t rip;
+        const uint8_t *hva;
+        uint8_t kind;
+        uint8_t len;
+};
+
+/*
+ * VMCS fields cached for the duration of an exit.  Each one is read at
+ * most once per exit, and written back right before the next VM entry
+ * only if it was changed.  Exit-information fields are never written.
+ */
+enum {
+        VMX_CACHE_RFLAGS,
+        VMX_CACHE_CR0,
+        VMX_CACHE_CR3,
+        VMX_CACHE_CR4,
+        VMX_CACHE_INTERRUPTIBILITY,
+        VMX_CACHE_EXIT_QUAL,
+        VMX_CACHE_INSN_LEN,
+        VMX_CACHE_INTR_INFO,
+        NR_VMX_CACHE
+};
+
+static const unsigned long vmx_cache_fields[NR_VMX_CACHE] = {
+        [VMX_CACHE_RFLAGS]              = GUEST_RFLAGS,
+        [VMX_CACHE_CR0]                 = GUEST_CR0,
+        [VMX_CACHE_CR3]                 = GUEST_CR3,
+        [VMX_CACHE_CR4]                 = GUEST_CR4,
+        [VMX_CACHE_INTERRUPTIBILITY]    = GUEST_INTERRUPTIBILITY_INFO,
+        [VMX_CACHE_EXIT_QUAL]           = EXIT_QUALIFICATION,
+        [VMX_CACHE_INSN_LEN]            = VM_EXIT_INSTRUCTION_LEN,
+        [VMX_CACHE_INTR_INFO]           = VM_EXIT_INTR_INFO,
+};
+
 struct vcpu_vmx {
         struct kvm_vcpu vcpu;
+        struct vmcs *vmcs;
         uint64_t host_rsp;
         int fail;
         int launched;
+        bool preemption_timer;
+        /* guest TSC = (host TSC * tsc_multiplier >> 48) + tsc_offset */
+        uint64_t tsc_offset;
+        uint64_t tsc_multiplier;
+        uint32_t exit_reason;
+        uint64_t exit_tsc;
         struct msr_autoload {
                 struct vmx_msr_entry guest[NR_AUTOLOAD_MSRS];
                 struct vmx_msr_entry host[NR_AUTOLOAD_MSRS];
         } msr_autoload;
+        struct syscall_segs {
+                bool valid;
+                /* CS/SS bases and limits are known to be flat */
+                bool flat;
+                uint64_t star;
+                uint16_t kernel_cs, kernel_ss, user_cs, user_ss;
+                uint32_t kernel_cs_ar, kernel_ss_ar, user_cs_ar, user_ss_ar;
+        } syscall_segs;
+        struct insn_cache_entry insn_cache[NR_INSN_CACHE];
+        /* page-modification log, allocated when dirty logging first starts */
+        uint64_t *pml_pg;
+        struct vmcs_cache {
+                unsigned long val[NR_VMX_CACHE];
+                uint32_t avail;
+                uint32_t dirty;
+        } vmcs_cache;
 };
 
-static unsigned long msr_bitmap[PAGE_SIZE / sizeof(unsigned long)] __aligned(PAGE_SIZE);
-static DEFINE_PER_CPU(struct vmcs, vmxarea) __aligned(PAGE_SIZE);
-static DEFINE_PER_CPU(struct vmcs, current_vmcs) __aligned(PAGE_SIZE);
+static unsigned long *msr_bitmap;
 static DEFINE_PER_CPU(struct vcpu_vmx, current_vmx);
+/* vmread/vmwrite instructions executed, folded into the vcpu stats */
+static DEFINE_PER_CPU(uint64_t, nr_vmreads);
+static DEFINE_PER_CPU(uint64_t, nr_vmwrites);
+
+/* vmcs_cache=0 turns the cache off, to measure what it saves */
+static bool vmcs_cache_enabled = true;
 
 #define KVM_GUEST_CR0_ALWAYS_ON         (X86_CR0_WP | X86_CR0_NE)
 #define KVM_GUEST_CR4_ALWAYS_ON         (X86_CR4_VMXE)
@@ -110,11 +208,42 @@ static inline bool cpu_has_vmx_ept_2m_page(void)
         return vmx_capability.ept & VMX_EPT_2MB_PAGE_BIT;
 }
 
+static inline bool cpu_has_vmx_ept_1g_page(void)
+{
+        return vmx_capability.ept & VMX_EPT_1GB_PAGE_BIT;
+}
+
 static inline bool cpu_has_vmx_ept_4levels(void)
 {
         return vmx_capability.ept & VMX_EPT_PAGE_WALK_4_BIT;
 }
 
+static inline bool cpu_has_vmx_invept_context(void)
+{
+        return vmx_capability.ept & VMX_EPT_EXTENT_CONTEXT_BIT;
+}
+
+static inline bool cpu_has_vmx_ept_ad(void)
+{
+        return vmx_capability.ept & VMX_EPT_AD_BIT;
+}
+
+static inline bool cpu_has_vmx_pml(void)
+{
+        return (vmcs_config.cpu_based_2nd_exec_ctrl & SECONDARY_EXEC_ENABLE_PML) &&
+               cpu_has_vmx_ept_ad();
+}
+
+static inline bool cpu_has_vmx_tsc_scaling(void)
+{
+        return vmcs_config.cpu_based_2nd_exec_ctrl & SECONDARY_EXEC_TSC_SCALING;
+}
+
+static int vmx_max_cr3_targets(void)
+{
+        return (rdmsrl(MSR_IA32_VMX_MISC) & VMX_MISC_CR3_TARGETS_MASK) >> VMX_MISC_CR3_TARGETS_SHIFT;
+}
+
 static int vmx_cpu_has_kvm_support(void)
 {
         return this_cpu_has(X86_FEATURE_VMX);
@@ -168,6 +297,7 @@ static __always_inline unsigned long __vmcs_read(unsigned long field)
 {
         unsigned long value;
 
+        this_cpu_write(nr_vmreads, this_cpu_read(nr_vmreads) + 1);
         asm volatile("vmread %1, %0"
                      : "=a" (value) : "d" (field) : "cc");
         return value;
@@ -201,6 +331,7 @@ static __always_inline void __vmcs_write(unsigned long field, unsigned long valu
 {
         uint8_t error;
 
+        this_cpu_write(nr_vmwrites, this_cpu_read(nr_vmwrites) + 1);
         asm volatile("vmwrite %1, %2; setna %0"
                      : "=q" (error) : "a" (value), "d" (field) : "cc");
         if (error)
@@ -232,6 +363,106 @@ static __always_inline void __vmcs_write(unsigned long field, unsigned long valu
         __vmcs_write(field, value);     \
 })
 
+static unsigned long vmx_cache_read(struct vcpu_vmx *vmx, int i)
+{
+        struct vmcs_cache *c = &vmx->vmcs_cache;
+
+        if (!(c->avail & BIT_32(i))) {
+                c->val[i] = __vmcs_read(vmx_cache_fields[i]);
+                if (vmcs_cache_enabled)
+                        c->avail |= BIT_32(i);
+        }
+        return c->val[i];
+}
+
+static void vmx_cache_write(struct vcpu_vmx *vmx, int i, unsigned long val)
+{
+        struct vmcs_cache *c = &vmx->vmcs_cache;
+
+        if (!vmcs_cache_enabled) {
+                __vmcs_write(vmx_cache_fields[i], val);
+                return;
+        }
+        c->val[i] = val;
+        c->avail |= BIT_32(i);
+        c->dirty |= BIT_32(i);
+}
+
+/* write back dirty fields and registers before entering the guest */
+static void vmx_cache_flush(struct vcpu_vmx *vmx)
+{
+        struct kvm_vcpu *vcpu = &vmx->vcpu;
+        struct vmcs_cache *c = &vmx->vmcs_cache;
+        int i;
+
+        if (vcpu->regs_dirty & BIT_32(VCPU_REGS_RSP))
+                vmcs_writel(GUEST_RSP, vcpu->regs[VCPU_REGS_RSP]);
+        if (vcpu->regs_dirty & BIT_32(VCPU_REGS_RIP))
+                vmcs_writel(GUEST_RIP, vcpu->regs[VCPU_REGS_RIP]);
+        vcpu->regs_dirty = 0;
+
+        for (i = 0; c->dirty; ++i) {
+                if (c->dirty & BIT_32(i)) {
+                        __vmcs_write(vmx_cache_fields[i], c->val[i]);
+                        c->dirty &= ~BIT_32(i);
+                }
+        }
+}
+
+/* everything but the GPRs is stale after an exit */
+static void vmx_cache_reset(struct vcpu_vmx *vmx)
+{
+        vmx->vcpu.regs_avail = KVM_GPRS_ALWAYS_AVAIL;
+        vmx->vcpu.regs_dirty = 0;
+        vmx->vmcs_cache.avail = 0;
+        vmx->vmcs_cache.dirty = 0;
+}
+
+static void vmx_cache_reg(struct kvm_vcpu *vcpu, enum kvm_reg reg)
+{
+        switch (reg) {
+        case VCPU_REGS_RSP:
+                vcpu->regs[reg] = vmcs_readl(GUEST_RSP);
+                break;
+        case VCPU_REGS_RIP:
+                vcpu->regs[reg] = vmcs_readl(GUEST_RIP);
+                break;
+        default:
+                BUG();
+        }
+        if (vmcs_cache_enabled)
+                vcpu->regs_avail |= BIT_32(reg);
+}
+
+/*
+ * EPT accessed and dirty bits, on in every EPTP.  The processor sets them
+ * as it walks EPT, for PML and for finding idle guest pages.
+ */
+static bool enable_ept_ad = true;
+
+static bool vmx_has_ept_ad(void)
+{
+        return enable_ept_ad && cpu_has_vmx_ept_ad();
+}
+
+static int set_vmcs_cache(const char *val)
+{
+        char *end;
+
+        vmcs_cache_enabled = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("vmcs_cache=", set_vmcs_cache);
+
+static int set_ept_ad(const char *val)
+{
+        char *end;
+
+        enable_ept_ad = simple_strtoull(val, &end, 0);
+        return *end ? -1 : 0;
+}
+__setup("ept_ad=", set_ept_ad);
+
 static int vmx_disabled_by_bios(void)
 {
         uint64_t msr;
@@ -294,8 +525,7 @@ static int setup_vmcs_config(struct vmcs_config *vmcs_conf)
         min = 0
                 | CPU_BASED_USE_MSR_BITMAPS
                 | CPU_BASED_ACTIVATE_SECONDARY_CONTROLS
-		| CPU_BASED_RDTSC_EXITING
-                | CPU_BASED_CR3_LOAD_EXITING
+                | CPU_BASED_USE_TSC_OFFSETING
                 ;
         opt = 0;
         adjust_vmx_controls(min, opt, MSR_IA32_VMX_PROCBASED_CTLS,
@@ -314,12 +544,19 @@ static int setup_vmcs_config(struct vmcs_config *vmcs_conf)
         opt2 = 0
                 | SECONDARY_EXEC_RDTSCP
                 | SECONDARY_EXEC_ENABLE_INVPCID
+                | SECONDARY_EXEC_TSC_SCALING
+                | SECONDARY_EXEC_ENABLE_PML
                 ;
         adjust_vmx_controls(min2, opt2, MSR_IA32_VMX_PROCBASED_CTLS2,
                             &_cpu_based_2nd_exec_control);
 
-        /* CR3 accesses and invlpg don't need to cause VM Exits when EPT enabled */
-        _cpu_based_exec_control &= ~(// CPU_BASED_CR3_LOAD_EXITING |
+        /*
+         * CR3 accesses and invlpg don't need to cause VM Exits when EPT enabled.
+         * CR3-load exiting is turned back on by vmx_setup_cr3_exiting() if
+         * address spaces are tracked.  The VMM's cache of guest translations
+         * re-reads the guest's entries on every hit, so it needs no INVLPG.
+         */
+        _cpu_based_exec_control &= ~(CPU_BASED_CR3_LOAD_EXITING |
                                      CPU_BASED_CR3_STORE_EXITING |
                                      CPU_BASED_INVLPG_EXITING);
         rdmsr(MSR_IA32_VMX_EPT_VPID_CAP,
@@ -339,12 +576,17 @@ static int setup_vmcs_config(struct vmcs_config *vmcs_conf)
         adjust_vmx_controls(min, opt, MSR_IA32_VMX_EXIT_CTLS,
                             &_vmexit_control);
 
+        /* other CPUs kick this one out of the guest with NMIs */
         min = 0
+                | PIN_BASED_NMI_EXITING
                 ;
         opt = 0
+                | PIN_BASED_VMX_PREEMPTION_TIMER
                 ;
         adjust_vmx_controls(min, opt, MSR_IA32_VMX_PINBASED_CTLS,
                             &_pin_based_exec_control);
+        if (_pin_based_exec_control & PIN_BASED_VMX_PREEMPTION_TIMER)
+                cpu_preemption_timer_rate = rdmsrl(MSR_IA32_VMX_MISC) & VMX_MISC_PREEMPTION_TIMER_RATE_MASK;
 
         min = 0
                 | VM_ENTRY_LOAD_DEBUG_CONTROLS
@@ -428,6 +670,10 @@ static int vmx_hardware_setup(void)
 
         setup_vmcs_config(&vmcs_config);
 
+        msr_bitmap = get_zeroed_page(PAGE_TYPE_BITMAP);
+        if (!msr_bitmap)
+                panic("vmx: cannot allocate MSR bitmap\n");
+
         if (!cpu_has_vmx_ept_2m_page())
                 panic("vmx: no support for 2MB EPT pages\n");
 
@@ -440,16 +686,12 @@ static int vmx_hardware_setup(void)
         set_msr_interception(MSR_IA32_APICBASE, 0, 1);
 
         /*
-         * Intel DM 33.5 suggests a VMM can put a guest in the wait-for-SIPI
-         * activity state and use INIT-SIPI-SIPI to wake it up.  However,
-         * it's unclear how this work:
-         * - Bochs causes a vmexit upon INIT and subsequent vmentries fail.
-         * - KVM seems to block INIT/SIPI.
-         *
-         * To be safe, intercept INIT and SIPI from sender's ICR and emulate
-         * the startup algorithm with NMI.
+         * Each guest CPU runs on the CPU with the same APIC ID, so INIT and
+         * SIPI from the guest, through the xAPIC page or the x2APIC ICR,
+         * go straight to the CPU of the target vcpu.  There INIT causes a
+         * VM exit, and the vcpu waits in the wait-for-SIPI activity state,
+         * where SIPI causes another (Intel SDM 33.5).
          */
-        set_msr_interception(APIC_BASE_MSR + (APIC_ICR >> 4), 0, 1);
 
         /*
          * MSR_IA32_FEATURE_CONTROL is already locked so it's okay to
@@ -465,9 +707,28 @@ static int vmx_hardware_setup(void)
 	/* intercept write into efer to disable SCE */
 	set_msr_interception(MSR_EFER, 0, 1);
 
+        /*
+         * The guest TSC is offset (and maybe scaled) from the host TSC, so a
+         * write to the TSC or the TSC deadline has to be translated rather
+         * than go to the host.  RDMSR of the TSC already applies the offset.
+         */
+        set_msr_interception(MSR_IA32_TSC, 0, 1);
+        set_msr_interception(MSR_IA32_TSC_DEADLINE, 1, 1);
+
+        /* the guest has its own MTRRs, which go into the EPT memory types */
+        for (i = MTRRphysBase_MSR(0); i <= MSR_MTRRdefType; ++i) {
+                if (is_mtrr_msr(i))
+                        set_msr_interception(i, 1, 1);
+        }
+
         return 0;
 }
 
+static int vmx_get_lpage_level(void)
+{
+        return cpu_has_vmx_ept_1g_page() ? 3 : 2;
+}
+
 static void kvm_cpu_vmxon(uint64_t addr)
 {
         asm volatile("vmxon %0" : : "m" (addr) : "memory", "cc");
@@ -484,6 +745,17 @@ static void vmcs_load(uint64_t addr)
                 panic("vmx: vmptrld %" PRIx64 "failed\n", addr);
 }
 
+static void vmcs_clear(uint64_t addr)
+{
+        uint8_t error;
+
+        asm volatile ("vmclear %1; setna %0"
+                        : "=qm" (error) : "m" (addr)
+                        : "cc", "memory");
+        if (error)
+                panic("vmx: vmclear %" PRIx64 "failed\n", addr);
+}
+
 static struct kvm_vcpu *vmx_vcpu_enable(void)
 {
         struct vmcs *vmxon, *vmcs;
@@ -502,17 +774,59 @@ static struct kvm_vcpu *vmx_vcpu_enable(void)
                 wrmsrl(MSR_IA32_FEATURE_CONTROL, old | test_bits);
         cr4_set_bits(X86_CR4_VMXE);
 
-        vmxon = this_cpu_ptr(&vmxarea);
+        vmxon = get_zeroed_page(PAGE_TYPE_VMCS);
+        vmcs = get_zeroed_page(PAGE_TYPE_VMCS);
+        if (!vmxon || !vmcs)
+                panic("vmx: cannot allocate VMCS\n");
+
         vmxon->revision_id = vmcs_config.revision_id;
         kvm_cpu_vmxon(__pa(vmxon));
 
-        vmcs = this_cpu_ptr(&current_vmcs);
         vmcs->revision_id = vmcs_config.revision_id;
         vmcs_load(__pa(vmcs));
 
+        this_cpu_ptr(&current_vmx)->vmcs = vmcs;
         return &this_cpu_ptr(&current_vmx)->vcpu;
 }
 
+/* another vcpu on this cpu, after vmx_vcpu_enable(); its VMCS is loaded */
+static struct kvm_vcpu *vmx_vcpu_create(void)
+{
+        unsigned int order = get_order(sizeof(struct vcpu_vmx));
+        struct vcpu_vmx *vmx;
+
+        vmx = alloc_pages(order, PAGE_TYPE_OTHER);
+        if (!vmx)
+                return NULL;
+        memset(vmx, 0, sizeof(*vmx));
+        vmx->vmcs = get_zeroed_page(PAGE_TYPE_VMCS);
+        if (!vmx->vmcs) {
+                free_pages(vmx, order);
+                return NULL;
+        }
+        vmx->vmcs->revision_id = vmcs_config.revision_id;
+        vmcs_clear(__pa(vmx->vmcs));
+        vmcs_load(__pa(vmx->vmcs));
+        return &vmx->vcpu;
+}
+
+static void vmx_vcpu_load(struct kvm_vcpu *vcpu)
+{
+        vmcs_load(__pa(to_vmx(vcpu)->vmcs));
+}
+
+/* a vcpu from vmx_vcpu_create(), which must not be loaded */
+static void vmx_vcpu_free(struct kvm_vcpu *vcpu)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+
+        vmcs_clear(__pa(vmx->vmcs));
+        free_page(vmx->vmcs);
+        if (vmx->pml_pg)
+                free_page(vmx->pml_pg);
+        free_pages(vmx, get_order(sizeof(struct vcpu_vmx)));
+}
+
 /*
  * Consistency requirements:
  * - EFER.LMA == VM-entry control's 64-bit guest mode bit
@@ -554,8 +868,10 @@ static void exit_lmode(struct kvm_vcpu *vcpu)
 
 static void vmx_set_cr0(struct kvm_vcpu *vcpu, unsigned long cr0)
 {
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+
         if (vmcs_read64(GUEST_IA32_EFER) & EFER_LME) {
-                unsigned long old_cr0 = vmcs_readl(GUEST_CR0);
+                unsigned long old_cr0 = vmx_cache_read(vmx, VMX_CACHE_CR0);
 
                 if (!(old_cr0 & X86_CR0_PG) && (cr0 & X86_CR0_PG))
                         enter_lmode(vcpu);
@@ -563,17 +879,78 @@ static void vmx_set_cr0(struct kvm_vcpu *vcpu, unsigned long cr0)
                         exit_lmode(vcpu);
         }
 
-        vmcs_writel(GUEST_CR0, cr0 | KVM_GUEST_CR0_ALWAYS_ON);
+        vmx_cache_write(vmx, VMX_CACHE_CR0, cr0 | KVM_GUEST_CR0_ALWAYS_ON);
 }
 
 static void vmx_set_cr3(struct kvm_vcpu *vcpu, unsigned long cr3)
 {
-        vmcs_writel(GUEST_CR3, cr3);
+        vmx_cache_write(to_vmx(vcpu), VMX_CACHE_CR3, cr3);
+}
+
+static unsigned long vmx_get_cr0(struct kvm_vcpu *vcpu)
+{
+        return vmx_cache_read(to_vmx(vcpu), VMX_CACHE_CR0);
+}
+
+static unsigned long vmx_get_cr3(struct kvm_vcpu *vcpu)
+{
+        return vmx_cache_read(to_vmx(vcpu), VMX_CACHE_CR3);
+}
+
+static unsigned long vmx_get_cr4(struct kvm_vcpu *vcpu)
+{
+        return vmx_cache_read(to_vmx(vcpu), VMX_CACHE_CR4);
+}
+
+static uint64_t vmx_get_efer(struct kvm_vcpu *vcpu)
+{
+        return vmcs_read64(GUEST_IA32_EFER);
+}
+
+static void vmx_get_pdptrs(struct kvm_vcpu *vcpu, uint64_t *pdptrs)
+{
+        pdptrs[0] = vmcs_read64(GUEST_PDPTR0);
+        pdptrs[1] = vmcs_read64(GUEST_PDPTR1);
+        pdptrs[2] = vmcs_read64(GUEST_PDPTR2);
+        pdptrs[3] = vmcs_read64(GUEST_PDPTR3);
+}
+
+/*
+ * With EPT, VM entry loads the PAE PDPTEs from the VMCS rather than from
+ * memory (Intel SDM 26.3.2.4), so an emulated write to CR0, CR3 or CR4
+ * has to load them as the CPU would.
+ */
+static void vmx_load_pdptrs(struct kvm_vcpu *vcpu)
+{
+        struct x86_exception fault;
+        uint64_t *pdptes, hpa;
+
+        if (!(vmx_get_cr0(vcpu) & X86_CR0_PG) || !(vmx_get_cr4(vcpu) & X86_CR4_PAE) ||
+            (vmx_get_efer(vcpu) & EFER_LMA))
+                return;
+        if (kvm_gpa_to_hpa(vcpu, vmx_get_cr3(vcpu) & 0xffffffe0, 0, &hpa, &fault))
+                panic("vmx: PDPTEs at 0x%08lx not in guest memory\n", vmx_get_cr3(vcpu));
+        pdptes = __va(hpa);
+        vmcs_write64(GUEST_PDPTR0, pdptes[0]);
+        vmcs_write64(GUEST_PDPTR1, pdptes[1]);
+        vmcs_write64(GUEST_PDPTR2, pdptes[2]);
+        vmcs_write64(GUEST_PDPTR3, pdptes[3]);
+}
+
+/* CR3 loads of these values don't cause VM exits */
+static void vmx_set_cr3_targets(struct kvm_vcpu *vcpu, const uint64_t *cr3s, int n)
+{
+        int i;
+
+        BUG_ON(n > 4);
+        for (i = 0; i < n; ++i)
+                __vmcs_write(CR3_TARGET_VALUE0 + i * 2, cr3s[i]);
+        vmcs_write32(CR3_TARGET_COUNT, n);
 }
 
 static void vmx_set_cr4(struct kvm_vcpu *vcpu, unsigned long cr4)
 {
-        vmcs_writel(GUEST_CR4, cr4 | KVM_GUEST_CR4_ALWAYS_ON);
+        vmx_cache_write(to_vmx(vcpu), VMX_CACHE_CR4, cr4 | KVM_GUEST_CR4_ALWAYS_ON);
 }
 
 static inline unsigned long get_tr_base(void)
@@ -592,12 +969,113 @@ static inline unsigned long get_tr_base(void)
                ((unsigned long)desc->base3 << 32);
 }
 
+/* (a << 48) / b without 128-bit division, for a, b < 2^32 */
+static uint64_t tsc_ratio(uint64_t a, uint64_t b)
+{
+        uint64_t q = a / b, r = a % b, frac;
+
+        r <<= 24;
+        frac = r / b;
+        r = (r % b) << 24;
+        frac = (frac << 24) | (r / b);
+        return (q << TSC_MULTIPLIER_FRAC_BITS) | frac;
+}
+
+static uint64_t vmx_scale_tsc(struct vcpu_vmx *vmx, uint64_t host_tsc)
+{
+        if (!vmx->tsc_multiplier)
+                return host_tsc;
+        return ((unsigned __int128)host_tsc * vmx->tsc_multiplier) >> TSC_MULTIPLIER_FRAC_BITS;
+}
+
+static uint64_t vmx_read_guest_tsc(struct vcpu_vmx *vmx, uint64_t host_tsc)
+{
+        return vmx_scale_tsc(vmx, host_tsc) + vmx->tsc_offset;
+}
+
+/* the host TSC at which the guest TSC reads guest_tsc, at least 1 */
+static uint64_t vmx_host_tsc(struct vcpu_vmx *vmx, uint64_t guest_tsc)
+{
+        int64_t delta = guest_tsc - vmx->tsc_offset;
+        uint64_t host_tsc, hi, lo;
+
+        if (delta <= 0)
+                return 1;
+        host_tsc = delta;
+        if (vmx->tsc_multiplier) {
+                hi = host_tsc >> (64 - TSC_MULTIPLIER_FRAC_BITS);
+                lo = host_tsc << TSC_MULTIPLIER_FRAC_BITS;
+                /* too far away to arm */
+                if (hi >= vmx->tsc_multiplier)
+                        return ~UINT64_C(0);
+                asm("divq %2" : "=a" (host_tsc), "+d" (hi) : "rm" (vmx->tsc_multiplier), "a" (lo));
+        }
+        return host_tsc ? : 1;
+}
+
+/*
+ * The guest TSC starts from zero and, if the guest asks for a different
+ * frequency with tsc_khz=, runs at that rate via TSC scaling.  The same
+ * offset and multiplier are used to emulate RDTSC(P) in the exit mode,
+ * so switching modes doesn't change what the guest observes.
+ */
+static void vmx_setup_tsc(struct vcpu_vmx *vmx)
+{
+        uint32_t exec, exec2;
+
+        exec = vmcs_read32(CPU_BASED_VM_EXEC_CONTROL);
+        exec2 = vmcs_read32(SECONDARY_VM_EXEC_CONTROL);
+
+        vmx->tsc_multiplier = 0;
+        if (kvm_guest_tsc_khz && kvm_guest_tsc_khz != tsc_khz) {
+                if (cpu_has_vmx_tsc_scaling())
+                        vmx->tsc_multiplier = tsc_ratio(kvm_guest_tsc_khz, tsc_khz);
+                else
+                        pr_warn("vmx: no TSC scaling; guest TSC runs at %lu kHz\n", tsc_khz);
+        }
+
+        if (vmx->tsc_multiplier) {
+                exec2 |= SECONDARY_EXEC_TSC_SCALING;
+                vmcs_write64(TSC_MULTIPLIER, vmx->tsc_multiplier);
+        } else {
+                exec2 &= ~SECONDARY_EXEC_TSC_SCALING;
+        }
+
+        /* the guest TSC starts at 0 when the first vcpu is set up, on all vcpus */
+        if (!tsc_epoch)
+                tsc_epoch = rdtsc();
+        vmx->tsc_offset = -vmx_scale_tsc(vmx, tsc_epoch);
+        vmcs_write64(TSC_OFFSET, vmx->tsc_offset);
+
+        if (tsc_mode == TSC_MODE_EXIT)
+                exec |= CPU_BASED_RDTSC_EXITING;
+        else
+                exec &= ~CPU_BASED_RDTSC_EXITING;
+
+        vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, exec);
+        vmcs_write32(SECONDARY_VM_EXEC_CONTROL, exec2);
+}
+
+static void vmx_setup_cr3_exiting(struct kvm_vcpu *vcpu)
+{
+        uint32_t exec = vmcs_read32(CPU_BASED_VM_EXEC_CONTROL);
+
+        if (kvm_cr3_track == KVM_CR3_TRACK_OFF)
+                exec &= ~CPU_BASED_CR3_LOAD_EXITING;
+        else
+                exec |= CPU_BASED_CR3_LOAD_EXITING;
+        vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, exec);
+        vmcs_write32(CR3_TARGET_COUNT, 0);
+}
+
 static void vmx_vcpu_setup(struct kvm_vcpu *vcpu)
 {
         struct vcpu_vmx *vmx = to_vmx(vcpu);
         struct desc_ptr dt;
         size_t i, nmsrs;
 
+        vmx_cache_reset(vmx);
+
         /* I/O: pass through */
 
         /* MSR */
@@ -606,16 +1084,19 @@ static void vmx_vcpu_setup(struct kvm_vcpu *vcpu)
         vmcs_write64(VMCS_LINK_POINTER, ~UINT64_C(0));
 
         /* Control */
-        vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, vmcs_config.pin_based_exec_ctrl);
+        /* the preemption timer is enabled on demand by vmx_update_preemption_timer() */
+        vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, vmcs_config.pin_based_exec_ctrl & ~PIN_BASED_VMX_PREEMPTION_TIMER);
         vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, vmcs_config.cpu_based_exec_ctrl);
-        vmcs_write32(SECONDARY_VM_EXEC_CONTROL, vmcs_config.cpu_based_2nd_exec_ctrl);
+        /* PML is enabled on demand by vmx_set_pml() */
+        vmcs_write32(SECONDARY_VM_EXEC_CONTROL, vmcs_config.cpu_based_2nd_exec_ctrl & ~SECONDARY_EXEC_ENABLE_PML);
         vmcs_write32(VM_EXIT_CONTROLS, vmcs_config.vmexit_ctrl);
         vmcs_write32(VM_ENTRY_CONTROLS, vmcs_config.vmentry_ctrl);
+        vmx_setup_tsc(vmx);
 
 	vmcs_write32(EXCEPTION_BITMAP, (1 << 6) | (1 << 14));
         vmcs_write32(PAGE_FAULT_ERROR_CODE_MASK, 0);
         vmcs_write32(PAGE_FAULT_ERROR_CODE_MATCH, 0);
-        vmcs_write32(CR3_TARGET_COUNT, 0);
+        vmx_setup_cr3_exiting(vcpu);
 
         BUILD_BUG_ON(ARRAY_SIZE(vmx_msr_index) > NR_AUTOLOAD_MSRS);
         nmsrs = ARRAY_SIZE(vmx_msr_index);
@@ -730,7 +1211,10 @@ static void vmx_vcpu_setup(struct kvm_vcpu *vcpu)
 
         vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, 0);
 
-        vmcs_write16(VIRTUAL_PROCESSOR_ID, 1);
+        if (vmcs_config.vmentry_ctrl & VM_ENTRY_LOAD_IA32_PAT)
+                vmcs_write64(GUEST_IA32_PAT, MSR_IA32_CR_PAT_DEFAULT);
+
+        vmcs_write16(VIRTUAL_PROCESSOR_ID, GUEST_VPID);
 
         /* initial CR0: NW and CD are set; ET is hard-wired to be 1 */
         vmcs_writel(CR0_GUEST_HOST_MASK, KVM_GUEST_CR0_ALWAYS_ON);
@@ -744,16 +1228,230 @@ static void vmx_vcpu_setup(struct kvm_vcpu *vcpu)
         vmx_set_cr4(vcpu, 0);
 }
 
+/*
+ * Back to the state after INIT, waiting for SIPI (see handle_sipi()).
+ * EPT and dirty logging are the VMM's and stay.
+ */
+static void vmx_vcpu_reset(struct kvm_vcpu *vcpu)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+        uint32_t pml;
+
+        if (!(rdmsrl(MSR_IA32_VMX_MISC) & VMX_MISC_ACTIVITY_WAIT_SIPI))
+                panic("vmx: no support for the wait-for-SIPI activity state\n");
+
+        pml = vmcs_read32(SECONDARY_VM_EXEC_CONTROL) & SECONDARY_EXEC_ENABLE_PML;
+        memset(vcpu->regs, 0, sizeof(vcpu->regs));
+        vmx_vcpu_setup(vcpu);
+        vmcs_write32(SECONDARY_VM_EXEC_CONTROL, vmcs_read32(SECONDARY_VM_EXEC_CONTROL) | pml);
+        vmcs_writel(GUEST_RSP, 0);
+
+        vmx->syscall_segs.valid = false;
+        vmx->syscall_segs.flat = false;
+        memset(vmx->insn_cache, 0, sizeof(vmx->insn_cache));
+        kvm_mmu_flush_tlb(vcpu);
+
+        vmcs_write32(GUEST_ACTIVITY_STATE, GUEST_ACTIVITY_WAIT_SIPI);
+        vcpu->activity_state = KVM_ACTIVITY_WAIT_SIPI;
+}
+
 static void vmx_set_tdp(struct kvm_vcpu *vcpu, unsigned long tdp)
 {
         vmcs_write64(EPT_POINTER, tdp
                         | VMX_EPT_DEFAULT_MT
-                        | (VMX_EPT_DEFAULT_GAW << VMX_EPT_GAW_EPTP_SHIFT));
+                        | (VMX_EPT_DEFAULT_GAW << VMX_EPT_GAW_EPTP_SHIFT)
+                        | (vmx_has_ept_ad() ? VMX_EPT_AD_ENABLE_BIT : 0));
+}
+
+static uint64_t vmx_get_tdp(struct kvm_vcpu *vcpu)
+{
+        return vmcs_read64(EPT_POINTER);
+}
+
+static inline void __invept(unsigned long ext, uint64_t eptp)
+{
+        struct {
+                uint64_t eptp, gpa;
+        } operand = { eptp, 0 };
+
+        asm volatile("invept %0, %1" : : "m" (operand), "r" (ext) : "memory", "cc");
+}
+
+static void vmx_flush_tdp(struct kvm_vcpu *vcpu)
+{
+        if (cpu_has_vmx_invept_context())
+                __invept(VMX_EPT_EXTENT_CONTEXT, vmx_get_tdp(vcpu));
+        else
+                __invept(VMX_EPT_EXTENT_GLOBAL, 0);
+}
+
+#define PML_ENTITY_NUM          512
+
+static bool vmx_has_pml(void)
+{
+        return cpu_has_vmx_pml() && vmx_has_ept_ad();
+}
+
+/* move the logged addresses to the dirty log and reset the index */
+static void vmx_flush_pml(struct kvm_vcpu *vcpu)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+        uint16_t index;
+
+        index = vmcs_read16(GUEST_PML_INDEX);
+        /* the index wraps to 0xffff when the buffer is full */
+        if (index >= PML_ENTITY_NUM)
+                index = 0;
+        else
+                ++index;
+        for (; index < PML_ENTITY_NUM; ++index)
+                kvm_dirty_log_mark(vmx->pml_pg[index]);
+        vmcs_write16(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
+}
+
+/* PML needs EPT A/D bits, which vmx_set_tdp() turns on */
+static void vmx_set_pml(struct kvm_vcpu *vcpu, bool enable)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+        uint32_t exec2 = vmcs_read32(SECONDARY_VM_EXEC_CONTROL);
+
+        if (enable) {
+                if (!vmx->pml_pg)
+                        vmx->pml_pg = alloc_page(PAGE_TYPE_OTHER);
+                if (!vmx->pml_pg)
+                        panic("vmx: cannot allocate PML buffer\n");
+                vmcs_write64(PML_ADDRESS, __pa(vmx->pml_pg));
+                vmcs_write16(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
+                exec2 |= SECONDARY_EXEC_ENABLE_PML;
+        } else {
+                vmx_flush_pml(vcpu);
+                exec2 &= ~SECONDARY_EXEC_ENABLE_PML;
+        }
+        vmcs_write32(SECONDARY_VM_EXEC_CONTROL, exec2);
+        vmx_flush_tdp(vcpu);
+}
+
+/* the VMCS guest state besides the GPRs, RIP, and RSP */
+static void vmx_save_state(struct kvm_vcpu *vcpu, struct kvm_snapshot_cpu *s)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+        size_t i;
+
+        vmx_cache_flush(vmx);
+
+        s->rflags = vmcs_readl(GUEST_RFLAGS);
+        s->cr0 = vmcs_readl(GUEST_CR0);
+        s->cr0_shadow = vmcs_readl(CR0_READ_SHADOW);
+        s->cr3 = vmcs_readl(GUEST_CR3);
+        s->cr4 = vmcs_readl(GUEST_CR4);
+        s->cr4_shadow = vmcs_readl(CR4_READ_SHADOW);
+        s->dr7 = vmcs_readl(GUEST_DR7);
+        s->efer = vmcs_read64(GUEST_IA32_EFER);
+        if (vmcs_config.vmentry_ctrl & VM_ENTRY_LOAD_IA32_PAT)
+                s->pat = vmcs_read64(GUEST_IA32_PAT);
+        s->sysenter_cs = vmcs_read32(GUEST_SYSENTER_CS);
+        s->sysenter_esp = vmcs_readl(GUEST_SYSENTER_ESP);
+        s->sysenter_eip = vmcs_readl(GUEST_SYSENTER_EIP);
+        s->pending_dbg = vmcs_readl(GUEST_PENDING_DBG_EXCEPTIONS);
+        s->pdptr[0] = vmcs_read64(GUEST_PDPTR0);
+        s->pdptr[1] = vmcs_read64(GUEST_PDPTR1);
+        s->pdptr[2] = vmcs_read64(GUEST_PDPTR2);
+        s->pdptr[3] = vmcs_read64(GUEST_PDPTR3);
+        s->gdtr_base = vmcs_readl(GUEST_GDTR_BASE);
+        s->gdtr_limit = vmcs_read32(GUEST_GDTR_LIMIT);
+        s->idtr_base = vmcs_readl(GUEST_IDTR_BASE);
+        s->idtr_limit = vmcs_read32(GUEST_IDTR_LIMIT);
+        s->interruptibility = vmcs_read32(GUEST_INTERRUPTIBILITY_INFO);
+        s->activity = vmcs_read32(GUEST_ACTIVITY_STATE);
+
+        BUILD_BUG_ON(ARRAY_SIZE(kvm_vmx_segment_fields) != KVM_SNAPSHOT_NR_SEGS);
+        for (i = 0; i < ARRAY_SIZE(kvm_vmx_segment_fields); ++i) {
+                const struct kvm_vmx_segment_field *sf = &kvm_vmx_segment_fields[i];
+
+                s->segs[i].base = __vmcs_read(sf->base);
+                s->segs[i].limit = __vmcs_read(sf->limit);
+                s->segs[i].ar = __vmcs_read(sf->ar_bytes);
+                s->segs[i].selector = __vmcs_read(sf->selector);
+        }
+
+        BUILD_BUG_ON(ARRAY_SIZE(vmx_msr_index) > KVM_SNAPSHOT_NR_MSRS);
+        s->nr_msrs = ARRAY_SIZE(vmx_msr_index);
+        for (i = 0; i < s->nr_msrs; ++i) {
+                s->msrs[i].index = vmx->msr_autoload.guest[i].index;
+                s->msrs[i].value = vmx->msr_autoload.guest[i].value;
+        }
+
+        s->tsc = vmx_read_guest_tsc(vmx, rdtsc());
+}
+
+/* the inverse of vmx_save_state(), on a vcpu fresh from vmx_vcpu_setup() */
+static void vmx_load_state(struct kvm_vcpu *vcpu, const struct kvm_snapshot_cpu *s)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+        uint32_t entry = vmcs_read32(VM_ENTRY_CONTROLS);
+        size_t i, j;
+
+        /* drop what vmx_vcpu_setup() left in the cache */
+        vmx_cache_reset(vmx);
+
+        vmcs_writel(GUEST_RFLAGS, s->rflags);
+        vmcs_writel(GUEST_CR0, s->cr0);
+        vmcs_writel(CR0_READ_SHADOW, s->cr0_shadow);
+        vmcs_writel(GUEST_CR3, s->cr3);
+        vmcs_writel(GUEST_CR4, s->cr4);
+        vmcs_writel(CR4_READ_SHADOW, s->cr4_shadow);
+        vmcs_writel(GUEST_DR7, s->dr7);
+        vmcs_write64(GUEST_IA32_EFER, s->efer);
+        if (vmcs_config.vmentry_ctrl & VM_ENTRY_LOAD_IA32_PAT)
+                vmcs_write64(GUEST_IA32_PAT, s->pat);
+        vmcs_write32(GUEST_SYSENTER_CS, s->sysenter_cs);
+        vmcs_writel(GUEST_SYSENTER_ESP, s->sysenter_esp);
+        vmcs_writel(GUEST_SYSENTER_EIP, s->sysenter_eip);
+        vmcs_writel(GUEST_PENDING_DBG_EXCEPTIONS, s->pending_dbg);
+        vmcs_write64(GUEST_PDPTR0, s->pdptr[0]);
+        vmcs_write64(GUEST_PDPTR1, s->pdptr[1]);
+        vmcs_write64(GUEST_PDPTR2, s->pdptr[2]);
+        vmcs_write64(GUEST_PDPTR3, s->pdptr[3]);
+        vmcs_writel(GUEST_GDTR_BASE, s->gdtr_base);
+        vmcs_write32(GUEST_GDTR_LIMIT, s->gdtr_limit);
+        vmcs_writel(GUEST_IDTR_BASE, s->idtr_base);
+        vmcs_write32(GUEST_IDTR_LIMIT, s->idtr_limit);
+        vmcs_write32(GUEST_INTERRUPTIBILITY_INFO, s->interruptibility);
+        vmcs_write32(GUEST_ACTIVITY_STATE, s->activity);
+
+        if (s->efer & EFER_LMA)
+                entry |= VM_ENTRY_IA32E_MODE;
+        else
+                entry &= ~VM_ENTRY_IA32E_MODE;
+        vmcs_write32(VM_ENTRY_CONTROLS, entry);
+
+        for (i = 0; i < ARRAY_SIZE(kvm_vmx_segment_fields); ++i) {
+                const struct kvm_vmx_segment_field *sf = &kvm_vmx_segment_fields[i];
+
+                __vmcs_write(sf->base, s->segs[i].base);
+                __vmcs_write(sf->limit, s->segs[i].limit);
+                __vmcs_write(sf->ar_bytes, s->segs[i].ar);
+                __vmcs_write(sf->selector, s->segs[i].selector);
+        }
+        vmx->syscall_segs.valid = false;
+        vmx->syscall_segs.flat = false;
+        memset(vmx->insn_cache, 0, sizeof(vmx->insn_cache));
+
+        /* by index, in case the list changed */
+        for (i = 0; i < ARRAY_SIZE(vmx_msr_index); ++i) {
+                for (j = 0; j < min((size_t)s->nr_msrs, (size_t)KVM_SNAPSHOT_NR_MSRS); ++j) {
+                        if (s->msrs[j].index == vmx->msr_autoload.guest[i].index)
+                                vmx->msr_autoload.guest[i].value = s->msrs[j].value;
+                }
+        }
+
+        vmx->tsc_offset = s->tsc - vmx_scale_tsc(vmx, rdtsc());
+        vmcs_write64(TSC_OFFSET, vmx->tsc_offset);
 }
 
 static bool is_real_mode(struct kvm_vcpu *vcpu)
 {
-        return !(vmcs_readl(GUEST_CR0) & X86_CR0_PE);
+        return !(vmx_get_cr0(vcpu) & X86_CR0_PE);
 }
 
 static int vmx_get_cpl(struct kvm_vcpu *vcpu)
@@ -808,6 +1506,8 @@ static void vmx_set_segment(struct kvm_vcpu *vcpu, struct kvm_segment *var, int
 {
         const struct kvm_vmx_segment_field *sf = &kvm_vmx_segment_fields[seg];
 
+        to_vmx(vcpu)->syscall_segs.flat = false;
+
         __vmcs_write(sf->base, var->base);
         __vmcs_write(sf->limit, var->limit);
         __vmcs_write(sf->selector, var->selector);
@@ -816,27 +1516,85 @@ static void vmx_set_segment(struct kvm_vcpu *vcpu, struct kvm_segment *var, int
 
 static unsigned long vmx_get_rflags(struct kvm_vcpu *vcpu)
 {
-        return vmcs_readl(GUEST_RFLAGS);
+        return vmx_cache_read(to_vmx(vcpu), VMX_CACHE_RFLAGS);
 }
 
 static void vmx_set_rflags(struct kvm_vcpu *vcpu, unsigned long rflags)
 {
-        vmcs_writel(GUEST_RFLAGS, rflags);
+        vmx_cache_write(to_vmx(vcpu), VMX_CACHE_RFLAGS, rflags);
 }
 
 static unsigned long vmx_get_rip(struct kvm_vcpu *vcpu)
 {
-        return vmcs_readl(GUEST_RIP);
+        return kvm_register_read(vcpu, VCPU_REGS_RIP);
 }
 
 static void vmx_set_rip(struct kvm_vcpu *vcpu, unsigned long rip)
 {
-        vmcs_writel(GUEST_RIP, rip);
+        kvm_register_write(vcpu, VCPU_REGS_RIP, rip);
+}
+
+/*
+ * Arm the VMX-preemption timer so that the guest exits no later than
+ * the next periodic work; disable it when there is nothing to do.
+ */
+static void vmx_update_preemption_timer(struct kvm_vcpu *vcpu, uint64_t now)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+        bool enable = vcpu->next_tick != 0;
+        uint64_t delta;
+
+        if (!(vmcs_config.pin_based_exec_ctrl & PIN_BASED_VMX_PREEMPTION_TIMER))
+                return;
+
+        if (enable != vmx->preemption_timer) {
+                uint32_t pin = vmcs_read32(PIN_BASED_VM_EXEC_CONTROL);
+
+                if (enable)
+                        pin |= PIN_BASED_VMX_PREEMPTION_TIMER;
+                else
+                        pin &= ~PIN_BASED_VMX_PREEMPTION_TIMER;
+                vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, pin);
+                vmx->preemption_timer = enable;
+        }
+
+        if (!enable)
+                return;
+
+        delta = vcpu->next_tick > now ? vcpu->next_tick - now : 0;
+        delta >>= cpu_preemption_timer_rate;
+        vmcs_write32(VMX_PREEMPTION_TIMER_VALUE, min_t(uint64_t, delta, UINT32_MAX));
+}
+
+/* an NMI the guest can't take yet is tried again at the next entry */
+static void vmx_inject_nmi(struct kvm_vcpu *vcpu)
+{
+        uint32_t intr = vmx_cache_read(to_vmx(vcpu), VMX_CACHE_INTERRUPTIBILITY);
+
+        if (intr & (GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS | GUEST_INTR_STATE_NMI)) {
+                WRITE_ONCE(vcpu->nmi_pending, true);
+                return;
+        }
+        vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, X86_TRAP_NMI | INTR_TYPE_NMI_INTR | INTR_INFO_VALID_MASK);
 }
 
 static void vmx_vcpu_run(struct kvm_vcpu *vcpu)
 {
         struct vcpu_vmx *vmx = to_vmx(vcpu);
+        uint64_t now = rdtsc();
+
+        /* account the exit-to-entry round trip to the previous exit */
+        if (vmx->exit_tsc)
+                kvm_stat_roundtrip(vcpu, vmx->exit_reason, now - vmx->exit_tsc);
+
+        vmx_update_preemption_timer(vcpu, now);
+        /* an NMI for the guest taken in the VMM, unless an event is pending */
+        if (READ_ONCE(vcpu->nmi_pending) &&
+            !(vmcs_read32(VM_ENTRY_INTR_INFO_FIELD) & INTR_INFO_VALID_MASK)) {
+                WRITE_ONCE(vcpu->nmi_pending, false);
+                vmx_inject_nmi(vcpu);
+        }
+        vmx_cache_flush(vmx);
 
         asm volatile(
                 /* Store host registers */
@@ -933,7 +1691,14 @@ static void vmx_vcpu_run(struct kvm_vcpu *vcpu)
                 , "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
         );
 
+        vmx->exit_tsc = rdtsc();
         vmx->launched = 1;
+        vmx_cache_reset(vmx);
+
+        vcpu->stat.vmreads += this_cpu_read(nr_vmreads);
+        vcpu->stat.vmwrites += this_cpu_read(nr_vmwrites);
+        this_cpu_write(nr_vmreads, 0);
+        this_cpu_write(nr_vmwrites, 0);
 }
 
 static void vmx_dump_sel(char *name, uint32_t sel)
@@ -954,15 +1719,23 @@ static void vmx_dump_dtsel(char *name, uint32_t limit)
 
 static void dump_vmcs(struct kvm_vcpu *vcpu)
 {
-        uint32_t vmentry_ctl = vmcs_read32(VM_ENTRY_CONTROLS);
-        uint32_t vmexit_ctl = vmcs_read32(VM_EXIT_CONTROLS);
-        uint32_t cpu_based_exec_ctrl = vmcs_read32(CPU_BASED_VM_EXEC_CONTROL);
-        uint32_t pin_based_exec_ctrl = vmcs_read32(PIN_BASED_VM_EXEC_CONTROL);
-        uint32_t secondary_exec_control = vmcs_read32(SECONDARY_VM_EXEC_CONTROL);
-        unsigned long cr4 = vmcs_readl(GUEST_CR4);
-        uint64_t efer = vmcs_read64(GUEST_IA32_EFER);
+        uint32_t vmentry_ctl, vmexit_ctl, cpu_based_exec_ctrl;
+        uint32_t pin_based_exec_ctrl, secondary_exec_control;
+        unsigned long cr4;
+        uint64_t efer;
         int i, n;
 
+        /* show what the next VM entry would see */
+        vmx_cache_flush(to_vmx(vcpu));
+
+        vmentry_ctl = vmcs_read32(VM_ENTRY_CONTROLS);
+        vmexit_ctl = vmcs_read32(VM_EXIT_CONTROLS);
+        cpu_based_exec_ctrl = vmcs_read32(CPU_BASED_VM_EXEC_CONTROL);
+        pin_based_exec_ctrl = vmcs_read32(PIN_BASED_VM_EXEC_CONTROL);
+        secondary_exec_control = vmcs_read32(SECONDARY_VM_EXEC_CONTROL);
+        cr4 = vmcs_readl(GUEST_CR4);
+        efer = vmcs_read64(GUEST_IA32_EFER);
+
         pr_err("*** Guest State ***\n");
         pr_err("CR0: actual=0x%016lx, shadow=0x%016lx, gh_mask=%016lx\n",
                vmcs_readl(GUEST_CR0), vmcs_readl(CR0_READ_SHADOW),
@@ -1095,9 +1868,17 @@ static void dump_vmcs(struct kvm_vcpu *vcpu)
 
 static void handle_rdtsc(struct kvm_vcpu *vcpu)
 {
-	uint64_t val = rdtsc();
-	kvm_write_edx_eax(vcpu, val);
-	return kvm_skip_emulated_instruction(vcpu);
+        uint64_t val = vmx_read_guest_tsc(to_vmx(vcpu), rdtsc());
+
+        kvm_write_edx_eax(vcpu, val);
+        return kvm_skip_emulated_instruction(vcpu);
+}
+
+static void handle_rdtscp(struct kvm_vcpu *vcpu)
+{
+        /* MSR_TSC_AUX is passed through and not switched */
+        kvm_register_write(vcpu, VCPU_REGS_RCX, (uint32_t)rdmsrl(MSR_TSC_AUX));
+        return handle_rdtsc(vcpu);
 }
 
 static void handle_cr(struct kvm_vcpu *vcpu)
@@ -1105,7 +1886,7 @@ static void handle_cr(struct kvm_vcpu *vcpu)
         unsigned long exit_qualification, val;
         int cr, reg, op;
 
-        exit_qualification = vmcs_readl(EXIT_QUALIFICATION);
+        exit_qualification = vmx_cache_read(to_vmx(vcpu), VMX_CACHE_EXIT_QUAL);
         cr = exit_qualification & 15;
         reg = (exit_qualification >> 8) & 15;
         op = (exit_qualification >> 4) & 3;
@@ -1114,13 +1895,17 @@ static void handle_cr(struct kvm_vcpu *vcpu)
         case 0:
                 /* mov to cr */
                 val = kvm_register_read(vcpu, reg);
+                /* any of these may change guest translations */
+                kvm_mmu_flush_tlb(vcpu);
                 switch (cr) {
                 case 0:
                         vmx_set_cr0(vcpu, val);
+                        vmx_load_pdptrs(vcpu);
                         return kvm_skip_emulated_instruction(vcpu);
 		case 3:
-			pr_info("cr3: %lx\n", val);
+			kvm_cr3_load(vcpu, val);
 			vmx_set_cr3(vcpu, val);
+			vmx_load_pdptrs(vcpu);
 			return kvm_skip_emulated_instruction(vcpu);
                 case 4:
                         /*
@@ -1128,6 +1913,7 @@ static void handle_cr(struct kvm_vcpu *vcpu)
                          * assuming no nested virtualization.
                          */
                         vmx_set_cr4(vcpu, val);
+                        vmx_load_pdptrs(vcpu);
                         return kvm_skip_emulated_instruction(vcpu);
                 default:
                         panic("unknown control register\n");
@@ -1139,16 +1925,45 @@ static void handle_cr(struct kvm_vcpu *vcpu)
         panic("unhandled control register: op %d cr %d\n", op, cr);
 }
 
+static void vmx_inject_gp(struct kvm_vcpu *vcpu)
+{
+        vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
+        vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, X86_TRAP_GP | INTR_TYPE_HARD_EXCEPTION |
+                     INTR_INFO_DELIVER_CODE_MASK | INTR_INFO_VALID_MASK);
+}
+
 static void handle_rdmsr(struct kvm_vcpu *vcpu)
 {
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
         uint32_t msr = kvm_register_read(vcpu, VCPU_REGS_RCX);
+        uint64_t val;
 
-        dump_vmcs(vcpu);
-        panic("unknown rdmsr 0x%08x\n", msr);
+        switch (msr) {
+        case MSR_IA32_TSC_DEADLINE:
+                /* 0 means disarmed, or that the timer has fired */
+                val = rdmsrl(msr);
+                if (val)
+                        val = vmx_read_guest_tsc(vmx, val);
+                break;
+        case MSR_MTRRfix64K_00000:
+        case MSR_MTRRfix16K_80000 ... MSR_MTRRfix16K_A0000:
+        case MSR_MTRRfix4K_C0000 ... MSR_MTRRfix4K_F8000:
+        case MSR_MTRRdefType:
+        case MTRRphysBase_MSR(0) ... MTRRphysMask_MSR(MTRR_MAX_VAR_RANGES - 1):
+                val = kvm_mtrr_get_msr(vcpu, msr);
+                break;
+        default:
+                dump_vmcs(vcpu);
+                panic("unknown rdmsr 0x%08x\n", msr);
+        }
+
+        kvm_write_edx_eax(vcpu, val);
+        return kvm_skip_emulated_instruction(vcpu);
 }
 
 static void handle_wrmsr(struct kvm_vcpu *vcpu)
 {
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
         uint32_t msr;
         uint64_t val;
 
@@ -1162,20 +1977,21 @@ static void handle_wrmsr(struct kvm_vcpu *vcpu)
                         pr_info("vmx: x2apic enabled by guest on cpu %d acpi_id[0x%02x]\n", smp_processor_id(), read_apic_id());
                 wrmsrl(msr, val);
                 break;
-        case APIC_BASE_MSR + (APIC_ICR >> 4):
-                switch (val & 0x00700) {
-                case APIC_DM_INIT:
-                        /* silently drop INIT */
-                        break;
-                case APIC_DM_STARTUP: {
-                        /* silently drop AP startup */
-                        break;
-                }
-                default:
-                        /* pass-through by default */
-                        wrmsrl(msr, val);
-                        break;
-                }
+        case MSR_IA32_TSC:
+                /* only this vcpu's TSC moves, as with WRMSR on hardware */
+                vmx->tsc_offset = val - vmx_scale_tsc(vmx, rdtsc());
+                vmcs_write64(TSC_OFFSET, vmx->tsc_offset);
+                break;
+        case MSR_IA32_TSC_DEADLINE:
+                wrmsrl(msr, val ? vmx_host_tsc(vmx, val) : 0);
+                break;
+        case MSR_MTRRfix64K_00000:
+        case MSR_MTRRfix16K_80000 ... MSR_MTRRfix16K_A0000:
+        case MSR_MTRRfix4K_C0000 ... MSR_MTRRfix4K_F8000:
+        case MSR_MTRRdefType:
+        case MTRRphysBase_MSR(0) ... MTRRphysMask_MSR(MTRR_MAX_VAR_RANGES - 1):
+                if (kvm_mtrr_set_msr(vcpu, msr, val))
+                        return vmx_inject_gp(vcpu);
                 break;
 	case MSR_EFER:
 		/* disable SCE */
@@ -1193,189 +2009,305 @@ static void handle_wrmsr(struct kvm_vcpu *vcpu)
 
 static void handle_ept_violation(struct kvm_vcpu *vcpu)
 {
-	uint64_t guest_phys;
+	uint64_t guest_phys, qual;
+	uint32_t access = 0;
+
 	if (!vcpu->ept_handler)
 		panic("cannot handle EPT violation\n");
 	guest_phys = vmcs_read64(GUEST_PHYSICAL_ADDRESS);
-	vcpu->ept_handler(guest_phys);
+	qual = vmx_cache_read(to_vmx(vcpu), VMX_CACHE_EXIT_QUAL);
+	if (qual & EPT_VIOLATION_ACC_WRITE)
+		access |= PFERR_WRITE_MASK;
+	if (qual & EPT_VIOLATION_ACC_INSTR)
+		access |= PFERR_FETCH_MASK;
+	vcpu->ept_handler(guest_phys, access);
 }
 
-static uint64_t masks[] = {
-	0xffffff8000000000,
-	0xffffffffc0000000,
-	0xffffffffffe00000,
-	0xfffffffffffff000,
-};
-static uint64_t shifts[] = {
-	39,
-	30,
-	21,
-	12,
+#define SAVED_MSR(vmx, msr) ((vmx)->msr_autoload.guest[SAVED_##msr].value)
+
+static const struct insn_pattern {
+        uint8_t kind;
+        uint8_t len;
+        uint8_t bytes[3];
+} insn_patterns[] = {
+        { INSN_SYSCALL, 2, { 0x0f, 0x05 } },
+        /* sysretq (REX.W) */
+        { INSN_SYSRET, 3, { 0x48, 0x0f, 0x07 } },
 };
 
-static uint64_t gpa2hpa(uint64_t eptp, uint64_t gpa) {
-	uint64_t entry, *entries = (uint64_t *) __va(eptp);
-	
-	for (int i = 0; i < 4; i++) {
-		uint64_t idx = (gpa >> shifts[i]) & 0x1ff;
-		entry = entries[idx];
-		assert(entry & 0x1); /* must be readable */
-		if (entry & (1 << 7)) {
-			/* large page */
-			assert(i == 1 || i == 2);
-			return (entry & masks[i]) | (gpa & ~masks[i]);
-		} else {
-			/* keep walking */
-			entries = (uint64_t *) __va(entry & ~0xfff);
-		}
-	}
-	return (entry & ~0xfff) | (gpa & 0xfff);
-}
-
-static void *gva2hva(uintptr_t gva) {
-	uintptr_t cr3;
-	uint64_t eptr, entry;
-	cr3 = vmcs_readl(GUEST_CR3);
-	eptr = vmcs_read64(EPT_POINTER);
-
-	uint64_t *entries = (uint64_t *) __va(gpa2hpa(eptr & ~0xfff, cr3 & ~0xfff));
-	for (int i = 0; i < 4; i++) {
-		uint64_t idx = (gva >> shifts[i]) & 0x1ff;
-		entry = entries[idx];
-		assert(entry & 0x1);
-		if (entry & (1 << 7)) {
-			assert(i == 1 || i == 2);
-			return (void *) ((entry & masks[i]) | (gva & ~masks[i]));
-		} else if (i < 3) {
-			entries = (uint64_t *) __va(gpa2hpa(eptr & ~0xfff, entry & ~0xfff));
-		}
-	}
+static const struct insn_pattern *match_insn(const uint8_t *bytes, size_t n)
+{
+        size_t i;
 
-	return (void *) __va((entry & ~0xfff) | (gva & 0xfff));
-}
-
-static void handle_syscall(struct kvm_vcpu *vcpu)
-{
-#define SAVED_MSR(msr) to_vmx(vcpu)->msr_autoload.guest[SAVED_##msr].value
-	pr_info("syscall!\n");
-	struct kvm_segment cs, ss;
-	unsigned long syscall_mask;
-	uint64_t rip = SAVED_MSR(MSR_LSTAR);
-	kvm_skip_emulated_instruction(vcpu);
-	vcpu->regs[VCPU_REGS_RCX] = vmx_get_rip(vcpu);
-	vmx_set_rip(vcpu, rip);
-	unsigned long rflags = vmx_get_rflags(vcpu);
-	vcpu->regs[VCPU_REGS_R11] = rflags;
-	syscall_mask = SAVED_MSR(MSR_SYSCALL_MASK);
-	vmx_set_rflags(vcpu, rflags & ~syscall_mask);
-	/* CS */
-	cs.selector = (SAVED_MSR(MSR_STAR) >> 32 & 0xfffc);
-	cs.base = 0;
-	cs.limit = 0xfffff;
-	cs.type = 11;
-	cs.s = 1;
-	cs.dpl = 0;
-	cs.present = 1;
-	cs.l = 1;
-	cs.db = 0;
-	cs.g = 1;
-	cs.unusable = 0;
-	/* SS */
-	ss.selector = (SAVED_MSR(MSR_STAR) >> 32 & 0xffff) + 8;
-	ss.base = 0;
-	ss.limit = 0xfffff;
-	ss.type = 3;
-	ss.s = 1;
-	ss.dpl = 0;
-	ss.present = 1;
-	ss.db = 1;
-	ss.g = 1;
-	ss.l = 0;
-	ss.unusable = 0;
-	
-	vmx_set_segment(vcpu, &cs, VCPU_SREG_CS);
-	vmx_set_segment(vcpu, &ss, VCPU_SREG_SS);
-}
-
-static void handle_sysret(struct kvm_vcpu *vcpu)
-{
-	pr_info("sysret!\n");
-	struct kvm_segment cs, ss;
-	vmx_set_rip(vcpu, vcpu->regs[VCPU_REGS_RCX]);
-	vmx_set_rflags(vcpu, (vcpu->regs[VCPU_REGS_R11] & 0x3c7fd7) | 2);
-
-	cs.selector = ((SAVED_MSR(MSR_STAR) >> 48) & 0xffff) + 16;
-	cs.selector |= 3;
-	cs.base = 0;
-	cs.limit = 0xfffff;
-	cs.type = 11;
-	cs.s = 1;
-	cs.dpl = 3;
-	cs.present = 1;
-	cs.l = 1;
-	cs.db = 0;
-	cs.g = 1;
-	cs.unusable = 0;
-
-	ss.selector = ((SAVED_MSR(MSR_STAR) >> 48) & 0xffff) + 8;
-	ss.selector |= 3;
-	ss.base = 0;
-	ss.limit = 0xfffff;
-	ss.type = 3;
-	ss.s = 1;
-	ss.dpl = 3;
-	ss.present = 1;
-	ss.db = 1;
-	ss.g = 1;
-	ss.l = 0;
-	ss.unusable = 0;
-
-	vmx_set_segment(vcpu, &cs, VCPU_SREG_CS);
-	vmx_set_segment(vcpu, &ss, VCPU_SREG_SS);
-#undef SAVED_MSR
+        for (i = 0; i < ARRAY_SIZE(insn_patterns); ++i) {
+                const struct insn_pattern *p = &insn_patterns[i];
+
+                if (p->len <= n && !memcmp(bytes, p->bytes, p->len))
+                        return p;
+        }
+        return NULL;
+}
+
+/*
+ * Classify the instruction at rip, caching the result by (CR3, RIP).
+ * The page may be remapped, or its code rewritten, without CR3 changing,
+ * so a hit still translates rip (cheap on a translation cache hit) and
+ * re-checks the opcode bytes where rip maps now.
+ */
+static int vmx_decode_insn(struct kvm_vcpu *vcpu, unsigned long rip, int *len)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+        const struct insn_pattern *p;
+        struct insn_cache_entry *e;
+        struct x86_exception fault;
+        unsigned long cr3;
+        uint8_t bytes[3];
+        const uint8_t *hva;
+        uint32_t access;
+        size_t n, avail;
+
+        access = PFERR_FETCH_MASK | (vmx_get_cpl(vcpu) == 3 ? PFERR_USER_MASK : 0);
+        hva = kvm_gva_to_hva(vcpu, rip, access, &fault);
+        if (!hva)
+                return INSN_NONE;
+
+        cr3 = vmx_get_cr3(vcpu);
+        e = &vmx->insn_cache[(rip ^ (cr3 >> PAGE_SHIFT)) % NR_INSN_CACHE];
+        if (e->kind != INSN_NONE && e->rip == rip && e->cr3 == cr3 && e->hva == hva &&
+            !memcmp(hva, insn_patterns[e->kind - 1].bytes, e->len)) {
+                *len = e->len;
+                return e->kind;
+        }
+
+        n = min_t(size_t, sizeof(bytes), PAGE_SIZE - (rip & ~PAGE_MASK));
+        memcpy(bytes, hva, n);
+        /* a short instruction may end right before an unmapped page */
+        avail = sizeof(bytes);
+        if (n < avail && kvm_read_guest_virt(vcpu, rip + n, bytes + n, avail - n, access, &fault))
+                avail = n;
+
+        p = match_insn(bytes, avail);
+        if (!p)
+                return INSN_NONE;
+
+        if (p->len <= n) {
+                e->cr3 = cr3;
+                e->rip = rip;
+                e->hva = hva;
+                e->kind = p->kind;
+                e->len = p->len;
+        }
+        *len = p->len;
+        return p->kind;
+}
+
+/* selectors and access rights for syscall/sysret, recomputed when STAR changes */
+static void vmx_update_syscall_segs(struct vcpu_vmx *vmx)
+{
+        uint64_t star = SAVED_MSR(vmx, MSR_STAR);
+        struct kvm_segment seg = {
+                .s = 1,
+                .present = 1,
+                .g = 1,
+        };
+
+        if (vmx->syscall_segs.valid && vmx->syscall_segs.star == star)
+                return;
+
+        seg.type = 11;
+        seg.l = 1;
+        seg.db = 0;
+        seg.dpl = 0;
+        vmx->syscall_segs.kernel_cs_ar = vmx_segment_access_rights(&seg);
+        seg.dpl = 3;
+        vmx->syscall_segs.user_cs_ar = vmx_segment_access_rights(&seg);
+
+        seg.type = 3;
+        seg.l = 0;
+        seg.db = 1;
+        seg.dpl = 0;
+        vmx->syscall_segs.kernel_ss_ar = vmx_segment_access_rights(&seg);
+        seg.dpl = 3;
+        vmx->syscall_segs.user_ss_ar = vmx_segment_access_rights(&seg);
+
+        vmx->syscall_segs.kernel_cs = (star >> 32) & 0xfffc;
+        vmx->syscall_segs.kernel_ss = ((star >> 32) & 0xffff) + 8;
+        vmx->syscall_segs.user_cs = (((star >> 48) & 0xffff) + 16) | 3;
+        vmx->syscall_segs.user_ss = (((star >> 48) & 0xffff) + 8) | 3;
+        vmx->syscall_segs.star = star;
+        vmx->syscall_segs.valid = true;
 }
 
+/*
+ * Load flat CS/SS with the given selectors and access rights.  Bases and
+ * limits are only written the first time: the guest itself can only load
+ * flat ones in 64-bit mode, where they are ignored anyway.
+ */
+static void vmx_load_syscall_segs(struct vcpu_vmx *vmx, uint16_t cs, uint32_t cs_ar,
+                                  uint16_t ss, uint32_t ss_ar)
+{
+        if (!vmx->syscall_segs.flat) {
+                vmcs_writel(GUEST_CS_BASE, 0);
+                vmcs_write32(GUEST_CS_LIMIT, 0xffffffff);
+                vmcs_writel(GUEST_SS_BASE, 0);
+                vmcs_write32(GUEST_SS_LIMIT, 0xffffffff);
+                vmx->syscall_segs.flat = true;
+        }
+        vmcs_write16(GUEST_CS_SELECTOR, cs);
+        vmcs_write32(GUEST_CS_AR_BYTES, cs_ar);
+        vmcs_write16(GUEST_SS_SELECTOR, ss);
+        vmcs_write32(GUEST_SS_AR_BYTES, ss_ar);
+}
+
+/* the emulated instruction retires: drop any STI/MOV SS blocking */
+static void vmx_clear_interrupt_shadow(struct kvm_vcpu *vcpu)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+        uint32_t interruptibility;
+
+        interruptibility = vmx_cache_read(vmx, VMX_CACHE_INTERRUPTIBILITY);
+        if (interruptibility & (GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS)) {
+                interruptibility &= ~(GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS);
+                vmx_cache_write(vmx, VMX_CACHE_INTERRUPTIBILITY, interruptibility);
+        }
+}
+
+static void emulate_syscall(struct kvm_vcpu *vcpu, unsigned long rip, int len)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+        unsigned long rflags;
+
+        vmx_update_syscall_segs(vmx);
+        vmx_clear_interrupt_shadow(vcpu);
+
+        rflags = vmx_get_rflags(vcpu);
+        kvm_register_write(vcpu, VCPU_REGS_RCX, rip + len);
+        kvm_register_write(vcpu, VCPU_REGS_R11, rflags);
+        vmx_set_rflags(vcpu, rflags & ~SAVED_MSR(vmx, MSR_SYSCALL_MASK));
+        vmx_set_rip(vcpu, SAVED_MSR(vmx, MSR_LSTAR));
+
+        vmx_load_syscall_segs(vmx, vmx->syscall_segs.kernel_cs, vmx->syscall_segs.kernel_cs_ar,
+                              vmx->syscall_segs.kernel_ss, vmx->syscall_segs.kernel_ss_ar);
+}
+
+static void emulate_sysret(struct kvm_vcpu *vcpu)
+{
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
+
+        vmx_update_syscall_segs(vmx);
+        vmx_clear_interrupt_shadow(vcpu);
+
+        vmx_set_rip(vcpu, kvm_register_read(vcpu, VCPU_REGS_RCX));
+        vmx_set_rflags(vcpu, (kvm_register_read(vcpu, VCPU_REGS_R11) & 0x3c7fd7) | 2);
+
+        vmx_load_syscall_segs(vmx, vmx->syscall_segs.user_cs, vmx->syscall_segs.user_cs_ar,
+                              vmx->syscall_segs.user_ss, vmx->syscall_segs.user_ss_ar);
+}
+
+#undef SAVED_MSR
+
+/*
+ * A guest NMI the guest blocks is left pending; without virtual NMIs there is
+ * no NMI-window exiting, so it waits for the next exit or preemption timer.
+ */
 static void handle_exception_nmi(struct kvm_vcpu *vcpu)
 {
-        uint32_t intr_info, exception, type;
-	unsigned long rip;
-	intr_info = vmcs_read32(VM_EXIT_INTR_INFO);
-	type = (intr_info >> 8) & 0x7;
-	exception = intr_info & 0xff;
-	// pr_info("intr_info: %x, type: %x, exception: %x, qual: %lx\n", intr_info, type, exception, qual);
-	if (exception == 6 && type == 3) {
-		/* #UD */
-		rip = vmx_get_rip(vcpu);
-		char *instr = (char *) gva2hva(rip);
-		if (instr[0] == 0xf && instr[1] == 0x5) {
-			return handle_syscall(vcpu);
-		} else if (instr[0] == 0x48 && instr[1] == 0xf && instr[2] == 0x7) {
-			return handle_sysret(vcpu);
-		}
+        uint32_t intr_info;
+        unsigned long rip;
+        int len;
 
-	}
-	dump_vmcs(vcpu);
-	panic("cannot handle exception/nmi\n");
+        intr_info = vmx_cache_read(to_vmx(vcpu), VMX_CACHE_INTR_INFO);
+
+        /* a kick from kvm_kick_vcpu(), or an NMI meant for the guest */
+        if ((intr_info & INTR_INFO_INTR_TYPE_MASK) == INTR_TYPE_NMI_INTR) {
+                if (kvm_take_kick(vcpu))
+                        return;
+                return vmx_inject_nmi(vcpu);
+        }
+
+        /*
+         * SCE is masked off in the guest EFER, so syscall/sysret raise #UD
+         * and are emulated here.
+         */
+        if ((intr_info & (INTR_INFO_VECTOR_MASK | INTR_INFO_INTR_TYPE_MASK)) ==
+            (X86_TRAP_UD | INTR_TYPE_HARD_EXCEPTION)) {
+                rip = vmx_get_rip(vcpu);
+                switch (vmx_decode_insn(vcpu, rip, &len)) {
+                case INSN_SYSCALL:
+                        return emulate_syscall(vcpu, rip, len);
+                case INSN_SYSRET:
+                        return emulate_sysret(vcpu);
+                default:
+                        break;
+                }
+        }
+
+        dump_vmcs(vcpu);
+        panic("cannot handle exception/nmi\n");
+}
+
+/* INIT from the guest, while this vcpu was in the guest */
+static void handle_init_signal(struct kvm_vcpu *vcpu)
+{
+        vmx_vcpu_reset(vcpu);
+}
+
+/* the exit qualification holds the vector */
+static void handle_sipi(struct kvm_vcpu *vcpu)
+{
+        uint8_t vector = vmx_cache_read(to_vmx(vcpu), VMX_CACHE_EXIT_QUAL) & 0xff;
+
+        kvm_emulate_sipi(vcpu, vector);
+        vmcs_write32(GUEST_ACTIVITY_STATE, GUEST_ACTIVITY_ACTIVE);
+}
+
+static void handle_pml_full(struct kvm_vcpu *vcpu)
+{
+        vmx_flush_pml(vcpu);
+}
+
+static void handle_preemption_timer(struct kvm_vcpu *vcpu)
+{
+        /* periodic work is done by kvm_loop() */
 }
 
 static void (*const vmx_exit_handlers[])(struct kvm_vcpu *) = {
 	[EXIT_REASON_EXCEPTION_NMI]     = handle_exception_nmi,
+        [EXIT_REASON_INIT_SIGNAL]       = handle_init_signal,
+        [EXIT_REASON_SIPI]              = handle_sipi,
         [EXIT_REASON_CR_ACCESS]         = handle_cr,
         [EXIT_REASON_CPUID]             = kvm_emulate_cpuid,
         [EXIT_REASON_MSR_READ]          = handle_rdmsr,
         [EXIT_REASON_MSR_WRITE]         = handle_wrmsr,
 	[EXIT_REASON_RDTSC]             = handle_rdtsc,
+        [EXIT_REASON_RDTSCP]            = handle_rdtscp,
 	[EXIT_REASON_EPT_VIOLATION]     = handle_ept_violation,
+        [EXIT_REASON_VMCALL]            = kvm_emulate_hypercall,
+        [EXIT_REASON_PREEMPTION_TIMER]  = handle_preemption_timer,
+        [EXIT_REASON_PML_FULL]          = handle_pml_full,
 };
 
 static void vmx_handle_exit(struct kvm_vcpu *vcpu)
 {
+        struct vcpu_vmx *vmx = to_vmx(vcpu);
         uint32_t exit_reason;
+        uint64_t start;
 
         exit_reason = vmcs_read32(VM_EXIT_REASON);
-
-        if (exit_reason < ARRAY_SIZE(vmx_exit_handlers) && vmx_exit_handlers[exit_reason])
-                return vmx_exit_handlers[exit_reason](vcpu);
+        vmx->exit_reason = exit_reason;
+
+        if (kvm_trace_enabled)
+                __kvm_trace_exit(vmx->exit_tsc, exit_reason,
+                                 vmx_cache_read(vmx, VMX_CACHE_EXIT_QUAL),
+                                 kvm_rip_read(vcpu), vmx_get_cr3(vcpu),
+                                 vcpu->vcpu_id);
+
+        if (exit_reason < ARRAY_SIZE(vmx_exit_handlers) && vmx_exit_handlers[exit_reason]) {
+                start = rdtsc();
+                vmx_exit_handlers[exit_reason](vcpu);
+                kvm_stat_handler(vcpu, exit_reason, rdtsc() - start);
+                return;
+        }
 
         dump_vmcs(vcpu);
         panic("vmx: unexpected exit reason %d\n", exit_reason);
@@ -1384,25 +2316,27 @@ static void vmx_handle_exit(struct kvm_vcpu *vcpu)
 static void vmx_skip_emulated_instruction(struct kvm_vcpu *vcpu)
 {
         unsigned long rip;
-        uint32_t interruptibility;
 
         rip = kvm_rip_read(vcpu);
-        rip += vmcs_read32(VM_EXIT_INSTRUCTION_LEN);
+        rip += vmx_cache_read(to_vmx(vcpu), VMX_CACHE_INSN_LEN);
         kvm_rip_write(vcpu, rip);
 
         /* skipping an emulated instruction also counts */
-        interruptibility = vmcs_read32(GUEST_INTERRUPTIBILITY_INFO);
-        interruptibility &= ~(GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS);
-        vmcs_write32(GUEST_INTERRUPTIBILITY_INFO, interruptibility);
+        vmx_clear_interrupt_shadow(vcpu);
 }
 
 struct kvm_x86_ops vmx_x86_ops = {
         .cpu_has_kvm_support = vmx_cpu_has_kvm_support,
         .disabled_by_bios = vmx_disabled_by_bios,
         .hardware_setup = vmx_hardware_setup,
+        .get_lpage_level = vmx_get_lpage_level,
 
         .vcpu_enable = vmx_vcpu_enable,
+        .vcpu_create = vmx_vcpu_create,
+        .vcpu_load = vmx_vcpu_load,
+        .vcpu_free = vmx_vcpu_free,
         .vcpu_setup = vmx_vcpu_setup,
+        .vcpu_reset = vmx_vcpu_reset,
         .get_cpl = vmx_get_cpl,
         .get_segment = vmx_get_segment,
         .set_segment = vmx_set_segment,
@@ -1410,9 +2344,37 @@ struct kvm_x86_ops vmx_x86_ops = {
         .set_rflags = vmx_set_rflags,
         .get_rip = vmx_get_rip,
         .set_rip = vmx_set_rip,
+        .cache_reg = vmx_cache_reg,
+        .get_cr0 = vmx_get_cr0,
+        .get_cr3 = vmx_get_cr3,
+        .get_cr4 = vmx_get_cr4,
+        .get_efer = vmx_get_efer,
+        .get_pdptrs = vmx_get_pdptrs,
+        .get_tdp = vmx_get_tdp,
+        .flush_tdp = vmx_flush_tdp,
+        .has_pml = vmx_has_pml,
+        .set_pml = vmx_set_pml,
+        .flush_pml = vmx_flush_pml,
+        .has_ept_ad = vmx_has_ept_ad,
+        .save_state = vmx_save_state,
+        .load_state = vmx_load_state,
+        .max_cr3_targets = vmx_max_cr3_targets,
+        .set_cr3_targets = vmx_set_cr3_targets,
         .set_tdp = vmx_set_tdp,
 
         .run = vmx_vcpu_run,
         .handle_exit = vmx_handle_exit,
         .skip_emulated_instruction = vmx_skip_emulated_instruction,
 };
+
+static int set_tsc_mode(const char *val)
+{
+        if (!strcmp(val, "offset"))
+                tsc_mode = TSC_MODE_OFFSET;
+        else if (!strcmp(val, "exit"))
+                tsc_mode = TSC_MODE_EXIT;
+        else
+                return -1;
+        return 0;
+}
+__setup("tsc=", set_tsc_mode);